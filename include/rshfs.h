@@ -8,7 +8,9 @@
 #include <rsh.h>
 
 #include <stdint.h>
+#include <stddef.h>
 #include <dirent.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -16,6 +18,10 @@
  * correlated to the equivalent POSIX standard calls. */
 ssize_t        _rsh_read(int fd, void *buf, size_t count);
 ssize_t        _rsh_write(int fd, const void *buf, size_t count);
+ssize_t        _rsh_writev(int fd, const struct iovec *iov, int iovcnt);
+int            _rsh_readv_map(int fd, struct iovec *iov, int iovcnt,
+			      size_t count);
+int            _rsh_fallocate(int fd, off_t len);
 int            _rsh_dup2(int oldfd, int newfd);
 int            _rsh_open(const char *pathname, int flags, mode_t mode);
 int            _rsh_close(int fd);
@@ -23,6 +29,9 @@ struct dirent *_rsh_readdir(int dfd);
 int            _rsh_fstat(int fd, struct stat *buf);
 int            _rsh_mkdir(const char *path);
 int            _rsh_unlink(const char *path);
+int            _rsh_rename(const char *oldpath, const char *newpath);
+int            _rsh_clone(const char *oldpath, const char *newpath);
+off_t          _rsh_lseek(int fd, off_t offset, int whence);
 int            _rsh_chdir(const char *path);
 char          *_rsh_fs_parse_path(char **copy, char **next, const char *start);
 char          *_rsh_getcwd(char *buf, size_t size);
@@ -85,6 +94,30 @@ struct rsh_io_ops {
   int     (*mkdir)(const char *path);
   int     (*unlink)(const char *path);
 
+  /* Optional. Move a file or directory within the file system. */
+  int     (*rename)(const char *oldpath, const char *newpath);
+
+  /* Optional. Make newpath a copy of the file at oldpath that shares its
+   * data until one of them is written. */
+  int     (*clone)(const char *oldpath, const char *newpath);
+
+  /* Optional. Rather than copying file data into a buffer, fill in up to
+   * iovcnt segments that point straight at the file's data, covering at most
+   * count bytes from the file's offset. The offset moves past the mapped
+   * bytes. Returns the number of segments filled in, 0 at EOF. The segments
+   * are only good until the file system is next changed. */
+  int     (*readv_map)(struct rsh_file *file, struct iovec *iov, int iovcnt,
+		       size_t count);
+
+  /* Optional. Make sure there's space for len more bytes past the file's
+   * offset without changing the size of the file. */
+  int     (*fallocate)(struct rsh_file *file, off_t len);
+
+  /* Optional. Move the file's offset like lseek(). Without it only SEEK_SET
+   * and SEEK_CUR work, SEEK_END uses the size the file had when opened and
+   * the whole file counts as data. */
+  off_t   (*lseek)(struct rsh_file *file, off_t offset, int whence);
+
 };
 
 /* Some high level functions for RSH to call. */
@@ -100,26 +133,98 @@ int rsh_unregister_fs();
 
 typedef uint32_t fat_t; /* This really should be 16 bits, but oh well. */
 
-/* FAT special values. */
+/* FAT special values. Version 0 images store FAT_RESERVED and FAT_TERM as
+ * 0xfffe and 0xffff; rsh_fat16_get_entry() and rsh_fat16_set_entry() take
+ * care of that so nothing else has to. */
 #define FAT_FREE      0x00000000
-#define FAT_RESERVED  0x0000fffe
-#define FAT_TERM      0x0000ffff
+#define FAT_RESERVED  0xfffffffe
+#define FAT_TERM      0xffffffff
+
+/* Not a FAT value: rsh_fat16_file.shared when nothing in the map is shared. */
+#define FAT_UNSHARED  0xffffffff
+
+/* Not a FAT value either: what _rsh_fat16_file_cluster() gives back for a
+ * cluster of a file that falls in a hole. Cluster 0 is the header so no file
+ * can have it. */
+#define FAT_HOLE      0x00000000
+
+/* Not a FAT value either: the index of a dirent whose file is small enough to
+ * be packed in with others rather than have clusters of its own, see
+ * fs_fat16_pack.c. Again, no chain can start at cluster 0. */
+#define FAT_PACKED    0x00000000
+
+#define FAT16_RESERVED 0x0000fffe
+#define FAT16_TERM     0x0000ffff
 
 /* File entry types. */
 #define FAT_FILE      0x00
+#define FAT_ZFILE     0x01 /* Compressed, see fs_fat16_zip.c. */
 #define FAT_DIR       0xff
 
+/* Image format versions. Version 0 images are the originals: 16 bit
+ * cluster numbers (so at most 65534 clusters), 32 bit image and file sizes
+ * and no magic number. Version 1 uses all 32 bits of a cluster number and
+ * has 64 bit image and file sizes. Version 2 adds a metadata journal right
+ * after the FAT, see fs_fat16_journal.c. Version 3 adds cluster reference
+ * counts after that so files can share clusters, see fs_fat16_cow.c. Version
+ * 4 adds a table of holes after those for sparse files, see
+ * fs_fat16_sparse.c. Version 5 packs small files into shared clusters, see
+ * fs_fat16_pack.c. Version 6 adds header flags, which say among other things
+ * which directory format the image uses, see fs_fat16_dirent.c, whether
+ * big directories get trees, see fs_fat16_tree.c, whether files are
+ * compressed, see fs_fat16_zip.c, and whether files that are the same share
+ * clusters, see fs_fat16_dedup.c. Version 7 adds a checksum per cluster after
+ * the hole table, see fs_fat16_csum.c. */
+#define RSH_FS_MAGIC   0x46485352 /* "RSHF" */
+#define RSH_FS_V0      0
+#define RSH_FS_V1      1
+#define RSH_FS_V2      2
+#define RSH_FS_V3      3
+#define RSH_FS_V4      4
+#define RSH_FS_V5      5
+#define RSH_FS_V6      6
+#define RSH_FS_V7      7
+#define RSH_FS_VERSION RSH_FS_V7
+
+/* Header flags, version 6 and up. */
+#define RSH_FS_COMPACT_DIRS 0x00000001 /* Variable length dirents. */
+#define RSH_FS_TREE_DIRS    0x00000002 /* B+tree indexed directories. */
+#define RSH_FS_ZIP_FILES    0x00000004 /* Compress files as they're written. */
+#define RSH_FS_DEDUP_FILES  0x00000008 /* Share clusters as files are closed. */
+
 /*
  * Boot record. Lol. Well anyway, as defined by the specs, but a little extra
- * spice for some fun. Maybe.
+ * spice for some fun. Maybe. Version 0 images only have the first four fields
+ * and the rest of cluster 0 is zero, so a 0 magic means version 0. Version 1
+ * images leave len at 0 so that older shells refuse to map them.
  */
 struct rsh_fs_block {
 
   uint32_t csize;
-  uint32_t len;
+  uint32_t len;              /* Image size, version 0 only. */
   uint32_t root_offset;
   uint32_t fat_offset;
 
+  uint32_t magic;
+  uint32_t version;
+  uint64_t size;             /* Image size. Filled in for version 0 too. */
+
+  uint32_t journal_offset;   /* First cluster of the journal, 0 for none. */
+  uint32_t journal_clusters;
+
+  uint32_t refs_offset;      /* First cluster of the reference counts. */
+  uint32_t refs_clusters;
+
+  uint32_t holes_offset;     /* First cluster of the hole table. */
+  uint32_t holes_clusters;
+
+  uint32_t pack_offset;      /* First cluster small files are packed into. */
+
+  uint32_t flags;            /* RSH_FS_* flags. */
+
+  uint32_t csum_offset;      /* First cluster of the checksums. */
+  uint32_t csum_clusters;
+
 } __attribute__((packed));
 
 /*
@@ -135,22 +240,74 @@ struct rsh_fat16_fs {
   uint32_t fat_per_cluster;  /* Number of fat_t's that fit into a cluster. */
   uint32_t fat_clusters;     /* Number of clusters required to store FAT. */
   uint32_t fat_size;         /* Size of the FAT in bytes. */
-  uint32_t dir_per_cluster;  /* Dir entries per cluster. */
+
+  /* Free cluster bitmap. One bit per cluster, set if the cluster is free. The
+   * summary has one bit per free_map word, set if that word has any free
+   * clusters in it. Built at mount time and kept up to date by
+   * rsh_fat16_set_entry(). */
+  uint32_t *free_map;
+  uint32_t *free_summary;
+  uint32_t free_words;       /* Length of free_map in 32 bit words. */
+  uint32_t free_hint;        /* Cluster the next search starts from. */
+  uint32_t free_clusters;    /* Number of free clusters in the FAT. */
+
+  /* Bumped by things that may change any chain at all (dedup and fsck
+   * repairs). Cached cluster maps compare this against their own copy. The
+   * rest only change one file's chain and tell whoever has it open, see
+   * _rsh_fat16_chain_changed(). */
+  uint32_t chain_gen;
+
+  /* Dirty page bitmap. One bit per page of the mapping, set when something
+   * on that page has been changed since the last rsh_fat16_sync(). */
+  uint32_t *dirty_map;
+  uint32_t dirty_words;      /* Length of dirty_map in 32 bit words. */
+  uint32_t dirty_count;      /* Number of dirty pages. */
+  uint32_t page_size;
+
+  /* The clusters small files are packed into, in the order they're chained,
+   * and the biggest file that gets packed (0 if the image doesn't). */
+  uint32_t *packs;
+  uint32_t pack_count;
+  uint32_t pack_size;        /* Slots allocated in packs. */
+  uint32_t pack_hint;        /* Where in packs to look for room first. */
+  uint32_t pack_max;
+
+  /* A cluster of zeros for handing out holes from readv_map. */
+  void *zero_cluster;
 
   /* The starting address of the file systems mmap()'ed data. */
   void *fs_io;
+  uint64_t map_size;         /* Address space set aside for it to grow into. */
 
   /* The file descriptor for the native file. */
   int fs_fd;
 
 };
 
+/* The mounted FAT16 file system. Defined in fs_fat16.c. */
+extern struct rsh_fat16_fs fat16_fs;
+
+#define FAT_CLUSTER_TO_ADDR(cluster)		\
+  ( fat16_fs.fs_io + ((uint64_t)(cluster) * fat16_fs.fs_header.csize) )
+#define FAT_WIPE_CLUSTER(cluster_io_addr)	\
+  ( memset(cluster_io_addr, 0, fat16_fs.fs_header.csize) )
+
+#define FAT_CLUSTER_SIZE (fat16_fs.fs_header.csize)
+
 /*
- * A directory entry. Not the same thing that the FS deals with though...
+ * A directory entry. Not the same thing that the FS deals with though... The
+ * top half of the size is only used on version 1+ images; use FAT_DIRENT_SIZE()
+ * and _rsh_fat16_set_size() rather than poking at size directly. Packed files
+ * never need it, so they keep where their data is in size_hi instead.
+ *
+ * This is just what the directory says about the file. The name goes before
+ * or after it depending on the directory format (see fs_fat16_dirent.c), so
+ * use FAT_DIRENT_NAME() to get at it and _rsh_fat16_dirent_name() to change
+ * it.
  */
 struct rsh_fat_dirent {
 
-  char name[112];
+  uint32_t size_hi;
   uint32_t index;
   uint32_t size;
   uint32_t type;
@@ -158,21 +315,495 @@ struct rsh_fat_dirent {
 
 } __attribute__((packed));
 
+/*
+ * Longest name a dirent can have on the mounted image. Version 0 images don't
+ * have size_hi, so their names can run on into where it is now. Anything
+ * longer gets ENAMETOOLONG. FAT_NAME_ROOM holds the longest name there is and
+ * its NULL.
+ */
+#define FAT_NAME_MAX							\
+  ( fat16_fs.fs_header.version ? 107 : 111 )
+#define FAT_NAME_ROOM 112
+
+/*
+ * The original directory format: every entry is a 128 byte slot, name first.
+ * An empty name means an empty slot.
+ */
+struct rsh_fat_slot {
+
+  char name[108];            /* On into ent.size_hi on version 0. */
+  struct rsh_fat_dirent ent;
+
+} __attribute__((packed));
+
+/*
+ * The compact directory format: records as long as their names need, one
+ * after another to the end of the cluster. Empty records have a 0 name_len
+ * and an empty name.
+ */
+struct rsh_fat_drec {
+
+  uint32_t len;              /* Bytes from here to the next record. */
+  uint16_t hash;             /* Bottom of _rsh_fat16_name_hash() of the name. */
+  uint16_t name_len;
+  struct rsh_fat_dirent ent;
+  char name[];               /* NULL terminated, padded out to 4 bytes. */
+
+} __attribute__((packed));
+
+/* How long a record for a name of len characters is. */
+#define FAT_DREC_LEN(len)						\
+  ( (sizeof(struct rsh_fat_drec) + (len) + 4) & ~(uint32_t)3 )
+
+#define FAT_COMPACT_DIRS						\
+  ( fat16_fs.fs_header.flags & RSH_FS_COMPACT_DIRS )
+
+/* From a dirent to the slot or record it's in, and its name. */
+#define FAT_DIRENT_SLOT(dent)						\
+  ( (struct rsh_fat_slot *)((void *)(dent) -				\
+			    offsetof(struct rsh_fat_slot, ent)) )
+#define FAT_DIRENT_DREC(dent)						\
+  ( (struct rsh_fat_drec *)((void *)(dent) -				\
+			    offsetof(struct rsh_fat_drec, ent)) )
+#define FAT_DIRENT_NAME(dent)						\
+  ( FAT_COMPACT_DIRS ? FAT_DIRENT_DREC(dent)->name :			\
+    FAT_DIRENT_SLOT(dent)->name )
+
+#define FAT_TREE_DIRS							\
+  ( fat16_fs.fs_header.flags & RSH_FS_TREE_DIRS )
+
+/*
+ * A node of a directory's B+tree, see fs_fat16_tree.c. Each is a cluster of
+ * its own: this header, then the offsets of the keys in name order, then free
+ * space, and the keys themselves packed in from the end of the cluster.
+ */
+struct rsh_fat_tnode {
+
+  uint32_t magic;
+  uint16_t level;            /* 0 for leaves. */
+  uint16_t count;            /* Number of keys. */
+  uint32_t link;             /* Leaves: the next leaf, FAT_TERM for the last.
+				Others: the child for names before the first
+				key. */
+  uint32_t heap;             /* Where the packed keys start. */
+  uint16_t offs[];
+
+} __attribute__((packed));
+
+/*
+ * A key in a tree node. In a leaf it says where the dirent with that name
+ * is; in the others, which child has the names from it up to the next key.
+ */
+struct rsh_fat_tkey {
+
+  uint32_t ptr;              /* Cluster of the dirent, or the child. */
+  uint16_t at;               /* Where in the cluster the dirent is. */
+  uint8_t  len;
+  char     name[];           /* Not NULL terminated. */
+
+} __attribute__((packed));
+
+#define FAT_TNODE_MAGIC 0x45455254 /* "TREE" */
+#define FAT_TNODE(cluster)						\
+  ( (struct rsh_fat_tnode *)FAT_CLUSTER_TO_ADDR(cluster) )
+#define FAT_TKEY(node, i)						\
+  ( (struct rsh_fat_tkey *)((void *)(node) + (node)->offs[i]) )
+#define FAT_TKEY_LEN(len) ( sizeof(struct rsh_fat_tkey) + (len) )
+
+/* Deepest a tree can get. A node holds at least a few keys, so this is far
+ * more than there are cluster numbers for. */
+#define FAT_TREE_DEPTH 32
+
+#define FAT_ZIP_FILES							\
+  ( fat16_fs.fs_header.flags & RSH_FS_ZIP_FILES )
+
+#define FAT_DEDUP_FILES							\
+  ( fat16_fs.fs_header.flags & RSH_FS_DEDUP_FILES )
+
+/*
+ * The start of a compressed file's chain. The file is cut into FAT_ZIP_CHUNK
+ * byte chunks, each compressed on its own, and they follow this header one
+ * after the other. A chunk that's as long as it was to start with is stored
+ * as it is.
+ */
+struct rsh_fat_zhead {
+
+  uint32_t magic;
+  uint32_t chunks;
+  uint64_t size;             /* Of the file, uncompressed. */
+  uint32_t ends[];           /* Where in the chain each chunk ends. */
+
+} __attribute__((packed));
+
+#define FAT_ZHEAD_MAGIC 0x5a485352 /* "RSHZ" */
+#define FAT_ZIP_CHUNK   65536
+#define FAT_ZHEAD_LEN(chunks)						\
+  ( sizeof(struct rsh_fat_zhead) + (uint64_t)(chunks) * sizeof(uint32_t) )
+
+#define FAT_DIRENT_PACKED(ent)						\
+  ( (ent)->index == FAT_PACKED && (ent)->type == FAT_FILE )
+
+#define FAT_DIRENT_SIZE(ent)						\
+  ( fat16_fs.fs_header.version && ! FAT_DIRENT_PACKED(ent) ?		\
+    (((uint64_t)(ent)->size_hi << 32) | (ent)->size) : (ent)->size )
+
+/* Biggest file the mounted image can hold. */
+#define FAT_MAX_FILE_SIZE						\
+  ( fat16_fs.fs_header.version ? (uint64_t)INT64_MAX : (uint64_t)UINT32_MAX )
+
+/*
+ * What an open file's rsh_file.local points to. Along with the file's dirent
+ * we keep a map of the file's cluster chain: clusters[i] is the i'th cluster
+ * in the chain and logical[i] is which cluster of the file that is. They
+ * only differ once the file has holes. It's built lazily as the file is read
+ * or written so that finding a cluster doesn't mean walking the chain from
+ * the head every time.
+ */
+struct rsh_fat16_file {
+
+  struct rsh_fat_dirent *dirent;
+
+  uint32_t *clusters;
+  uint32_t *logical;
+  uint32_t length;           /* Number of clusters we know about so far. */
+  uint32_t size;             /* Number of slots allocated in clusters. */
+  uint32_t pos;              /* Where in the map the last lookup landed. */
+  uint32_t gen;              /* fat16_fs.chain_gen when the map was built. */
+  uint32_t parent;           /* Table of the directory the file is in. */
+  uint32_t shared;           /* First index in the map shared with another
+				file, FAT_UNSHARED if there isn't one. */
+  uint64_t next_read;        /* Where a sequential read would start next. */
+  uint64_t hinted;           /* How far ahead we've asked to have read. */
+  uint32_t streak;           /* Sequential reads in a row. */
+  int prealloc;              /* Set if the chain may run past the EOF. */
+  int dirty;                 /* Set if this open changed anything. */
+
+  /* Compressed files: the header (NULL until it's needed), chain_gen when
+   * it was read and the last chunk uncompressed. */
+  struct rsh_fat_zhead *zhead;
+  uint32_t zgen;
+  uint32_t zchunk;
+  uint32_t zfill;            /* How much of zchunk is in zbuf so far. */
+  uint8_t *zbuf;             /* What's in zchunk. */
+  uint8_t *zin;              /* A chunk that didn't fit in one cluster. */
+
+  /* What a write uncompressed: the old header and chunks, still compressed,
+   * and how much of the file from the front hasn't changed since. */
+  struct rsh_fat_zhead *zold;
+  uint8_t *zdata;
+  uint64_t zsame;
+
+  struct rsh_fat16_file *next; /* Next open file. */
+
+};
+
+/*
+ * An in memory index of a directory's table, see fs_fat16_index.c. The hash
+ * table maps names to dirents (open addressing, linear probing, NULL for an
+ * empty bucket). The free stack holds the directory's empty slots.
+ */
+struct rsh_fat16_dindex {
+
+  uint32_t dir;              /* First cluster of the directory's table. */
+
+  struct rsh_fat_dirent **table;
+  uint32_t mask;             /* Size of table - 1; size is a power of 2. */
+  uint32_t entries;          /* Number of used buckets in table. */
 
+  struct rsh_fat_dirent **free;
+  uint32_t free_len;
+  uint32_t free_size;
+
+  /* Compact directories have records of all sizes, so rather than empty
+   * slots they keep the clusters that have empty records in them. */
+  uint32_t *rooms;
+  uint32_t rooms_len;
+  uint32_t rooms_size;
+
+  uint64_t bytes;            /* Total size of the files in the directory. */
+
+  struct rsh_fat16_dindex *next;
+
+};
+
+/*
+ * An entry in the dentry cache, see fs_fat16_dcache.c. Maps an absolute path
+ * to the address of its dirent in the image. A NULL slot is a negative entry:
+ * the path didn't resolve and err says why.
+ */
+#define RSH_FAT16_DCACHE_PATH 256
+
+struct rsh_fat16_dentry {
+
+  char path[RSH_FAT16_DCACHE_PATH];
+  int len;                   /* Length of path, 0 if the entry is unused. */
+  uint32_t hash;
+
+  struct rsh_fat_dirent *slot;
+  int err;
+  uint32_t gen;              /* Creation generation, for negative entries. */
+
+  struct rsh_fat16_dentry *hnext;
+  struct rsh_fat16_dentry *prev;
+  struct rsh_fat16_dentry *next;
+
+};
+
+/* Durability modes, see fs_fat16_sync.c. */
+#define RSH_FAT16_SYNC      0
+#define RSH_FAT16_ASYNC     1
+#define RSH_FAT16_PERIODIC  2
+
+extern int      rsh_fat16_durability;
+extern long int rsh_fat16_flush_ms;
+extern long int rsh_fat16_flush_bytes;
+
+/* Image mapping policy bits, see fs_fat16_map.c. */
+#define RSH_FAT16_MAP_POPULATE  0x1
+#define RSH_FAT16_MAP_HUGEPAGE  0x2
+#define RSH_FAT16_MAP_STREAM    0x4
+#define RSH_FAT16_MAP_ALL       0x7
+
+extern int      rsh_fat16_map_policy;
+
+/* Growing the image when it fills up, see fs_fat16_grow.c. 0 for no
+ * growing. */
+extern uint64_t rsh_fat16_grow_max;
+extern int      rsh_fat16_grow_pct;
+
+/* Format version and header flags to use when making a new image. */
+extern int      rsh_fat16_new_version;
+extern uint32_t rsh_fat16_new_flags;
+
+/* Milliseconds of defragging to do between commands, 0 for none. */
+extern long int rsh_fat16_defrag_idle_ms;
+
+/* Usage counters as shell variables. */
+extern char    *rsh_fat16_stat_syms[];
 
 /* And finally some functions. */
 int       rsh_fat16_init(char *local_path, size_t size, size_t cluster);
 fat_t     rsh_fat16_alloc_cluster(fat_t parent);
+void      rsh_fat16_dirty(void *addr, size_t len);
+void      rsh_fat16_meta(void *addr, size_t len);
+int       rsh_fat16_sync(int flags);
+int       rsh_fat16_set_durability(int mode, long int ms, long int bytes);
+int       rsh_fat16_parse_durability(char *spec);
+int       rsh_fat16_set_map_policy(int policy);
+int       rsh_fat16_parse_map_policy(char *spec);
+int       rsh_fat16_set_grow(uint64_t max, int pct);
+int       rsh_fat16_parse_grow(char *spec);
+int       rsh_fat16_grow(uint64_t size);
+void      rsh_fat16_shutdown();
+char     *rsh_fat16_stat_sym(char *sym);
+int       rsh_fat16_defrag_idle();
+int       rsh_fat16_fsck(int threads, int repair, int out);
 
 /* These are intended for internal and/or debugging use. */
 fat_t     rsh_fat16_get_entry(uint32_t index);
 void      rsh_fat16_set_entry(uint32_t index, fat_t value);
 int       rsh_fat16_mkdir(const char *path);
+int       rsh_fat16_rename(const char *oldpath, const char *newpath);
+int       rsh_fat16_clone(const char *oldpath, const char *newpath);
+void     _rsh_fat16_remove(uint32_t dir, struct rsh_fat_dirent *child);
+int      _rsh_fat16_parent(char *path, char **name, uint32_t *dir);
+int      _rsh_fat16_is_under(uint32_t dir, uint32_t top);
+fat_t    _rsh_fat16_follow_head(uint32_t head, uint32_t offset);
 int      _rsh_fat16_mkfile(uint32_t dir_table, const char *name);
-void     _rsh_fat16_wipe_file(struct rsh_fat_dirent *dirent);
+struct rsh_fat_dirent *_rsh_fat16_locate_child(const char *child,
+					       uint32_t dir_table);
+struct rsh_fat_dirent *_rsh_fat16_new_dirent(uint32_t dir_table,
+					     const char *name);
+int      _rsh_fat16_wipe_file(struct rsh_fat_dirent *dirent);
+void     _rsh_fat16_set_size(struct rsh_fat_dirent *dirent, uint64_t size);
+uint32_t _rsh_fat16_chain_extents(uint32_t head, uint32_t *length);
+int      _rsh_fat16_relocate(struct rsh_fat_dirent *ent, uint32_t length);
 int      _rsh_fat16_find_open_cluster(uint32_t *addr);
+int     __rsh_fat16_find_open_cluster(uint32_t *addr);
+int      _rsh_fat16_scan_open_cluster(uint32_t *addr);
+int      _rsh_fat16_find_open_run(uint32_t want, uint32_t *start,
+				  uint32_t *len);
+int      _rsh_fat16_build_free_map(struct rsh_fat16_fs *fs);
+int      _rsh_fat16_build_dirty_map(struct rsh_fat16_fs *fs);
+int      _rsh_fat16_close_sync();
+int      _rsh_fat16_is_open(struct rsh_fat_dirent *dirent);
+void     _rsh_fat16_chain_changed(uint32_t head, struct rsh_fat16_file *keep);
+void     _rsh_fat16_zip_changed(struct rsh_fat_dirent *dirent, uint64_t off);
+uint32_t _rsh_fat16_file_cluster(struct rsh_fat16_file *file, uint32_t index);
+int      _rsh_fat16_file_grow(struct rsh_fat16_file *file);
+int      _rsh_fat16_file_append(struct rsh_fat16_file *file, uint32_t cluster);
 char    *_rsh_fat16_parse_path(char **copy, char **next, const char *path);
 int      _rsh_fat16_path_to_dirent(const char *path, 
 				   struct rsh_fat_dirent *ent,
 				   struct rsh_fat_dirent **fs_addr);
 void     _rsh_fat16_display_fat();
+void      rsh_fat16_badness();
+
+/* Directory indexes. */
+uint32_t _rsh_fat16_name_hash(const char *name);
+struct rsh_fat16_dindex *_rsh_fat16_dindex_get(uint32_t dir);
+struct rsh_fat_dirent   *_rsh_fat16_dindex_lookup(struct rsh_fat16_dindex *index,
+						  const char *name);
+struct rsh_fat_dirent   *_rsh_fat16_dindex_open_slot(
+					    struct rsh_fat16_dindex *index,
+					    const char *name);
+void     _rsh_fat16_dindex_insert(uint32_t dir, struct rsh_fat_dirent *slot);
+void     _rsh_fat16_dindex_remove(uint32_t dir, struct rsh_fat_dirent *slot);
+void     _rsh_fat16_dindex_add_cluster(uint32_t dir, uint32_t cluster);
+void     _rsh_fat16_dindex_resize(uint32_t dir, int64_t delta);
+void     _rsh_fat16_dindex_drop(uint32_t dir);
+void     _rsh_fat16_dindex_drop_all();
+
+/* Directory formats. */
+struct rsh_fat_dirent *_rsh_fat16_dirent_next(uint32_t cluster,
+					      struct rsh_fat_dirent *ent);
+struct rsh_fat_dirent *_rsh_fat16_dirent_room(uint32_t cluster,
+					      const char *name, int *any);
+struct rsh_fat_dirent *_rsh_fat16_dirent_refind(uint32_t cluster,
+						struct rsh_fat_dirent *ent);
+uint32_t _rsh_fat16_dir_joins();
+int      _rsh_fat16_dirent_fits(struct rsh_fat_dirent *ent, const char *name);
+void     _rsh_fat16_dirent_name(struct rsh_fat_dirent *ent, const char *name);
+int      _rsh_fat16_dirent_name_ok(struct rsh_fat_dirent *ent);
+void     _rsh_fat16_dirent_clear(struct rsh_fat_dirent *ent);
+void     _rsh_fat16_dir_cluster(uint32_t cluster);
+void     _rsh_fat16_dir_format(uint32_t cluster, uint32_t parent);
+int      _rsh_fat16_dir_ends(uint32_t cluster, struct rsh_fat_dirent *last);
+void     _rsh_fat16_dir_cut(uint32_t cluster, struct rsh_fat_dirent *last);
+
+/* Tree directories. */
+uint32_t _rsh_fat16_tree_root(uint32_t dir);
+struct rsh_fat_dirent *_rsh_fat16_tree_lookup(uint32_t root, const char *name);
+struct rsh_fat_dirent *_rsh_fat16_tree_room(uint32_t dir, const char *name);
+int      _rsh_fat16_tree_insert(uint32_t dir, struct rsh_fat_dirent *ent);
+void     _rsh_fat16_tree_remove(uint32_t dir, struct rsh_fat_dirent *ent);
+int      _rsh_fat16_tree_empty(uint32_t root);
+int      _rsh_fat16_tree_readdir(uint32_t root, char *last, struct dirent *ents,
+				 int max);
+int      _rsh_fat16_tree_build(uint32_t dir);
+void     _rsh_fat16_tree_drop(uint32_t dir);
+void     _rsh_fat16_tree_rebuild_all();
+
+/* Metadata journal. */
+extern uint32_t rsh_fat16_journal_commits;
+extern uint32_t rsh_fat16_journal_checkpoints;
+int      _rsh_fat16_journal_format(struct rsh_fat16_fs *fs);
+int      _rsh_fat16_journal_open(struct rsh_fat16_fs *fs);
+void     _rsh_fat16_journal_close();
+int      _rsh_fat16_journal_unmount();
+int      _rsh_fat16_journal_unclean();
+int      _rsh_fat16_journal_unsynced(uint64_t *from, uint64_t *to);
+int      _rsh_fat16_journal_sync(uint64_t from, uint64_t to, int flags);
+void     _rsh_fat16_journal_log(void *addr, size_t len, int zero);
+int      _rsh_fat16_journal_commit();
+int      _rsh_fat16_journal_checkpoint();
+void     _rsh_fat16_journal_free(uint32_t cluster);
+uint32_t _rsh_fat16_journal_freeing(uint32_t **clusters);
+int      _rsh_fat16_journal_full();
+int      _rsh_fat16_journal_pending();
+
+/* Shared clusters. */
+#define FAT_MAX_REFS  255
+uint32_t _rsh_fat16_refs(uint32_t cluster);
+void     _rsh_fat16_set_refs(uint32_t cluster, uint32_t refs);
+void     _rsh_fat16_release(uint32_t cluster);
+int      _rsh_fat16_unshare(struct rsh_fat16_file *file, uint32_t index);
+int      _rsh_fat16_chain_shared(uint32_t head);
+
+/* Mapping the image. */
+int      _rsh_fat16_map_image(struct rsh_fat16_fs *fs, uint64_t size);
+void     _rsh_fat16_unmap_image(struct rsh_fat16_fs *fs);
+int      _rsh_fat16_map_reserve(struct rsh_fat16_fs *fs, uint64_t size);
+int      _rsh_fat16_map_extend(struct rsh_fat16_fs *fs, uint64_t size);
+int      _rsh_fat16_make_room(uint32_t want);
+void     _rsh_fat16_grow_ahead(uint32_t want);
+void     _rsh_fat16_grow_deferred();
+void     _rsh_fat16_stream_hint(struct rsh_file *file, size_t count);
+
+/* Sparse files. */
+uint32_t _rsh_fat16_gap(uint32_t cluster);
+void     _rsh_fat16_set_gap(uint32_t cluster, uint32_t gap);
+int      _rsh_fat16_fill_hole(struct rsh_fat16_file *file, uint32_t index,
+			      uint32_t *cluster);
+off_t     rsh_fat16_lseek(struct rsh_file *file, off_t offset, int whence);
+
+/* Packed small files. The data of a packed file is FAT_PACK_UNIT sized units
+ * in a pack cluster, and its dirent's size_hi says which unit of the image it
+ * starts at. A pack cluster starts with a header saying which of its units
+ * are taken. */
+#define FAT_PACK_UNIT   64
+#define FAT_PACK_MAGIC  0x4b434150 /* "PACK" */
+
+#define FAT_PACK_TO_ADDR(unit)						\
+  ( fat16_fs.fs_io + (uint64_t)(unit) * FAT_PACK_UNIT )
+#define FAT_PACK_UNITS(bytes)						\
+  ( ((bytes) + FAT_PACK_UNIT - 1) / FAT_PACK_UNIT )
+
+struct rsh_fat16_pack {
+
+  uint32_t magic;
+  uint32_t used;             /* Units taken, the header's own included. */
+  uint8_t  map[];            /* A bit per unit, set if it's taken. */
+
+} __attribute__((packed));
+
+uint32_t _rsh_fat16_pack_header_units();
+void     _rsh_fat16_pack_format(uint32_t cluster);
+int      _rsh_fat16_pack_open(struct rsh_fat16_fs *fs);
+ssize_t  _rsh_fat16_pack_read(struct rsh_file *file, void *buf, size_t count);
+int      _rsh_fat16_pack_readv_map(struct rsh_file *file, struct iovec *iov,
+				   int iovcnt, size_t count);
+ssize_t  _rsh_fat16_pack_write(struct rsh_file *file, const void *buf,
+			       size_t count);
+int      _rsh_fat16_pack_copy(struct rsh_fat_dirent *from, uint32_t *unit);
+void     _rsh_fat16_pack_free(struct rsh_fat_dirent *dirent);
+int      _rsh_fat16_unpack(struct rsh_fat16_file *file);
+
+/* Compressed files. */
+extern uint32_t rsh_fat16_zip_chunks;
+int      _rsh_fat16_zip_load(struct rsh_fat16_file *file);
+void     _rsh_fat16_zip_forget(struct rsh_fat16_file *file);
+void     _rsh_fat16_zip_drop(struct rsh_fat16_file *file);
+ssize_t  _rsh_fat16_zip_read(struct rsh_file *file, void *buf, size_t count);
+int      _rsh_fat16_zip_readv_map(struct rsh_file *file, struct iovec *iov,
+				  int iovcnt, size_t count);
+int      _rsh_fat16_zip(struct rsh_fat16_file *file);
+int      _rsh_fat16_unzip(struct rsh_fat16_file *file);
+int      _rsh_fat16_zip_check(struct rsh_fat_dirent *dirent);
+uint32_t _rsh_fat16_zip_pack(const uint8_t *src, uint32_t len, uint8_t *dst,
+			     uint32_t max);
+int      _rsh_fat16_zip_unpack(const uint8_t *src, uint32_t len, uint8_t *dst,
+			       uint32_t want, uint32_t need);
+
+/* Deduplication. */
+extern uint64_t rsh_fat16_dedup_saved;
+uint64_t _rsh_fat16_dedup_hash(const void *data, uint32_t len);
+void     _rsh_fat16_dedup_forget(uint32_t cluster);
+void     _rsh_fat16_dedup_drop();
+int      _rsh_fat16_dedup_close(struct rsh_fat_dirent *ent);
+int      rsh_fat16_dedup(int threads, uint64_t *clusters, uint64_t *shared);
+
+/* Cluster checksums. */
+extern int      rsh_fat16_verify_reads;
+extern uint32_t rsh_fat16_csum_errors;
+uint32_t _rsh_fat16_crc32c(uint32_t crc, const void *buf, size_t len);
+uint32_t _rsh_fat16_crc32c_sw(uint32_t crc, const void *buf, size_t len);
+void     _rsh_fat16_csum_close();
+int      _rsh_fat16_csum_open(struct rsh_fat16_fs *fs);
+void     _rsh_fat16_csum_format(struct rsh_fat16_fs *fs);
+void     _rsh_fat16_csum_grow(uint32_t *table, uint32_t from, uint32_t to);
+void     _rsh_fat16_csum_stale(void *addr, size_t len);
+void     _rsh_fat16_csum_flush();
+int      _rsh_fat16_csum_check(uint32_t cluster);
+int      _rsh_fat16_csum_check_addr(void *addr);
+int      rsh_fat16_scrub(int threads, int out);
+
+/* Dentry cache. */
+extern uint32_t rsh_fat16_dcache_hits;
+extern uint32_t rsh_fat16_dcache_misses;
+struct rsh_fat16_dentry *_rsh_fat16_dcache_lookup(const char *path, int len);
+void     _rsh_fat16_dcache_add(const char *path, int len,
+			       struct rsh_fat_dirent *slot, int err);
+void     _rsh_fat16_dcache_forget(struct rsh_fat_dirent *slot);
+void     _rsh_fat16_dcache_created();
+void     _rsh_fat16_dcache_flush();
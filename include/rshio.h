@@ -24,6 +24,7 @@
 
 #include <rsh.h>
 
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 
@@ -36,9 +37,20 @@
 #define _RSH_FD(fd) ( fd & _RSH_FD_OFFSET )
 #define _RSH_FD_TO_INDEX(fd) ( fd & ~_RSH_FD_OFFSET )
 
+/* Linux's values, for when <unistd.h> was included without _GNU_SOURCE. */
+#ifndef SEEK_DATA
+# define SEEK_DATA 3
+# define SEEK_HOLE 4
+#endif
+
 /* Definitions for RSH's version of the necessary I/O sys calls. */
 ssize_t        rsh_read(int fd, void *buf, size_t count);
 ssize_t        rsh_write(int fd, const void *buf, size_t count);
+ssize_t        rsh_writev(int fd, const struct iovec *iov, int iovcnt);
+int            rsh_readv_map(int fd, struct iovec *iov, int iovcnt,
+			     size_t count);
+ssize_t        rsh_copy_fd(int in, int out);
+int            rsh_fallocate(int fd, off_t len);
 int            rsh_dup2(int oldfd, int newfd);
 int            rsh_open(const char *pathname, int flags, mode_t mode);
 int            rsh_close(int fd);
@@ -46,6 +58,9 @@ struct dirent *rsh_readdir(int dfd);
 int            rsh_fstat(int fd, struct stat *buf);
 int            rsh_mkdir(const char *path, mode_t mode);
 int            rsh_unlink(const char *path);
+int            rsh_rename(const char *oldpath, const char *newpath);
+int            rsh_clone(const char *oldpath, const char *newpath);
+off_t          rsh_lseek(int fd, off_t offset, int whence);
 int            rsh_chdir(const char *path);
 char          *rsh_getcwd(char *buf, size_t size);
  
@@ -55,3 +70,4 @@ int            rsh_dprintf(int fd, char *format, ...);
 /* Other things. */
 inline void    rsh_fs(int where);
 int            rsh_native_path(const char *path);
+char          *rsh_builtin_path(char *path);
@@ -14,6 +14,19 @@ struct sym_entry {
 
 };
 
+/*
+ * A symbol whose value is worked out every time it is looked up. get() is
+ * passed the symbol's name and returns its current value.
+ */
+struct sym_dynamic {
+
+  char *name;
+  char *(*get)(char *sym);
+
+  struct sym_dynamic *next;
+
+};
+
 struct sym_table {
 
   struct sym_entry *tbl_entries;
@@ -28,6 +41,9 @@ struct sym_table {
   /* Speed up adding entries by keeping track of the last entry. */
   struct sym_entry *last;
 
+  /* Symbols that are computed on the fly. */
+  struct sym_dynamic *dynamic;
+
 };
 
 /* These are the functions to control and access the symbol table. */
@@ -36,6 +52,7 @@ int   symtable_add(char *sym, char *data);
 char *symtable_get(char *sym);
 int   symtable_remove(char *sym);
 int   symtable_numeric(struct sym_entry **status, char **name, char **data);
+int   symtable_add_dynamic(char *sym, char *(*get)(char *sym));
 
 /* Some internal/book keeping functions. */
 struct sym_entry *_symtable_get_entry(char *sym);
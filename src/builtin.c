@@ -62,6 +62,28 @@ extern int builtin_source(int argc, char **argv, int in, int out, int err);
 /* Defined in fs_fat16.c */
 extern int builtin_fatinfo(int argc, char **argv, int in, int out, int err);
 
+/* Defined in fs_fat16_sync.c */
+extern int builtin_durability(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_map.c */
+extern int builtin_mapping(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_grow.c */
+extern int builtin_grow(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_defrag.c */
+extern int builtin_defrag(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_fsck.c */
+extern int builtin_fsck(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_dedup.c */
+extern int builtin_dedup(int argc, char **argv, int in, int out, int err);
+
+/* Defined in fs_fat16_csum.c */
+extern int builtin_scrub(int argc, char **argv, int in, int out, int err);
+extern int builtin_verify(int argc, char **argv, int in, int out, int err);
+
 /* Defined in rshio.c */
 extern int builtin_native(int argc, char **argv, int in, int out, int err);
 
@@ -80,6 +102,14 @@ struct builtin builtins[] = {
   {"dproc", builtin_dproc},
   {"dfs", builtin_dfs},
   {"fatinfo", builtin_fatinfo},
+  {"durability", builtin_durability},
+  {"mapping", builtin_mapping},
+  {"grow", builtin_grow},
+  {"defrag", builtin_defrag},
+  {"fsck", builtin_fsck},
+  {"dedup", builtin_dedup},
+  {"scrub", builtin_scrub},
+  {"verify", builtin_verify},
   {"source", builtin_source},
   {"export", builtin_export},
   {"native", builtin_native},
@@ -124,7 +154,7 @@ struct builtin *rsh_identify_builtin(char *command){
 int builtin_exit(int argc, char **argv, int in, int out, int err){
 
   /* This should be made a bit more sophisticated... */
-  exit(0);
+  rsh_exit(0);
   return 0;
 
 }
@@ -579,17 +609,16 @@ int _rsh_cp_star_expand(char *_star_path){
 
 }
 
-#define CHUNK_SIZE (16*1024) /* Copy 16KB chunks at a time. */
-
 /*
  * This function assumes erorr cheching has been done so far. Thus we can
  * expect that if dest is a directory, we are copying source _into_ dest and
- * if dest is a regular file, then we are overwriting dest with source.
+ * if dest is a regular file, then we are overwriting dest with source. If
+ * clone is set and both ends are in the builtin file system, dest just shares
+ * source's clusters, which takes no time or space at all.
  */
-int _do_copy(char *source, char *dest){
+int _do_copy(char *source, char *dest, int clone){
 
   int ret = 0;
-  int bytes;
   int tmpfd;
   int dest_fd;
   int source_fd;
@@ -597,7 +626,6 @@ int _do_copy(char *source, char *dest){
   int free_tmp = 0, free_dest_file_name = 0;
   char *tmp, *source_node;
   char *dest_file_name;
-  char chunk[CHUNK_SIZE];
   struct stat statbuf;
 
   /* Dest FD is the hard one so lets do that first. */
@@ -644,6 +672,12 @@ int _do_copy(char *source, char *dest){
     dest_file_name = dest;
   }
 
+  /* Anything that can't be cloned (a native file, a directory, an old image)
+   * just gets copied. */
+  if ( clone && ! rsh_native_path(source) && ! rsh_native_path(dest_file_name)
+       && rsh_clone(source, dest_file_name) == 0 )
+    goto cleanup;
+
   source_fd = rsh_open(source, O_RDONLY, 0);
   if ( source_fd < 0 ){
     perror("rsh_open");
@@ -661,10 +695,14 @@ int _do_copy(char *source, char *dest){
     goto cleanup;
   }
 
-  /* If we are here, we have two valid descriptors. Simply read from source and
-   * write to dest until there is nothing left. */
-  while ( (bytes = rsh_read(source_fd, chunk, CHUNK_SIZE)) != 0 )
-    rsh_write(dest_fd, chunk, bytes);
+  /* If we are here, we have two valid descriptors. Simply copy from source to
+   * dest until there is nothing left. */
+  if ( rsh_copy_fd(source_fd, dest_fd) < 0 ){
+    perror("rsh_copy_fd");
+    ret = RSH_ERR;
+  }
+  rsh_close(source_fd);
+  rsh_close(dest_fd);
 
   /* And we are done. */
  cleanup:
@@ -680,6 +718,7 @@ int builtin_cp(int argc, char **argv, int in, int out, int err){
 
   int i;
   int fd;
+  int clone = 1;
   int ret = 0, tmpret;
   char *dest;
   struct stat buf;
@@ -694,12 +733,21 @@ int builtin_cp(int argc, char **argv, int in, int out, int err){
    * following: cp <sources> <dest>. sources may be many files/dirs thus for
    * each passed file, a particular action must be taken, be that a native
    * copy, a native to bifs copy, etc. Anyway, thats the jist of this code.
+   *
+   * Copies within the bifs share clusters with the source until one of them
+   * is written; --no-clone makes a real copy up front.
    */
   argc--;
   argv++;
 
+  if ( argc && strcmp(argv[0], "--no-clone") == 0 ){
+    clone = 0;
+    argc--;
+    argv++;
+  }
+
   if ( argc < 2 ){
-    printf("cp: usage: cp <source [source] ...> <dest>\n");
+    printf("cp: usage: cp [--no-clone] <source [source] ...> <dest>\n");
     return 1;
   }
 
@@ -758,7 +806,7 @@ int builtin_cp(int argc, char **argv, int in, int out, int err){
   /* OK, now, basically, we can just copy each part of list into the dest. */
   for ( i = 0; i < list_elems; i++){
     rsh_dprintf(out, "cp: %s -> %s\n", list[i], dest);
-    _do_copy(list[i], dest);
+    _do_copy(list[i], dest, clone);
   }
 
  done:
@@ -771,16 +819,55 @@ int builtin_cp(int argc, char **argv, int in, int out, int err){
 }
 
 /*
- * ALERT: ***EXTREMELY*** naive implementation of mv. Copy the file, then
- * delete the original. This could be made a billion, million, googlyplex times
- * as fast by implementing it on the dirent level in the file system. But I
- * don't have time to go and pull that sort of code out of my butt :(. This
- * will have to do for now. Plus it allows for copying from one file system to
- * another.
+ * Work out where mv should put source: if dest is a directory then the
+ * source goes inside it. Returns a malloc()'ed path.
+ */
+char *_rsh_mv_dest(char *source, char *dest){
+
+  int fd;
+  int is_dir = 0;
+  char *leaf;
+  char *dir;
+  char *path;
+  struct stat buf;
+
+  if ( rsh_native_path(dest) ){
+    is_dir = stat(dest, &buf) == 0 && S_ISDIR(buf.st_mode);
+  } else {
+    /* Once the image's name is off the front it looks like a native path,
+     * so go straight to the built in FS with it. */
+    fd = _rsh_open(*dest == '/' ? rsh_builtin_path(dest) : dest, O_RDONLY, 0);
+    if ( fd >= 0 ){
+      is_dir = rsh_fstat(fd, &buf) == 0 && (buf.st_mode & S_IFDIR);
+      rsh_close(fd);
+    }
+  }
+
+  if ( ! is_dir )
+    return strdup(dest);
+
+  leaf = strrchr(source, '/');
+  leaf = leaf ? leaf + 1 : source;
+  if ( dest[strlen(dest)-1] == '/' )
+    return _combine_paths(dest, leaf);
+
+  dir = _combine_paths(dest, "/");
+  path = _combine_paths(dir, leaf);
+  free(dir);
+  return path;
+
+}
+
+/*
+ * Move a file. If the source and destination are on the same file system
+ * this is just a rename, which doesn't touch the file's data. Going from one
+ * file system to the other means copying the file and then deleting the
+ * original.
  */
 int builtin_mv(int argc, char **argv, int in, int out, int err){
 
   int ret = 0;
+  char *dest;
   char *cp_argv[4];
 
   if ( argc != 3 ){
@@ -788,6 +875,24 @@ int builtin_mv(int argc, char **argv, int in, int out, int err){
     return 1;
   }
 
+  dest = _rsh_mv_dest(argv[1], argv[2]);
+  if ( ! dest ){
+    rsh_dprintf(err, "mv: out of memory\n");
+    ret = 1;
+    goto cleanup;
+  }
+
+  if ( rsh_rename(argv[1], dest) == 0 ){
+    free(dest);
+    goto cleanup;
+  }
+  free(dest);
+  if ( errno != EXDEV && errno != ENOSYS ){
+    rsh_dprintf(err, "mv: %s: %s\n", argv[1], strerror(errno));
+    ret = 1;
+    goto cleanup;
+  }
+
   cp_argv[0] = "cp";
   cp_argv[1] = argv[1];
   cp_argv[2] = argv[2];
@@ -950,8 +1055,13 @@ int builtin_ls(int argc, char **argv, int in, int out, int err){
     goto cleanup;
   }
 
-  /* Now sort the list of dirents. */
-  qsort(ent_list, list_index, sizeof(struct dirent), _rsh_compare_dirent);
+  /* Now sort the list of dirents. Tree directories come back sorted
+   * already. */
+  for ( i = 1; i < list_index; i++ )
+    if ( _rsh_compare_dirent(&ent_list[i - 1], &ent_list[i]) > 0 )
+      break;
+  if ( i < list_index )
+    qsort(ent_list, list_index, sizeof(struct dirent), _rsh_compare_dirent);
   
   /* Fill up the stat bufs. */
   bufs = (struct stat *)malloc(sizeof(struct stat) * list_index);
@@ -1135,8 +1245,6 @@ int builtin_cat(int argc, char **argv, int in, int out, int err){
   int i;
   int fd;
   int ret;
-  int bytes;
-  char chunk[CHUNK_SIZE];
   struct stat buf;
 
   if ( native ){
@@ -1170,8 +1278,9 @@ int builtin_cat(int argc, char **argv, int in, int out, int err){
     }
 
     /* Print out the file. Yeesh. */
-    while ( ( bytes = rsh_read(fd, chunk, CHUNK_SIZE)) != 0 )
-      rsh_write(out, chunk, bytes);
+    if ( rsh_copy_fd(fd, out) < 0 )
+      perror("rsh_copy_fd");
+    rsh_close(fd);
 
   }
 
@@ -0,0 +1,904 @@
+/*
+ * Some timing for the FAT16 driver. Not a test so much as a way to see if the
+ * changes to the driver actually made anything faster. Run it with an
+ * optional geometry (<size>:<cluster_size>, same as --geometry) and it will
+ * make a fresh image called fat16bench.img in the current directory, and
+ * others, fat16small.img, fat16dirs.img, fat16zip.img, fat16dedup.img and
+ * fat16csum.img, for the small file, directory format, compression, dedup and
+ * checksum tests.
+ */
+
+#include <rsh.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+
+extern struct rsh_fat16_fs fat16_fs;
+extern int _rsh_fat16_geometry(char *geometry, long int *geo);
+extern int _rsh_open(const char *pathname, int flags, mode_t mode);
+extern int _rsh_close(int fd);
+extern int _rsh_unlink(const char *path);
+extern struct dirent *_rsh_readdir(int dfd);
+extern ssize_t _rsh_write(int fd, const void *buf, size_t count);
+extern ssize_t _rsh_read(int fd, void *buf, size_t count);
+extern int __rsh_fat16_find_open_cluster(uint32_t *addr);
+extern struct rsh_fat_dirent *_rsh_fat16_locate_child(const char *child,
+						      uint32_t dir_table);
+extern struct rsh_fat_dirent *_rsh_fat16_scan_child(const char *child,
+						    uint32_t dir_table);
+
+#define BENCH_IMAGE "fat16bench.img"
+#define BENCH_SMALL_IMAGE "fat16small.img"
+#define BENCH_DIRS_IMAGE "fat16dirs.img"
+#define BENCH_ZIP_IMAGE "fat16zip.img"
+#define BENCH_DEDUP_IMAGE "fat16dedup.img"
+#define BENCH_CSUM_IMAGE "fat16csum.img"
+
+/*
+ * Wall clock time in seconds.
+ */
+double bench_now(){
+
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+
+}
+
+/*
+ * Allocate clusters one at a time into a single chain until the disk is full.
+ * This is what appending to a big file looks like to the allocator. The find
+ * function is the allocator to use. Returns the head of the chain and sets
+ * *count to the number of clusters allocated.
+ */
+fat_t bench_fill(int (*find)(uint32_t *addr), uint32_t *count){
+
+  fat_t head = FAT_TERM;
+  fat_t tail = FAT_TERM;
+  uint32_t cluster;
+
+  *count = 0;
+  while ( find(&cluster) == RSH_OK ){
+
+    rsh_fat16_set_entry(cluster, FAT_TERM);
+    if ( tail != FAT_TERM )
+      rsh_fat16_set_entry(tail, cluster);
+
+    if ( head == FAT_TERM )
+      head = cluster;
+    tail = cluster;
+    (*count)++;
+
+  }
+
+  return head;
+
+}
+
+/*
+ * Give a chain back to the free pool.
+ */
+void bench_free(fat_t head){
+
+  fat_t next;
+
+  while ( head != FAT_TERM ){
+    next = rsh_fat16_get_entry(head);
+    rsh_fat16_set_entry(head, FAT_FREE);
+    head = next;
+  }
+
+}
+
+void bench_report(char *what, uint32_t count, double elapsed){
+
+  printf("  %-24s %8u allocs in %8.4f s: %12.0f allocs/s\n", what, count,
+	 elapsed, count / elapsed);
+
+}
+
+/*
+ * Look up every name in a directory of count files. Returns the number of
+ * names that were actually found, which had better be count.
+ */
+uint32_t bench_lookup(struct rsh_fat_dirent *(*find)(const char *child,
+						     uint32_t dir_table),
+		      uint32_t dir, uint32_t count){
+
+  uint32_t i, found = 0;
+  char name[32];
+
+  for ( i = 0; i < count; i++ ){
+    sprintf(name, "file%u", i);
+    if ( find(name, dir) )
+      found++;
+  }
+
+  return found;
+
+}
+
+/*
+ * Write total bytes to a new file, size bytes per write. Prints out how fast
+ * that went.
+ */
+void bench_write(size_t size, size_t total){
+
+  int fd;
+  char *buf;
+  size_t done = 0;
+  uint32_t writes = 0;
+  double start, elapsed;
+
+  buf = malloc(size);
+  if ( ! buf )
+    return;
+  memset(buf, 'x', size);
+
+  fd = _rsh_open("/wbench", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  if ( fd < 0 ){
+    free(buf);
+    return;
+  }
+
+  start = bench_now();
+  while ( done < total ){
+    if ( _rsh_write(fd, buf, size) != size )
+      break;
+    done += size;
+    writes++;
+  }
+  elapsed = bench_now() - start;
+
+  printf("  %8lu byte writes: %8u in %8.4f s: %12.0f writes/s %8.1f MB/s\n",
+	 (unsigned long)size, writes, elapsed, writes / elapsed,
+	 done / elapsed / (1024 * 1024));
+
+  _rsh_close(fd);
+  _rsh_unlink("/wbench");
+  free(buf);
+
+}
+
+/*
+ * Read the file at path front to back under a mapping policy, starting from
+ * a cold image: everything written back, out of our page tables and, if the
+ * kernel will let it go, out of the page cache. Prints how long mapping and
+ * reading took and how many page faults it cost.
+ */
+void bench_map(char *what, int policy, const char *path){
+
+  int fd;
+  char *buf;
+  ssize_t bytes;
+  size_t done = 0;
+  double start, mapped, elapsed;
+  struct rusage before, after;
+
+  buf = malloc(64*1024);
+  if ( ! buf )
+    return;
+
+  rsh_fat16_set_map_policy(0);
+  rsh_fat16_sync(MS_SYNC);
+  madvise(fat16_fs.fs_io, fat16_fs.fs_header.size, MADV_DONTNEED);
+  posix_fadvise(fat16_fs.fs_fd, 0, 0, POSIX_FADV_DONTNEED);
+
+  getrusage(RUSAGE_SELF, &before);
+  start = bench_now();
+  rsh_fat16_set_map_policy(policy);
+  mapped = bench_now() - start;
+
+  fd = _rsh_open(path, O_RDONLY, 0);
+  if ( fd < 0 ){
+    free(buf);
+    return;
+  }
+  while ( (bytes = _rsh_read(fd, buf, 64*1024)) > 0 )
+    done += bytes;
+  elapsed = bench_now() - start;
+  getrusage(RUSAGE_SELF, &after);
+  _rsh_close(fd);
+
+  printf("  %-24s map %8.4f s total %8.4f s: %8.1f MB/s %8ld minor %6ld "
+	 "major faults\n", what, mapped, elapsed,
+	 done / elapsed / (1024 * 1024), after.ru_minflt - before.ru_minflt,
+	 after.ru_majflt - before.ru_majflt);
+
+  free(buf);
+
+}
+
+/*
+ * cat every file of the small file tree: open, read it all, close. Returns
+ * how long that took per file, in microseconds.
+ */
+double bench_cat(uint32_t count, char *buf, size_t len){
+
+  int fd;
+  uint32_t i;
+  char name[32];
+  double start = bench_now();
+
+  for ( i = 0; i < count; i++ ){
+    sprintf(name, "/s%u/f%u", i / 100, i);
+    fd = _rsh_open(name, O_RDONLY, 0);
+    if ( fd < 0 )
+      continue;
+    while ( _rsh_read(fd, buf, len) > 0 )
+      ;
+    _rsh_close(fd);
+  }
+
+  return (bench_now() - start) * 1e6 / count;
+
+}
+
+/*
+ * Make a tree of count small files, config file sized and 100 to a
+ * directory, on a fresh image of the given format version. Prints how much
+ * of the image the tree takes and how long a cat of each file takes, first
+ * with nothing of the image in memory and then again with all of it.
+ */
+void bench_small(int version, long int cluster, uint32_t count){
+
+  int fd;
+  char *buf;
+  char name[32];
+  uint32_t i;
+  uint32_t before;
+  uint32_t used;
+  uint64_t bytes = 0;
+  size_t size;
+  double cold, warm;
+
+  buf = malloc(2048);
+  if ( ! buf )
+    return;
+  memset(buf, 'c', 2048);
+
+  rsh_fat16_new_version = version;
+  unlink(BENCH_SMALL_IMAGE);
+  if ( rsh_fat16_init(BENCH_SMALL_IMAGE, (uint64_t)count * cluster * 2,
+		      cluster) ){
+    printf("Could not make the small file image.\n");
+    free(buf);
+    return;
+  }
+
+  before = fat16_fs.free_clusters;
+  srand(1);
+  for ( i = 0; i < count; i++ ){
+    if ( i % 100 == 0 ){
+      sprintf(name, "/s%u", i / 100);
+      rsh_fat16_mkdir(name);
+    }
+    sprintf(name, "/s%u/f%u", i / 100, i);
+    fd = _rsh_open(name, O_CREAT|O_TRUNC|O_WRONLY, 0);
+    if ( fd < 0 )
+      break;
+    size = 50 + rand() % 1450;
+    _rsh_write(fd, buf, size);
+    _rsh_close(fd);
+    bytes += size;
+  }
+  used = before - fat16_fs.free_clusters;
+
+  rsh_fat16_sync(MS_SYNC);
+  madvise(fat16_fs.fs_io, fat16_fs.fs_header.size, MADV_DONTNEED);
+  posix_fadvise(fat16_fs.fs_fd, 0, 0, POSIX_FADV_DONTNEED);
+  cold = bench_cat(i, buf, 2048);
+  warm = bench_cat(i, buf, 2048);
+
+  printf("  version %d %8u files %8.1f MB of data in %8.1f MB (%5.1fx) cat "
+	 "%6.2f us cold %6.2f us warm\n", version, i,
+	 bytes / (1024.0 * 1024), (double)used * cluster / (1024 * 1024),
+	 (double)used * cluster / bytes, cold, warm);
+
+  unlink(BENCH_SMALL_IMAGE);
+  free(buf);
+
+}
+
+/*
+ * Make a directory of count empty files on a fresh image with the given
+ * header flags (fixed or compact dirents), then see how many clusters it
+ * takes and how long it takes to read it (cold), look everything in it up
+ * without the index and build the index for it.
+ */
+void bench_dirs(uint32_t flags, long int cluster, uint32_t count){
+
+  int dfd;
+  char name[32];
+  uint32_t i;
+  uint32_t found;
+  uint32_t clusters = 0;
+  uint32_t table;
+  double start, list, scan, index;
+  struct rsh_fat_dirent ent;
+
+  rsh_fat16_new_version = RSH_FS_V6;
+  rsh_fat16_new_flags = flags;
+  unlink(BENCH_DIRS_IMAGE);
+  if ( rsh_fat16_init(BENCH_DIRS_IMAGE, 16*1024*1024, cluster) ){
+    printf("Could not make the directory image.\n");
+    rsh_fat16_new_flags = 0;
+    return;
+  }
+
+  rsh_fat16_mkdir("/d");
+  _rsh_fat16_path_to_dirent("/d", &ent, NULL);
+  for ( i = 0; i < count; i++ ){
+    sprintf(name, "file%u", i);
+    if ( _rsh_fat16_mkfile(ent.index, name) )
+      break;
+  }
+  count = i;
+
+  for ( table = ent.index; table != FAT_TERM;
+	table = rsh_fat16_get_entry(table) )
+    clusters++;
+
+  rsh_fat16_sync(MS_SYNC);
+  madvise(fat16_fs.fs_io, fat16_fs.fs_header.size, MADV_DONTNEED);
+  posix_fadvise(fat16_fs.fs_fd, 0, 0, POSIX_FADV_DONTNEED);
+  start = bench_now();
+  dfd = _rsh_open("/d", O_RDONLY, 0);
+  while ( dfd >= 0 && _rsh_readdir(dfd) )
+    ;
+  _rsh_close(dfd);
+  list = bench_now() - start;
+
+  start = bench_now();
+  found = bench_lookup(_rsh_fat16_scan_child, ent.index, count);
+  scan = bench_now() - start;
+
+  start = bench_now();
+  _rsh_fat16_dindex_drop_all();
+  _rsh_fat16_dindex_get(ent.index);
+  index = bench_now() - start;
+
+  printf("  %-8s %8u files in %5u clusters: readdir %7.2f ms, scan %8u "
+	 "in %7.2f ms, index %6.2f ms\n", flags & RSH_FS_COMPACT_DIRS ?
+	 "compact" : "fixed", count, clusters, list * 1e3, found, scan * 1e3,
+	 index * 1e3);
+
+  rsh_fat16_new_flags = 0;
+  unlink(BENCH_DIRS_IMAGE);
+
+}
+
+/*
+ * One directory of count files, made, looked up, listed and thinned out, with
+ * and without a tree. The first lookup is from a cold start, which for a
+ * directory without a tree means building its index first.
+ */
+void bench_big_dir(uint32_t flags, long int cluster, uint32_t count){
+
+  int dfd;
+  char name[64];
+  uint32_t i;
+  uint32_t found;
+  uint32_t listed = 0;
+  double start, make, first, lookup, list, rm;
+  struct rsh_fat_dirent ent;
+
+  rsh_fat16_new_version = RSH_FS_V6;
+  rsh_fat16_new_flags = flags;
+  unlink(BENCH_DIRS_IMAGE);
+  if ( rsh_fat16_init(BENCH_DIRS_IMAGE, 128*1024*1024, cluster) ){
+    printf("Could not make the directory image.\n");
+    rsh_fat16_new_flags = 0;
+    return;
+  }
+
+  rsh_fat16_mkdir("/d");
+  _rsh_fat16_path_to_dirent("/d", &ent, NULL);
+  start = bench_now();
+  for ( i = 0; i < count; i++ ){
+    sprintf(name, "file%u", i);
+    if ( _rsh_fat16_mkfile(ent.index, name) )
+      break;
+  }
+  make = bench_now() - start;
+  count = i;
+
+  rsh_fat16_sync(MS_SYNC);
+  _rsh_fat16_dindex_drop_all();
+  madvise(fat16_fs.fs_io, fat16_fs.fs_header.size, MADV_DONTNEED);
+  posix_fadvise(fat16_fs.fs_fd, 0, 0, POSIX_FADV_DONTNEED);
+  start = bench_now();
+  _rsh_fat16_locate_child("file0", ent.index);
+  first = bench_now() - start;
+
+  start = bench_now();
+  found = bench_lookup(_rsh_fat16_locate_child, ent.index, count);
+  lookup = bench_now() - start;
+
+  start = bench_now();
+  dfd = _rsh_open("/d", O_RDONLY, 0);
+  while ( dfd >= 0 && _rsh_readdir(dfd) )
+    listed++;
+  _rsh_close(dfd);
+  list = bench_now() - start;
+
+  start = bench_now();
+  for ( i = 0; i < count; i += 10 ){
+    sprintf(name, "/d/file%u", i);
+    _rsh_unlink(name);
+  }
+  rm = bench_now() - start;
+
+  printf("  %-8s %6u files: create %7.1f ms, cold lookup %6.2f ms, "
+	 "%6u lookups %6.1f ms, readdir %6u in %6.1f ms, rm 10%% %6.1f ms\n",
+	 flags & RSH_FS_TREE_DIRS ? "tree" : "index", count, make * 1e3,
+	 first * 1e3, found, lookup * 1e3, listed, list * 1e3, rm * 1e3);
+
+  rsh_fat16_new_flags = 0;
+  unlink(BENCH_DIRS_IMAGE);
+
+}
+
+/*
+ * Fill buf with len bytes of something that looks like a log: time stamps,
+ * a handful of hosts and messages, and numbers that don't repeat much.
+ */
+void bench_log(char *buf, size_t len){
+
+  size_t used = 0;
+  uint32_t seed = 12345;
+  uint32_t line = 0;
+  char text[256];
+  int n;
+  static char *hosts[] = { "build01", "build02", "web-frontend", "db-primary" };
+  static char *what[] = {
+    "INFO  request served", "INFO  cache miss, fetching", "WARN  slow query",
+    "INFO  session opened for user", "DEBUG retrying connection to",
+    "ERROR upstream returned"
+  };
+
+  while ( used < len ){
+    seed = seed * 1103515245 + 12345;
+    n = sprintf(text, "2026-10-17 %02u:%02u:%02u.%03u %s rsh[%u]: %s %u "
+		"(%u ms)\n", line / 360000 % 24, line / 6000 % 60,
+		line / 100 % 60, seed % 1000, hosts[(seed >> 8) % 4],
+		1000 + (seed >> 12) % 50, what[(seed >> 16) % 6],
+		(seed >> 4) % 100000, (seed >> 20) % 2000);
+    if ( n > len - used )
+      n = len - used;
+    memcpy(buf + used, text, n);
+    used += n;
+    line++;
+  }
+
+}
+
+/*
+ * Read a file front to back; returns how many bytes that was.
+ */
+size_t bench_read_all(const char *path, char *buf, size_t size){
+
+  int fd;
+  ssize_t got;
+  size_t total = 0;
+
+  fd = _rsh_open(path, O_RDONLY, 0);
+  if ( fd < 0 )
+    return 0;
+  while ( (got = _rsh_read(fd, buf, size)) > 0 )
+    total += got;
+  _rsh_close(fd);
+
+  return total;
+
+}
+
+/*
+ * Write size bytes of log to a file on a fresh image with the given header
+ * flags (compressed or not), then see how much room it took and how fast it
+ * can be written, read back (cat), copied (cp), read at random and added to
+ * a line at a time (open, append, close).
+ */
+void bench_zip(uint32_t flags, long int cluster, size_t size){
+
+  int fd, out;
+  char *log;
+  char *buf;
+  uint32_t i;
+  uint32_t before;
+  size_t xfer = 64*1024;
+  size_t total = 0;
+  ssize_t got;
+  double start, write, cat, cp, rnd, app;
+
+  log = malloc(size);
+  buf = malloc(xfer);
+  if ( ! log || ! buf ){
+    free(log);
+    free(buf);
+    return;
+  }
+  bench_log(log, size);
+
+  rsh_fat16_new_version = RSH_FS_V6;
+  rsh_fat16_new_flags = flags;
+  unlink(BENCH_ZIP_IMAGE);
+  if ( rsh_fat16_init(BENCH_ZIP_IMAGE, size * 3, cluster) ){
+    printf("Could not make the compression image.\n");
+    rsh_fat16_new_flags = 0;
+    free(log);
+    free(buf);
+    return;
+  }
+
+  before = fat16_fs.free_clusters;
+  start = bench_now();
+  fd = _rsh_open("/log", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  for ( i = 0; i < size / xfer; i++ )
+    _rsh_write(fd, log + i * xfer, xfer);
+  _rsh_close(fd);
+  write = bench_now() - start;
+  before -= fat16_fs.free_clusters;
+
+  start = bench_now();
+  total = bench_read_all("/log", buf, xfer);
+  cat = bench_now() - start;
+
+  start = bench_now();
+  fd = _rsh_open("/log", O_RDONLY, 0);
+  out = _rsh_open("/copy", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  while ( (got = _rsh_read(fd, buf, xfer)) > 0 )
+    _rsh_write(out, buf, got);
+  _rsh_close(out);
+  _rsh_close(fd);
+  cp = bench_now() - start;
+
+  /* 4k reads from all over the file. */
+  fd = _rsh_open("/log", O_RDONLY, 0);
+  start = bench_now();
+  for ( i = 0; i < 10000; i++ ){
+    _rsh_lseek(fd, (i * 2654435761U) % (size - 4096), SEEK_SET);
+    _rsh_read(fd, buf, 4096);
+  }
+  rnd = bench_now() - start;
+  _rsh_close(fd);
+
+  start = bench_now();
+  for ( i = 0; i < 100; i++ ){
+    fd = _rsh_open("/log", O_WRONLY|O_APPEND, 0);
+    _rsh_write(fd, log, 80);
+    _rsh_close(fd);
+  }
+  app = bench_now() - start;
+
+  printf("  %-6s %5.1f MB in %6u clusters (%4.2fx): write %7.1f MB/s, "
+	 "cat %7.1f MB/s, cp %7.1f MB/s, 10000 4k reads %6.1f ms, "
+	 "100 appends %6.1f ms\n",
+	 flags & RSH_FS_ZIP_FILES ? "zip" : "plain", total / 1e6, before,
+	 (double)size / ((double)before * cluster), size / 1e6 / write,
+	 size / 1e6 / cat, size / 1e6 / cp, rnd * 1e3, app * 1e3);
+
+  rsh_fat16_new_flags = 0;
+  unlink(BENCH_ZIP_IMAGE);
+  free(log);
+  free(buf);
+
+}
+
+/*
+ * Write copies copies of the same size bytes (something like a build
+ * artifact, that doesn't compress) into a directory each, on a fresh image
+ * with the given header flags. Then, if the image doesn't share clusters as
+ * files are written, run dedup over it with threads threads. Shows how much
+ * room the copies took and how long it all took.
+ */
+void bench_dedup(uint32_t flags, int threads, long int cluster, size_t size,
+		 int copies){
+
+  int i, fd;
+  char *data;
+  char path[64];
+  uint32_t used;
+  uint32_t j;
+  uint32_t seed = 4242;
+  uint64_t looked = 0;
+  uint64_t freed = 0;
+  double start, write, dedup = 0;
+
+  data = malloc(size);
+  if ( ! data )
+    return;
+  for ( j = 0; j < size / 4; j++ ){
+    seed = seed * 1103515245 + 12345;
+    ((uint32_t *)data)[j] = seed;
+  }
+
+  rsh_fat16_new_version = RSH_FS_V6;
+  rsh_fat16_new_flags = flags;
+  unlink(BENCH_DEDUP_IMAGE);
+  if ( rsh_fat16_init(BENCH_DEDUP_IMAGE, size * (copies + 2), cluster) ){
+    printf("Could not make the dedup image.\n");
+    rsh_fat16_new_flags = 0;
+    free(data);
+    return;
+  }
+
+  used = fat16_fs.free_clusters;
+  start = bench_now();
+  for ( i = 0; i < copies; i++ ){
+    sprintf(path, "/build%d", i);
+    rsh_fat16_mkdir(path);
+    sprintf(path, "/build%d/artifact", i);
+    fd = _rsh_open(path, O_CREAT|O_TRUNC|O_WRONLY, 0);
+    for ( j = 0; j < size; j += 64*1024 )
+      _rsh_write(fd, data + j, size - j < 64*1024 ? size - j : 64*1024);
+    _rsh_close(fd);
+  }
+  write = bench_now() - start;
+
+  if ( ! (flags & RSH_FS_DEDUP_FILES) ){
+    start = bench_now();
+    rsh_fat16_dedup(threads, &looked, &freed);
+    dedup = bench_now() - start;
+  }
+  used -= fat16_fs.free_clusters;
+
+  if ( flags & RSH_FS_DEDUP_FILES )
+    printf("  %-18s %6u clusters: write %7.1f MB/s\n", "dedup on close",
+	   used, size / 1e6 * copies / write);
+  else
+    printf("  dedup -j %-9d %6u clusters: write %7.1f MB/s, dedup of %llu "
+	   "clusters %7.1f ms\n", threads, used,
+	   size / 1e6 * copies / write, (unsigned long long)looked,
+	   dedup * 1e3);
+
+  rsh_fat16_new_flags = 0;
+  unlink(BENCH_DEDUP_IMAGE);
+  free(data);
+
+}
+
+/*
+ * CRC32C of a 1MB buffer, loops times over, with crc. The sum is printed so
+ * that the two CRCs can be seen to agree.
+ */
+void bench_crc(char *name, uint32_t (*crc)(uint32_t, const void *, size_t),
+	       int loops){
+
+  int i;
+  char *buf;
+  uint32_t sum = 0;
+  double start, took;
+
+  buf = malloc(1024*1024);
+  if ( ! buf )
+    return;
+  for ( i = 0; i < 1024*1024; i++ )
+    buf[i] = i * 2654435761U >> 24;
+
+  start = bench_now();
+  for ( i = 0; i < loops; i++ )
+    sum = crc(sum, buf, 1024*1024);
+  took = bench_now() - start;
+
+  printf("  %-18s %7.1f MB/s (%08x)\n", name, loops * 1.048576 / took, sum);
+  free(buf);
+
+}
+
+/*
+ * Write a size byte file of random data to a fresh image of the given
+ * version and read it back with verify reads on or off. Closing the file
+ * syncs it, so the write includes working out the sums. The first cat checks
+ * every cluster, the second only what changed since, which is nothing. Then
+ * scrub the lot if the image has checksums at all.
+ */
+void bench_csum(int version, int verify, long int cluster, size_t size){
+
+  int fd, null;
+  char *buf;
+  size_t j;
+  uint32_t seed = 777;
+  uint32_t i;
+  double start, write, cold, warm, rnd, scrub = 0;
+
+  buf = malloc(size);
+  if ( ! buf )
+    return;
+  for ( j = 0; j < size / 4; j++ ){
+    seed = seed * 1103515245 + 12345;
+    ((uint32_t *)buf)[j] = seed;
+  }
+
+  rsh_fat16_new_version = version;
+  rsh_fat16_verify_reads = verify;
+  unlink(BENCH_CSUM_IMAGE);
+  if ( rsh_fat16_init(BENCH_CSUM_IMAGE, size * 2, cluster) ){
+    printf("Could not make the checksum image.\n");
+    rsh_fat16_new_version = RSH_FS_VERSION;
+    rsh_fat16_verify_reads = 0;
+    free(buf);
+    return;
+  }
+
+  start = bench_now();
+  fd = _rsh_open("/data", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  for ( j = 0; j < size; j += 64*1024 )
+    _rsh_write(fd, buf + j, size - j < 64*1024 ? size - j : 64*1024);
+  _rsh_close(fd);
+  write = bench_now() - start;
+
+  start = bench_now();
+  bench_read_all("/data", buf, 64*1024);
+  cold = bench_now() - start;
+
+  start = bench_now();
+  bench_read_all("/data", buf, 64*1024);
+  warm = bench_now() - start;
+
+  fd = _rsh_open("/data", O_RDONLY, 0);
+  start = bench_now();
+  for ( i = 0; i < 10000; i++ ){
+    _rsh_lseek(fd, (i * 2654435761U) % (size - 4096), SEEK_SET);
+    _rsh_read(fd, buf, 4096);
+  }
+  rnd = bench_now() - start;
+  _rsh_close(fd);
+
+  if ( fat16_fs.fs_header.csum_offset ){
+    null = open("/dev/null", O_WRONLY);
+    start = bench_now();
+    rsh_fat16_scrub(0, null);
+    scrub = bench_now() - start;
+    close(null);
+  }
+
+  printf("  v%d verify %-3s write %7.1f MB/s, cat %7.1f MB/s then "
+	 "%7.1f MB/s, 10000 4k reads %6.1f ms, scrub %6.1f ms\n", version,
+	 verify ? "on" : "off", size / 1e6 / write, size / 1e6 / cold,
+	 size / 1e6 / warm, rnd * 1e3, scrub * 1e3);
+
+  rsh_fat16_new_version = RSH_FS_VERSION;
+  rsh_fat16_verify_reads = 0;
+  unlink(BENCH_CSUM_IMAGE);
+  free(buf);
+
+}
+
+int main(int argc, char **argv){
+
+  long int geo[2] = { 50*1024*1024, 8*1024 };
+  int fd;
+  char *buf;
+  uint32_t count;
+  uint32_t found;
+  uint32_t limit;
+  double start;
+  fat_t head;
+  char name[32];
+  struct rsh_fat_dirent ent;
+
+  if ( argc > 1 && _rsh_fat16_geometry(argv[1], geo) ){
+    printf("usage: %s [<size>:<cluster_size>]\n", argv[0]);
+    return 1;
+  }
+
+  unlink(BENCH_IMAGE);
+  rsh_init_fs();
+  if ( rsh_fat16_init(BENCH_IMAGE, geo[0], geo[1]) ){
+    printf("Could not make the benchmark image.\n");
+    return 1;
+  }
+
+  printf("Image: %ld bytes, %ld byte clusters, %u clusters\n",
+	 geo[0], geo[1], fat16_fs.fat_entries);
+
+  /* Cluster allocation: bitmap allocator vs. the FAT scan. */
+  printf("Cluster allocation (fill the image):\n");
+  start = bench_now();
+  head = bench_fill(__rsh_fat16_find_open_cluster, &count);
+  bench_report("free map", count, bench_now() - start);
+  bench_free(head);
+
+  start = bench_now();
+  head = bench_fill(_rsh_fat16_scan_open_cluster, &count);
+  bench_report("FAT scan", count, bench_now() - start);
+  bench_free(head);
+
+  /* Directory lookups: hashed index vs. the linear scan. Use up about half
+   * the disk with empty files so there's room for the directory table. */
+  printf("Directory lookups:\n");
+  rsh_fat16_mkdir("/bench");
+  _rsh_fat16_path_to_dirent("/bench", &ent, NULL);
+  limit = fat16_fs.free_clusters / 2;
+  for ( count = 0; count < limit; count++ ){
+    sprintf(name, "file%u", count);
+    if ( _rsh_fat16_mkfile(ent.index, name) )
+      break;
+  }
+
+  start = bench_now();
+  found = bench_lookup(_rsh_fat16_locate_child, ent.index, count);
+  printf("  %-24s %8u of %8u in %8.4f s\n", "dir index", found, count,
+	 bench_now() - start);
+
+  start = bench_now();
+  found = bench_lookup(_rsh_fat16_scan_child, ent.index, count);
+  printf("  %-24s %8u of %8u in %8.4f s\n", "dir scan", found, count,
+	 bench_now() - start);
+
+  /* Writes of a few different sizes. Leave room for the files from the
+   * lookup test. */
+  printf("Writes:\n");
+  limit = fat16_fs.free_clusters / 2 * fat16_fs.fs_header.csize;
+  bench_write(64, limit / 4);
+  bench_write(4096, limit);
+  bench_write(1024*1024, limit);
+
+  /* Cold reads of one big file under each mapping policy. */
+  printf("Mapping policies (cold read):\n");
+  fd = _rsh_open("/mbench", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  buf = malloc(64*1024);
+  if ( fd >= 0 && buf ){
+    memset(buf, 'm', 64*1024);
+    for ( count = 0; count < limit / (64*1024); count++ )
+      if ( _rsh_write(fd, buf, 64*1024) != 64*1024 )
+	break;
+    _rsh_close(fd);
+    bench_map("none", 0, "/mbench");
+    bench_map("populate", RSH_FAT16_MAP_POPULATE, "/mbench");
+    bench_map("hugepage", RSH_FAT16_MAP_HUGEPAGE, "/mbench");
+    bench_map("stream", RSH_FAT16_MAP_STREAM, "/mbench");
+    bench_map("all", RSH_FAT16_MAP_ALL, "/mbench");
+    rsh_fat16_set_map_policy(0);
+    _rsh_unlink("/mbench");
+  }
+  free(buf);
+  unlink(BENCH_IMAGE);
+
+  /* A tree of small files, each with a cluster of its own vs. packed. */
+  printf("Small files (10000 files of 50-1500 bytes):\n");
+  bench_small(RSH_FS_V4, geo[1], 10000);
+  bench_small(RSH_FS_V5, geo[1], 10000);
+
+  /* One big directory with each dirent format. */
+  printf("Directory formats (one directory of 10000 files):\n");
+  bench_dirs(0, geo[1], 10000);
+  bench_dirs(RSH_FS_COMPACT_DIRS, geo[1], 10000);
+
+  /* A really big directory, indexed in memory vs. with its own tree. */
+  printf("Big directories (one directory of 100000 files):\n");
+  bench_big_dir(RSH_FS_COMPACT_DIRS, geo[1], 100000);
+  bench_big_dir(RSH_FS_COMPACT_DIRS | RSH_FS_TREE_DIRS, geo[1], 100000);
+
+  /* A big log file, stored as it is vs. compressed. */
+  printf("Compression (32MB of log):\n");
+  bench_zip(0, geo[1], 32*1024*1024);
+  bench_zip(RSH_FS_ZIP_FILES, geo[1], 32*1024*1024);
+
+  /* The same file copied all over, shared afterwards or as it's written. */
+  printf("Dedup (8 copies of 8MB):\n");
+  bench_dedup(0, 1, geo[1], 8*1024*1024, 8);
+  bench_dedup(0, 4, geo[1], 8*1024*1024, 8);
+  bench_dedup(RSH_FS_DEDUP_FILES, 0, geo[1], 8*1024*1024, 8);
+
+  /* What checksums cost: the CRC itself, then writing and reading a file
+   * without them, with them, and with every read checked. */
+  printf("Checksums (CRC32C of 1MB, then 64MB of data):\n");
+  bench_crc("crc32c", _rsh_fat16_crc32c, 1000);
+  bench_crc("crc32c (table)", _rsh_fat16_crc32c_sw, 1000);
+  bench_csum(RSH_FS_V6, 0, geo[1], 64*1024*1024);
+  bench_csum(RSH_FS_V7, 0, geo[1], 64*1024*1024);
+  bench_csum(RSH_FS_V7, 1, geo[1], 64*1024*1024);
+
+  return 0;
+
+}
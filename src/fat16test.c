@@ -4,6 +4,7 @@
  */
 
 #include <rsh.h>
+#include <rshio.h>
 #include <rshfs.h>
 
 #include <errno.h>
@@ -12,11 +13,16 @@
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 extern char *_rsh_fat16_split_path(char *path, char **name);
+extern struct rsh_fat_dirent *_rsh_fat16_scan_child(const char *child,
+						    uint32_t dir_table);
 void _rsh_fs_interpolate(char *path);
 extern int builtin_fatinfo(int argc, char **argv, int in, int out, int err);
+extern int builtin_mv(int argc, char **argv, int in, int out, int err);
+extern int builtin_defrag(int argc, char **argv, int in, int out, int err);
 
 extern int rsh_fat16_open(struct rsh_file *file, 
 			  const char *pathname, int flags);
@@ -24,12 +30,2142 @@ extern ssize_t rsh_fat16_write(struct rsh_file *file,
 			       const void *buf, size_t count);
 extern ssize_t rsh_fat16_read(struct rsh_file *file, void *buf, size_t count);
 extern int rsh_fat16_close(struct rsh_file *file);
+extern int rsh_fat16_readdir(struct rsh_file *file, void *buf, size_t space);
 extern void _rsh_fat16_display_root_dir();
 extern void _rsh_fat16_display_path_dir(const char *path);
 
 extern struct dirent *_rsh_readdir(int dfd);
 extern int _rsh_open(const char *path, int flags, mode_t mode);
 
+#define TEST_IMAGE "testfs.bin"
+
+/* How many checks have failed so far. */
+static int failures = 0;
+
+/*
+ * Complain if ok isn't true.
+ */
+static void check(int ok, const char *what){
+
+  if ( ok )
+    return;
+  printf("  FAILED: %s\n", what);
+  failures++;
+
+}
+
+/*
+ * Fill buf with bytes that don't repeat too soon. Different seeds give
+ * different data.
+ */
+static void test_pattern(char *buf, size_t len, int seed){
+
+  size_t i;
+
+  for ( i = 0; i < len; i++ )
+    buf[i] = (i * 131 + seed * 17 + (i >> 9)) & 0xff;
+
+}
+
+/*
+ * Make a fresh test image of the given version and header flags.
+ */
+static int test_image(int version, uint32_t flags, size_t size,
+		      size_t cluster){
+
+  rsh_fat16_new_version = version;
+  rsh_fat16_new_flags = flags;
+  unlink(TEST_IMAGE);
+  if ( rsh_fat16_init(TEST_IMAGE, size, cluster) ){
+    check(0, "make image");
+    return RSH_ERR;
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Write len bytes of buf to path, chunk bytes at a time.
+ */
+static int test_put(const char *path, const char *buf, size_t len,
+		    size_t chunk){
+
+  int fd;
+  size_t off;
+  size_t xfer;
+
+  fd = _rsh_open(path, O_CREAT|O_TRUNC|O_WRONLY, 0);
+  if ( fd < 0 )
+    return RSH_ERR;
+
+  for ( off = 0; off < len; off += xfer ){
+    xfer = len - off < chunk ? len - off : chunk;
+    if ( _rsh_write(fd, buf + off, xfer) != xfer ){
+      _rsh_close(fd);
+      return RSH_ERR;
+    }
+  }
+
+  return _rsh_close(fd);
+
+}
+
+/*
+ * Read path back chunk bytes at a time and see that it's exactly the len
+ * bytes in buf.
+ */
+static int test_same(const char *path, const char *buf, size_t len,
+		     size_t chunk){
+
+  int fd;
+  char *got;
+  size_t off = 0;
+  ssize_t bytes;
+
+  fd = _rsh_open(path, O_RDONLY, 0);
+  got = malloc(chunk);
+  if ( fd < 0 || ! got ){
+    free(got);
+    if ( fd >= 0 )
+      _rsh_close(fd);
+    return 0;
+  }
+
+  while ( (bytes = _rsh_read(fd, got, chunk)) > 0 ){
+    if ( off + bytes > len || memcmp(got, buf + off, bytes) )
+      break;
+    off += bytes;
+  }
+
+  free(got);
+  _rsh_close(fd);
+  return bytes == 0 && off == len;
+
+}
+
+/*
+ * Read path back through readv_map, up to count bytes at a time, and see
+ * that it's the len bytes in buf.
+ */
+static int test_same_map(const char *path, const char *buf, size_t len,
+			 size_t count){
+
+  int i;
+  int fd;
+  int got;
+  size_t off = 0;
+  struct iovec iov[4];
+
+  fd = _rsh_open(path, O_RDONLY, 0);
+  if ( fd < 0 )
+    return 0;
+
+  while ( (got = _rsh_readv_map(fd, iov, 4, count)) > 0 ){
+    for ( i = 0; i < got; i++ ){
+      if ( off + iov[i].iov_len > len ||
+	   memcmp(iov[i].iov_base, buf + off, iov[i].iov_len) )
+	got = -1;
+      off += iov[i].iov_len;
+    }
+    if ( got < 0 )
+      break;
+  }
+
+  _rsh_close(fd);
+  return got == 0 && off == len;
+
+}
+
+/*
+ * Open the test image again from the disk and see that fsck is happy with
+ * it.
+ */
+static int test_remount(){
+
+  if ( rsh_fat16_init(TEST_IMAGE, 0, 0) )
+    return 0;
+
+  return rsh_fat16_fsck(0, 0, 1) == 0;
+
+}
+
+/*
+ * Does the free cluster map say the same as the FAT, and does the count go
+ * with it?
+ */
+static int test_free_map_ok(){
+
+  uint32_t i;
+  uint32_t count = 0;
+  int free, mapped;
+
+  for ( i = 0; i < fat16_fs.fat_entries; i++ ){
+    free = rsh_fat16_get_entry(i) == FAT_FREE;
+    mapped = (fat16_fs.free_map[i / 32] >> (i % 32)) & 1;
+    if ( free != mapped )
+      return 0;
+    count += free;
+  }
+
+  return count == fat16_fs.free_clusters;
+
+}
+
+/*
+ * Clusters come out of the free map and go back into it. A version 0 image
+ * so that files really are chains of clusters all the way down.
+ */
+static void test_alloc(){
+
+  int n;
+  char buf[4*512];
+  uint32_t free_start;
+  uint32_t a, b;
+
+  printf("Free cluster map:\n");
+  if ( test_image(RSH_FS_V0, 0, 1024*1024, 512) )
+    return;
+  check(fat16_fs.free_map != NULL, "free map");
+  if ( ! fat16_fs.free_map )
+    return;
+  check(test_free_map_ok(), "map after format");
+
+  /* Truncating keeps the first cluster and gives back the rest, however
+   * long the chain was. */
+  test_pattern(buf, sizeof(buf), 20);
+  check(test_put("/f", "", 0, 1) == 0, "create");
+  free_start = fat16_fs.free_clusters;
+  for ( n = 2; n <= 4; n++ ){
+    check(test_put("/f", buf, n * 512, 512) == 0, "write");
+    check(free_start - fat16_fs.free_clusters == n - 1, "clusters taken");
+    check(test_put("/f", buf, 0, 1) == 0, "truncate");
+    check(fat16_fs.free_clusters == free_start, "clusters given back");
+  }
+  check(test_free_map_ok(), "map after truncates");
+
+  /* Chains grow off the end. */
+  a = rsh_fat16_alloc_cluster(FAT_TERM);
+  b = rsh_fat16_alloc_cluster(a);
+  check(a != FAT_TERM && b != FAT_TERM && a != b, "alloc");
+  check(rsh_fat16_get_entry(a) == b && rsh_fat16_get_entry(b) == FAT_TERM,
+	"chained");
+  check(fat16_fs.free_clusters == free_start - 2, "alloc counted");
+  rsh_fat16_set_entry(a, FAT_FREE);
+  rsh_fat16_set_entry(b, FAT_FREE);
+
+  check(test_put("/g", buf, sizeof(buf), 100) == 0, "write");
+  check(_rsh_unlink("/f") == 0, "unlink");
+  check(test_free_map_ok(), "map after unlink");
+
+  check(test_remount(), "fsck");
+  check(test_free_map_ok(), "map after remount");
+  check(test_same("/g", buf, sizeof(buf), 4096), "after remount");
+
+}
+
+/*
+ * An open file's cluster map survives changes to other files' chains, and
+ * goes when its own chain changes under it.
+ */
+static void test_map(){
+
+  int fd;
+  char buf[50000];
+  char got[50000];
+  uint32_t length;
+  struct rsh_file file;
+  struct rsh_fat16_file *fat_file;
+
+  printf("Cluster maps:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  test_pattern(buf, sizeof(buf), 11);
+  check(test_put("/big", buf, sizeof(buf), 4096) == 0, "write");
+  memset(&file, 0, sizeof(struct rsh_file));
+  if ( rsh_fat16_open(&file, "/big", O_RDONLY) ){
+    check(0, "open");
+    return;
+  }
+  fat_file = file.local;
+
+  check(rsh_fat16_read(&file, got, 20000) == 20000, "read");
+  length = fat_file->length;
+  check(length >= 20000 / 512, "mapped");
+
+  /* Somebody else's clusters come and go. */
+  check(test_put("/other", buf, 10000, 4096) == 0, "write other");
+  check(_rsh_unlink("/other") == 0, "unlink other");
+  check(fat_file->length == length && fat_file->gen == fat16_fs.chain_gen,
+	"map kept");
+  check(rsh_fat16_read(&file, got + 20000, 30000) == 30000 &&
+	memcmp(got, buf, sizeof(buf)) == 0, "read rest");
+
+  /* Its own get cut. */
+  fd = _rsh_open("/big", O_WRONLY|O_TRUNC, 0);
+  check(fd >= 0, "truncate");
+  check(fat_file->length == 0, "map dropped");
+  test_pattern(buf, sizeof(buf), 12);
+  check(fd >= 0 && _rsh_write(fd, buf, 30000) == 30000, "write again");
+  _rsh_close(fd);
+  file.offset = 0;
+  check(rsh_fat16_read(&file, got, sizeof(got)) == 30000 &&
+	memcmp(got, buf, 30000) == 0, "read after truncate");
+  rsh_fat16_close(&file);
+
+  check(test_remount(), "fsck");
+  check(test_same("/big", buf, 30000, 4096), "after remount");
+
+}
+
+/*
+ * Clusters in the chain starting at head.
+ */
+static uint32_t test_chain_len(uint32_t head){
+
+  uint32_t count = 0;
+
+  for ( ; head != FAT_TERM; head = rsh_fat16_get_entry(head) )
+    count++;
+
+  return count;
+
+}
+
+/*
+ * Cluster n of the chain starting at head.
+ */
+static uint32_t test_nth(uint32_t head, uint32_t n){
+
+  while ( n-- && head != FAT_TERM )
+    head = rsh_fat16_get_entry(head);
+
+  return head;
+
+}
+
+/*
+ * Does looking every file up through the directory index find the same
+ * dirent as going through the directory one slot at a time?
+ */
+static int test_index_ok(uint32_t dir, int files, int round){
+
+  int i;
+  char name[32];
+  struct rsh_fat_dirent *want;
+
+  for ( i = 0; i < files; i++ ){
+    sprintf(name, "n%d_%d", round, i);
+    want = _rsh_fat16_scan_child(name, dir);
+    if ( _rsh_fat16_locate_child(name, dir) != want )
+      return 0;
+    if ( (i % 2 == 0 || round) != (want != NULL) )
+      return 0;
+  }
+
+  return 1;
+
+}
+
+/*
+ * A directory index finds what a scan would, and new files go into the
+ * slots removed ones left rather than making the directory bigger.
+ */
+static void test_index(){
+
+  int i;
+  char name[32];
+  uint32_t dir;
+  uint32_t clusters;
+  struct rsh_fat_dirent ent;
+
+  printf("Directory index:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  for ( i = 0; i < 100; i++ ){
+    sprintf(name, "/d/n0_%d", i);
+    check(test_put(name, "", 0, 1) == 0, "create");
+  }
+  _rsh_fat16_path_to_dirent("/d", &ent, NULL);
+  dir = ent.index;
+  clusters = test_chain_len(dir);
+  check(clusters > 1, "big directory");
+
+  for ( i = 1; i < 100; i += 2 ){
+    sprintf(name, "/d/n0_%d", i);
+    check(_rsh_unlink(name) == 0, "unlink");
+  }
+  check(test_index_ok(dir, 100, 0), "after unlink");
+
+  for ( i = 0; i < 50; i++ ){
+    sprintf(name, "/d/n1_%d", i);
+    check(test_put(name, "", 0, 1) == 0, "create again");
+  }
+  check(test_chain_len(dir) == clusters, "slots reused");
+  check(test_index_ok(dir, 100, 0) && test_index_ok(dir, 50, 1),
+	"after create");
+
+  /* And once it's built again from the directory. */
+  _rsh_fat16_dindex_drop_all();
+  check(test_index_ok(dir, 100, 0) && test_index_ok(dir, 50, 1),
+	"rebuilt");
+
+  check(test_remount(), "fsck");
+  check(test_index_ok(dir, 100, 0) && test_index_ok(dir, 50, 1),
+	"after remount");
+
+}
+
+/*
+ * Does path resolve, and if so is it a file of len bytes?
+ */
+static int test_lookup(const char *path, int len){
+
+  struct rsh_fat_dirent ent;
+
+  if ( _rsh_fat16_path_to_dirent(path, &ent, NULL) )
+    return len < 0;
+
+  return len >= 0 && FAT_DIRENT_SIZE(&ent) == len;
+
+}
+
+/*
+ * Paths that are cached, for better or worse, follow the files they name
+ * through creates, unlinks and renames of the file and of the directories
+ * on the way to it.
+ */
+static void test_dcache(){
+
+  uint32_t hits;
+
+  printf("Dentry cache:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  check(rsh_fat16_mkdir("/a") == 0 && rsh_fat16_mkdir("/a/b") == 0,
+	"mkdir");
+  check(test_put("/a/b/f", "ffff", 4, 4) == 0, "write");
+  check(test_lookup("/a/b/f", 4), "lookup");
+  hits = rsh_fat16_dcache_hits;
+  check(test_lookup("/a/b/f", 4), "lookup again");
+  check(rsh_fat16_dcache_hits > hits, "cached");
+
+  /* Nothing there, then something. */
+  check(test_lookup("/a/b/g", -1), "missing");
+  check(test_put("/a/b/g", "gg", 2, 2) == 0, "create");
+  check(test_lookup("/a/b/g", 2), "created");
+
+  /* Gone, then back as something else. */
+  check(_rsh_unlink("/a/b/f") == 0, "unlink");
+  check(test_lookup("/a/b/f", -1), "unlinked");
+  check(test_put("/a/b/f", "f", 1, 1) == 0, "create again");
+  check(test_lookup("/a/b/f", 1), "created again");
+
+  /* Renamed, and renamed over. */
+  check(rsh_fat16_rename("/a/b/g", "/a/g") == 0, "rename");
+  check(test_lookup("/a/b/g", -1) && test_lookup("/a/g", 2), "renamed");
+  check(test_lookup("/a/b/../g", 2), "through ..");
+  check(rsh_fat16_rename("/a/b/f", "/a/g") == 0, "rename over");
+  check(test_lookup("/a/b/f", -1) && test_lookup("/a/g", 1),
+	"renamed over");
+
+  /* Whole directories. */
+  check(test_put("/a/b/h", "hhh", 3, 3) == 0, "write");
+  check(test_lookup("/a/b/h", 3), "lookup");
+  check(rsh_fat16_rename("/a/b", "/c") == 0, "rename dir");
+  check(test_lookup("/a/b/h", -1) && test_lookup("/c/h", 3), "dir renamed");
+  check(_rsh_unlink("/c/h") == 0 && _rsh_unlink("/c") == 0, "rmdir");
+  check(test_lookup("/c/h", -1) && test_lookup("/c", -1), "dir gone");
+  check(rsh_fat16_mkdir("/c") == 0, "mkdir again");
+  check(test_lookup("/c/h", -1), "new dir empty");
+
+  check(test_remount(), "fsck");
+  check(test_lookup("/a/g", 1) && test_lookup("/c/h", -1), "after remount");
+
+}
+
+/*
+ * Segments handed out by readv_map point at the file's clusters in the
+ * image, one per run of clusters that sit together on the disk.
+ */
+static void test_readv(){
+
+  int i;
+  int fd, fd2;
+  int segs;
+  char buf[20000];
+  struct iovec iov[4];
+
+  printf("Mapped reads:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  /* In one piece on a fresh image. */
+  test_pattern(buf, sizeof(buf), 30);
+  check(test_put("/one", buf, sizeof(buf), 4096) == 0, "write");
+  fd = _rsh_open("/one", O_RDONLY, 0);
+  check(fd >= 0, "open");
+  segs = _rsh_readv_map(fd, iov, 4, sizeof(buf));
+  check(segs == 1 && iov[0].iov_len == sizeof(buf) &&
+	iov[0].iov_base > fat16_fs.fs_io &&
+	iov[0].iov_base + iov[0].iov_len <=
+	fat16_fs.fs_io + fat16_fs.fs_header.size, "one segment");
+  check(segs == 1 && memcmp(iov[0].iov_base, buf, sizeof(buf)) == 0,
+	"one segment data");
+  check(_rsh_readv_map(fd, iov, 4, sizeof(buf)) == 0, "eof");
+  _rsh_close(fd);
+
+  /* Two files written a cluster at a time each end up interleaved, so no
+   * two clusters of either are next to each other. */
+  fd = _rsh_open("/x", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  fd2 = _rsh_open("/y", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0 && fd2 >= 0, "create");
+  for ( i = 0; i < 8; i++ ){
+    check(_rsh_write(fd, buf + i * 512, 512) == 512 &&
+	  _rsh_write(fd2, buf + i * 512, 512) == 512, "write interleaved");
+  }
+  _rsh_close(fd);
+  _rsh_close(fd2);
+
+  fd = _rsh_open("/x", O_RDONLY, 0);
+  check(fd >= 0, "open");
+  segs = _rsh_readv_map(fd, iov, 4, 8 * 512);
+  check(segs == 4 && _rsh_lseek(fd, 0, SEEK_CUR) == 4 * 512,
+	"stops when out of segments");
+  for ( i = 0; i < segs; i++ )
+    check(iov[i].iov_len == 512 &&
+	  memcmp(iov[i].iov_base, buf + i * 512, 512) == 0, "segment data");
+  _rsh_close(fd);
+
+  /* Odd sized reads that start and end mid cluster, and packed files. */
+  check(test_same_map("/one", buf, sizeof(buf), 777), "read in pieces");
+  check(test_same_map("/y", buf, 8 * 512, 700), "interleaved in pieces");
+  check(test_put("/small", buf, 100, 100) == 0, "write small");
+  check(test_same_map("/small", buf, 100, 33), "packed");
+
+  check(test_remount(), "fsck");
+  check(test_same_map("/x", buf, 8 * 512, 1000), "after remount");
+
+}
+
+/*
+ * Writes only touch the bytes they're given, and one that runs out of room
+ * partway writes what fits and says so, like write() does.
+ */
+static void test_write(){
+
+  int fd;
+  ssize_t got;
+  char *buf;
+  char *more;
+  size_t size = 2*1024*1024;
+  uint64_t grow_max = rsh_fat16_grow_max;
+
+  printf("Writes:\n");
+  buf = malloc(size);
+  more = malloc(size);
+  if ( ! buf || ! more || test_image(RSH_FS_VERSION, 0, 1024*1024, 512) ){
+    free(buf);
+    free(more);
+    return;
+  }
+
+  /* No growing out of trouble here. */
+  rsh_fat16_grow_max = 0;
+  test_pattern(buf, size, 40);
+  test_pattern(more, size, 41);
+
+  /* In the middle of a cluster, across the end of one, and past the end of
+   * the file. */
+  check(test_put("/f", buf, 2000, 2000) == 0, "write");
+  fd = _rsh_open("/f", O_WRONLY, 0);
+  check(fd >= 0, "open");
+  check(_rsh_lseek(fd, 700, SEEK_SET) == 700 &&
+	_rsh_write(fd, more, 100) == 100, "write middle");
+  memcpy(buf + 700, more, 100);
+  check(_rsh_lseek(fd, 1000, SEEK_SET) == 1000 &&
+	_rsh_write(fd, more, 100) == 100, "write across");
+  memcpy(buf + 1000, more, 100);
+  check(_rsh_lseek(fd, 2100, SEEK_SET) == 2100 &&
+	_rsh_write(fd, more, 10) == 10, "write past end");
+  memset(buf + 2000, 0, 100);
+  memcpy(buf + 2100, more, 10);
+  _rsh_close(fd);
+  check(test_same("/f", buf, 2110, 333), "partial writes");
+
+  /* Far more than there's room for. */
+  fd = _rsh_open("/full", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0, "create");
+  got = _rsh_write(fd, more, size);
+  check(got > 0 && got < size, "short write");
+  errno = 0;
+  check(_rsh_write(fd, more, 512) < 0 && errno == ENOSPC, "ENOSPC");
+  _rsh_close(fd);
+  check(got > 0 && test_same("/full", more, got, 65536), "short write kept");
+  check(test_same("/f", buf, 2110, 2110), "other file");
+
+  check(_rsh_unlink("/full") == 0, "unlink");
+  check(test_put("/again", buf, 100000, 65536) == 0, "room again");
+
+  check(test_remount(), "fsck");
+  check(test_same("/f", buf, 2110, 2110), "after remount");
+  free(buf);
+  free(more);
+  rsh_fat16_grow_max = grow_max;
+
+}
+
+/*
+ * fallocate takes one run of clusters even when the free space near the
+ * start of the image is in bits, doesn't change the size, and whatever
+ * wasn't written gets given back on close.
+ */
+static void test_falloc(){
+
+  int i;
+  int fd, fd2;
+  char buf[20*512];
+  uint32_t free_start;
+  uint32_t length;
+  struct rsh_fat_dirent ent;
+
+  printf("Preallocation:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+  test_pattern(buf, sizeof(buf), 50);
+
+  /* Leave one cluster gaps all over. */
+  fd = _rsh_open("/x", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  fd2 = _rsh_open("/y", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  for ( i = 0; i < 16; i++ ){
+    check(_rsh_write(fd, buf, 512) == 512 && _rsh_write(fd2, buf, 512) == 512,
+	  "write interleaved");
+  }
+  _rsh_close(fd);
+  _rsh_close(fd2);
+  check(_rsh_unlink("/x") == 0, "unlink");
+
+  check(test_put("/f", "", 0, 1) == 0, "create");
+  free_start = fat16_fs.free_clusters;
+  fd = _rsh_open("/f", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_fallocate(fd, sizeof(buf)) == 0, "fallocate");
+  check(free_start - fat16_fs.free_clusters == 20, "clusters taken");
+  check(test_lookup("/f", 0), "size unchanged");
+  _rsh_fat16_path_to_dirent("/f", &ent, NULL);
+  check(_rsh_fat16_chain_extents(ent.index, &length) == 1 && length == 20,
+	"one run");
+
+  /* Write some of it and close: the rest goes back. */
+  check(_rsh_write(fd, buf, 3000) == 3000, "write");
+  _rsh_close(fd);
+  check(free_start - fat16_fs.free_clusters == 6, "trimmed");
+  check(test_same("/f", buf, 3000, 1000), "read back");
+
+  /* All of it, and then some. */
+  fd = _rsh_open("/g", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0 && _rsh_fallocate(fd, sizeof(buf)) == 0, "fallocate");
+  check(_rsh_write(fd, buf, sizeof(buf)) == sizeof(buf) &&
+	_rsh_write(fd, buf, 100) == 100, "write");
+  _rsh_close(fd);
+  _rsh_fat16_path_to_dirent("/g", &ent, NULL);
+  check(_rsh_fat16_chain_extents(ent.index, &length) <= 2 && length == 21,
+	"written in place");
+
+  /* Small enough to stay packed. */
+  fd = _rsh_open("/p", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0 && _rsh_fallocate(fd, 64) == 0, "fallocate small");
+  _rsh_close(fd);
+  _rsh_fat16_path_to_dirent("/p", &ent, NULL);
+  check(FAT_DIRENT_PACKED(&ent), "still packed");
+
+  check(test_remount(), "fsck");
+  check(test_same("/f", buf, 3000, 3000), "after remount");
+
+}
+
+/*
+ * Is the page with addr in it marked dirty?
+ */
+static int test_page_dirty(void *addr){
+
+  uint32_t page = (addr - fat16_fs.fs_io) / fat16_fs.page_size;
+
+  return (fat16_fs.dirty_map[page / 32] >> (page % 32)) & 1;
+
+}
+
+/*
+ * Writes mark the pages they change dirty and a sync cleans them. Only opens
+ * that changed something have anything to write back on close, and O_TRUNC
+ * is a change.
+ */
+static void test_dirty(){
+
+  char buf[5000];
+  char got[100];
+  uint32_t cluster;
+  struct rsh_file file;
+  struct rsh_fat16_file *fat_file;
+
+  printf("Dirty pages:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+  check(fat16_fs.dirty_map != NULL, "dirty map");
+  if ( ! fat16_fs.dirty_map )
+    return;
+
+  test_pattern(buf, sizeof(buf), 60);
+  check(test_put("/f", buf, sizeof(buf), 1000) == 0, "write");
+  check(fat16_fs.dirty_count == 0, "clean after close");
+
+  /* Reading changes nothing. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/f", O_RDONLY) == 0, "open");
+  fat_file = file.local;
+  check(rsh_fat16_read(&file, got, sizeof(got)) == sizeof(got), "read");
+  check(! fat_file->dirty && fat16_fs.dirty_count == 0, "read is clean");
+  rsh_fat16_close(&file);
+
+  /* Writing dirties the page the bytes went to and sync cleans it. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/f", O_WRONLY) == 0, "open");
+  fat_file = file.local;
+  file.offset = 2000;
+  check(rsh_fat16_write(&file, "dirty", 5) == 5, "write");
+  memcpy(buf + 2000, "dirty", 5);
+  cluster = _rsh_fat16_file_cluster(fat_file, 2000 / 512);
+  check(fat_file->dirty && test_page_dirty(FAT_CLUSTER_TO_ADDR(cluster)),
+	"page dirty");
+  check(rsh_fat16_sync(MS_SYNC) == 0 && fat16_fs.dirty_count == 0 &&
+	! test_page_dirty(FAT_CLUSTER_TO_ADDR(cluster)), "synced");
+  rsh_fat16_close(&file);
+  check(test_same("/f", buf, sizeof(buf), 777), "read back");
+
+  /* Truncating without writing anything. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/f", O_WRONLY|O_TRUNC) == 0, "truncate");
+  fat_file = file.local;
+  check(fat_file->dirty, "truncate is a change");
+  rsh_fat16_close(&file);
+  check(test_lookup("/f", 0) && test_same("/f", "", 0, 100), "size reset");
+
+  check(test_remount(), "fsck");
+  check(test_lookup("/f", 0), "after remount");
+
+}
+
+/*
+ * Wait up to a couple of seconds for no more than pages pages to be dirty.
+ */
+static int test_wait_clean(uint32_t pages){
+
+  int i;
+
+  for ( i = 0; i < 200 && fat16_fs.dirty_count > pages; i++ )
+    usleep(10000);
+
+  return fat16_fs.dirty_count <= pages;
+
+}
+
+/*
+ * async writes back on close without waiting; periodic leaves it to the
+ * flusher, which goes when its timer runs out or when too much is dirty.
+ */
+static void test_durability(){
+
+  char *buf;
+  size_t size = 256*1024;
+  struct rsh_file file;
+
+  printf("Durability modes:\n");
+  buf = malloc(size);
+  if ( ! buf || test_image(RSH_FS_VERSION, 0, 4*1024*1024, 4096) ){
+    free(buf);
+    return;
+  }
+  test_pattern(buf, size, 70);
+
+  check(rsh_fat16_parse_durability("bogus") != 0, "bad mode");
+  check(rsh_fat16_parse_durability("async") == 0 &&
+	rsh_fat16_durability == RSH_FAT16_ASYNC, "async");
+  check(test_put("/a", buf, 10000, 4096) == 0, "write");
+  check(fat16_fs.dirty_count == 0, "written on close");
+
+  /* On a timer. */
+  check(rsh_fat16_parse_durability("periodic:50") == 0 &&
+	rsh_fat16_durability == RSH_FAT16_PERIODIC &&
+	rsh_fat16_flush_ms == 50, "periodic");
+  check(test_put("/p", buf, 10000, 4096) == 0, "write");
+  check(test_wait_clean(0), "flushed on time");
+
+  /* Kicked by a big write long before the timer. */
+  check(rsh_fat16_set_durability(RSH_FAT16_PERIODIC, 60000, 64*1024) == 0,
+	"periodic by size");
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/big", O_CREAT|O_WRONLY) == 0, "open");
+  check(rsh_fat16_write(&file, buf, size) == size, "write big");
+  check(test_wait_clean(64*1024 / fat16_fs.page_size), "flushed on size");
+  check(rsh_fat16_write(&file, buf, 4096) == 4096, "write more");
+  rsh_fat16_close(&file);
+
+  /* Switching back writes out whatever's left. */
+  check(fat16_fs.dirty_count > 0, "still dirty");
+  check(rsh_fat16_set_durability(RSH_FAT16_SYNC, 0, 0) == 0 &&
+	fat16_fs.dirty_count == 0, "sync");
+
+  check(test_remount(), "fsck");
+  check(test_same("/a", buf, 10000, 4096) && test_same("/p", buf, 10000, 4096),
+	"after remount");
+  check(test_lookup("/big", size + 4096), "big after remount");
+  free(buf);
+
+}
+
+/*
+ * Bytes in the files directly in path, as its directory index has kept
+ * track of them. If rebuilt is set the index is built from scratch first.
+ */
+static uint64_t test_dir_bytes(const char *path, int rebuilt){
+
+  struct rsh_fat_dirent ent;
+  struct rsh_fat16_dindex *index;
+
+  if ( _rsh_fat16_path_to_dirent(path, &ent, NULL) )
+    return -1;
+  if ( rebuilt )
+    _rsh_fat16_dindex_drop(ent.index);
+  index = _rsh_fat16_dindex_get(ent.index);
+
+  return index ? index->bytes : -1;
+
+}
+
+/*
+ * The usage counters df and the FS_* variables use stay in step with the
+ * FAT and the directories without anything being counted again.
+ */
+static void test_df(){
+
+  int fd;
+  char buf[3000];
+  char want[32];
+  uint32_t i;
+  uint32_t free = 0;
+
+  printf("Usage counters:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+  test_pattern(buf, sizeof(buf), 80);
+
+  check(rsh_fat16_mkdir("/d") == 0 && rsh_fat16_mkdir("/e") == 0, "mkdir");
+  check(test_put("/d/a", buf, 1000, 1000) == 0 &&
+	test_put("/d/b", buf, 3000, 1000) == 0 &&
+	test_put("/d/c", buf, 100, 100) == 0, "write");
+  check(test_dir_bytes("/d", 0) == 4100, "bytes");
+
+  /* Grow, truncate, remove and move files and see that the counts kept
+   * come out the same as counting again. */
+  fd = _rsh_open("/d/a", O_WRONLY|O_APPEND, 0);
+  check(fd >= 0 && _rsh_write(fd, buf, 500) == 500, "append");
+  _rsh_close(fd);
+  check(test_put("/d/b", buf, 10, 10) == 0, "truncate");
+  check(_rsh_unlink("/d/c") == 0, "unlink");
+  check(test_put("/e/f", buf, 2000, 2000) == 0 &&
+	rsh_fat16_rename("/e/f", "/d/f") == 0, "rename");
+  check(test_dir_bytes("/d", 0) == 3510 && test_dir_bytes("/d", 1) == 3510,
+	"bytes kept");
+  check(test_dir_bytes("/e", 0) == 0 && test_dir_bytes("/e", 1) == 0,
+	"bytes moved");
+
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    free += rsh_fat16_get_entry(i) == FAT_FREE;
+  check(free == fat16_fs.free_clusters, "free clusters");
+  sprintf(want, "%u", free);
+  check(strcmp(rsh_fat16_stat_sym("FS_FREE_CLUSTERS"), want) == 0,
+	"FS_FREE_CLUSTERS");
+  sprintf(want, "%llu", (unsigned long long)
+	  (fat16_fs.fat_entries - free) * FAT_CLUSTER_SIZE);
+  check(strcmp(rsh_fat16_stat_sym("FS_USED_BYTES"), want) == 0,
+	"FS_USED_BYTES");
+  check(rsh_fat16_stat_sym("FS_NOTHING") == NULL, "not a counter");
+
+  check(test_remount(), "fsck");
+  check(free == fat16_fs.free_clusters, "free after remount");
+  check(test_dir_bytes("/d", 0) == 3510, "bytes after remount");
+
+}
+
+/*
+ * The header of the test image as it is on the disk.
+ */
+static int test_header(struct rsh_fs_block *header){
+
+  int fd;
+  ssize_t got;
+
+  fd = open(TEST_IMAGE, O_RDONLY);
+  if ( fd < 0 )
+    return RSH_ERR;
+  got = pread(fd, header, sizeof(struct rsh_fs_block), 0);
+  close(fd);
+
+  return got == sizeof(struct rsh_fs_block) ? RSH_OK : RSH_ERR;
+
+}
+
+/*
+ * Use a version 0 or 1 image and see that it stays that version, with the
+ * header, file sizes and name lengths that version has.
+ */
+static void test_old_version(int version){
+
+  int fd;
+  int len;
+  char buf[5000];
+  char name[128];
+  uint64_t big = 5ULL*1024*1024*1024 + 7;
+  struct rsh_fs_block header;
+  struct rsh_fat_dirent ent;
+  struct rsh_fat_dirent *where;
+
+  if ( test_image(version, 0, 1024*1024, 512) )
+    return;
+  test_pattern(buf, sizeof(buf), 90 + version);
+
+  check(rsh_fat16_mkdir("/d") == 0 && rsh_fat16_mkdir("/d/e") == 0,
+	"mkdir");
+  check(test_put("/d/e/f", buf, sizeof(buf), 1000) == 0, "write");
+  check(test_header(&header) == 0, "header");
+  if ( version == RSH_FS_V0 )
+    check(header.magic == 0 && header.version == 0 &&
+	  header.len == fat16_fs.fs_header.size, "v0 header");
+  else
+    check(header.magic == RSH_FS_MAGIC && header.version == version &&
+	  header.len == 0 && header.size == fat16_fs.fs_header.size,
+	  "v1 header");
+
+  /* Sizes past 4GB only fit on version 1. */
+  if ( _rsh_fat16_path_to_dirent("/d/e/f", &ent, &where) == 0 ){
+    _rsh_fat16_set_size(where, big);
+    check(FAT_DIRENT_SIZE(where) == (version ? big : (uint32_t)big),
+	  "big size");
+    check(strcmp(FAT_DIRENT_NAME(where), "f") == 0, "name kept");
+    _rsh_fat16_set_size(where, sizeof(buf));
+  }
+
+  /* Version 0 names run on into size_hi, so they can be a bit longer. One
+   * more than that isn't cut short, it's turned away. */
+  len = sprintf(name, "/d/");
+  memset(name + len, 'n', FAT_NAME_MAX);
+  name[len + FAT_NAME_MAX] = 0;
+  check(FAT_NAME_MAX == (version ? 107 : 111), "name max");
+  check(test_put(name, buf, 100, 100) == 0, "long name");
+  if ( _rsh_fat16_path_to_dirent(name, &ent, &where) == 0 ){
+    _rsh_fat16_set_size(where, big);
+    check(strcmp(FAT_DIRENT_NAME(where), name + len) == 0, "long name kept");
+    _rsh_fat16_set_size(where, 100);
+  } else {
+    check(0, "long name kept");
+  }
+  name[len + FAT_NAME_MAX] = 'n';
+  name[len + FAT_NAME_MAX + 1] = 0;
+  errno = 0;
+  check(_rsh_open(name, O_CREAT|O_WRONLY, 0) < 0 && errno == ENAMETOOLONG,
+	"create too long");
+  errno = 0;
+  check(rsh_fat16_mkdir(name) < 0 && errno == ENAMETOOLONG, "mkdir too long");
+  errno = 0;
+  check(rsh_fat16_rename("/d/e/f", name) < 0 && errno == ENAMETOOLONG &&
+	test_same("/d/e/f", buf, sizeof(buf), 777), "rename too long");
+  name[len + FAT_NAME_MAX] = 0;
+  if ( version == RSH_FS_V0 ){
+    fd = _rsh_open("/d/e/f", O_WRONLY, 0);
+    errno = 0;
+    check(fd >= 0 && _rsh_lseek(fd, 1LL << 32, SEEK_SET) == 1LL << 32 &&
+	  _rsh_write(fd, "x", 1) < 0 && errno == EFBIG, "EFBIG");
+    _rsh_close(fd);
+  }
+
+  check(test_remount(), "fsck");
+  check(fat16_fs.fs_header.version == version, "same version");
+  check(test_same("/d/e/f", buf, sizeof(buf), 777), "after remount");
+  check(test_same(name, buf, 100, 100), "long name after remount");
+
+}
+
+/*
+ * The older formats still work, and a newer one than we know isn't touched.
+ */
+static void test_versions(){
+
+  int fd;
+  uint32_t version = RSH_FS_VERSION + 1;
+
+  printf("Old versions:\n");
+  test_old_version(RSH_FS_V0);
+  test_old_version(RSH_FS_V1);
+
+  fd = open(TEST_IMAGE, O_WRONLY);
+  check(fd >= 0 && pwrite(fd, &version, sizeof(version),
+			  offsetof(struct rsh_fs_block, version)) ==
+	sizeof(version), "bump version");
+  check(rsh_fat16_init(TEST_IMAGE, 0, 0) != 0, "newer refused");
+  version = RSH_FS_V1;
+  check(fd >= 0 && pwrite(fd, &version, sizeof(version),
+			  offsetof(struct rsh_fs_block, version)) ==
+	sizeof(version), "put version back");
+  if ( fd >= 0 )
+    close(fd);
+  check(test_remount(), "opens again");
+
+}
+
+/*
+ * Extents in the chain of the file at path, 0 if there's no such file.
+ */
+static uint32_t test_extents(const char *path){
+
+  uint32_t length;
+  struct rsh_fat_dirent ent;
+
+  if ( _rsh_fat16_path_to_dirent(path, &ent, NULL) )
+    return 0;
+
+  return _rsh_fat16_chain_extents(ent.index, &length);
+
+}
+
+/*
+ * Files written a cluster at a time side by side end up in pieces; defrag
+ * puts each back together without changing what's in it, even for a reader
+ * that has it open. A report moves nothing. A pass done in slices gets to
+ * every file even when files it has already done go away in between.
+ */
+static void test_defrag(){
+
+  int i, j;
+  int fd[3];
+  int gone;
+  int slices;
+  char buf[3][10*512];
+  char got[10*512];
+  char path[32];
+  char *paths[] = { "/d/a", "/d/b", "/d/c" };
+  char *report_argv[] = { "defrag", "-r", NULL };
+  char *defrag_argv[] = { "defrag", NULL };
+  uint32_t free_start;
+  struct rsh_file file;
+
+  printf("Defrag:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  for ( j = 0; j < 3; j++ ){
+    test_pattern(buf[j], sizeof(buf[j]), 100 + j);
+    fd[j] = _rsh_open(paths[j], O_CREAT|O_TRUNC|O_WRONLY, 0);
+  }
+  for ( i = 0; i < 10; i++ )
+    for ( j = 0; j < 3; j++ )
+      check(fd[j] >= 0 && _rsh_write(fd[j], buf[j] + i * 512, 512) == 512,
+	    "write interleaved");
+  for ( j = 0; j < 3; j++ )
+    _rsh_close(fd[j]);
+  check(test_extents("/d/a") == 10 && test_extents("/d/c") == 10,
+	"fragmented");
+
+  check(builtin_defrag(2, report_argv, 0, 1, 2) == 0, "report");
+  check(test_extents("/d/a") == 10, "report moves nothing");
+
+  /* Half read when it moves. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/d/b", O_RDONLY) == 0, "open");
+  check(rsh_fat16_read(&file, got, 2500) == 2500, "read");
+
+  free_start = fat16_fs.free_clusters;
+  check(builtin_defrag(1, defrag_argv, 0, 1, 2) == 0, "defrag");
+  for ( j = 0; j < 3; j++ ){
+    check(test_extents(paths[j]) == 1, "one extent");
+    check(test_same(paths[j], buf[j], sizeof(buf[j]), 700), "same data");
+  }
+  check(fat16_fs.free_clusters == free_start, "nothing leaked");
+
+  check(rsh_fat16_read(&file, got + 2500, sizeof(got)) ==
+	sizeof(got) - 2500 && memcmp(got, buf[1], sizeof(got)) == 0,
+	"reader follows");
+  rsh_fat16_close(&file);
+
+  check(test_remount(), "fsck");
+  check(test_extents("/d/b") == 1 &&
+	test_same("/d/b", buf[1], sizeof(buf[1]), 4096), "after remount");
+
+  /* 40 files a cluster at a time round robin, half in /s and half in /s/t
+   * so slices stop down in a directory and have to climb back out. */
+  if ( test_image(RSH_FS_VERSION, 0, 32*1024*1024, 4096) )
+    return;
+  check(rsh_fat16_mkdir("/s") == 0 && rsh_fat16_mkdir("/s/t") == 0, "mkdir");
+  test_pattern(buf[0], 4096, 7);
+  for ( i = 0; i < 64; i++ ){
+    for ( j = 0; j < 40; j++ ){
+      sprintf(path, j < 20 ? "/s/f%02d" : "/s/t/f%02d", j);
+      fd[0] = _rsh_open(path, O_CREAT|O_WRONLY|O_APPEND, 0);
+      _rsh_write(fd[0], buf[0], 4096);
+      _rsh_close(fd[0]);
+    }
+  }
+  check(test_extents("/s/f00") == 64 && test_extents("/s/t/f39") == 64,
+	"fragmented");
+
+  /* Between slices the first file that's done goes away. */
+  rsh_fat16_defrag_idle_ms = 1;
+  gone = 0;
+  for ( slices = 1; rsh_fat16_defrag_idle(); slices++ ){
+    sprintf(path, gone < 20 ? "/s/f%02d" : "/s/t/f%02d", gone);
+    if ( test_extents(path) == 1 && _rsh_unlink(path) == 0 )
+      gone++;
+  }
+  rsh_fat16_defrag_idle_ms = 0;
+  printf("  %d slices, %d files removed\n", slices, gone);
+
+  for ( j = gone; j < 40; j++ ){
+    sprintf(path, j < 20 ? "/s/f%02d" : "/s/t/f%02d", j);
+    check(test_extents(path) == 1, "one pass gets them all");
+  }
+  check(test_remount(), "fsck after slices");
+
+}
+
+/*
+ * Does the file at path start with the len bytes in buf?
+ */
+static int test_prefix(const char *path, const char *buf, size_t len){
+
+  int fd;
+  int ok;
+  char *got = malloc(len);
+
+  fd = _rsh_open(path, O_RDONLY, 0);
+  ok = got && fd >= 0 && _rsh_read(fd, got, len) == len &&
+    memcmp(got, buf, len) == 0;
+  if ( fd >= 0 )
+    _rsh_close(fd);
+  free(got);
+
+  return ok;
+
+}
+
+/*
+ * The dirent of the file at path in the image, NULL if there isn't one.
+ */
+static struct rsh_fat_dirent *test_dirent(const char *path){
+
+  struct rsh_fat_dirent ent;
+  struct rsh_fat_dirent *where;
+
+  if ( _rsh_fat16_path_to_dirent(path, &ent, &where) )
+    return NULL;
+
+  return where;
+
+}
+
+/*
+ * Break an image in the ways fsck knows about. A check finds them all, with
+ * any number of threads, and changes nothing; a repair keeps what it can of
+ * each file and leaves nothing for the next check to find.
+ */
+static void test_fsck(){
+
+  int found;
+  char buf[3000];
+  uint32_t leak, loose, head;
+  uint32_t i;
+  struct rsh_fat_dirent *ent;
+
+  printf("fsck:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+  test_pattern(buf, sizeof(buf), 110);
+
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  check(test_put("/a", buf, sizeof(buf), 1000) == 0 &&
+	test_put("/b", buf, sizeof(buf), 1000) == 0 &&
+	test_put("/d/c", buf, sizeof(buf), 1000) == 0 &&
+	test_put("/d/e", buf, sizeof(buf), 1000) == 0, "write");
+  check(rsh_fat16_fsck(0, 0, 1) == 0, "clean");
+
+  for ( leak = fat16_fs.fat_entries - 1; leak > 0; leak-- )
+    if ( rsh_fat16_get_entry(leak) == FAT_FREE )
+      break;
+  for ( loose = leak - 1; loose > 0; loose-- )
+    if ( rsh_fat16_get_entry(loose) == FAT_FREE )
+      break;
+
+  /* An orphan, a file longer than its chain, a chain into a free cluster,
+   * two chains that meet and a .. that points at the wrong place. */
+  rsh_fat16_set_entry(leak, FAT_TERM);
+  _rsh_fat16_set_size(test_dirent("/a"), 10000);
+  rsh_fat16_set_entry(test_nth(test_dirent("/b")->index, 2), loose);
+  rsh_fat16_set_entry(test_nth(test_dirent("/d/c")->index, 3),
+		      test_nth(test_dirent("/d/e")->index, 2));
+  head = test_dirent("/d")->index;
+  ent = _rsh_fat16_locate_child("..", head);
+  if ( ent ){
+    ent->index = head;
+    rsh_fat16_meta(ent, sizeof(struct rsh_fat_dirent));
+  }
+
+  found = rsh_fat16_fsck(1, 0, 1);
+  check(found >= 5, "found");
+  check(rsh_fat16_fsck(4, 0, 1) == found, "same with threads");
+  check(rsh_fat16_get_entry(leak) == FAT_TERM, "check changes nothing");
+
+  rsh_fat16_fsck(0, 1, 1);
+  check(rsh_fat16_fsck(0, 0, 1) == 0, "repaired");
+  check(rsh_fat16_get_entry(leak) == FAT_FREE, "orphan freed");
+  check(test_free_map_ok(), "free map");
+
+  /* /a is cut back to its chain, /b just past the free cluster it ran
+   * into. */
+  ent = test_dirent("/a");
+  check(ent && FAT_DIRENT_SIZE(ent) == 6 * 512, "size clamped");
+  ent = test_dirent("/b");
+  check(ent && FAT_DIRENT_SIZE(ent) == 4 * 512, "cut at bad link");
+  check(test_prefix("/b", buf, 3 * 512), "kept up to bad link");
+  check(_rsh_fat16_locate_child("..", head)->index ==
+	fat16_fs.fs_header.root_offset, ".. fixed");
+  for ( i = 0; i < 2; i++ ){
+    ent = test_dirent(i ? "/d/e" : "/d/c");
+    check(ent && FAT_DIRENT_SIZE(ent) <= sizeof(buf), "cross link cut");
+  }
+
+  check(test_remount(), "fsck after remount");
+  check(test_prefix("/b", buf, 3 * 512), "after remount");
+
+}
+
+/*
+ * Mapping policies: changing them maps the image again in the same place
+ * with everything in it, and streaming reads get noticed and read ahead of.
+ */
+static void test_mapping(){
+
+  int i;
+  char *buf;
+  char got[4096];
+  void *io;
+  size_t size = 256*1024;
+  struct rsh_file file;
+  struct rsh_fat16_file *fat_file;
+
+  printf("Mapping policies:\n");
+  buf = malloc(size);
+  if ( ! buf || test_image(RSH_FS_VERSION, 0, 4*1024*1024, 4096) ){
+    free(buf);
+    return;
+  }
+  test_pattern(buf, size, 120);
+  check(test_put("/f", buf, size, 65536) == 0, "write");
+
+  check(rsh_fat16_parse_map_policy("populate,bogus") != 0 &&
+	rsh_fat16_map_policy == 0, "bad policy");
+
+  /* Open across the change, so pointers into the image have to stay
+   * good. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/f", O_RDONLY) == 0, "open");
+  fat_file = file.local;
+  io = fat16_fs.fs_io;
+  check(rsh_fat16_parse_map_policy("populate,stream") == 0 &&
+	rsh_fat16_map_policy ==
+	(RSH_FAT16_MAP_POPULATE|RSH_FAT16_MAP_STREAM), "set policy");
+  check(fat16_fs.fs_io == io, "same place");
+
+  /* A few reads front to back and it's streaming. */
+  for ( i = 0; i < 5; i++ )
+    check(rsh_fat16_read(&file, got, sizeof(got)) == sizeof(got) &&
+	  memcmp(got, buf + i * sizeof(got), sizeof(got)) == 0, "read");
+  check(fat_file->streak == 5 && fat_file->hinted == size, "read ahead");
+
+  /* Jumping around isn't. */
+  file.offset = 100000;
+  check(rsh_fat16_read(&file, got, sizeof(got)) == sizeof(got) &&
+	memcmp(got, buf + 100000, sizeof(got)) == 0, "read elsewhere");
+  check(fat_file->streak == 1, "streak over");
+  rsh_fat16_close(&file);
+
+  check(rsh_fat16_parse_map_policy("none") == 0 &&
+	rsh_fat16_map_policy == 0 && fat16_fs.fs_io == io, "policy off");
+  check(test_same("/f", buf, size, 65536), "read back");
+
+  check(test_remount(), "fsck");
+  check(test_same("/f", buf, size, 65536), "after remount");
+  free(buf);
+
+}
+
+/*
+ * Metadata committed to the journal but never written back gets replayed
+ * when the image is opened again, and whatever got written back without
+ * being committed is cleaned up by fsck. Dropping the journal without
+ * unmounting is the crash.
+ */
+static void test_journal(){
+
+  char buf[20000];
+  uint32_t leak;
+  struct rsh_fat_dirent ent;
+  struct rsh_fat_dirent *where;
+
+  printf("Journal replay:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  test_pattern(buf, sizeof(buf), 1);
+  check(rsh_fat16_mkdir("/j") == 0, "mkdir");
+  check(test_put("/j/file", buf, sizeof(buf), 1000) == 0, "write");
+  check(rsh_fat16_journal_commits > 0, "commits");
+  check(test_same("/j/file", buf, sizeof(buf), 777), "read back");
+
+  /* Lose the dirent, like a crash before the kernel got around to writing
+   * it back. Its last commit still has it. */
+  if ( _rsh_fat16_path_to_dirent("/j/file", &ent, &where) == 0 )
+    memset(where, 0, sizeof(struct rsh_fat_dirent));
+
+  _rsh_fat16_journal_close();
+  check(test_remount(), "fsck after replay");
+  check(test_same("/j/file", buf, sizeof(buf), 4096), "replayed");
+
+  /* Half an operation made it to the disk and was never committed: a
+   * cluster taken for a file that never got it. */
+  for ( leak = fat16_fs.fat_entries - 1; leak > 0; leak-- )
+    if ( rsh_fat16_get_entry(leak) == FAT_FREE )
+      break;
+  rsh_fat16_set_entry(leak, FAT_TERM);
+  _rsh_fat16_journal_close();
+  check(test_remount(), "fsck after unclean mount");
+  check(rsh_fat16_get_entry(leak) == FAT_FREE, "leak freed");
+
+  /* Periodic commits are written by the next sync. */
+  check(rsh_fat16_set_durability(RSH_FAT16_PERIODIC, 60000, 0) == 0,
+	"periodic");
+  test_pattern(buf, sizeof(buf), 3);
+  check(test_put("/j/late", buf, sizeof(buf), 1000) == 0, "write periodic");
+  check(rsh_fat16_sync(MS_SYNC) == 0, "sync");
+  if ( _rsh_fat16_path_to_dirent("/j/late", &ent, &where) == 0 )
+    memset(where, 0, sizeof(struct rsh_fat_dirent));
+  rsh_fat16_set_durability(RSH_FAT16_SYNC, 0, 0);
+  _rsh_fat16_journal_close();
+  check(test_remount(), "fsck after periodic");
+  check(test_same("/j/late", buf, sizeof(buf), 4096), "periodic replayed");
+
+}
+
+/*
+ * Renames move the dirent and nothing else. mv uses them, including to move
+ * a file into a directory.
+ */
+static void test_rename(){
+
+  int fd;
+  char buf[3000];
+  char *mv_argv[] = { "mv", "/" TEST_IMAGE "/m", "/" TEST_IMAGE "/e", NULL };
+  struct rsh_fat_dirent ent;
+
+  printf("Rename:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  test_pattern(buf, sizeof(buf), 2);
+  check(rsh_fat16_mkdir("/d") == 0 && rsh_fat16_mkdir("/e") == 0, "mkdir");
+  check(test_put("/f", buf, sizeof(buf), 512) == 0, "write");
+  check(rsh_fat16_rename("/f", "/d/g") == 0, "rename file");
+  check(rsh_fat16_rename("/d", "/e/d") == 0, "rename dir");
+  check(_rsh_fat16_path_to_dirent("/f", &ent, NULL) != 0, "old name gone");
+  check(test_same("/e/d/g", buf, sizeof(buf), 100), "renamed");
+
+  /* Over the top of another file. */
+  check(test_put("/h", "old", 3, 3) == 0, "write");
+  check(rsh_fat16_rename("/e/d/g", "/h") == 0, "rename over");
+  check(test_same("/h", buf, sizeof(buf), 1000), "replaced");
+
+  /* But not while it's open: the handle would end up on the moved file. */
+  check(test_put("/x", "xxxx", 4, 4) == 0, "write");
+  fd = _rsh_open("/h", O_WRONLY, 0);
+  check(rsh_fat16_rename("/x", "/h") < 0 && errno == EBUSY, "rename over open");
+  check(fd >= 0 && _rsh_write(fd, "ZZZZ", 4) == 4, "write open target");
+  _rsh_close(fd);
+  check(test_same("/x", "xxxx", 4, 4), "moved file untouched");
+  memcpy(buf, "ZZZZ", 4);
+  check(test_same("/h", buf, sizeof(buf), 1000), "open target written");
+  check(rsh_fat16_rename("/x", "/h") == 0, "rename after close");
+  check(test_same("/h", "xxxx", 4, 4), "replaced after close");
+
+  /* mv into a directory on the image keeps the name. */
+  check(test_put("/m", buf, 100, 100) == 0, "write");
+  check(builtin_mv(3, mv_argv, 0, 1, 2) == 0, "mv");
+  check(_rsh_fat16_path_to_dirent("/m", &ent, NULL) != 0, "mv source gone");
+  check(test_same("/e/m", buf, 100, 100), "mv into dir");
+
+  check(test_remount(), "fsck");
+  check(test_same("/h", "xxxx", 4, 4), "after remount");
+  check(test_same("/e/m", buf, 100, 100), "mv after remount");
+
+}
+
+/*
+ * Clones share the whole chain. Writing to one copies the front of it up to
+ * where the write was and leaves the rest shared; freeing one only frees
+ * what isn't shared.
+ */
+static void test_clone(){
+
+  int fd;
+  char buf[20000];
+  char copy[20000];
+  uint32_t free_start;
+  uint32_t head;
+  uint32_t join;
+  uint32_t gen;
+  uint32_t length;
+  struct rsh_file file;
+  struct rsh_fat_dirent ent;
+
+  printf("Clones:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  free_start = fat16_fs.free_clusters;
+  test_pattern(buf, sizeof(buf), 3);
+  check(test_put("/a", buf, sizeof(buf), 4096) == 0, "write");
+  _rsh_fat16_path_to_dirent("/a", &ent, NULL);
+  head = ent.index;
+  join = test_nth(head, 10000 / 512 + 1);
+
+  check(rsh_fat16_clone("/a", "/b") == 0, "clone");
+  _rsh_fat16_path_to_dirent("/b", &ent, NULL);
+  check(ent.index == head, "same chain");
+  check(_rsh_fat16_refs(head) == 1 && _rsh_fat16_refs(join) == 0, "refs");
+
+  /* Write into the middle of the clone. Its chain runs back into the
+   * original right after the cluster written to. */
+  memcpy(copy, buf, sizeof(copy));
+  copy[10000] = ~copy[10000];
+  fd = _rsh_open("/b", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_lseek(fd, 10000, SEEK_SET) == 10000 &&
+	_rsh_write(fd, copy + 10000, 1) == 1, "write clone");
+  _rsh_close(fd);
+  _rsh_fat16_path_to_dirent("/b", &ent, NULL);
+  check(ent.index != head, "front copied");
+  check(test_nth(ent.index, 10000 / 512 + 1) == join, "rest still shared");
+  check(_rsh_fat16_refs(head) == 0 && _rsh_fat16_refs(join) == 1,
+	"refs after write");
+  check(test_same("/a", buf, sizeof(buf), 1000), "original");
+  check(test_same("/b", copy, sizeof(copy), 1000), "clone");
+
+  check(test_remount(), "fsck");
+  check(test_same("/a", buf, sizeof(buf), 3000), "original after remount");
+  check(test_same("/b", copy, sizeof(copy), 3000), "clone after remount");
+
+  /* Each goes away without taking the other's clusters with it. */
+  check(_rsh_unlink("/a") == 0, "unlink");
+  check(_rsh_fat16_refs(join) == 0, "refs after unlink");
+  check(test_same("/b", copy, sizeof(copy), 3000), "clone after unlink");
+  check(_rsh_unlink("/b") == 0, "unlink");
+  check(fat16_fs.free_clusters == free_start, "all freed");
+  check(test_remount(), "fsck after unlink");
+
+  /* Not over the top of an open file, whose slot the clone would take. */
+  check(test_put("/a", buf, sizeof(buf), 4096) == 0, "write");
+  check(test_put("/c", copy, 2000, 2000) == 0, "write");
+  fd = _rsh_open("/c", O_WRONLY, 0);
+  check(rsh_fat16_clone("/a", "/c") < 0 && errno == EBUSY, "clone over open");
+  check(fd >= 0 && _rsh_write(fd, "ZZZZ", 4) == 4, "write open target");
+  _rsh_close(fd);
+  check(test_same("/a", buf, sizeof(buf), 1000), "original untouched");
+  memcpy(copy, "ZZZZ", 4);
+  check(test_same("/c", copy, 2000, 2000), "open target written");
+  check(rsh_fat16_clone("/a", "/c") == 0, "clone after close");
+  check(test_remount(), "fsck");
+  check(test_same("/c", buf, sizeof(buf), 3000), "clone after remount");
+
+  /* Something open before it was cloned has to copy before it writes. */
+  check(test_put("/p", buf, sizeof(buf), 4096) == 0, "write");
+  fd = _rsh_open("/p", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_write(fd, "1", 1) == 1, "write original");
+  check(rsh_fat16_clone("/p", "/d") == 0, "clone open file");
+  check(fd >= 0 && _rsh_lseek(fd, 5000, SEEK_SET) == 5000 &&
+	_rsh_write(fd, "2", 1) == 1, "write after clone");
+  _rsh_close(fd);
+  memcpy(copy, buf, sizeof(copy));
+  copy[0] = '1';
+  check(test_same("/d", copy, sizeof(copy), 3000), "clone of open file");
+  copy[5000] = '2';
+  check(test_same("/p", copy, sizeof(copy), 3000), "open file written");
+
+  /* Copying doesn't get in the way of reading something else. */
+  memset(&file, 0, sizeof(struct rsh_file));
+  if ( rsh_fat16_open(&file, "/c", O_RDONLY) == 0 ){
+    check(rsh_fat16_read(&file, copy, 8000) == 8000, "read");
+    gen = fat16_fs.chain_gen;
+    length = ((struct rsh_fat16_file *)file.local)->length;
+    fd = _rsh_open("/d", O_WRONLY, 0);
+    check(fd >= 0 && _rsh_lseek(fd, 15000, SEEK_SET) == 15000 &&
+	  _rsh_write(fd, "3", 1) == 1, "write clone");
+    _rsh_close(fd);
+    check(fat16_fs.chain_gen == gen &&
+	  ((struct rsh_fat16_file *)file.local)->length == length, "map kept");
+    check(rsh_fat16_read(&file, copy + 8000, 12000) == 12000 &&
+	  memcmp(copy, buf, sizeof(copy)) == 0, "read rest");
+    rsh_fat16_close(&file);
+  }
+  check(test_remount(), "fsck");
+
+}
+
+/*
+ * Write a bit at the start of a file and a bit way past its end. Only the
+ * two clusters written get allocated, the rest reads as zeros, and SEEK_DATA
+ * and SEEK_HOLE find the edges a cluster at a time.
+ */
+static void test_sparse(){
+
+  int fd;
+  char *buf;
+  char *got;
+  uint32_t free_start;
+  uint32_t length;
+  struct rsh_file same;
+  struct rsh_file other;
+
+  printf("Sparse files:\n");
+  buf = calloc(1, 100100);
+  if ( ! buf || test_image(RSH_FS_VERSION, 0, 1024*1024, 512) ){
+    free(buf);
+    return;
+  }
+
+  free_start = fat16_fs.free_clusters;
+  test_pattern(buf, 100, 4);
+  test_pattern(buf + 100000, 100, 5);
+  fd = _rsh_open("/s", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0 && _rsh_write(fd, buf, 100) == 100 &&
+	_rsh_lseek(fd, 100000, SEEK_SET) == 100000 &&
+	_rsh_write(fd, buf + 100000, 100) == 100, "write");
+  _rsh_close(fd);
+  check(free_start - fat16_fs.free_clusters == 2, "two clusters");
+  check(test_same("/s", buf, 100100, 4096), "read back");
+
+  fd = _rsh_open("/s", O_RDONLY, 0);
+  check(_rsh_lseek(fd, 0, SEEK_HOLE) == 512, "first hole");
+  check(_rsh_lseek(fd, 512, SEEK_DATA) == 99840, "next data");
+  check(_rsh_lseek(fd, 99840, SEEK_HOLE) == 100100, "hole at the end");
+  errno = 0;
+  check(_rsh_lseek(fd, 100100, SEEK_DATA) == -1 && errno == ENXIO,
+	"no data past the end");
+  _rsh_close(fd);
+
+  /* Writing into the hole fills in just that cluster. Anyone else reading
+   * the file sees it; anyone reading another file keeps their map. */
+  check(test_put("/t", buf, 5000, 4096) == 0, "write other");
+  memset(&other, 0, sizeof(struct rsh_file));
+  memset(&same, 0, sizeof(struct rsh_file));
+  if ( rsh_fat16_open(&other, "/t", O_RDONLY) ||
+       rsh_fat16_open(&same, "/s", O_RDONLY) ){
+    check(0, "open");
+    free(buf);
+    return;
+  }
+  got = malloc(100100);
+  check(got && rsh_fat16_read(&other, got, 5000) == 5000 &&
+	rsh_fat16_read(&same, got, 100100) == 100100, "read");
+  length = ((struct rsh_fat16_file *)other.local)->length;
+  free_start = fat16_fs.free_clusters;
+  test_pattern(buf + 50000, 10, 6);
+  fd = _rsh_open("/s", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_lseek(fd, 50000, SEEK_SET) == 50000 &&
+	_rsh_write(fd, buf + 50000, 10) == 10, "fill");
+  _rsh_close(fd);
+  check(free_start - fat16_fs.free_clusters == 1, "one more cluster");
+  check(((struct rsh_fat16_file *)other.local)->length == length &&
+	((struct rsh_fat16_file *)other.local)->gen == fat16_fs.chain_gen,
+	"other map kept");
+  same.offset = 0;
+  check(got && rsh_fat16_read(&same, got, 100100) == 100100 &&
+	memcmp(got, buf, 100100) == 0, "seen by other reader");
+  rsh_fat16_close(&same);
+  rsh_fat16_close(&other);
+  free(got);
+  fd = _rsh_open("/s", O_RDONLY, 0);
+  check(_rsh_lseek(fd, 512, SEEK_DATA) == 49664, "filled data");
+  _rsh_close(fd);
+
+  check(test_remount(), "fsck");
+  check(test_same("/s", buf, 100100, 3000), "after remount");
+  free(buf);
+
+}
+
+/*
+ * Fill a small image past full. Growing is turned on in main() since that
+ * has to happen before an image is mapped. The image gets bigger instead of
+ * running out, and a file opened before it grew can still be written. Running
+ * low halfway through a transaction doesn't grow it until the commit.
+ */
+static void test_grow(){
+
+  int fd;
+  char *buf;
+  size_t size = 3*1024*1024;
+  size_t fill;
+  uint64_t max;
+  uint64_t before;
+
+  printf("Growing:\n");
+  buf = malloc(size);
+  if ( ! buf )
+    return;
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) ){
+    free(buf);
+    return;
+  }
+
+  fd = _rsh_open("/keep", O_CREAT|O_TRUNC|O_WRONLY, 0);
+  check(fd >= 0 && _rsh_write(fd, "keep", 4) == 4, "write");
+  test_pattern(buf, size, 7);
+  check(test_put("/big", buf, size, 65536) == 0, "write past full");
+  check(fat16_fs.fs_header.size > size, "grew");
+  check(_rsh_write(fd, "more", 4) == 4, "write after growing");
+  _rsh_close(fd);
+
+  check(test_same("/big", buf, size, 65536), "read back");
+  check(test_same("/keep", "keepmore", 8, 8), "old file");
+  check(test_remount(), "fsck");
+  check(test_same("/big", buf, size, 5000), "after remount");
+
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) ){
+    free(buf);
+    return;
+  }
+  max = rsh_fat16_grow_max;
+  rsh_fat16_grow_max = 0;
+  fill = (fat16_fs.free_clusters - 20) * 512;
+  check(test_put("/fill", buf, fill, 65536) == 0, "fill");
+  rsh_fat16_grow_max = max;
+  before = fat16_fs.fs_header.size;
+  check(_rsh_fat16_mkfile(fat16_fs.fs_header.root_offset, "half") == 0 &&
+	_rsh_fat16_journal_pending(), "half done");
+  check(_rsh_fat16_make_room(1) == 0 && fat16_fs.fs_header.size == before &&
+	_rsh_fat16_journal_pending(), "waits");
+  check(_rsh_fat16_journal_commit() == 0 && ! _rsh_fat16_journal_pending() &&
+	fat16_fs.fs_header.size > before, "grew after the commit");
+  check(test_remount(), "fsck");
+  check(test_same("/half", "", 0, 1) && test_same("/fill", buf, fill, 65536),
+	"after remount");
+  free(buf);
+
+}
+
+/*
+ * Small files go in shared pack clusters, a few to a cluster. One that grows
+ * too big moves out into clusters of its own, and pack clusters that empty
+ * out go back.
+ */
+static void test_pack(){
+
+  int i;
+  int n;
+  int fd;
+  char buf[1200];
+  char name[32];
+  uint32_t free_start;
+  uint32_t packs;
+  uint32_t checkpoints;
+  uint32_t cluster;
+  struct rsh_fat_dirent ent;
+
+  printf("Packed small files:\n");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  check(rsh_fat16_mkdir("/p") == 0, "mkdir");
+  free_start = fat16_fs.free_clusters;
+  for ( i = 0; i < 100; i++ ){
+    sprintf(name, "/p/f%d", i);
+    test_pattern(buf, i * 128 / 100, i);
+    check(test_put(name, buf, i * 128 / 100, 7) == 0, "write");
+    check(_rsh_fat16_path_to_dirent(name, &ent, NULL) == 0 &&
+	  (! i || FAT_DIRENT_PACKED(&ent)), "packed");
+  }
+  check(free_start - fat16_fs.free_clusters < 50, "shared clusters");
+
+  /* Get rid of every other one and put others in their place. */
+  for ( i = 1; i < 100; i += 2 ){
+    sprintf(name, "/p/f%d", i);
+    check(_rsh_unlink(name) == 0, "unlink");
+    sprintf(name, "/p/g%d", i);
+    test_pattern(buf, 100 - i, i + 1000);
+    check(test_put(name, buf, 100 - i, 100) == 0, "write");
+  }
+
+  /* Past a quarter of a cluster it's an ordinary file. */
+  test_pattern(buf, sizeof(buf), 50);
+  fd = _rsh_open("/p/f50", O_WRONLY|O_APPEND, 0);
+  check(fd >= 0 && _rsh_write(fd, buf + 64, sizeof(buf) - 64) ==
+	sizeof(buf) - 64, "append");
+  _rsh_close(fd);
+  check(_rsh_fat16_path_to_dirent("/p/f50", &ent, NULL) == 0 &&
+	! FAT_DIRENT_PACKED(&ent), "unpacked");
+
+  /* Fill up another pack cluster and empty it again. It comes off the chain
+   * without a checkpoint and is free after the next one. */
+  packs = fat16_fs.pack_count;
+  checkpoints = rsh_fat16_journal_checkpoints;
+  for ( n = 0; fat16_fs.pack_count == packs && n < 100; n++ ){
+    sprintf(name, "/p/h%d", n);
+    check(test_put(name, buf, 128, 128) == 0, "write");
+  }
+  cluster = fat16_fs.packs[fat16_fs.pack_count - 1];
+  for ( i = 0; i < n; i++ ){
+    sprintf(name, "/p/h%d", i);
+    check(_rsh_unlink(name) == 0, "unlink");
+  }
+  check(fat16_fs.pack_count == packs &&
+	rsh_fat16_journal_checkpoints == checkpoints, "no checkpoint");
+  check(rsh_fat16_get_entry(cluster) == FAT_TERM &&
+	rsh_fat16_fsck(0, 0, 1) == 0, "not free yet");
+  _rsh_fat16_journal_checkpoint();
+  check(rsh_fat16_get_entry(cluster) == FAT_FREE && test_free_map_ok(),
+	"freed");
+
+  check(test_remount(), "fsck");
+  for ( i = 0; i < 100; i++ ){
+    sprintf(name, i % 2 ? "/p/g%d" : "/p/f%d", i);
+    if ( i == 50 ){
+      test_pattern(buf, sizeof(buf), 50);
+      check(test_same(name, buf, sizeof(buf), 500), "unpacked file");
+      continue;
+    }
+    test_pattern(buf, 128, i % 2 ? i + 1000 : i);
+    check(test_same(name, buf, i % 2 ? 100 - i : i * 128 / 100, 50),
+	  "read back");
+  }
+
+}
+
+/*
+ * Name of file i in test_dir(). Names come in every length up to about as
+ * long as they can be.
+ */
+static void test_dir_name(char *name, int i, int renamed){
+
+  int len;
+
+  len = sprintf(name, "/d/%c%d_", renamed ? 'r' : 'f', i);
+  memset(name + len, 'x', i % 100);
+  name[len + i % 100] = 0;
+
+}
+
+/*
+ * See that the directory test_dir() made has what it should.
+ */
+static void test_dir_check(int files){
+
+  int i;
+  int dfd;
+  int seen = 0;
+  char name[128];
+  char buf[200];
+  struct rsh_fat_dirent ent;
+
+  dfd = _rsh_open("/d", O_RDONLY, 0);
+  while ( dfd >= 0 && _rsh_readdir(dfd) )
+    seen++;
+  if ( dfd >= 0 )
+    _rsh_close(dfd);
+  check(seen == files - files / 4 + 2, "readdir");
+
+  for ( i = 0; i < files; i++ ){
+    test_dir_name(name, i, i % 4 == 2);
+    if ( i % 4 == 1 ){
+      check(_rsh_fat16_path_to_dirent(name, &ent, NULL) != 0, "removed");
+      continue;
+    }
+    test_pattern(buf, i % 200, i);
+    check(test_same(name, buf, i % 3 ? 0 : i % 200, 64), "lookup");
+  }
+
+}
+
+/*
+ * Fill one directory of an image with the given header flags, then remove
+ * and rename some of what's in it. Returns how many clusters the directory
+ * ended up with.
+ */
+static uint32_t test_dir(uint32_t flags, size_t size, size_t cluster,
+			 int files){
+
+  int i;
+  char name[128];
+  char renamed[128];
+  char buf[200];
+  uint32_t count = 0;
+  uint32_t dir;
+  struct rsh_fat_dirent ent;
+
+  if ( test_image(RSH_FS_VERSION, flags, size, cluster) )
+    return 0;
+
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  for ( i = 0; i < files; i++ ){
+    test_dir_name(name, i, 0);
+    test_pattern(buf, i % 200, i);
+    check(test_put(name, buf, i % 3 ? 0 : i % 200, 64) == 0, "create");
+  }
+  for ( i = 0; i < files; i++ ){
+    test_dir_name(name, i, 0);
+    if ( i % 4 == 1 )
+      check(_rsh_unlink(name) == 0, "unlink");
+    test_dir_name(renamed, i, 1);
+    if ( i % 4 == 2 )
+      check(rsh_fat16_rename(name, renamed) == 0, "rename");
+  }
+  test_dir_check(files);
+
+  _rsh_fat16_path_to_dirent("/d", &ent, NULL);
+  for ( dir = ent.index; dir != FAT_TERM; dir = rsh_fat16_get_entry(dir) )
+    count++;
+
+  check(test_remount(), "fsck");
+  test_dir_check(files);
+
+  return count;
+
+}
+
+/*
+ * Variable length dirents take a lot less room than the fixed ones when the
+ * names are short, and a directory being read doesn't lose its place when
+ * records it has been through get joined up.
+ */
+static void test_compact(){
+
+  uint32_t fixed;
+  uint32_t compact;
+  struct dirent dirents[8];
+  struct rsh_file file;
+
+  printf("Compact directories:\n");
+  fixed = test_dir(0, 1024*1024, 512, 500);
+  compact = test_dir(RSH_FS_COMPACT_DIRS, 1024*1024, 512, 500);
+  printf("  %u clusters fixed, %u compact\n", fixed, compact);
+  check(compact && compact < fixed, "smaller");
+
+  /* Empty records get joined up under a directory being read. The new name
+   * is a bit shorter than the first one, so what's left over starts just
+   * before where the second one did. */
+  if ( test_image(RSH_FS_VERSION, RSH_FS_COMPACT_DIRS, 1024*1024, 512) )
+    return;
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  check(test_put("/d/aaaaaaaaaaaaaaaaaaaa", "", 0, 1) == 0 &&
+	test_put("/d/bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb",
+		 "", 0, 1) == 0 &&
+	test_put("/d/c", "", 0, 1) == 0 && test_put("/d/e", "", 0, 1) == 0,
+	"create");
+  memset(&file, 0, sizeof(struct rsh_file));
+  check(rsh_fat16_open(&file, "/d", O_RDONLY) == 0 &&
+	rsh_fat16_readdir(&file, dirents, 4 * sizeof(struct dirent)) == 4,
+	"readdir");
+  check(_rsh_unlink("/d/aaaaaaaaaaaaaaaaaaaa") == 0 &&
+	_rsh_unlink("/d/bbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbbb"
+		    "bbbb") == 0, "unlink");
+  check(test_put("/d/ffffffffffff", "", 0, 1) == 0, "create again");
+  check(rsh_fat16_readdir(&file, dirents, sizeof(dirents)) == 2 &&
+	strcmp(dirents[0].d_name, "c") == 0 &&
+	strcmp(dirents[1].d_name, "e") == 0, "read on");
+  rsh_fat16_close(&file);
+  check(test_remount(), "fsck");
+
+}
+
+/*
+ * A directory bigger than a cluster gets a B+tree, deep enough here to have
+ * split a few times, and readdir hands the names out in order from it.
+ */
+static void test_tree(){
+
+  int dfd;
+  int sorted = 1;
+  char last[128] = "";
+  struct dirent *dirent;
+  struct rsh_fat_dirent ent;
+
+  printf("Tree directories:\n");
+  if ( ! test_dir(RSH_FS_COMPACT_DIRS | RSH_FS_TREE_DIRS, 4*1024*1024, 1024,
+		  2000) )
+    return;
+
+  _rsh_fat16_path_to_dirent("/d", &ent, NULL);
+  check(_rsh_fat16_tree_root(ent.index) != 0, "has a tree");
+
+  dfd = _rsh_open("/d", O_RDONLY, 0);
+  while ( dfd >= 0 && (dirent = _rsh_readdir(dfd)) ){
+    if ( *dirent->d_name == '.' )
+      continue;
+    if ( strcmp(last, dirent->d_name) >= 0 )
+      sorted = 0;
+    strcpy(last, dirent->d_name);
+  }
+  if ( dfd >= 0 )
+    _rsh_close(dfd);
+  check(sorted, "in order");
+
+}
+
+/*
+ * Compressed files: one that's all text and one whose first chunk is random
+ * and so gets stored as it is. Both read back in pieces that don't line up
+ * with the chunks. Writing to one only compresses the chunks from the first
+ * change on again.
+ */
+static void test_zip(){
+
+  int i;
+  int fd;
+  int other;
+  char *buf;
+  char got[100];
+  off_t at;
+  size_t len = 0;
+  size_t size = 200000;
+  uint32_t seed = 1;
+  uint32_t free_start;
+  uint32_t chunks;
+  struct rsh_fat_dirent ent;
+
+  printf("Compressed files:\n");
+  buf = malloc(size + 100);
+  if ( ! buf || test_image(RSH_FS_VERSION, RSH_FS_ZIP_FILES, 4*1024*1024,
+			   4096) ){
+    free(buf);
+    return;
+  }
+
+  for ( i = 0; len < size; i++ )
+    len += sprintf(buf + len, "12:%02d:%02d host%d request %d done in %d ms\n",
+		   i % 60, i % 37, i % 5, i, i % 1000);
+  free_start = fat16_fs.free_clusters;
+  check(test_put("/log", buf, size, 4096) == 0, "write");
+  check(_rsh_fat16_path_to_dirent("/log", &ent, NULL) == 0 &&
+	ent.type == FAT_ZFILE, "compressed");
+  check(free_start - fat16_fs.free_clusters < size / 4096 / 2, "smaller");
+  check(test_same("/log", buf, size, 7777), "read back");
+  check(test_same_map("/log", buf, size, 7777), "readv_map");
+
+  for ( i = 0; i < FAT_ZIP_CHUNK; i++ ){
+    seed = seed * 1103515245 + 12345;
+    buf[i] = seed >> 16;
+  }
+  check(test_put("/mixed", buf, size, 4096) == 0, "write");
+  check(_rsh_fat16_path_to_dirent("/mixed", &ent, NULL) == 0 &&
+	ent.type == FAT_ZFILE, "compressed");
+  check(test_same("/mixed", buf, size, 7777), "raw chunk read back");
+  check(test_same_map("/mixed", buf, size, 7777), "raw chunk readv_map");
+
+  /* Back and forth inside the raw chunk. */
+  fd = _rsh_open("/mixed", O_RDONLY, 0);
+  for ( i = 0; i < 20; i++ ){
+    at = (i * 40503) % (FAT_ZIP_CHUNK - 100);
+    check(_rsh_lseek(fd, at, SEEK_SET) == at &&
+	  _rsh_read(fd, got, 100) == 100 && memcmp(got, buf + at, 100) == 0,
+	  "seek in raw chunk");
+  }
+  _rsh_close(fd);
+
+  /* Opening it to write without writing leaves it compressed. */
+  free_start = fat16_fs.free_clusters;
+  fd = _rsh_open("/mixed", O_RDWR, 0);
+  check(fd >= 0 && _rsh_read(fd, got, 100) == 100, "open to write");
+  _rsh_close(fd);
+  check(_rsh_fat16_path_to_dirent("/mixed", &ent, NULL) == 0 &&
+	ent.type == FAT_ZFILE, "still compressed");
+  check(fat16_fs.free_clusters == free_start, "nothing moved");
+
+  /* Writing uncompresses it, and closing compresses it again: an append
+   * just the last chunk, which is the one it went into. */
+  chunks = rsh_fat16_zip_chunks;
+  fd = _rsh_open("/mixed", O_WRONLY|O_APPEND, 0);
+  check(fd >= 0 && _rsh_write(fd, "tail\n", 5) == 5, "append");
+  _rsh_close(fd);
+  memcpy(buf + size, "tail\n", 5);
+  size += 5;
+  check(rsh_fat16_zip_chunks - chunks == 1, "append packs one chunk");
+  chunks = rsh_fat16_zip_chunks;
+  fd = _rsh_open("/mixed", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_lseek(fd, 70000, SEEK_SET) == 70000 &&
+	_rsh_write(fd, "ZZZZ", 4) == 4, "rewrite");
+  _rsh_close(fd);
+  memcpy(buf + 70000, "ZZZZ", 4);
+  check(rsh_fat16_zip_chunks - chunks == 3, "rewrite packs the rest");
+  check(_rsh_fat16_path_to_dirent("/mixed", &ent, NULL) == 0 &&
+	ent.type == FAT_ZFILE, "compressed again");
+  check(test_same("/mixed", buf, size, 7777), "after writes");
+
+  /* Two at once: the write through the other one counts too, even though
+   * it's the other one that ends up compressing it. */
+  chunks = rsh_fat16_zip_chunks;
+  fd = _rsh_open("/mixed", O_WRONLY|O_APPEND, 0);
+  other = _rsh_open("/mixed", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_write(fd, "more\n", 5) == 5, "append");
+  check(other >= 0 && _rsh_write(other, "AAAA", 4) == 4, "write in front");
+  _rsh_close(fd);
+  _rsh_close(other);
+  memcpy(buf + size, "more\n", 5);
+  size += 5;
+  memcpy(buf, "AAAA", 4);
+  check(rsh_fat16_zip_chunks - chunks == 4, "packs all of it");
+  check(test_same("/mixed", buf, size, 7777), "after both");
+
+  check(test_remount(), "fsck");
+  check(test_same("/mixed", buf, size, 7777), "after remount");
+  free(buf);
+
+}
+
+/*
+ * Files with the same clusters share them after a dedup pass, or as soon as
+ * they're closed on images that dedup as they go. Writing to one afterwards
+ * doesn't change the others.
+ */
+static void test_dedup(){
+
+  int fd;
+  char *buf;
+  char *other;
+  size_t size = 100000;
+  uint32_t free_start;
+  uint64_t looked = 0;
+  uint64_t shared = 0;
+
+  printf("Dedup:\n");
+  buf = malloc(size);
+  other = malloc(size);
+  if ( ! buf || ! other || test_image(RSH_FS_VERSION, 0, 4*1024*1024, 4096) )
+    goto done;
+
+  /* A copy, and one that only differs in its first cluster. */
+  test_pattern(buf, size, 8);
+  memcpy(other, buf, size);
+  other[10] = ~other[10];
+  check(rsh_fat16_mkdir("/b") == 0, "mkdir");
+  check(test_put("/a", buf, size, 4096) == 0 &&
+	test_put("/b/x", buf, size, 3000) == 0 &&
+	test_put("/c", other, size, 65536) == 0, "write");
+  free_start = fat16_fs.free_clusters;
+  check(rsh_fat16_dedup(2, &looked, &shared) == 0, "dedup");
+  printf("  %llu of %llu clusters shared\n", (unsigned long long)shared,
+	 (unsigned long long)looked);
+  check(shared >= 2 * (size / 4096) - 1, "shared");
+  check(fat16_fs.free_clusters - free_start == shared, "freed");
+  check(test_same("/a", buf, size, 5000) && test_same("/b/x", buf, size, 5000)
+	&& test_same("/c", other, size, 5000), "read back");
+
+  /* Copy on write from here. */
+  fd = _rsh_open("/b/x", O_WRONLY, 0);
+  check(fd >= 0 && _rsh_lseek(fd, 50000, SEEK_SET) == 50000 &&
+	_rsh_write(fd, "new", 3) == 3, "write shared");
+  _rsh_close(fd);
+  check(test_same("/a", buf, size, 5000), "others unchanged");
+  check(test_same("/c", other, size, 5000), "others unchanged");
+  check(test_remount(), "fsck");
+  memcpy(buf + 50000, "new", 3);
+  check(test_same("/b/x", buf, size, 5000), "after remount");
+
+  /* Sharing as files are closed. */
+  if ( test_image(RSH_FS_VERSION, RSH_FS_DEDUP_FILES, 4*1024*1024, 4096) )
+    goto done;
+  test_pattern(buf, size, 9);
+  check(test_put("/a", buf, size, 4096) == 0, "write");
+  free_start = fat16_fs.free_clusters;
+  check(test_put("/b", buf, size, 777) == 0, "write copy");
+  check(fat16_fs.free_clusters == free_start, "shared on close");
+  check(test_remount(), "fsck");
+  check(test_same("/b", buf, size, 5000), "after remount");
+
+ done:
+  free(buf);
+  free(other);
+
+}
+
+/*
+ * Checksums: the CRC itself, a scrub of a good image before and after it's
+ * been written back, and a byte that changes under the file system.
+ */
+static void test_csum(){
+
+  int fd;
+  char buf[50000];
+  char got[4096];
+  uint8_t *addr;
+  uint32_t errors;
+  struct rsh_fat_dirent ent;
+
+  printf("Checksums:\n");
+  check(_rsh_fat16_crc32c(0, "123456789", 9) == 0xe3069283, "crc32c");
+  check(_rsh_fat16_crc32c_sw(0, "123456789", 9) == 0xe3069283,
+	"crc32c tables");
+  if ( test_image(RSH_FS_VERSION, 0, 1024*1024, 512) )
+    return;
+
+  test_pattern(buf, sizeof(buf), 10);
+  check(rsh_fat16_mkdir("/d") == 0, "mkdir");
+  check(test_put("/d/a", buf, sizeof(buf), 3000) == 0, "write");
+  check(test_put("/b", buf, 700, 700) == 0, "write");
+  check(rsh_fat16_scrub(1, 1) == 0, "scrub");
+  check(test_remount(), "fsck");
+  check(rsh_fat16_scrub(2, 1) == 0, "scrub after remount");
+  check(test_same("/d/a", buf, sizeof(buf), 4096), "read back");
+
+  /* Behind the file system's back, like the disk would. */
+  _rsh_fat16_path_to_dirent("/d/a", &ent, NULL);
+  addr = FAT_CLUSTER_TO_ADDR(test_nth(ent.index, 3));
+  addr[100] = ~addr[100];
+  check(rsh_fat16_scrub(1, 1) == 1, "scrub finds it");
+
+  rsh_fat16_verify_reads = 1;
+  errors = rsh_fat16_csum_errors;
+  fd = _rsh_open("/d/a", O_RDONLY, 0);
+  check(fd >= 0 && _rsh_read(fd, got, 512) == 512, "good cluster");
+  check(fd >= 0 && _rsh_lseek(fd, 3 * 512, SEEK_SET) == 3 * 512 &&
+	_rsh_read(fd, got, 512) < 0 && errno == EIO, "read fails");
+  _rsh_close(fd);
+  check(rsh_fat16_csum_errors == errors + 1, "counted");
+
+  /* Writing it out again fixes it. */
+  check(test_put("/d/a", buf, sizeof(buf), 4096) == 0, "rewrite");
+  check(test_same("/d/a", buf, sizeof(buf), 4096), "read back");
+  check(rsh_fat16_scrub(1, 1) == 0, "scrub after rewrite");
+  check(test_remount(), "fsck");
+  check(test_same("/d/a", buf, sizeof(buf), 4096), "after remount");
+  rsh_fat16_verify_reads = 0;
+
+  /* No table to check before v7. */
+  if ( test_image(RSH_FS_V6, 0, 1024*1024, 512) )
+    return;
+  check(rsh_fat16_scrub(1, 1) < 0 && errno == ENOTSUP, "v6 scrub");
+  rsh_fat16_new_version = RSH_FS_VERSION;
+  rsh_fat16_new_flags = 0;
+
+}
+
 int main(){
 
   int err;
@@ -38,7 +2174,13 @@ int main(){
   rsh_init_fs();
 
   printf("FS core intialized.\n");
-  err = rsh_fat16_init("testfs.bin", 1024*16, 512);
+
+  /* Start from a fresh image every time. Anything version 2 or later needs
+   * room for at least a 64K journal, so 16K like this used to be won't do. */
+  unlink("testfs.bin");
+  if ( rsh_fat16_set_grow(8*1024*1024, 5) )
+    printf("WARNING: Could not turn on growing.\n");
+  err = rsh_fat16_init("testfs.bin", 1024*1024, 512);
   if ( err ){
     printf("WARNING: Could not load internal FS.\n");
     return 1;
@@ -69,7 +2211,37 @@ int main(){
   char *a_path = strdup("/");
   char *a_dir = _rsh_fat16_split_path(a_path, &name);
   printf("dir='%s' name='%s'\n", a_dir, name);
-  return 0;
+
+  /* Now the on-disk features, each on a fresh image: write something, read
+   * it back, open the image again and make sure fsck doesn't mind. */
+  test_alloc();
+  test_map();
+  test_index();
+  test_dcache();
+  test_readv();
+  test_write();
+  test_falloc();
+  test_dirty();
+  test_durability();
+  test_df();
+  test_versions();
+  test_defrag();
+  test_fsck();
+  test_mapping();
+  test_journal();
+  test_rename();
+  test_clone();
+  test_sparse();
+  test_grow();
+  test_pack();
+  test_compact();
+  test_tree();
+  test_zip();
+  test_dedup();
+  test_csum();
+
+  printf("%d failures.\n", failures);
+  return failures ? 1 : 0;
   
   /* Now we can traverse a path by looking at directory tables and stuff. */
   /*
@@ -404,6 +404,143 @@ ssize_t _rsh_write(int fd, const void *buf, size_t count){
 
 }
 
+/*
+ * Like writev(). The driver only knows how to write one buffer at a time so
+ * that's what we do. Stops at the first short write.
+ */
+ssize_t _rsh_writev(int fd, const struct iovec *iov, int iovcnt){
+
+  int i;
+  ssize_t ret;
+  ssize_t written = 0;
+
+  for ( i = 0; i < iovcnt; i++ ){
+    ret = _rsh_write(fd, iov[i].iov_base, iov[i].iov_len);
+    if ( ret < 0 )
+      return written ? written : ret;
+    written += ret;
+    if ( ret < iov[i].iov_len )
+      break;
+  }
+
+  return written;
+
+}
+
+/*
+ * Get segments pointing at a file's data instead of copying it out. See the
+ * readv_map entry in struct rsh_io_ops. Fails with ENOSYS if the driver can't
+ * do this; just use _rsh_read() in that case.
+ */
+int _rsh_readv_map(int fd, struct iovec *iov, int iovcnt, size_t count){
+
+  if ( ! _RSH_FD(fd) ){
+    errno = EBADF;
+    return RSH_ERR;
+  }
+  fd = _RSH_FD_TO_INDEX(fd);
+
+  /* Check to make sure this is actually an open file. */
+  if ( ! fs.ftable[fd].used ){
+    errno = EBADF;
+    return RSH_ERR;
+  }
+
+  if ( ! fs.fops->readv_map ){
+    errno = ENOSYS;
+    return RSH_ERR;
+  }
+
+  return fs.fops->readv_map(FD_TO_FPTR(fd), iov, iovcnt, count);
+
+}
+
+/*
+ * Reserve space for len more bytes past the file's offset. Fails with ENOSYS
+ * if the driver doesn't know how.
+ */
+int _rsh_fallocate(int fd, off_t len){
+
+  if ( ! _RSH_FD(fd) ){
+    errno = EBADF;
+    return RSH_ERR;
+  }
+  fd = _RSH_FD_TO_INDEX(fd);
+
+  /* Check to make sure this is actually an open file. */
+  if ( ! fs.ftable[fd].used ){
+    errno = EBADF;
+    return RSH_ERR;
+  }
+
+  if ( ! fs.fops->fallocate ){
+    errno = ENOSYS;
+    return RSH_ERR;
+  }
+
+  return fs.fops->fallocate(FD_TO_FPTR(fd), len);
+
+}
+
+/*
+ * Move a file's offset. Drivers that don't do their own get SEEK_SET,
+ * SEEK_CUR and SEEK_END done here, and for SEEK_DATA/SEEK_HOLE the whole file
+ * is data.
+ */
+off_t _rsh_lseek(int fd, off_t offset, int whence){
+
+  off_t ret;
+  struct rsh_file *file;
+
+  if ( ! _RSH_FD(fd) ){
+    errno = EBADF;
+    return -1;
+  }
+  fd = _RSH_FD_TO_INDEX(fd);
+
+  /* Check to make sure this is actually an open file. */
+  if ( ! fs.ftable[fd].used ){
+    errno = EBADF;
+    return -1;
+  }
+  file = FD_TO_FPTR(fd);
+
+  if ( fs.fops->lseek )
+    return fs.fops->lseek(file, offset, whence);
+
+  switch ( whence ){
+  case SEEK_SET:
+    ret = offset;
+    break;
+  case SEEK_CUR:
+    ret = file->offset + offset;
+    break;
+  case SEEK_END:
+    ret = file->size + offset;
+    break;
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    if ( offset < 0 || offset >= file->size ){
+      errno = ENXIO;
+      return -1;
+    }
+    ret = whence == SEEK_DATA ? offset : file->size;
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( ret < 0 ){
+    errno = EINVAL;
+    return -1;
+  }
+
+  file->offset = ret;
+  return ret;
+
+}
+
 int _rsh_dup2(int oldfd, int newfd){
 
   return RSH_ERR;
@@ -627,6 +764,49 @@ int _rsh_unlink(const char *path){
 
 }
 
+int _rsh_rename(const char *oldpath, const char *newpath){
+
+  int ret;
+  char *old_name, *new_name;
+
+  if ( ! fs.fops->rename ){
+    errno = ENOSYS;
+    return RSH_ERR;
+  }
+
+  old_name = _rsh_fs_rel2abs(oldpath);
+  new_name = _rsh_fs_rel2abs(newpath);
+  ret = fs.fops->rename(old_name, new_name);
+  free(old_name);
+  free(new_name);
+
+  return ret;
+
+}
+
+/*
+ * Make newpath share oldpath's data, if the file system knows how.
+ */
+int _rsh_clone(const char *oldpath, const char *newpath){
+
+  int ret;
+  char *old_name, *new_name;
+
+  if ( ! fs.fops->clone ){
+    errno = ENOSYS;
+    return RSH_ERR;
+  }
+
+  old_name = _rsh_fs_rel2abs(oldpath);
+  new_name = _rsh_fs_rel2abs(newpath);
+  ret = fs.fops->clone(old_name, new_name);
+  free(old_name);
+  free(new_name);
+
+  return ret;
+
+}
+
 int builtin_dumpfds(int argc, char **argv, int in, int out, int err){
 
   int i;
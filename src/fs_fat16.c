@@ -9,6 +9,7 @@
 #include <fcntl.h>
 #include <stdio.h>
 #include <errno.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,14 +19,19 @@
 
 struct rsh_fat16_fs fat16_fs;
 
-#define FAT_CLUSTER_TO_ADDR(cluster)		\
-  ( fat16_fs.fs_io + (cluster * fat16_fs.fs_header.csize) )
-#define FAT_WIPE_CLUSTER(cluster_io_addr)	\
-  ( memset(cluster_io_addr, 0, fat16_fs.fs_header.csize) )
+/* Every open file, so a rename can point them at the dirent's new slot. */
+static struct rsh_fat16_file *open_files = NULL;
+
+/* Format of the images we make. Existing images are mounted as they are. */
+int      rsh_fat16_new_version = RSH_FS_VERSION;
+uint32_t rsh_fat16_new_flags = 0;
 
-#define FAT_CLUSTER_SIZE (fat16_fs.fs_header.csize)
 #define MEDIUM_BLK_SIZE  4096 /* Size of a page in Linux. */
 
+/* Bounds on the size of a new image's journal. */
+#define JOURNAL_MIN      (64*1024)
+#define JOURNAL_MAX      (4*1024*1024)
+
 /*
  * Get the geometry of a disk from the passed string. The format should be as
  * follows: <size>:<cluster_size>. This will place the geometry in the passed
@@ -50,6 +56,7 @@ int _rsh_fat16_geometry(char *geometry, long int *geo){
 void rsh_fat16_badness(){
 
   printf("FAT16 filesystem irrevocably corrupt. Cry moar.\n");
+  printf("Starting the shell with --fsck=repair may get it back.\n");
   exit(1);
 
 }
@@ -110,11 +117,10 @@ fat_t _rsh_fat16_follow_head(uint32_t head, uint32_t offset){
 }
 
 /*
- * Finds an open cluster. Thats it. The cluster you get may be filled with
- * crap. Call _rsh_fat16_find_open_cluster() to get a cleared cluster. This
- * requires a write to the disk drive though.
+ * The slow way of finding an open cluster: walk the FAT from the start. This
+ * is only used if we could not allocate the free cluster bitmap.
  */
-int __rsh_fat16_find_open_cluster(uint32_t *addr){
+int _rsh_fat16_scan_open_cluster(uint32_t *addr){
 
   uint32_t i;
   fat_t entry;
@@ -134,6 +140,123 @@ int __rsh_fat16_find_open_cluster(uint32_t *addr){
 
 }
 
+/*
+ * Build the free cluster bitmap from the FAT. This is done once when the file
+ * system is mounted, after that rsh_fat16_set_entry() keeps it up to date. If
+ * the memory can't be had, then we just keep scanning the FAT like we used to.
+ * The free cluster count gets set up either way; df and friends live off of
+ * it.
+ */
+int _rsh_fat16_build_free_map(struct rsh_fat16_fs *fs){
+
+  uint32_t i;
+  uint32_t summary_words;
+
+  fs->free_words = (fs->fat_entries + 31) / 32;
+  summary_words = (fs->free_words + 31) / 32;
+
+  fs->free_map = (uint32_t *)malloc(fs->free_words * sizeof(uint32_t));
+  fs->free_summary = (uint32_t *)malloc(summary_words * sizeof(uint32_t));
+  if ( ! fs->free_map || ! fs->free_summary ){
+    free(fs->free_map);
+    free(fs->free_summary);
+    fs->free_map = NULL;
+    fs->free_summary = NULL;
+  } else {
+    memset(fs->free_map, 0, fs->free_words * sizeof(uint32_t));
+    memset(fs->free_summary, 0, summary_words * sizeof(uint32_t));
+  }
+
+  fs->free_clusters = 0;
+  fs->free_hint = 0;
+
+  for ( i = 0; i < fs->fat_entries; i++){
+    if ( rsh_fat16_get_entry(i) != FAT_FREE )
+      continue;
+    fs->free_clusters++;
+    if ( ! fs->free_map )
+      continue;
+    fs->free_map[i / 32] |= 1U << (i % 32);
+    fs->free_summary[i / 1024] |= 1U << ((i / 32) % 32);
+  }
+
+  return fs->free_map ? RSH_OK : RSH_ERR;
+
+}
+
+/*
+ * Find the first set bit in the free map at or after the passed word. This
+ * uses the summary level to skip over full words 32 at a time. Returns the
+ * word index or free_words if there are no free clusters past word.
+ */
+uint32_t _rsh_fat16_free_map_next_word(uint32_t word){
+
+  uint32_t sword = word / 32;
+  uint32_t summary;
+
+  if ( word >= fat16_fs.free_words )
+    return fat16_fs.free_words;
+
+  /* Mask off the summary bits for words before the one we want. */
+  summary = fat16_fs.free_summary[sword] & (~0U << (word % 32));
+
+  while ( ! summary ){
+    if ( ++sword * 32 >= fat16_fs.free_words )
+      return fat16_fs.free_words;
+    summary = fat16_fs.free_summary[sword];
+  }
+
+  return sword * 32 + __builtin_ctz(summary);
+
+}
+
+/*
+ * Finds an open cluster. Thats it. The cluster you get may be filled with
+ * crap. Call _rsh_fat16_find_open_cluster() to get a cleared cluster. This
+ * requires a write to the disk drive though.
+ *
+ * The search starts at the free_hint and wraps around to the start of the FAT
+ * so that successive allocations walk forward through the disk. The hint is
+ * left pointing just past the cluster we return.
+ */
+int __rsh_fat16_find_open_cluster(uint32_t *addr){
+
+  uint32_t word;
+  uint32_t bits;
+  uint32_t hint;
+
+  /* This is where a growing image notices it's getting full. */
+  if ( _rsh_fat16_make_room(1) )
+    return RSH_ERR;
+
+  if ( ! fat16_fs.free_map )
+    return _rsh_fat16_scan_open_cluster(addr);
+
+  hint = fat16_fs.free_hint;
+  if ( hint >= fat16_fs.fat_entries )
+    hint = 0;
+
+  /* First check the rest of the word the hint lands in. */
+  word = hint / 32;
+  bits = fat16_fs.free_map[word] & (~0U << (hint % 32));
+
+  /* Then anything after that, then wrap around. */
+  if ( ! bits ){
+    word = _rsh_fat16_free_map_next_word(word + 1);
+    if ( word >= fat16_fs.free_words )
+      word = _rsh_fat16_free_map_next_word(0);
+    if ( word >= fat16_fs.free_words )
+      rsh_fat16_badness(); /* free_clusters says otherwise. */
+    bits = fat16_fs.free_map[word];
+  }
+
+  *addr = word * 32 + __builtin_ctz(bits);
+  fat16_fs.free_hint = *addr + 1;
+
+  return RSH_OK;
+
+}
+
 /*
  * Find and return the first available cluster. This will only fail if there
  * are no more free clusters in the file system. :(. On success, *addr will
@@ -146,35 +269,139 @@ int _rsh_fat16_find_open_cluster(uint32_t *addr){
     return err;
 
   FAT_WIPE_CLUSTER(FAT_CLUSTER_TO_ADDR(*addr));
+  rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(*addr), FAT_CLUSTER_SIZE);
   return err;
 
 }
 
 /*
- * Locate a child node in the specified directory table. It is assumed that the
- * cluster pointed to by dir_table is the start of the dir table. We will 
- * assume the calling function did proper error checking. If no child with the 
- * specified name was found then NULL is returned. Otherwise, the address of
- * the child's dirent on the file system is returned.
+ * Look for free runs in the clusters [from, to). Stops as soon as it finds a
+ * run of want clusters, otherwise leaves the longest run it saw in *best.
  */
-struct rsh_fat_dirent *_rsh_fat16_locate_child(const char *child, 
-					       uint32_t dir_table){
+void _rsh_fat16_run_scan(uint32_t from, uint32_t to, uint32_t want,
+			 uint32_t *best_start, uint32_t *best_len){
+
+  uint32_t i = from;
+  uint32_t run;
+  uint32_t bits;
+
+  while ( i < to && *best_len < want ){
+
+    /* Skip to the next free cluster. */
+    bits = fat16_fs.free_map[i / 32] >> (i % 32);
+    if ( ! bits ){
+      i = (i / 32 + 1) * 32;
+      continue;
+    }
+    i += __builtin_ctz(bits);
+    if ( i >= to )
+      break;
+
+    /* And see how far it goes. */
+    run = i;
+    while ( i < to && i - run < want &&
+	    (fat16_fs.free_map[i / 32] & (1U << (i % 32))) )
+      i++;
+
+    if ( i - run > *best_len ){
+      *best_start = run;
+      *best_len = i - run;
+    }
+
+  }
+
+}
+
+/*
+ * Find a run of free clusters for an allocation of want clusters. We take the
+ * first run at or after the free hint that is long enough, or failing that
+ * the longest run on the disk. *len gets the length of the run, which is
+ * never more than want. Without the free map we can only hand out one
+ * cluster at a time.
+ */
+int _rsh_fat16_find_open_run(uint32_t want, uint32_t *start, uint32_t *len){
+
+  uint32_t hint;
+
+  if ( ! want )
+    return RSH_ERR;
+
+  if ( ! fat16_fs.free_map ){
+    *len = 1;
+    return __rsh_fat16_find_open_cluster(start);
+  }
+
+  /* Short of want is fine as long as there's something. */
+  _rsh_fat16_make_room(want);
+  if ( ! fat16_fs.free_clusters )
+    return RSH_ERR;
+
+  hint = fat16_fs.free_hint;
+  if ( hint >= fat16_fs.fat_entries )
+    hint = 0;
+
+  *len = 0;
+  _rsh_fat16_run_scan(hint, fat16_fs.fat_entries, want, start, len);
+  _rsh_fat16_run_scan(0, hint, want, start, len);
+  if ( ! *len )
+    rsh_fat16_badness(); /* free_clusters says otherwise. */
+
+  fat16_fs.free_hint = *start + *len;
+  return RSH_OK;
+
+}
+
+/*
+ * Allocate a cleared cluster and tack it onto the end of the chain that parent
+ * is in. If parent is FAT_TERM then the new cluster starts a chain of its own.
+ * Returns the index of the new cluster or FAT_TERM if the disk is full.
+ */
+fat_t rsh_fat16_alloc_cluster(fat_t parent){
+
+  uint32_t cluster;
+
+  if ( _rsh_fat16_find_open_cluster(&cluster) )
+    return FAT_TERM;
+
+  rsh_fat16_set_entry(cluster, FAT_TERM);
+  if ( parent != FAT_TERM )
+    rsh_fat16_set_entry(_rsh_fat16_follow_head(parent, -1), cluster);
+
+  return cluster;
+
+}
+
+/*
+ * The slow way to find a child: look at every dirent in the directory. Only
+ * used when there's no memory for a directory index.
+ */
+struct rsh_fat_dirent *_rsh_fat16_scan_child(const char *child, 
+					     uint32_t dir_table){
 
-  int i;
   uint32_t clust = dir_table;
+  uint32_t len = strlen(child);
+  uint16_t hash = _rsh_fat16_name_hash(child);
   struct rsh_fat_dirent *child_addr = NULL;
-  struct rsh_fat_dirent *dir_entries;
+  struct rsh_fat_dirent *ent;
+  struct rsh_fat_drec *rec;
 
   do {
 
   start:
-    /* Search the cluster. */
-    dir_entries = FAT_CLUSTER_TO_ADDR(clust);
-    for ( i = 0; i < fat16_fs.dir_per_cluster; i++){
+    /* Search the cluster. Compact records say enough about their names to
+     * pass over most of them without a strcmp(). */
+    for ( ent = _rsh_fat16_dirent_next(clust, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(clust, ent) ){
+
+      if ( FAT_COMPACT_DIRS ){
+	rec = FAT_DIRENT_DREC(ent);
+	if ( rec->name_len != len || rec->hash != hash )
+	  continue;
+      }
 
       /* We have a winner. */
-      if ( strcmp(child, dir_entries[i].name) == 0 ){
-	child_addr = &(dir_entries[i]);
+      if ( strcmp(child, FAT_DIRENT_NAME(ent)) == 0 ){
+	child_addr = ent;
 	break;
       }
 
@@ -197,13 +424,99 @@ struct rsh_fat_dirent *_rsh_fat16_locate_child(const char *child,
 }
 
 /*
- * Locate an empty dirent spot in a directory table.
+ * Locate a child node in the specified directory table. It is assumed that the
+ * cluster pointed to by dir_table is the start of the dir table. We will 
+ * assume the calling function did proper error checking. If no child with the 
+ * specified name was found then NULL is returned. Otherwise, the address of
+ * the child's dirent on the file system is returned.
+ */
+struct rsh_fat_dirent *_rsh_fat16_locate_child(const char *child, 
+					       uint32_t dir_table){
+
+  uint32_t root;
+  struct rsh_fat16_dindex *index;
+
+  /* Empty slots have empty names, but they aren't anybody. */
+  if ( ! *child )
+    return NULL;
+
+  root = _rsh_fat16_tree_root(dir_table);
+  if ( root )
+    return _rsh_fat16_tree_lookup(root, child);
+
+  index = _rsh_fat16_dindex_get(dir_table);
+  if ( ! index )
+    return _rsh_fat16_scan_child(child, dir_table);
+
+  return _rsh_fat16_dindex_lookup(index, child);
+
+}
+
+/*
+ * Locate an empty dirent spot in a directory table that name will fit in.
  */
-inline struct rsh_fat_dirent *_rsh_fat16_find_open_dirent(uint32_t dir_tbl){
+static struct rsh_fat_dirent *_rsh_fat16_find_open_dirent(uint32_t dir_tbl,
+							  const char *name){
 
-  char empty = 0;
-  
-  return _rsh_fat16_locate_child(&empty, dir_tbl);
+  int any;
+  uint32_t clust = dir_tbl;
+  struct rsh_fat_dirent *slot;
+  struct rsh_fat16_dindex *index;
+
+  if ( _rsh_fat16_tree_root(dir_tbl) )
+    return _rsh_fat16_tree_room(dir_tbl, name);
+
+  index = _rsh_fat16_dindex_get(dir_tbl);
+  if ( index )
+    return _rsh_fat16_dindex_open_slot(index, name);
+
+  for ( ; clust != FAT_TERM; clust = rsh_fat16_get_entry(clust) ){
+    if ( clust == FAT_FREE || clust == FAT_RESERVED )
+      rsh_fat16_badness();
+    slot = _rsh_fat16_dirent_room(clust, name, &any);
+    if ( slot )
+      return slot;
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Get a slot that name fits in for a new dirent in dir_table, growing the
+ * table by a cluster if it's full. Returns NULL with errno set if the name is
+ * too long for the image (ENAMETOOLONG) or the disk is full (ENOSPC). The name
+ * isn't filled in.
+ */
+struct rsh_fat_dirent *_rsh_fat16_new_dirent(uint32_t dir_table,
+					     const char *name){
+
+  uint32_t cluster;
+  struct rsh_fat_dirent *slot;
+
+  if ( strlen(name) > FAT_NAME_MAX ){
+    errno = ENAMETOOLONG;
+    return NULL;
+  }
+
+  slot = _rsh_fat16_find_open_dirent(dir_table, name);
+  if ( slot )
+    return slot;
+
+  /* Tack a cluster onto the dir table. */
+  cluster = rsh_fat16_alloc_cluster(dir_table);
+  if ( cluster == FAT_TERM ){
+    errno = ENOSPC;
+    return NULL;
+  }
+  _rsh_fat16_journal_log(FAT_CLUSTER_TO_ADDR(cluster), FAT_CLUSTER_SIZE, 1);
+  _rsh_fat16_dir_cluster(cluster);
+  _rsh_fat16_dindex_add_cluster(dir_table, cluster);
+
+  slot = _rsh_fat16_find_open_dirent(dir_table, name);
+  if ( ! slot )
+    errno = ENOSPC;
+  return slot;
 
 }
 
@@ -212,48 +525,87 @@ inline struct rsh_fat_dirent *_rsh_fat16_find_open_dirent(uint32_t dir_tbl){
  * is copied into the rsh_fat_dirent struct passed to this function in ent. If
  * an error occurs, then a negative return value will result. Check errno for
  * the specific error.
+ *
+ * Paths are parsed like _rsh_fs_parse_path() does it: the path ends at the
+ * first empty node, so "/a/" and "/a//b" are both just "/a". We start from
+ * the longest prefix of the path in the dentry cache and cache everything we
+ * resolve past that.
  */
 int _rsh_fat16_path_to_dirent(const char *path, struct rsh_fat_dirent *ent,
 			      struct rsh_fat_dirent **fs_addr){
 
-  uint32_t dir_tbl = fat16_fs.fs_header.root_offset;
+  int len, end, start;
+  uint32_t dir_tbl;
+  char node[112];
+  struct rsh_fat16_dentry *dentry = NULL;
   struct rsh_fat_dirent *child;
 
-  /* Start with the root directory entry and start looking up path nodes. */
-  char *node;
-  char *copy = NULL, *next = NULL;
-  while ( (node = _rsh_fs_parse_path(&copy, &next, path)) != NULL){
+  /* Figure out where the path really ends. */
+  for ( len = 1; path[len]; len++ )
+    if ( path[len] == '/' && (path[len-1] == '/' || ! path[len+1]) )
+      break;
+  if ( len > 1 && path[len-1] == '/' )
+    len--;
+
+  /* Find the longest prefix we know about. */
+  end = len;
+  while ( end > 1 ){
+    dentry = _rsh_fat16_dcache_lookup(path, end);
+    if ( dentry )
+      break;
+    while ( --end > 0 && path[end] != '/' )
+      ;
+  }
 
-    child = _rsh_fat16_locate_child(node, dir_tbl);
-    if ( ! child ){
-      errno = ENOENT;
+  if ( dentry ){
+    if ( ! dentry->slot ){
+      errno = dentry->err;
       return -1;
     }
+    child = dentry->slot;
+  } else {
+    child = _rsh_fat16_locate_child(".", fat16_fs.fs_header.root_offset);
+    if ( ! child )
+      rsh_fat16_badness();
+    end = 0;
+  }
 
-    /* We have a directory as part of the path, just set the dir_tbl to the
-     * new directorie's table, and try again. */
-    if ( child->type == FAT_DIR ){
-      dir_tbl = child->index;
-      continue;
+  /* And look up whatever is left one node at a time. */
+  while ( end < len ){
+
+    /* We have a regular file node. This is a problem if there are more nodes
+     * in the path. */
+    if ( child->type != FAT_DIR ){
+      if ( child->type != FAT_FILE && child->type != FAT_ZFILE )
+	rsh_fat16_badness();
+      errno = ENOTDIR;
+      return -1;
     }
 
-    /* Check if we have a corrupt file system. */
-    if ( child->type != FAT_FILE )
-      rsh_fat16_badness();
+    start = end + 1;
+    for ( end = start; end < len && path[end] != '/'; end++ )
+      ;
+
+    /* Names that long can't be on the disk. */
+    dir_tbl = child->index;
+    child = NULL;
+    if ( end - start < sizeof(node) ){
+      memcpy(node, path + start, end - start);
+      node[end - start] = 0;
+      child = _rsh_fat16_locate_child(node, dir_tbl);
+    }
 
-    /* OK, we have a regular file node. This is a problem if there are more
-     * nodes in the path. */
-    if ( _rsh_fs_parse_path(&copy, &next, path) != NULL ){
-      errno = ENOTDIR;
+    if ( ! child ){
+      _rsh_fat16_dcache_add(path, end, NULL, ENOENT);
+      errno = ENOENT;
       return -1;
-    } else {
-      break;
     }
+    _rsh_fat16_dcache_add(path, end, child, 0);
 
   }
 
   /* If we are here, then the dirent is valid. */
-  if ( ent)
+  if ( ent )
     *ent = *child;
   if ( fs_addr )
     *fs_addr = child;
@@ -262,37 +614,72 @@ int _rsh_fat16_path_to_dirent(const char *path, struct rsh_fat_dirent *ent,
 
 }
 
-void _rsh_fat16_wipe_file(struct rsh_fat_dirent *dirent){
+/*
+ * Set the size of a file. Version 0 images only have the bottom 32 bits;
+ * writers are expected to have stopped at FAT_MAX_FILE_SIZE.
+ */
+void _rsh_fat16_set_size(struct rsh_fat_dirent *dirent, uint64_t size){
+
+  if ( fat16_fs.fs_header.version && ! FAT_DIRENT_PACKED(dirent) )
+    dirent->size_hi = size >> 32;
+  dirent->size = size;
+  rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+
+}
+
+/*
+ * Cut a file down to one empty cluster. If the first cluster is shared with
+ * another file the file gets a fresh one instead, which can fail for lack of
+ * space. On images that pack small files it doesn't need any clusters at all.
+ */
+int _rsh_fat16_wipe_file(struct rsh_fat_dirent *dirent){
 
-  fat_t prev;
   fat_t current;
+  uint32_t head;
 
-  /* Set the first entry in the chain to FAT_TERM. We want to keep at least
-   * one cluster for use. */
-  current = rsh_fat16_get_entry(dirent->index);
-  rsh_fat16_set_entry(dirent->index, FAT_TERM);
-  if ( current == FAT_TERM )
-    return;
+  /* Whatever's left is an ordinary (empty) file. */
+  if ( dirent->type == FAT_ZFILE ){
+    dirent->type = FAT_FILE;
+    rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+  }
 
-  /* Iterate across a FAT table chain, wiping the FAT entries. */
-  current = rsh_fat16_get_entry(current);
-  prev = current;
-  do {
+  if ( FAT_DIRENT_PACKED(dirent) ){
+    _rsh_fat16_pack_free(dirent);
+    return RSH_OK;
+  }
 
-    current = rsh_fat16_get_entry(prev);
-    rsh_fat16_set_entry(prev, FAT_FREE);
+  _rsh_fat16_chain_changed(dirent->index, NULL);
 
-    /* We are done. */
-    if ( current == FAT_TERM )
-      break;
-    
-    /* This is BADNESS!!! */
-    if ( current == FAT_FREE )
-      rsh_fat16_badness();
+  if ( fat16_fs.pack_max ){
+    current = dirent->index;
+    dirent->index = FAT_PACKED;
+    dirent->size_hi = 0;
+    rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+    _rsh_fat16_release(current);
+    return RSH_OK;
+  }
 
-    prev = current;
+  if ( _rsh_fat16_refs(dirent->index) ){
+    if ( __rsh_fat16_find_open_cluster(&head) ){
+      errno = ENOSPC;
+      return RSH_ERR;
+    }
+    rsh_fat16_set_entry(head, FAT_TERM);
+    _rsh_fat16_release(dirent->index);
+    dirent->index = head;
+    rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+    return RSH_OK;
+  }
+
+  /* Set the first entry in the chain to FAT_TERM. We want to keep at least
+   * one cluster for use. Then give back the rest, or at least as much of it
+   * as isn't shared. */
+  current = rsh_fat16_get_entry(dirent->index);
+  rsh_fat16_set_entry(dirent->index, FAT_TERM);
+  _rsh_fat16_set_gap(dirent->index, 0);
+  _rsh_fat16_release(current);
 
-  } while ( 1 );
+  return RSH_OK;
 
 }
 
@@ -347,6 +734,133 @@ uint32_t _rsh_fat16_find_cluster_index(uint32_t head, int index){
 
 }
 
+/*
+ * Make room for at least one more cluster in a file's cluster map.
+ */
+int _rsh_fat16_file_grow(struct rsh_fat16_file *file){
+
+  uint32_t *tmp;
+  uint32_t size = file->size ? file->size * 2 : 16;
+
+  if ( file->length < file->size )
+    return RSH_OK;
+
+  tmp = (uint32_t *)realloc(file->clusters, size * sizeof(uint32_t));
+  if ( ! tmp ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+  file->clusters = tmp;
+
+  tmp = (uint32_t *)realloc(file->logical, size * sizeof(uint32_t));
+  if ( ! tmp ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+  file->logical = tmp;
+
+  file->size = size;
+  return RSH_OK;
+
+}
+
+/*
+ * Return the cluster that is index clusters into the file, FAT_HOLE if that
+ * part of the file is a hole, or FAT_TERM if the chain is not that long.
+ * FAT_RESERVED comes back if we ran out of memory growing the map (errno will
+ * be ENOMEM). file->pos is left at the last map entry at or before index. The
+ * map is extended from the last cluster we know about, so reading or writing
+ * a file front to back only ever follows each link in the chain once. Things
+ * that change the file's chain throw the map away as they do it (see
+ * _rsh_fat16_chain_changed()); the few that might change anybody's bump
+ * chain_gen and then we start over.
+ */
+uint32_t _rsh_fat16_file_cluster(struct rsh_fat16_file *file, uint32_t index){
+
+  fat_t next;
+  uint32_t last;
+  uint32_t lo, hi, mid;
+
+  if ( file->gen != fat16_fs.chain_gen ){
+    file->length = 0;
+    file->gen = fat16_fs.chain_gen;
+  }
+
+  if ( ! file->length ){
+    if ( _rsh_fat16_file_grow(file) )
+      return FAT_RESERVED;
+    file->clusters[0] = file->dirent->index;
+    file->logical[0] = 0;
+    file->length = 1;
+    file->pos = 0;
+    file->shared = _rsh_fat16_refs(file->dirent->index) ? 0 : FAT_UNSHARED;
+  }
+
+  while ( index > file->logical[file->length - 1] ){
+
+    last = file->clusters[file->length - 1];
+    next = rsh_fat16_get_entry(last);
+    if ( next == FAT_TERM ){
+      file->pos = file->length - 1;
+      return FAT_TERM;
+    }
+
+    if ( next == FAT_FREE || next == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    if ( _rsh_fat16_file_grow(file) )
+      return FAT_RESERVED;
+    if ( file->shared == FAT_UNSHARED && _rsh_fat16_refs(next) )
+      file->shared = file->length;
+    file->logical[file->length] = file->logical[file->length - 1] + 1 +
+      _rsh_fat16_gap(last);
+    file->clusters[file->length++] = next;
+
+  }
+
+  /* Usually it's the same entry as last time or the next one. If not, go
+   * look for it. */
+  lo = file->pos;
+  if ( lo >= file->length || file->logical[lo] > index )
+    lo = 0;
+  if ( lo + 1 < file->length && file->logical[lo + 1] <= index ){
+    lo++;
+    if ( lo + 1 < file->length && file->logical[lo + 1] <= index ){
+      hi = file->length - 1;
+      while ( lo < hi ){
+	mid = lo + (hi - lo + 1) / 2;
+	if ( file->logical[mid] <= index )
+	  lo = mid;
+	else
+	  hi = mid - 1;
+      }
+    }
+  }
+
+  file->pos = lo;
+  return file->logical[lo] == index ? file->clusters[lo] : FAT_HOLE;
+
+}
+
+/*
+ * Note that a cluster has been linked onto the end of a file's chain. The map
+ * must already cover the whole chain, which it will if the caller just got
+ * FAT_TERM back from _rsh_fat16_file_cluster().
+ */
+int _rsh_fat16_file_append(struct rsh_fat16_file *file, uint32_t cluster){
+
+  uint32_t last = file->length - 1;
+
+  if ( _rsh_fat16_file_grow(file) )
+    return RSH_ERR;
+
+  file->logical[file->length] = file->logical[last] + 1 +
+    _rsh_fat16_gap(file->clusters[last]);
+  file->clusters[file->length++] = cluster;
+  return RSH_OK;
+
+}
+
 /*
  * Read data from a file. Store that data in buf. Return the number of bytes
  * read.
@@ -358,33 +872,43 @@ ssize_t rsh_fat16_read(struct rsh_file *file, void *buf, size_t count){
   void *buffer = buf;
   void *cluster_io;
   uint32_t cluster;
-  uint32_t clusters;
   uint32_t cluster_addr;
   uint32_t cluster_offset;
-  struct rsh_fat_dirent *file_ent = file->local;
+  struct rsh_fat16_file *fat_file = file->local;
+  uint64_t size = FAT_DIRENT_SIZE(fat_file->dirent);
 
-  /* Figure out how many clusters are in the file. */
-  clusters = file_ent->size / FAT_CLUSTER_SIZE;
-  if ( clusters * FAT_CLUSTER_SIZE < file_ent->size )
-    clusters++;
-  if ( file_ent->size == 0 )
-    clusters = 1;
+  if ( FAT_DIRENT_PACKED(fat_file->dirent) )
+    return _rsh_fat16_pack_read(file, buf, count);
+  if ( fat_file->dirent->type == FAT_ZFILE )
+    return _rsh_fat16_zip_read(file, buf, count);
 
-  while ( remaining > 0 && (file->offset < file_ent->size) ){
+  _rsh_fat16_stream_hint(file, count);
+
+  while ( remaining > 0 && (file->offset < size) ){
 
     /* First find the source cluster. */
     cluster = file->offset / FAT_CLUSTER_SIZE;
     cluster_offset = file->offset % FAT_CLUSTER_SIZE;
-    cluster_addr = _rsh_fat16_find_cluster_index(file_ent->index, cluster);
-    cluster_io = FAT_CLUSTER_TO_ADDR(cluster_addr) + cluster_offset;
+    cluster_addr = _rsh_fat16_file_cluster(fat_file, cluster);
+    if ( cluster_addr == FAT_RESERVED )
+      return -1;
+    if ( cluster_addr == FAT_TERM )
+      rsh_fat16_badness(); /* The file is bigger than its chain. */
     xfer_size = FAT_CLUSTER_SIZE - cluster_offset;
     if ( xfer_size > remaining )
       xfer_size = remaining;
-    if ( (file_ent->size - file->offset) < xfer_size )
-      xfer_size = file_ent->size - file->offset;
+    if ( (size - file->offset) < xfer_size )
+      xfer_size = size - file->offset;
 
-    /* Now we can do the transfer. */
-    memcpy(buffer, cluster_io, xfer_size);
+    /* Now we can do the transfer. Holes are all zeros. */
+    if ( cluster_addr == FAT_HOLE ){
+      memset(buffer, 0, xfer_size);
+    } else {
+      if ( _rsh_fat16_csum_check(cluster_addr) )
+	return count - remaining ? count - remaining : -1;
+      cluster_io = FAT_CLUSTER_TO_ADDR(cluster_addr) + cluster_offset;
+      memcpy(buffer, cluster_io, xfer_size);
+    }
 
     /* Do some book keeping. */
     file->offset += xfer_size;
@@ -397,6 +921,252 @@ ssize_t rsh_fat16_read(struct rsh_file *file, void *buf, size_t count){
 
 }
 
+/*
+ * Like a read, but instead of copying the data out of the image we hand back
+ * segments pointing into the mmap()'ed image. Clusters that happen to sit
+ * next to each other on the disk end up in the same segment. Returns the
+ * number of segments filled in.
+ */
+int rsh_fat16_readv_map(struct rsh_file *file, struct iovec *iov, int iovcnt,
+			size_t count){
+
+  int segs = 0;
+  size_t xfer_size;
+  void *cluster_io;
+  uint32_t cluster;
+  uint32_t cluster_addr;
+  uint32_t cluster_offset;
+  struct rsh_fat16_file *fat_file = file->local;
+  uint64_t size = FAT_DIRENT_SIZE(fat_file->dirent);
+
+  if ( FAT_DIRENT_PACKED(fat_file->dirent) )
+    return _rsh_fat16_pack_readv_map(file, iov, iovcnt, count);
+  if ( fat_file->dirent->type == FAT_ZFILE )
+    return _rsh_fat16_zip_readv_map(file, iov, iovcnt, count);
+
+  _rsh_fat16_stream_hint(file, count);
+
+  while ( count > 0 && (file->offset < size) ){
+
+    cluster = file->offset / FAT_CLUSTER_SIZE;
+    cluster_offset = file->offset % FAT_CLUSTER_SIZE;
+    cluster_addr = _rsh_fat16_file_cluster(fat_file, cluster);
+    if ( cluster_addr == FAT_RESERVED )
+      return segs ? segs : -1;
+    if ( cluster_addr == FAT_TERM )
+      rsh_fat16_badness(); /* The file is bigger than its chain. */
+    if ( cluster_addr == FAT_HOLE )
+      cluster_io = fat16_fs.zero_cluster + cluster_offset;
+    else if ( _rsh_fat16_csum_check(cluster_addr) )
+      return segs ? segs : -1;
+    else
+      cluster_io = FAT_CLUSTER_TO_ADDR(cluster_addr) + cluster_offset;
+    xfer_size = FAT_CLUSTER_SIZE - cluster_offset;
+    if ( xfer_size > count )
+      xfer_size = count;
+    if ( (size - file->offset) < xfer_size )
+      xfer_size = size - file->offset;
+
+    /* Either grow the last segment or start a new one. */
+    if ( segs && iov[segs-1].iov_base + iov[segs-1].iov_len == cluster_io ){
+      iov[segs-1].iov_len += xfer_size;
+    } else {
+      if ( segs == iovcnt )
+	break;
+      iov[segs].iov_base = cluster_io;
+      iov[segs].iov_len = xfer_size;
+      segs++;
+    }
+
+    file->offset += xfer_size;
+    count -= xfer_size;
+
+  }
+
+  return segs;
+
+}
+
+/*
+ * Give a file enough clusters for len more bytes past its offset. The new
+ * clusters are taken in as few contiguous runs as we can find and linked onto
+ * the chain a run at a time. The file's size doesn't change; anything left
+ * over at close time is given back.
+ */
+int rsh_fat16_fallocate(struct rsh_file *file, off_t len){
+
+  uint32_t i;
+  uint32_t need;
+  uint32_t start;
+  uint32_t run;
+  uint32_t tail;
+  uint32_t end;
+  uint32_t first;
+  struct rsh_fat16_file *fat_file = file->local;
+
+  if ( len <= 0 )
+    return 0;
+
+  if ( file->offset + len > FAT_MAX_FILE_SIZE ){
+    errno = EFBIG;
+    return -1;
+  }
+  _rsh_fat16_grow_ahead(len / FAT_CLUSTER_SIZE + 1);
+
+  /* A compressed file gets uncompressed by the first thing that changes
+   * it. */
+  if ( _rsh_fat16_unzip(fat_file) )
+    return -1;
+
+  /* A packed file has all the room it needs until it's too big to pack. */
+  if ( FAT_DIRENT_PACKED(fat_file->dirent) ){
+    if ( file->offset + len <= fat16_fs.pack_max )
+      return 0;
+    if ( _rsh_fat16_unpack(fat_file) )
+      return -1;
+  }
+
+  need = (file->offset + len + FAT_CLUSTER_SIZE - 1) / FAT_CLUSTER_SIZE;
+
+  /* Already big enough? This also leaves the map covering the whole chain. */
+  tail = _rsh_fat16_file_cluster(fat_file, need - 1);
+  if ( tail == FAT_RESERVED )
+    return -1;
+  if ( tail != FAT_TERM )
+    return 0;
+
+  /* The tail we're about to link onto has to be ours alone. */
+  if ( fat_file->shared != FAT_UNSHARED &&
+       _rsh_fat16_unshare(fat_file, fat_file->length - 1) )
+    return -1;
+
+  /* If the offset is past the end of the chain, what's in between can stay a
+   * hole. */
+  end = fat_file->logical[fat_file->length - 1] + 1;
+  first = end;
+  if ( fat16_fs.fs_header.holes_offset &&
+       file->offset / FAT_CLUSTER_SIZE > end )
+    first = file->offset / FAT_CLUSTER_SIZE;
+
+  if ( _rsh_fat16_make_room(need - first) )
+    return -1;
+
+  fat_file->prealloc = 1;
+  fat_file->dirty = 1;
+  _rsh_fat16_set_gap(fat_file->clusters[fat_file->length - 1], first - end);
+  for ( ; ; ){
+
+    /* Where the next cluster linked on will land. */
+    tail = fat_file->clusters[fat_file->length - 1];
+    end = fat_file->logical[fat_file->length - 1] + 1 + _rsh_fat16_gap(tail);
+    if ( end >= need )
+      break;
+
+    if ( _rsh_fat16_find_open_run(need - end, &start, &run) ){
+      errno = ENOSPC;
+      return -1;
+    }
+
+    /* Chain the run together and then hang it off the end of the file. */
+    for ( i = 0; i < run; i++ ){
+      rsh_fat16_set_entry(start + i, i + 1 < run ? start + i + 1 : FAT_TERM);
+      if ( _rsh_fat16_file_append(fat_file, start + i) )
+	return -1;
+    }
+    rsh_fat16_set_entry(tail, start);
+
+  }
+
+  return 0;
+
+}
+
+/*
+ * Give back any clusters past the end of a file. These come from fallocate
+ * asking for more than ended up being written.
+ */
+void _rsh_fat16_file_trim(struct rsh_fat16_file *fat_file){
+
+  uint32_t keep;
+  uint32_t last;
+  uint32_t next;
+
+  /* Somebody else may have truncated it down to packed. */
+  if ( FAT_DIRENT_PACKED(fat_file->dirent) )
+    return;
+
+  keep = (FAT_DIRENT_SIZE(fat_file->dirent) + FAT_CLUSTER_SIZE - 1) /
+    FAT_CLUSTER_SIZE;
+  if ( ! keep )
+    keep = 1;
+
+  /* A file never ends in a hole, so this is a real cluster. */
+  last = _rsh_fat16_file_cluster(fat_file, keep - 1);
+  if ( last == FAT_TERM || last == FAT_RESERVED || last == FAT_HOLE )
+    return;
+
+  next = rsh_fat16_get_entry(last);
+  if ( next == FAT_TERM )
+    return;
+
+  /* Don't cut a chain someone else is using. */
+  if ( fat_file->pos >= fat_file->shared ){
+    if ( _rsh_fat16_unshare(fat_file, fat_file->pos) )
+      return;
+    last = fat_file->clusters[fat_file->pos];
+  }
+
+  _rsh_fat16_chain_changed(fat_file->clusters[0], fat_file);
+  rsh_fat16_set_entry(last, FAT_TERM);
+  _rsh_fat16_set_gap(last, 0);
+  _rsh_fat16_release(next);
+
+}
+
+/*
+ * Zero the bytes from..to of a file that are in clusters it already has. This
+ * is for writes past the end: whatever was left in the clusters there (the
+ * rest of the last one, anything fallocate added) has to read back as zeros
+ * once the file covers it. There are no holes past the end of a file so this
+ * stops at the end of the chain.
+ */
+int _rsh_fat16_zero_range(struct rsh_fat16_file *fat_file, uint64_t from,
+			  uint64_t to){
+
+  uint32_t index;
+  uint32_t cluster;
+  uint32_t start, end;
+
+  for ( index = from / FAT_CLUSTER_SIZE;
+	(uint64_t)index * FAT_CLUSTER_SIZE < to; index++ ){
+
+    cluster = _rsh_fat16_file_cluster(fat_file, index);
+    if ( cluster == FAT_RESERVED )
+      return RSH_ERR;
+    if ( cluster == FAT_TERM )
+      break;
+    if ( cluster == FAT_HOLE )
+      continue;
+
+    if ( fat_file->pos >= fat_file->shared ){
+      if ( _rsh_fat16_unshare(fat_file, fat_file->pos) )
+	return RSH_ERR;
+      cluster = fat_file->clusters[fat_file->pos];
+    }
+
+    start = from > (uint64_t)index * FAT_CLUSTER_SIZE ?
+      from % FAT_CLUSTER_SIZE : 0;
+    end = to < (uint64_t)(index + 1) * FAT_CLUSTER_SIZE ?
+      to % FAT_CLUSTER_SIZE : FAT_CLUSTER_SIZE;
+    memset(FAT_CLUSTER_TO_ADDR(cluster) + start, 0, end - start);
+    rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster) + start, end - start);
+
+  }
+
+  return RSH_OK;
+
+}
+
 /*
  * Write some data to a file. We are passed a rsh_file struct that describes
  * the file. All required data for accessing the file should be in the passed
@@ -406,91 +1176,147 @@ ssize_t rsh_fat16_read(struct rsh_file *file, void *buf, size_t count){
  */
 ssize_t rsh_fat16_write(struct rsh_file *file, const void *buf, size_t count){
 
-  int err;
-  int remaining = count;
-  int xfer_size;
-  void *cio;
-  void *cmem;
+  size_t remaining = count;
+  size_t xfer_size;
   uint32_t cluster;
   uint32_t cluster_addr;
   uint32_t cluster_offset;
   uint32_t cluster_index;
-  uint32_t clusters;
+  uint32_t tail;
   const void *buffer = buf;
-  struct rsh_fat_dirent *file_ent = file->local;
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat_dirent *file_ent = fat_file->dirent;
+  uint64_t size = FAT_DIRENT_SIZE(file_ent);
+  uint64_t max = FAT_MAX_FILE_SIZE;
+
+  /* Version 0 images can't hold a file past 4GB, and nothing can have more
+   * clusters than a cluster number can count. */
+  if ( max / FAT_CLUSTER_SIZE >= FAT_RESERVED )
+    max = (uint64_t)(FAT_RESERVED - 1) * FAT_CLUSTER_SIZE;
+  if ( file->offset + count > max ){
+    if ( file->offset >= max ){
+      errno = EFBIG;
+      return -1;
+    }
+    remaining = count = max - file->offset;
+  }
 
-  cmem = malloc(FAT_CLUSTER_SIZE);
-  if ( ! cmem ){
-    errno = ENOMEM;
-    return -1;
+  /* If what goes past the end needs the image to grow, that happens now
+   * rather than halfway through. */
+  if ( file->offset + count > size )
+    _rsh_fat16_grow_ahead((file->offset + count - size) / FAT_CLUSTER_SIZE +
+			  1);
+
+  if ( file_ent->type == FAT_ZFILE ){
+    if ( _rsh_fat16_unzip(fat_file) )
+      return -1;
+    size = FAT_DIRENT_SIZE(file_ent);
+  }
+  _rsh_fat16_zip_changed(file_ent, file->offset < size ? file->offset : size);
+
+  /* Small enough to stay packed? If not (or there's no room to keep it
+   * packed) it gets a chain like any other file. */
+  if ( FAT_DIRENT_PACKED(file_ent) ){
+    if ( file->offset + count <= fat16_fs.pack_max &&
+	 _rsh_fat16_pack_write(file, buf, count) >= 0 ){
+      remaining = 0;
+      goto out;
+    }
+    if ( _rsh_fat16_unpack(fat_file) )
+      return -1;
+    size = FAT_DIRENT_SIZE(file_ent);
   }
 
-  /* Figure out how many clusters are in the file. */
-  clusters = file_ent->size / FAT_CLUSTER_SIZE;
-  if ( clusters * FAT_CLUSTER_SIZE < file_ent->size )
-    clusters++;
-  if ( file_ent->size == 0 )
-    clusters = 1;
-  
-  /* Deal with the write. */
+  if ( file->offset > size &&
+       _rsh_fat16_zero_range(fat_file, size, file->offset) )
+    return -1;
+
+  /* Deal with the write. The image is mapped so we just copy the caller's
+   * bytes straight into the right spot in each cluster. Nothing else in the
+   * cluster gets touched. */
   while ( remaining > 0 ){
 
     cluster = file->offset / FAT_CLUSTER_SIZE;
-
-    /* First we prepare the source cluster for the transfer. We will only
-     * write to the FS in buffers equal to the cluster size. This makes the
-     * write simpler. If the file pointer is not on a cluster boundary, we
-     * must first fill the source cluster with the necessary bytes to preserve
-     * the data in the destination cluster. */
     cluster_offset = file->offset % FAT_CLUSTER_SIZE;
-    xfer_size = remaining;
-    if ( xfer_size > FAT_CLUSTER_SIZE )
-      xfer_size = FAT_CLUSTER_SIZE - cluster_offset;
-
-    /* Back up the cluster's storage if we have to. */
-    if ( cluster_offset )
-      memcpy(cmem, 
-	     FAT_CLUSTER_TO_ADDR(_rsh_fat16_find_cluster_index(file_ent->index,
-							       cluster)), 
-	     FAT_CLUSTER_SIZE);
-
-    /* Now copy relevant bytes from the passed buffer into cmem. */
-    memcpy(cmem + cluster_offset, buffer, xfer_size);
-    
-    /* We are now ready to prepare the destination cluster. The goal is to find
-     * an IO address we can copy to. This means we need to figure out how many
-     * clusters into the file we are and then determine if that cluster exists.
-     * If the cluster does not yet exist, we must allocate one. */
-    cluster_addr = _rsh_fat16_find_cluster_index(file_ent->index, cluster);
+    xfer_size = FAT_CLUSTER_SIZE - cluster_offset;
+    if ( xfer_size > remaining )
+      xfer_size = remaining;
 
-    /* If we need to allocate a new cluster, do so here. */
-    if ( cluster_addr == FAT_TERM ){
-      cluster_index = _rsh_fat16_follow_head(file_ent->index, -1);
-      err = __rsh_fat16_find_open_cluster(&cluster_addr);
-      if ( err ){
+    /* We need to find an IO address we can copy to. This means we need to
+     * figure out how many clusters into the file we are and then determine
+     * if that cluster exists. If the cluster does not yet exist, we must
+     * allocate one. Since the map now covers the whole chain, its last
+     * entry is the tail to link on to; anything we skip over on the way
+     * becomes a hole, or on images without holes, zeroed clusters. New
+     * clusters past the end aren't wiped otherwise: anything past the end of
+     * the file is never read back. A shared tail gets copied before anything
+     * is linked onto it. */
+    cluster_addr = _rsh_fat16_file_cluster(fat_file, cluster);
+    if ( cluster_addr == FAT_HOLE &&
+	 _rsh_fat16_fill_hole(fat_file, cluster, &cluster_addr) )
+      goto out;
+    while ( cluster_addr == FAT_TERM ){
+      if ( fat_file->shared != FAT_UNSHARED &&
+	   _rsh_fat16_unshare(fat_file, fat_file->length - 1) )
+	goto out;
+      cluster_index = fat_file->clusters[fat_file->length - 1];
+      tail = fat_file->logical[fat_file->length - 1];
+      if ( __rsh_fat16_find_open_cluster(&cluster_addr) ){
 	errno = ENOSPC;
-	return -1;
+	goto out;
+      }
+      if ( fat16_fs.fs_header.holes_offset )
+	_rsh_fat16_set_gap(cluster_index, cluster - tail - 1);
+      if ( ! fat16_fs.fs_header.holes_offset && tail + 1 < cluster ){
+	FAT_WIPE_CLUSTER(FAT_CLUSTER_TO_ADDR(cluster_addr));
+	rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster_addr), FAT_CLUSTER_SIZE);
+      } else if ( cluster_offset ){
+	memset(FAT_CLUSTER_TO_ADDR(cluster_addr), 0, cluster_offset);
+	rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster_addr), cluster_offset);
       }
       rsh_fat16_set_entry(cluster_index, cluster_addr);
       rsh_fat16_set_entry(cluster_addr, FAT_TERM);
+      if ( _rsh_fat16_file_append(fat_file, cluster_addr) )
+	goto out;
+      cluster_addr = _rsh_fat16_file_cluster(fat_file, cluster);
+    }
+    if ( cluster_addr == FAT_RESERVED )
+      goto out;
+
+    /* Writing a shared cluster gets this file its own copy first. */
+    if ( fat_file->pos >= fat_file->shared ){
+      if ( _rsh_fat16_unshare(fat_file, fat_file->pos) )
+	goto out;
+      cluster_addr = fat_file->clusters[fat_file->pos];
     }
 
-    /* We have the cluster address, get an IO address. */
-    cio = FAT_CLUSTER_TO_ADDR(cluster_addr);
-    memcpy(cio, cmem, FAT_CLUSTER_SIZE);
+    memcpy(FAT_CLUSTER_TO_ADDR(cluster_addr) + cluster_offset, buffer,
+	   xfer_size);
+    rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster_addr) + cluster_offset,
+		    xfer_size);
+    fat_file->dirty = 1;
 
     /* And some book keeping. */
     remaining -= xfer_size;
+    buffer += xfer_size;
     file->offset += xfer_size;
-    if ( file->offset > file_ent->size )
-      file_ent->size = file->offset;
+    if ( file->offset > size ){
+      _rsh_fat16_dindex_resize(fat_file->parent, file->offset - size);
+      size = file->offset;
+      _rsh_fat16_set_size(file_ent, size);
+    }
 
   }
 
-  /* Cleanup. */
-  free(cmem);
+ out:
+  /* Don't let a long write pile up more than the journal can take. */
+  if ( _rsh_fat16_journal_full() )
+    _rsh_fat16_journal_commit();
 
-  return count;
+  /* Like write(), only fail if nothing at all got written. */
+  if ( remaining == count && count )
+    return -1;
+  return count - remaining;
 
 }
 
@@ -504,17 +1330,24 @@ ssize_t rsh_fat16_write(struct rsh_file *file, const void *buf, size_t count){
 int rsh_fat16_readdir(struct rsh_file *file, void *buf, size_t space){
 
   int ents;
-  int ents_per_cluster = FAT_CLUSTER_SIZE / sizeof(struct rsh_fat_dirent);
-  uint32_t cluster;
-  uint32_t ent_index;
+  uint32_t root;
   uint32_t cluster_addr;
   struct dirent *dirent_p = buf;
-  struct rsh_fat_dirent *dir_entries;
-  struct rsh_fat_dirent *file_ent = file->local;
+  struct rsh_fat_dirent *ent;
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat_dirent *file_ent = fat_file->dirent;
   
-  /* This is the state information. */
-  static int next_dirent = 0;
-  static int almost_done = 0;
+  /* This is the state information: which cluster of the directory we're in
+   * and the last dirent in it we looked at. */
+  static uint32_t next_cluster = 0;
+  static struct rsh_fat_dirent *last = NULL;
+
+  /* If empty records got joined up since last time, last may be gone. */
+  static uint32_t joins;
+
+  /* Tree directories are read in name order, picking up after the last name
+   * handed out. */
+  static char last_name[FAT_NAME_ROOM];
 
   /* Verify the file descriptor. */
   if ( file_ent->type != FAT_DIR ){
@@ -525,34 +1358,45 @@ int rsh_fat16_readdir(struct rsh_file *file, void *buf, size_t space){
   /* Figure out how many entires we should transfer. */
   ents = space / sizeof(struct dirent);
 
-  while ( ents > 0 ){
+  root = _rsh_fat16_tree_root(file_ent->index);
+  if ( root ){
+    ents = _rsh_fat16_tree_readdir(root, last_name, buf, ents);
+    if ( ents < space / sizeof(struct dirent) )
+      last_name[0] = 0;
+    return ents;
+  }
 
-    /* Based on next_dirent, we can figure which cluster we should read the
-     * dirent from and how far into that cluster the dirent is stored. */
-    cluster = next_dirent / ents_per_cluster;
-    ent_index = next_dirent % ents_per_cluster;
-    next_dirent++;
+  while ( ents > 0 ){
 
-    /* Check if we are done. */
-    if ( ent_index == 0 && almost_done ){
-      next_dirent = 0;
-      almost_done = 0;
+    /* Now get the actual I/O memory address of the cluster. Past the last
+     * one means we are done. */
+    cluster_addr = _rsh_fat16_file_cluster(fat_file, next_cluster);
+    if ( cluster_addr == FAT_RESERVED )
+      return -1;
+    if ( cluster_addr == FAT_TERM ){
+      next_cluster = 0;
+      last = NULL;
       break;
     }
-    
-    /* Now get the actual I/O memory address of the cluster. */
-    cluster_addr = _rsh_fat16_find_cluster_index(file_ent->index, cluster);
-    dir_entries = (struct rsh_fat_dirent *) FAT_CLUSTER_TO_ADDR(cluster_addr);
 
-    if ( rsh_fat16_get_entry(cluster_addr) == FAT_TERM )
-      almost_done = 1;
+    if ( last && joins != _rsh_fat16_dir_joins() )
+      last = _rsh_fat16_dirent_refind(cluster_addr, last);
+    joins = _rsh_fat16_dir_joins();
 
-    if ( ! dir_entries[ent_index].name[0] )
+    ent = _rsh_fat16_dirent_next(cluster_addr, last);
+    if ( ! ent ){
+      next_cluster++;
+      last = NULL;
+      continue;
+    }
+    last = ent;
+
+    if ( ! FAT_DIRENT_NAME(ent)[0] )
       continue;
     
     /* Now just do a copy. */
     memset(dirent_p, 0, sizeof(struct dirent));
-    memcpy(dirent_p->d_name, dir_entries[ent_index].name, 112);
+    strncpy(dirent_p->d_name, FAT_DIRENT_NAME(ent), FAT_NAME_ROOM);
     ents--;
     dirent_p++;
 
@@ -577,11 +1421,14 @@ int rsh_fat16_readdir(struct rsh_file *file, void *buf, size_t space){
 int rsh_fat16_open(struct rsh_file *file, const char *pathname, int flags){
 
   int err;
+  int dirty = 0;
+  uint64_t size;
   char *dir = NULL, *name = NULL;
   char *copy;
   struct rsh_fat_dirent dirent;
   struct rsh_fat_dirent *dirent_p;
   struct rsh_fat_dirent *child;
+  struct rsh_fat16_file *fat_file;
   
   copy = strdup(pathname);
   if ( ! copy ){
@@ -599,9 +1446,13 @@ int rsh_fat16_open(struct rsh_file *file, const char *pathname, int flags){
     err = _rsh_fat16_path_to_dirent(dir, &dirent, NULL);
     if ( err ){
       free(copy);
-      errno = ENOTDIR;
       return err;
     }
+    if ( dirent.type != FAT_DIR ){
+      free(copy);
+      errno = ENOTDIR;
+      return -1;
+    }
   } else {
     dirent_p = _rsh_fat16_locate_child(".", fat16_fs.fs_header.root_offset);
     if ( ! dirent_p )
@@ -616,7 +1467,11 @@ int rsh_fat16_open(struct rsh_file *file, const char *pathname, int flags){
     if ( ! child ){
       /* The child doesn't exist, should we create one for the user? */
       if ( flags & O_CREAT ){
-	_rsh_fat16_mkfile(dirent.index, name);
+	if ( _rsh_fat16_mkfile(dirent.index, name) ){
+	  free(copy);
+	  return -1;
+	}
+	dirty = 1;
       } else {
 	errno = ENOENT;
 	free(copy);
@@ -632,61 +1487,186 @@ int rsh_fat16_open(struct rsh_file *file, const char *pathname, int flags){
       return -1;
     }
 
+    /* This will over write data, unless we're appending. */
+    file->offset = 0;
     if ( flags & O_APPEND ){
-      file->offset = child->size;
+      file->offset = FAT_DIRENT_SIZE(child);
     }
     if ( flags & O_TRUNC ){
       file->offset = 0;
-      _rsh_fat16_wipe_file(child);
+      size = FAT_DIRENT_SIZE(child);
+      if ( _rsh_fat16_wipe_file(child) ){
+	free(copy);
+	return -1;
+      }
+      _rsh_fat16_dindex_resize(dirent.index, -(int64_t)size);
+      _rsh_fat16_set_size(child, 0);
+      _rsh_fat16_zip_changed(child, 0);
+      dirty = 1;
     }
 
-    /* This will over write data. Not if its a directory though. */
-    file->offset = 0;
-
   } else {
     child = _rsh_fat16_locate_child(".", dirent.index);
   }
 
-  file->local = child;
+  fat_file = (struct rsh_fat16_file *)malloc(sizeof(struct rsh_fat16_file));
+  if ( ! fat_file ){
+    errno = ENOMEM;
+    free(copy);
+    return -1;
+  }
+  memset(fat_file, 0, sizeof(struct rsh_fat16_file));
+  fat_file->dirty = dirty;
+  fat_file->dirent = child;
+  fat_file->parent = dirent.index;
+  fat_file->gen = fat16_fs.chain_gen;
+  fat_file->shared = FAT_UNSHARED;
+  fat_file->zchunk = FAT_TERM;
+
+  /* A compressed file's size is in its header. It stays compressed until
+   * something is actually written to it, so opening one for writing and
+   * then not doing so leaves it as it was. */
+  size = child->type == FAT_DIR ? 0 : FAT_DIRENT_SIZE(child);
+  if ( child->type == FAT_ZFILE ){
+    if ( _rsh_fat16_zip_load(fat_file) ){
+      free(fat_file);
+      free(copy);
+      return -1;
+    }
+    size = fat_file->zhead->size;
+    if ( flags & O_APPEND )
+      file->offset = size;
+  }
+
+  fat_file->next = open_files;
+  open_files = fat_file;
+  file->local = fat_file;
 
   /* Fill in relevant file struct data fields. */
   file->mode = S_IRWXU | S_IRWXG | S_IRWXO; /* 777 */
   file->mode |= ( child->type == 0xFF ? S_IFDIR : S_IFREG );
-  file->size = child->size;
+  /* A directory's . keeps where its tree is in the size. */
+  file->size = size;
   file->block_size = (long int) fat16_fs.fs_header.csize;
   file->blocks = file->size / file->block_size;
   if ( file->block_size * file->block_size < file->size)
     file->blocks++;
   file->access_time = child->epoch;
 
-  free(copy);
-  
+  free(copy);
+  
+  return 0;
+
+}
+
+/*
+ * Close a file. Release any reousrces associated with the file that must be
+ * released (the file's cluster map, for one). If the file was changed while
+ * it was open, this will also msync the dirty parts of the image to the disk.
+ * Opens that only read don't cost a thing.
+ */
+int rsh_fat16_close(struct rsh_file *file){
+
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat16_file *other;
+  struct rsh_fat16_file **link;
+
+  if ( fat_file->prealloc )
+    _rsh_fat16_file_trim(fat_file);
+
+  for ( link = &open_files; *link; link = &(*link)->next ){
+    if ( *link == fat_file ){
+      *link = fat_file->next;
+      break;
+    }
+  }
+
+  for ( other = open_files; other; other = other->next )
+    if ( other->dirent == fat_file->dirent )
+      break;
+
+  /* Compress what was written, unless someone else still has it open: then
+   * it's their close that does it, with the old chunks if we had them. A
+   * file that doesn't get any smaller (or won't fit) just stays as it is. */
+  if ( other && fat_file->zold && ! other->zold ){
+    other->zold = fat_file->zold;
+    other->zdata = fat_file->zdata;
+    other->zsame = fat_file->zsame;
+    fat_file->zold = NULL;
+    fat_file->zdata = NULL;
+  }
+  if ( fat_file->dirty && FAT_ZIP_FILES && ! other )
+    _rsh_fat16_zip(fat_file);
+
+  if ( fat_file->dirty )
+    _rsh_fat16_close_sync();
+
+  /* Then share whatever of it is already somewhere else. That's only ever
+   * pointing it at clusters that are on disk already, so it goes after the
+   * sync. */
+  if ( fat_file->dirty && FAT_DEDUP_FILES && ! other )
+    _rsh_fat16_dedup_close(fat_file->dirent);
+
+  free(fat_file->clusters);
+  free(fat_file->logical);
+  _rsh_fat16_zip_forget(fat_file);
+  _rsh_fat16_zip_drop(fat_file);
+  free(fat_file);
+  file->local = NULL;
+
   return 0;
 
 }
 
 /*
- * Close a file. Release any reousrces associated with the file that must be
- * released. This will also msync all data to the disk. The kernel will handle
- * the caching though, so this should only write data that actually *needs* to
- * be written.
+ * The chain starting at head is about to change: clusters in it freed or
+ * relinked. Everyone with it open but keep throws their map away and builds
+ * it again from the dirent next time. Other files can't be affected, since
+ * only the part of a chain nobody else runs into ever changes.
  */
-int rsh_fat16_close(struct rsh_file *file){
+void _rsh_fat16_chain_changed(uint32_t head, struct rsh_fat16_file *keep){
+
+  struct rsh_fat16_file *fat_file;
+
+  for ( fat_file = open_files; fat_file; fat_file = fat_file->next ){
+    if ( fat_file == keep )
+      continue;
+    if ( fat_file->dirent->index == head ||
+	 (fat_file->length && fat_file->clusters[0] == head) ){
+      fat_file->length = 0;
+      _rsh_fat16_zip_forget(fat_file);
+    }
+  }
 
-  struct rsh_fat_dirent *file_ent = file->local;
-  fat_t entry = file_ent->index;
+}
 
-  while ( entry != FAT_TERM ){
+/*
+ * The file at dirent changed from off on. Whoever has it open keeps track
+ * of how much of it is still the same, to compress only the rest again when
+ * it's closed.
+ */
+void _rsh_fat16_zip_changed(struct rsh_fat_dirent *dirent, uint64_t off){
 
-    /* Sync the data out to disk. */
-    msync(FAT_CLUSTER_TO_ADDR(entry), FAT_CLUSTER_SIZE, MS_SYNC);
+  struct rsh_fat16_file *fat_file;
 
-    /* Now update entry */
-    entry = rsh_fat16_get_entry(entry);
-    if ( entry == FAT_FREE || entry == FAT_RESERVED )
-      rsh_fat16_badness();
+  for ( fat_file = open_files; fat_file; fat_file = fat_file->next )
+    if ( fat_file->dirent == dirent && fat_file->zsame > off )
+      fat_file->zsame = off;
 
-  }
+}
+
+/*
+ * Does anyone have the file whose dirent this is open? Their handles point
+ * at the dirent itself, so it can't be reused for something else while they
+ * do.
+ */
+int _rsh_fat16_is_open(struct rsh_fat_dirent *dirent){
+
+  struct rsh_fat16_file *fat_file;
+
+  for ( fat_file = open_files; fat_file; fat_file = fat_file->next )
+    if ( fat_file->dirent == dirent )
+      return 1;
 
   return 0;
 
@@ -699,12 +1679,8 @@ int rsh_fat16_close(struct rsh_file *file){
 int _rsh_fat16_mkdir(uint32_t dir_table, const char *name){
 
   int err;
-  uint32_t tail;
-  uint32_t cluster;
   uint32_t dir_cluster;
   struct rsh_fat_dirent *slot;
-  struct rsh_fat_dirent *dot;
-  struct rsh_fat_dirent *dotdot;
 
   /* Make sure there is no directory of the asked name. */
   if ( _rsh_fat16_locate_child(name, dir_table) ){
@@ -713,19 +1689,9 @@ int _rsh_fat16_mkdir(uint32_t dir_table, const char *name){
   }
 
   /* First we need to make sure there is room for another dirent. */
-  slot = _rsh_fat16_find_open_dirent(dir_table);
-  if ( ! slot ){
-    err = _rsh_fat16_find_open_cluster(&cluster);
-    if ( err < 0 ){
-      errno = ENOSPC;
-      return RSH_ERR;
-    }
-    /* Tack this cluster onto the dir table. */
-    tail = _rsh_fat16_follow_head(dir_table, -1);
-    rsh_fat16_set_entry(tail, cluster);
-    rsh_fat16_set_entry(cluster, FAT_TERM);
-    slot = _rsh_fat16_find_open_dirent(dir_table);
-  }
+  slot = _rsh_fat16_new_dirent(dir_table, name);
+  if ( ! slot )
+    return RSH_ERR;
 
   /* Now we have a slot. Get a cluster for the directory. */
   err = _rsh_fat16_find_open_cluster(&dir_cluster);
@@ -734,32 +1700,25 @@ int _rsh_fat16_mkdir(uint32_t dir_table, const char *name){
     return RSH_ERR;
   }
   rsh_fat16_set_entry(dir_cluster, FAT_TERM);
+  _rsh_fat16_journal_log(FAT_CLUSTER_TO_ADDR(dir_cluster), FAT_CLUSTER_SIZE, 1);
   
-  /* Fill in the directory entry. */
-  strncpy(slot->name, name, 112);
-  slot->name[111] = 0; /* Make sure its null terminated. */
+  /* Fill in the directory entry. The name goes last: on version 0 images
+   * it can run on into size_hi. */
   slot->index = dir_cluster;
+  slot->size_hi = 0;
   slot->size = 0;
   slot->type = FAT_DIR;
   slot->epoch = (uint32_t) time(NULL);
+  _rsh_fat16_dirent_name(slot, name);
+  rsh_fat16_meta(slot, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_dindex_insert(dir_table, slot);
+  _rsh_fat16_dcache_created();
 
-  /* Fill in the dot and dotdot entries. */
-  dot = FAT_CLUSTER_TO_ADDR(dir_cluster);
-  dotdot = FAT_CLUSTER_TO_ADDR(dir_cluster) + sizeof(struct rsh_fat_dirent);
-
-  /* dot points to ourselves. */
-  strcpy(dot->name, ".");
-  dot->index = dir_cluster;
-  dot->size = 0;
-  dot->type = FAT_DIR;
-  dot->epoch = (uint32_t) time(NULL);
+  /* Fill in the dot and dotdot entries: dot points to ourselves and dotdot
+   * to our parent. */
+  _rsh_fat16_dir_format(dir_cluster, dir_table);
 
-  /* dotdot points to our parent. */
-  strcpy(dotdot->name, "..");
-  dotdot->index = dir_table;
-  dotdot->size = 0;
-  dotdot->type = FAT_DIR;
-  dotdot->epoch = (uint32_t) time(NULL);
+  _rsh_fat16_journal_commit();
 
   return RSH_OK;
 
@@ -791,6 +1750,10 @@ int rsh_fat16_mkdir(const char *path){
     err = _rsh_fat16_path_to_dirent(dir, &ent, NULL);
     if ( err )
       return err;
+    if ( ent.type != FAT_DIR ){
+      errno = ENOTDIR;
+      return -1;
+    }
   }
 
   return _rsh_fat16_mkdir(ent.index, name);
@@ -803,41 +1766,37 @@ int rsh_fat16_mkdir(const char *path){
 int _rsh_fat16_mkfile(uint32_t dir_table, const char *name){
 
   int err;
-  uint32_t tail;
-  uint32_t cluster;
   uint32_t file_cluster;
   struct rsh_fat_dirent *slot;
 
   /* First we need to make sure there is room for another dirent. */
-  slot = _rsh_fat16_find_open_dirent(dir_table);
-  if ( ! slot ){
-    err = _rsh_fat16_find_open_cluster(&cluster);
+  slot = _rsh_fat16_new_dirent(dir_table, name);
+  if ( ! slot )
+    return RSH_ERR;
+
+  /* Now we have a slot. Get a cluster for the file, unless it can start out
+   * packed, in which case being empty costs nothing. */
+  if ( fat16_fs.pack_max ){
+    file_cluster = FAT_PACKED;
+  } else {
+    err = _rsh_fat16_find_open_cluster(&file_cluster);
     if ( err < 0 ){
       errno = ENOSPC;
       return RSH_ERR;
     }
-    /* Tack this cluster onto the dir table. */
-    tail = _rsh_fat16_follow_head(dir_table, -1);
-    rsh_fat16_set_entry(tail, cluster);
-    rsh_fat16_set_entry(cluster, FAT_TERM);
-    slot = _rsh_fat16_find_open_dirent(dir_table);
+    rsh_fat16_set_entry(file_cluster, FAT_TERM);
   }
 
-  /* Now we have a slot. Get a cluster for the file. */
-  err = _rsh_fat16_find_open_cluster(&file_cluster);
-  if ( err < 0 ){
-    errno = ENOSPC;
-    return RSH_ERR;
-  }
-  rsh_fat16_set_entry(file_cluster, FAT_TERM);
-
-  /* Fill in the file's entry. */
-  strncpy(slot->name, name, 112);
-  slot->name[111] = 0; /* Make sure its null terminated. */
+  /* Fill in the file's entry, name last as for directories. */
   slot->index = file_cluster;
+  slot->size_hi = 0;
   slot->size = 0;
   slot->type = FAT_FILE;
   slot->epoch = (uint32_t) time(NULL);
+  _rsh_fat16_dirent_name(slot, name);
+  rsh_fat16_meta(slot, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_dindex_insert(dir_table, slot);
+  _rsh_fat16_dcache_created();
 
   return RSH_OK;
 
@@ -855,7 +1814,7 @@ fat_t rsh_fat16_get_entry(uint32_t index){
   uint32_t fat_real_cluster;
   fat_t *fat_section;
 
-  if ( index > fat16_fs.fat_entries )
+  if ( index >= fat16_fs.fat_entries )
     return FAT_RESERVED;
 
   fat_cluster = index / fat16_fs.fat_per_cluster;
@@ -868,7 +1827,14 @@ fat_t rsh_fat16_get_entry(uint32_t index){
   fat_real_cluster = fat16_fs.fs_header.fat_offset + fat_cluster;
   fat_section = FAT_CLUSTER_TO_ADDR(fat_real_cluster);
 
-  /* Now we can address the fat entry via the fat_section pointer. */
+  /* Now we can address the fat entry via the fat_section pointer. Version 0
+   * images have 16 bit special values. */
+  if ( ! fat16_fs.fs_header.version ){
+    if ( fat_section[fat_offset] == FAT16_TERM )
+      return FAT_TERM;
+    if ( fat_section[fat_offset] == FAT16_RESERVED )
+      return FAT_RESERVED;
+  }
   return fat_section[fat_offset];
 
 }
@@ -884,7 +1850,7 @@ void rsh_fat16_set_entry(uint32_t index, fat_t value){
   uint32_t fat_real_cluster;
   fat_t *fat_section;
 
-  if ( index > fat16_fs.fat_entries )
+  if ( index >= fat16_fs.fat_entries )
     return;
 
   /* First figure out what cluster the index is in, and what offset the
@@ -896,7 +1862,39 @@ void rsh_fat16_set_entry(uint32_t index, fat_t value){
   fat_real_cluster = fat16_fs.fs_header.fat_offset + fat_cluster;
   fat_section = FAT_CLUSTER_TO_ADDR(fat_real_cluster);
 
+  /* Keep the free count and map in sync with the FAT. Only transitions to
+   * and from FAT_FREE matter. */
+  if ( fat_section[fat_offset] == FAT_FREE && value != FAT_FREE ){
+    fat16_fs.free_clusters--;
+    if ( fat16_fs.free_map ){
+      fat16_fs.free_map[index / 32] &= ~(1U << (index % 32));
+      if ( ! fat16_fs.free_map[index / 32] )
+	fat16_fs.free_summary[index / 1024] &= ~(1U << ((index / 32) % 32));
+    }
+  } else if ( fat_section[fat_offset] != FAT_FREE && value == FAT_FREE ){
+    fat16_fs.free_clusters++;
+    if ( fat16_fs.free_map ){
+      fat16_fs.free_map[index / 32] |= 1U << (index % 32);
+      fat16_fs.free_summary[index / 1024] |= 1U << ((index / 32) % 32);
+    }
+  }
+
+  /* Free clusters never have a hole after them; see fs_fat16_sparse.c. */
+  if ( value == FAT_FREE ){
+    if ( _rsh_fat16_gap(index) )
+      _rsh_fat16_set_gap(index, 0);
+    _rsh_fat16_dedup_forget(index);
+  }
+
+  if ( ! fat16_fs.fs_header.version ){
+    if ( value == FAT_TERM )
+      value = FAT16_TERM;
+    else if ( value == FAT_RESERVED )
+      value = FAT16_RESERVED;
+  }
+
   fat_section[fat_offset] = value;
+  rsh_fat16_meta(&fat_section[fat_offset], sizeof(fat_t));
 
 }
 
@@ -910,10 +1908,34 @@ int _rsh_fat16_init_creat(char *path, struct rsh_fat16_fs *fs,
   int flags = O_CREAT|O_RDWR;
   mode_t mode = S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH;
   uint32_t start;
-  struct rsh_fat_dirent *dot;
-  struct rsh_fat_dirent *dotdot;
+  uint64_t journal;
+
+  if ( sizeof(struct rsh_fat_slot) * 3 > cluster ){
+    return RSH_ERR;
+  }
+
+  /* Only version 6 images have anywhere to put flags. */
+  if ( rsh_fat16_new_flags && rsh_fat16_new_version < RSH_FS_V6 ){
+    printf("Version %d images can't have flags 0x%x.\n",
+	   rsh_fat16_new_version, rsh_fat16_new_flags);
+    return RSH_ERR;
+  }
+
+  /* Tree nodes say where things are in a cluster with 16 bits, and need room
+   * for a few of the longest names. */
+  if ( rsh_fat16_new_flags & RSH_FS_TREE_DIRS &&
+       (cluster < 1024 || cluster > 65536) ){
+    printf("Tree directories need clusters of 1K to 64K.\n");
+    return RSH_ERR;
+  }
 
-  if ( sizeof(struct rsh_fat_dirent) * 3 > cluster ){
+  /* Make sure the cluster numbers fit in the format we're making. The top
+   * two are taken by FAT_RESERVED and FAT_TERM. */
+  if ( size / cluster >= (rsh_fat16_new_version ? FAT_RESERVED :
+			  FAT16_RESERVED) ||
+       (! rsh_fat16_new_version && size > UINT32_MAX) ){
+    printf("Too many clusters for a version %d image.\n",
+	   rsh_fat16_new_version);
     return RSH_ERR;
   }
 
@@ -934,18 +1956,23 @@ int _rsh_fat16_init_creat(char *path, struct rsh_fat16_fs *fs,
     return RSH_ERR;
   }
 
-  fs->fs_io = mmap(NULL, size, PROT_READ|PROT_WRITE, MAP_SHARED,
-			fs->fs_fd, 0);
-  if ( fs->fs_io == MAP_FAILED ){
-    perror("mmap");
+  if ( _rsh_fat16_map_image(fs, size) )
     return RSH_ERR;
-  }
 
-  /* Now deal with some of the FS mechanics. */
+  /* Now deal with some of the FS mechanics. Version 0 images have nothing
+   * past fat_offset on the disk. */
+  memset(&fs->fs_header, 0, sizeof(struct rsh_fs_block));
   fs->fs_header.csize = cluster;
-  fs->fs_header.len = size;
   fs->fs_header.root_offset = 1;
   fs->fs_header.fat_offset = 2;
+  fs->fs_header.size = size;
+  if ( rsh_fat16_new_version ){
+    fs->fs_header.magic = RSH_FS_MAGIC;
+    fs->fs_header.version = rsh_fat16_new_version;
+    fs->fs_header.flags = rsh_fat16_new_flags;
+  } else {
+    fs->fs_header.len = size;
+  }
 
   /* Figure out how big the FAT needs to be in clusters: size/cluster will give
    * the number of required clusters. */
@@ -959,8 +1986,6 @@ int _rsh_fat16_init_creat(char *path, struct rsh_fat16_fs *fs,
   fs->fat_per_cluster = cluster / sizeof(fat_t);
   fs->fat_size = fs->fat_entries * sizeof(fat_t);
 
-  fs->dir_per_cluster = cluster / sizeof(struct rsh_fat_dirent);
-
   /* At this point we know: where the root directory table starts and ends
    * and where the FAT table starts. From here we need to make the FAT.
    */
@@ -971,36 +1996,122 @@ int _rsh_fat16_init_creat(char *path, struct rsh_fat16_fs *fs,
   }
   rsh_fat16_set_entry(start, FAT_TERM);
 
+  /* The journal goes right after the FAT: about 1/32 of the image, between
+   * 64K and 4M. It's a chain of its own so nothing else gets its clusters. */
+  if ( fs->fs_header.version >= RSH_FS_V2 ){
+    journal = size / 32;
+    if ( journal < JOURNAL_MIN )
+      journal = JOURNAL_MIN;
+    if ( journal > JOURNAL_MAX )
+      journal = JOURNAL_MAX;
+    fs->fs_header.journal_offset = start + 1;
+    fs->fs_header.journal_clusters = (journal + cluster - 1) / cluster;
+    if ( fs->fs_header.journal_offset + fs->fs_header.journal_clusters >=
+	 fs->fat_entries ){
+      printf("Image too small for a journal.\n");
+      return RSH_ERR;
+    }
+    start = fs->fs_header.journal_offset;
+    for ( i = 1; i < fs->fs_header.journal_clusters; i++ ){
+      rsh_fat16_set_entry(start, start+1);
+      start++;
+    }
+    rsh_fat16_set_entry(start, FAT_TERM);
+  }
+
+  /* Then a byte per cluster for reference counts, see fs_fat16_cow.c. */
+  if ( fs->fs_header.version >= RSH_FS_V3 ){
+    fs->fs_header.refs_offset = start + 1;
+    fs->fs_header.refs_clusters = (fs->fat_entries + cluster - 1) / cluster;
+    if ( fs->fs_header.refs_offset + fs->fs_header.refs_clusters >=
+	 fs->fat_entries ){
+      printf("Image too small for reference counts.\n");
+      return RSH_ERR;
+    }
+    memset(FAT_CLUSTER_TO_ADDR(fs->fs_header.refs_offset), 0,
+	   fs->fat_entries);
+    start = fs->fs_header.refs_offset;
+    for ( i = 1; i < fs->fs_header.refs_clusters; i++ ){
+      rsh_fat16_set_entry(start, start+1);
+      start++;
+    }
+    rsh_fat16_set_entry(start, FAT_TERM);
+  }
+
+  /* And the hole table, 32 bits per cluster. */
+  if ( fs->fs_header.version >= RSH_FS_V4 ){
+    fs->fs_header.holes_offset = start + 1;
+    fs->fs_header.holes_clusters =
+      (fs->fat_entries * sizeof(uint32_t) + cluster - 1) / cluster;
+    if ( fs->fs_header.holes_offset + fs->fs_header.holes_clusters >=
+	 fs->fat_entries ){
+      printf("Image too small for a hole table.\n");
+      return RSH_ERR;
+    }
+    memset(FAT_CLUSTER_TO_ADDR(fs->fs_header.holes_offset), 0,
+	   fs->fat_entries * sizeof(uint32_t));
+    start = fs->fs_header.holes_offset;
+    for ( i = 1; i < fs->fs_header.holes_clusters; i++ ){
+      rsh_fat16_set_entry(start, start+1);
+      start++;
+    }
+    rsh_fat16_set_entry(start, FAT_TERM);
+  }
+
+  /* And a checksum per cluster, see fs_fat16_csum.c. */
+  if ( fs->fs_header.version >= RSH_FS_V7 ){
+    fs->fs_header.csum_offset = start + 1;
+    fs->fs_header.csum_clusters =
+      (fs->fat_entries * sizeof(uint32_t) + cluster - 1) / cluster;
+    if ( fs->fs_header.csum_offset + fs->fs_header.csum_clusters >=
+	 fs->fat_entries ){
+      printf("Image too small for checksums.\n");
+      return RSH_ERR;
+    }
+    start = fs->fs_header.csum_offset;
+    for ( i = 1; i < fs->fs_header.csum_clusters; i++ ){
+      rsh_fat16_set_entry(start, start+1);
+      start++;
+    }
+    rsh_fat16_set_entry(start, FAT_TERM);
+  }
+
+  /* And the first cluster for packing small files into. */
+  if ( fs->fs_header.version >= RSH_FS_V5 ){
+    fs->fs_header.pack_offset = start + 1;
+    if ( fs->fs_header.pack_offset >= fs->fat_entries ){
+      printf("Image too small for packed files.\n");
+      return RSH_ERR;
+    }
+    _rsh_fat16_pack_format(fs->fs_header.pack_offset);
+    rsh_fat16_set_entry(fs->fs_header.pack_offset, FAT_TERM);
+  }
+
   /* Mark the root_dir entry and header entry in the FAT. */
   rsh_fat16_set_entry(0, FAT_TERM);
   rsh_fat16_set_entry(1, FAT_TERM);
 
-  /* And create the first two directory entries we need: . and .. */
-  dot = FAT_CLUSTER_TO_ADDR(fs->fs_header.root_offset);
-  dotdot = FAT_CLUSTER_TO_ADDR(fs->fs_header.root_offset) + 
-    sizeof(struct rsh_fat_dirent);
-
-  /* dot points to ourselves. */
-  strcpy(dot->name, ".");
-  dot->index = fs->fs_header.root_offset;
-  dot->size = 0;
-  dot->type = FAT_DIR;
-  dot->epoch = (uint32_t) time(NULL);
-
-  /* dotdot points to our parent, but in this case is just ourself. */
-  strcpy(dotdot->name, "..");
-  dotdot->index = fs->fs_header.root_offset;
-  dotdot->size = 0;
-  dotdot->type = FAT_DIR;
-  dotdot->epoch = (uint32_t) time(NULL);
+  /* And create the first two directory entries we need: . and .. where
+   * dotdot points to our parent, but in this case is just ourself. */
+  _rsh_fat16_dir_format(fs->fs_header.root_offset,
+			fs->fs_header.root_offset);
+
+  /* Everything's where it goes, so the sums can be worked out. */
+  if ( _rsh_fat16_csum_open(fs) )
+    return RSH_ERR;
+  _rsh_fat16_csum_format(fs);
 
   /* Finally copy the data structures we generated into the actual file system
    * data. */
-  memcpy(fat16_fs.fs_io, &(fat16_fs.fs_header), sizeof(struct rsh_fs_block));
-  msync(fat16_fs.fs_io, fat16_fs.fs_header.len, MS_SYNC);
+  if ( fs->fs_header.version )
+    memcpy(fat16_fs.fs_io, &(fat16_fs.fs_header), sizeof(struct rsh_fs_block));
+  else
+    memcpy(fat16_fs.fs_io, &(fat16_fs.fs_header),
+	   offsetof(struct rsh_fs_block, magic));
+  msync(fat16_fs.fs_io, fat16_fs.fs_header.size, MS_SYNC);
 
   /* At this point we should be good. */
-  return 0;
+  return _rsh_fat16_journal_format(fs);
 
 }
 
@@ -1009,20 +2120,29 @@ int _rsh_fat16_init_creat(char *path, struct rsh_fat16_fs *fs,
  */
 int _rsh_fat16_is_empty_dir(struct rsh_fat_dirent *ent){
 
-  int i;
-  int ents_per_cluster = FAT_CLUSTER_SIZE / sizeof(struct rsh_fat_dirent);
+  char *name;
   uint32_t cluster = ent->index;      /* Cluster offset. */
-  struct rsh_fat_dirent *subents;
+  struct rsh_fat_dirent *subent;
+  struct rsh_fat16_dindex *index;
+
+  if ( _rsh_fat16_tree_root(cluster) )
+    return _rsh_fat16_tree_empty(_rsh_fat16_tree_root(cluster));
+
+  /* The index knows how many names there are. Just . and .. means empty. */
+  index = _rsh_fat16_dindex_get(cluster);
+  if ( index )
+    return index->entries <= 2;
   
   do {
 
     if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
       rsh_fat16_badness();
 
-    subents = FAT_CLUSTER_TO_ADDR(cluster);
-    for ( i = 0; i < ents_per_cluster; i++){
-      if ( strcmp(subents[i].name, ".") && strcmp(subents[i].name, "..") )
-	if ( subents[i].name[0] )
+    for ( subent = _rsh_fat16_dirent_next(cluster, NULL); subent;
+	  subent = _rsh_fat16_dirent_next(cluster, subent) ){
+      name = FAT_DIRENT_NAME(subent);
+      if ( strcmp(name, ".") && strcmp(name, "..") )
+	if ( name[0] )
 	  return 0;
     }
 
@@ -1034,6 +2154,30 @@ int _rsh_fat16_is_empty_dir(struct rsh_fat_dirent *ent){
 
 }
 
+/*
+ * Free everything child (in the directory table dir) has and take it out of
+ * the index and the cache. The dirent itself is left for the caller to clear
+ * or reuse.
+ */
+void _rsh_fat16_remove(uint32_t dir, struct rsh_fat_dirent *child){
+
+  if ( child->type == FAT_DIR ){
+    _rsh_fat16_dindex_drop(child->index);
+    _rsh_fat16_tree_drop(child->index);
+  }
+
+  /* Clusters still shared with another file stay where they are. */
+  if ( FAT_DIRENT_PACKED(child) ){
+    _rsh_fat16_pack_free(child);
+  } else {
+    _rsh_fat16_chain_changed(child->index, NULL);
+    _rsh_fat16_release(child->index);
+  }
+  _rsh_fat16_dindex_remove(dir, child);
+  _rsh_fat16_dcache_forget(child);
+
+}
+
 /*
  * Unlink a node from the file system. Will only delete directories if they are
  * empty.
@@ -1041,6 +2185,7 @@ int _rsh_fat16_is_empty_dir(struct rsh_fat_dirent *ent){
 int rsh_fat16_unlink(const char *path){
 
   int err;
+  int is_dir;
   char *copy;
   char *dir, *name;
   struct rsh_fat_dirent top_ent;
@@ -1061,6 +2206,10 @@ int rsh_fat16_unlink(const char *path){
     err = _rsh_fat16_path_to_dirent(dir, &top_ent, NULL);
     if ( err )
       return err;
+    if ( top_ent.type != FAT_DIR ){
+      errno = ENOTDIR;
+      return -1;
+    }
   }
 
   /* Find the entity that we want to delete in the current ent. */
@@ -1080,17 +2229,206 @@ int rsh_fat16_unlink(const char *path){
   }
 
   /* Now that the checking is taken care off, wipe this bastard of a file. */
-  _rsh_fat16_wipe_file(child);
+  is_dir = child->type == FAT_DIR;
+  _rsh_fat16_remove(top_ent.index, child);
+  _rsh_fat16_dirent_clear(child);
+
+  /* The directory's old clusters may be file data before long; its dirents
+   * can't be in the log when that happens. */
+  if ( is_dir )
+    _rsh_fat16_journal_checkpoint();
+  else
+    _rsh_fat16_journal_commit();
+
+  return 0;
+
+}
+
+/*
+ * Find the table of the directory path lives in. path is split in place and
+ * *name is left pointing at the last node.
+ */
+int _rsh_fat16_parent(char *path, char **name, uint32_t *dir){
+
+  int err;
+  char *parent;
+  struct rsh_fat_dirent ent;
+
+  if ( strlen(path) > 1 && path[strlen(path)-1] == '/' )
+    path[strlen(path)-1] = 0;
+
+  parent = _rsh_fat16_split_path(path, name);
+  if ( ! parent || ! **name || strcmp(*name, ".") == 0 ||
+       strcmp(*name, "..") == 0 ){
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( ! *parent ){
+    *dir = fat16_fs.fs_header.root_offset;
+    return 0;
+  }
 
-  /* We still have two things to do, clean out the child dirent, and remove the
-   * last index out of the FAT table. */
-  rsh_fat16_set_entry(child->index, FAT_FREE);
-  memset(child, 0, sizeof(struct rsh_fat_dirent));
+  err = _rsh_fat16_path_to_dirent(parent, &ent, NULL);
+  if ( err )
+    return err;
+  if ( ent.type != FAT_DIR ){
+    errno = ENOTDIR;
+    return -1;
+  }
 
+  *dir = ent.index;
   return 0;
 
 }
 
+/*
+ * Is the directory table dir the directory whose table is top, or somewhere
+ * under it? Walks up the .. entries to the root.
+ */
+int _rsh_fat16_is_under(uint32_t dir, uint32_t top){
+
+  struct rsh_fat_dirent *dotdot;
+
+  while ( dir != top ){
+    if ( dir == fat16_fs.fs_header.root_offset )
+      return 0;
+    dotdot = _rsh_fat16_locate_child("..", dir);
+    if ( ! dotdot || dotdot->index == dir )
+      return 0;
+    dir = dotdot->index;
+  }
+
+  return 1;
+
+}
+
+/*
+ * Move the dirent at oldpath to newpath. Only the dirent moves, the file's
+ * clusters stay right where they are, so this costs the same whatever the
+ * size of the file. Like rename(), anything at newpath is replaced as long
+ * as it's the same kind of thing (and empty, if it's a directory), but not
+ * while it's open: that fails with EBUSY.
+ */
+int rsh_fat16_rename(const char *oldpath, const char *newpath){
+
+  int ret = -1;
+  int replaced_dir = 0;
+  char *old_copy, *new_copy;
+  char *old_name, *new_name;
+  uint32_t old_dir, new_dir;
+  struct rsh_fat_dirent *child;
+  struct rsh_fat_dirent *target;
+  struct rsh_fat_dirent *slot;
+  struct rsh_fat_dirent *dotdot;
+  struct rsh_fat16_file *fat_file;
+
+  old_copy = strdup(oldpath);
+  new_copy = strdup(newpath);
+  if ( ! old_copy || ! new_copy ){
+    errno = ENOMEM;
+    goto out;
+  }
+
+  if ( _rsh_fat16_parent(old_copy, &old_name, &old_dir) ||
+       _rsh_fat16_parent(new_copy, &new_name, &new_dir) )
+    goto out;
+
+  child = _rsh_fat16_locate_child(old_name, old_dir);
+  if ( ! child ){
+    errno = ENOENT;
+    goto out;
+  }
+
+  /* A directory can't go inside itself. */
+  if ( child->type == FAT_DIR && _rsh_fat16_is_under(new_dir, child->index) ){
+    errno = EINVAL;
+    goto out;
+  }
+
+  target = _rsh_fat16_locate_child(new_name, new_dir);
+  if ( target == child ){
+    ret = 0;
+    goto out;
+  }
+
+  if ( target ){
+    if ( child->type == FAT_DIR && target->type != FAT_DIR ){
+      errno = ENOTDIR;
+      goto out;
+    }
+    if ( child->type != FAT_DIR && target->type == FAT_DIR ){
+      errno = EISDIR;
+      goto out;
+    }
+    if ( target->type == FAT_DIR && ! _rsh_fat16_is_empty_dir(target) ){
+      errno = ENOTEMPTY;
+      goto out;
+    }
+    /* Its slot is about to be the moved file's. */
+    if ( _rsh_fat16_is_open(target) ){
+      errno = EBUSY;
+      goto out;
+    }
+    replaced_dir = target->type == FAT_DIR;
+    _rsh_fat16_remove(new_dir, target);
+    slot = target;
+  } else if ( old_dir == new_dir && _rsh_fat16_dirent_fits(child, new_name) ){
+    /* Just a new name, the dirent can stay where it is. */
+    _rsh_fat16_dindex_remove(old_dir, child);
+    _rsh_fat16_dcache_forget(child);
+    _rsh_fat16_dirent_name(child, new_name);
+    _rsh_fat16_dindex_insert(old_dir, child);
+    _rsh_fat16_dcache_created();
+    _rsh_fat16_journal_commit();
+    ret = 0;
+    goto out;
+  } else {
+    slot = _rsh_fat16_new_dirent(new_dir, new_name);
+    if ( ! slot )
+      goto out;
+  }
+
+  /* Copy the dirent over to its new slot and clear the old one. */
+  _rsh_fat16_dindex_remove(old_dir, child);
+  _rsh_fat16_dcache_forget(child);
+  *slot = *child;
+  _rsh_fat16_dirent_name(slot, new_name);
+  rsh_fat16_meta(slot, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_dindex_insert(new_dir, slot);
+  _rsh_fat16_dcache_created();
+  _rsh_fat16_dirent_clear(child);
+
+  /* A directory's .. has to follow it. */
+  if ( slot->type == FAT_DIR ){
+    dotdot = _rsh_fat16_locate_child("..", slot->index);
+    if ( ! dotdot )
+      rsh_fat16_badness();
+    dotdot->index = new_dir;
+    rsh_fat16_meta(dotdot, sizeof(struct rsh_fat_dirent));
+  }
+
+  /* Anyone who has the file open is still looking at the old slot. */
+  for ( fat_file = open_files; fat_file; fat_file = fat_file->next ){
+    if ( fat_file->dirent == child ){
+      fat_file->dirent = slot;
+      fat_file->parent = new_dir;
+    }
+  }
+
+  if ( replaced_dir )
+    _rsh_fat16_journal_checkpoint();
+  else
+    _rsh_fat16_journal_commit();
+  ret = 0;
+
+ out:
+  free(old_copy);
+  free(new_copy);
+  return ret;
+
+}
+
 /*
  * Open a previously created FAT16 filesystem. Ugh this one is actually more
  * annoying that creating a new file system. Nvm, I take that back.
@@ -1116,32 +2454,113 @@ int _rsh_fat16_init_open(char *path, struct rsh_fat16_fs *fs){
     return RSH_ERR;
   }
 
+  /* Figure out which format this is. No magic at all means it's from before
+   * there were versions. */
+  if ( ! fs->fs_header.magic && ! fs->fs_header.version ){
+    fs->fs_header.size = fs->fs_header.len;
+  } else if ( fs->fs_header.magic != RSH_FS_MAGIC ||
+	      fs->fs_header.version > RSH_FS_VERSION ){
+    printf("%s: not an image this shell understands (version %u).\n",
+	   path, fs->fs_header.version);
+    return RSH_ERR;
+  }
+
+  if ( ! fs->fs_header.csize || fs->fs_header.size < fs->fs_header.csize ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
   /* We should have the header, so map in the entirety of the file system
    * now. */
-  if ( lseek(fs->fs_fd, fs->fs_header.len, SEEK_SET) < 0 ){
+  if ( lseek(fs->fs_fd, fs->fs_header.size, SEEK_SET) < 0 ){
     perror("lseek");
     return RSH_ERR;
   }
-  fs->fs_io = mmap(NULL, fs->fs_header.len, PROT_READ|PROT_WRITE, 
-		   MAP_SHARED, fs->fs_fd, 0);
-  if ( fs->fs_io == MAP_FAILED ){
-    perror("mmap");
+  if ( _rsh_fat16_map_image(fs, fs->fs_header.size) )
     return RSH_ERR;
-  }
   
   /* Now populate the rest of the rsh_fat16_fs struct we were passed. */
-  fs->fat_entries = fs->fs_header.len / fs->fs_header.csize;
+  fs->fat_entries = fs->fs_header.size / fs->fs_header.csize;
   fs->fat_clusters = (fs->fat_entries * sizeof(fat_t)) / fs->fs_header.csize;
   if ( (fs->fat_clusters * fs->fs_header.csize) < 
        (fs->fat_entries * sizeof(fat_t)) ){
     fs->fat_clusters++;
   }
   fs->fat_per_cluster = fs->fs_header.csize / sizeof(fat_t);
-  fs->dir_per_cluster = fs->fs_header.csize / sizeof(struct rsh_fat_dirent);
   fs->fat_size = fs->fat_entries * sizeof(fat_t);
 
-  /* OK, and we are done. */
-  return RSH_OK;
+  /* The FAT can move when the image grows, so check where it is too. */
+  if ( (uint64_t)fs->fs_header.fat_offset + fs->fat_clusters >
+       fs->fat_entries ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version >= RSH_FS_V2 &&
+       (uint64_t)fs->fs_header.journal_offset +
+       fs->fs_header.journal_clusters > fs->fat_entries ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version < RSH_FS_V3 ){
+    fs->fs_header.refs_offset = 0;
+    fs->fs_header.refs_clusters = 0;
+  } else if ( (uint64_t)fs->fs_header.refs_offset +
+	      fs->fs_header.refs_clusters > fs->fat_entries ||
+	      (uint64_t)fs->fs_header.refs_clusters * fs->fs_header.csize <
+	      fs->fat_entries ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version < RSH_FS_V4 ){
+    fs->fs_header.holes_offset = 0;
+    fs->fs_header.holes_clusters = 0;
+  } else if ( (uint64_t)fs->fs_header.holes_offset +
+	      fs->fs_header.holes_clusters > fs->fat_entries ||
+	      (uint64_t)fs->fs_header.holes_clusters * fs->fs_header.csize <
+	      (uint64_t)fs->fat_entries * sizeof(uint32_t) ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version < RSH_FS_V5 ){
+    fs->fs_header.pack_offset = 0;
+  } else if ( ! fs->fs_header.pack_offset ||
+	      fs->fs_header.pack_offset >= fs->fat_entries ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version < RSH_FS_V6 ){
+    fs->fs_header.flags = 0;
+  } else if ( fs->fs_header.flags & ~(RSH_FS_COMPACT_DIRS|RSH_FS_TREE_DIRS|
+					 RSH_FS_ZIP_FILES|
+					 RSH_FS_DEDUP_FILES) ){
+    printf("%s: not an image this shell understands (flags 0x%x).\n",
+	   path, fs->fs_header.flags);
+    return RSH_ERR;
+  }
+
+  if ( fs->fs_header.version < RSH_FS_V7 ){
+    fs->fs_header.csum_offset = 0;
+    fs->fs_header.csum_clusters = 0;
+  } else if ( ! fs->fs_header.csum_offset ||
+	      (uint64_t)fs->fs_header.csum_offset +
+	      fs->fs_header.csum_clusters > fs->fat_entries ||
+	      (uint64_t)fs->fs_header.csum_clusters * fs->fs_header.csize <
+	      (uint64_t)fs->fat_entries * sizeof(uint32_t) ){
+    printf("%s: bad image header.\n", path);
+    return RSH_ERR;
+  }
+
+  /* Whatever replaying the journal changes needs new sums. */
+  if ( _rsh_fat16_csum_open(fs) )
+    return RSH_ERR;
+
+  /* Bring the metadata up to the last commit if we crashed. */
+  return _rsh_fat16_journal_open(fs);
 
 }
 
@@ -1154,6 +2573,11 @@ struct rsh_io_ops fops = {
   .readdir = rsh_fat16_readdir,
   .mkdir = rsh_fat16_mkdir,
   .unlink = rsh_fat16_unlink,
+  .rename = rsh_fat16_rename,
+  .clone = rsh_fat16_clone,
+  .readv_map = rsh_fat16_readv_map,
+  .fallocate = rsh_fat16_fallocate,
+  .lseek = rsh_fat16_lseek,
 
 };
 
@@ -1169,6 +2593,28 @@ int rsh_fat16_init(char *local_path, size_t size, size_t cluster){
   int err;
   struct stat buf;
 
+  /* Whatever journal we had was for some other image, and the same goes
+   * for what we knew about checksums. Unmounting the old image cleanly
+   * still needs the sums. */
+  _rsh_fat16_journal_unmount();
+  _rsh_fat16_csum_close();
+
+  /* Done with whatever image we had before. */
+  if ( fat16_fs.fs_io ){
+    _rsh_fat16_unmap_image(&fat16_fs);
+    close(fat16_fs.fs_fd);
+  }
+
+  /* The free and dirty maps are sized for the old image too. Creating or
+   * opening the new one already sets FAT entries and dirties pages, so they
+   * have to be gone before that, not just rebuilt after. */
+  free(fat16_fs.free_map);
+  free(fat16_fs.free_summary);
+  free(fat16_fs.dirty_map);
+  fat16_fs.free_map = NULL;
+  fat16_fs.free_summary = NULL;
+  fat16_fs.dirty_map = NULL;
+
   if ( stat(local_path, &buf) )
     err = _rsh_fat16_init_creat(local_path, &fat16_fs, size, cluster);
   else
@@ -1177,10 +2623,39 @@ int rsh_fat16_init(char *local_path, size_t size, size_t cluster){
   if ( err )
     return err;
 
+  /* Any directory indexes we have are for some other image. */
+  _rsh_fat16_dindex_drop_all();
+  _rsh_fat16_dcache_flush();
+  _rsh_fat16_dedup_drop();
+
+  /* Figure out where the free space is so allocation doesn't have to. */
+  if ( _rsh_fat16_build_free_map(&fat16_fs) )
+    printf("Warning: no memory for the free cluster map, using FAT scans.\n");
+  if ( _rsh_fat16_build_dirty_map(&fat16_fs) )
+    printf("Warning: no memory for the dirty page map, syncing everything.\n");
+
+  /* And where small files get packed. */
+  if ( _rsh_fat16_pack_open(&fat16_fs) )
+    return RSH_ERR;
+
+  /* What holes read as when handed out by readv_map. */
+  free(fat16_fs.zero_cluster);
+  fat16_fs.zero_cluster = calloc(1, FAT_CLUSTER_SIZE);
+  if ( ! fat16_fs.zero_cluster )
+    return RSH_ERR;
+
   /* Now register the file system driver (us) so that we can actually do
    * stuff. */
   rsh_register_fs(&fops, local_path, &fat16_fs);
 
+  /* The journal only brings back what was committed. Whatever else the
+   * kernel wrote back before a crash is fsck's to clean up. */
+  if ( _rsh_fat16_journal_unclean() ){
+    printf("%s: not unmounted cleanly, checking it.\n", local_path);
+    if ( rsh_fat16_fsck(0, 1, 1) < 0 )
+      printf("Warning: fsck of %s failed.\n", local_path);
+  }
+
   return RSH_OK;
 
 }
@@ -1191,15 +2666,52 @@ int rsh_fat16_init(char *local_path, size_t size, size_t cluster){
 int builtin_fatinfo(int argc, char **argv, int in, int out, int err){
 
   printf("FAT16 Header:\n");
+  printf("  version:         %u\n", fat16_fs.fs_header.version);
   printf("  csize:           %d\n", fat16_fs.fs_header.csize);
-  printf("  length:          %d\n", fat16_fs.fs_header.len);
+  printf("  length:          %llu\n",
+	 (unsigned long long)fat16_fs.fs_header.size);
   printf("  root_offset:     %d\n", fat16_fs.fs_header.root_offset);
   printf("  fat_offset:      %d\n", fat16_fs.fs_header.fat_offset);
+  if ( fat16_fs.fs_header.version >= RSH_FS_V2 ){
+    printf("  journal_offset:  %u\n", fat16_fs.fs_header.journal_offset);
+    printf("  journal_clusters: %u\n", fat16_fs.fs_header.journal_clusters);
+  }
+  if ( fat16_fs.fs_header.version >= RSH_FS_V3 ){
+    printf("  refs_offset:     %u\n", fat16_fs.fs_header.refs_offset);
+    printf("  refs_clusters:   %u\n", fat16_fs.fs_header.refs_clusters);
+  }
+  if ( fat16_fs.fs_header.version >= RSH_FS_V4 ){
+    printf("  holes_offset:    %u\n", fat16_fs.fs_header.holes_offset);
+    printf("  holes_clusters:  %u\n", fat16_fs.fs_header.holes_clusters);
+  }
+  if ( fat16_fs.fs_header.version >= RSH_FS_V5 )
+    printf("  pack_offset:     %u\n", fat16_fs.fs_header.pack_offset);
+  if ( fat16_fs.fs_header.version >= RSH_FS_V6 )
+    printf("  flags:           0x%08x\n", fat16_fs.fs_header.flags);
+  if ( fat16_fs.fs_header.version >= RSH_FS_V7 ){
+    printf("  csum_offset:     %u\n", fat16_fs.fs_header.csum_offset);
+    printf("  csum_clusters:   %u\n", fat16_fs.fs_header.csum_clusters);
+  }
   printf("Internal info:\n");
   printf("  fat_entries:     %d\n", fat16_fs.fat_entries);
   printf("  fat_per_cluster: %d\n", fat16_fs.fat_per_cluster);
   printf("  fat_clusters:    %d\n", fat16_fs.fat_clusters);
   printf("  fat_size:        %d\n", fat16_fs.fat_size);
+  printf("  dirents:         %s\n", FAT_COMPACT_DIRS ? "compact" : "fixed");
+  printf("  dir trees:       %s\n", FAT_TREE_DIRS ? "yes" : "no");
+  printf("  compression:     %s\n", FAT_ZIP_FILES ? "yes" : "no");
+  printf("  dedup:           %s\n", FAT_DEDUP_FILES ? "yes" : "no");
+  printf("  zip chunks:      %u\n", rsh_fat16_zip_chunks);
+  printf("  dedup saved:     %llu\n",
+	 (unsigned long long)rsh_fat16_dedup_saved);
+  printf("  verify reads:    %s\n", rsh_fat16_verify_reads ? "on" : "off");
+  printf("  checksum errors: %u\n", rsh_fat16_csum_errors);
+  printf("  pack clusters:   %u\n", fat16_fs.pack_count);
+  printf("  pack max:        %u\n", fat16_fs.pack_max);
+  printf("  dcache hits:     %u\n", rsh_fat16_dcache_hits);
+  printf("  dcache misses:   %u\n", rsh_fat16_dcache_misses);
+  printf("  journal commits: %u\n", rsh_fat16_journal_commits);
+  printf("  checkpoints:     %u\n", rsh_fat16_journal_checkpoints);
   printf("Memory map address: 0x%016lx\n", (long unsigned int)fat16_fs.fs_io);
 
   return 0;
@@ -1207,33 +2719,90 @@ int builtin_fatinfo(int argc, char **argv, int in, int out, int err){
 }
 
 /*
- * Display usage stats for the file system.
+ * Shell variables for scripts that want to keep an eye on free space. The
+ * shell hooks these up to rsh_fat16_stat_sym() so they're always current.
+ */
+char *rsh_fat16_stat_syms[] = {
+  "FS_FREE_CLUSTERS",
+  "FS_USED_CLUSTERS",
+  "FS_FREE_BYTES",
+  "FS_USED_BYTES",
+  NULL
+};
+
+/*
+ * Get the value of one of the above. The counters are kept up to date by
+ * rsh_fat16_set_entry() so this doesn't go anywhere near the FAT. The
+ * returned string is only good until the next call.
+ */
+char *rsh_fat16_stat_sym(char *sym){
+
+  static char value[32];
+  uint64_t free_clusters = fat16_fs.free_clusters;
+  uint64_t used_clusters = fat16_fs.fat_entries - fat16_fs.free_clusters;
+
+  if ( strcmp(sym, "FS_FREE_CLUSTERS") == 0 )
+    snprintf(value, sizeof(value), "%llu",
+	     (unsigned long long)free_clusters);
+  else if ( strcmp(sym, "FS_USED_CLUSTERS") == 0 )
+    snprintf(value, sizeof(value), "%llu",
+	     (unsigned long long)used_clusters);
+  else if ( strcmp(sym, "FS_FREE_BYTES") == 0 )
+    snprintf(value, sizeof(value), "%llu",
+	     (unsigned long long)free_clusters * FAT_CLUSTER_SIZE);
+  else if ( strcmp(sym, "FS_USED_BYTES") == 0 )
+    snprintf(value, sizeof(value), "%llu",
+	     (unsigned long long)used_clusters * FAT_CLUSTER_SIZE);
+  else
+    return NULL;
+
+  return value;
+
+}
+
+/*
+ * Display usage stats for the file system. Passed a directory, also show how
+ * many bytes the files directly in it take up. None of this scans the FAT,
+ * the counts are kept up to date as the FAT changes.
  */
 int builtin_df(int argc, char **argv, int in, int out, int err){
 
   int i;
-  int clusters;
-  int used_clusters;
-  fat_t *fat_table = 
-    (fat_t *)FAT_CLUSTER_TO_ADDR(fat16_fs.fs_header.fat_offset);
+  uint32_t clusters;
+  uint32_t used_clusters;
   float usage;
+  struct rsh_fat_dirent dirent;
+  struct rsh_fat16_dindex *index;
 
-  /* The total free clusters. */
-  clusters = fat16_fs.fs_header.len / fat16_fs.fs_header.csize;
-  
-  /* The total used clusters. */
-  for ( i = 0; i < fat16_fs.fat_entries; i++){
-    if ( fat_table[i] != FAT_FREE )
-      used_clusters++;
-  }
+  clusters = fat16_fs.fat_entries;
+  used_clusters = clusters - fat16_fs.free_clusters;
 
   usage = (float)used_clusters/(float)clusters;
   usage *= 100.0;
 
-  printf("Total bytes avaliable: %d\n", fat16_fs.fs_header.len);
-  printf("  Clusters used/avaliable: %d / %d\n", used_clusters, clusters);
+  printf("Total bytes avaliable: %llu\n",
+	 (unsigned long long)fat16_fs.fs_header.size);
+  printf("  Clusters used/avaliable: %u / %u\n", used_clusters, clusters);
   printf("Usage: %.2lf%%\n", usage);
 
+  for ( i = 1; i < argc; i++ ){
+    if ( _rsh_fat16_path_to_dirent(argv[i], &dirent, NULL) ||
+	 dirent.type != FAT_DIR ){
+      printf("%s: not a directory\n", argv[i]);
+      continue;
+    }
+    index = _rsh_fat16_dindex_get(dirent.index);
+    if ( ! index ){
+      printf("%s: out of memory\n", argv[i]);
+      continue;
+    }
+    printf("%s: %llu bytes in files\n", argv[i],
+	   (unsigned long long)index->bytes);
+    /* Tree directories don't keep an index up to date. */
+    if ( _rsh_fat16_tree_root(dirent.index) )
+      _rsh_fat16_dindex_drop(dirent.index);
+  }
+
   return 0;
   
 }
@@ -1260,25 +2829,24 @@ void _rsh_fat16_display_fat(){
 
 void _rsh_fat16_display_dir(uint32_t dir){
 
-  int i;
   int index = 0;
   uint32_t clust = dir;
-  struct rsh_fat_dirent *dir_entries;
+  struct rsh_fat_dirent *ent;
 
   do {
   start:
 
     /* Search the cluster. */
-    dir_entries = FAT_CLUSTER_TO_ADDR(clust);
-    for ( i = 0; i < fat16_fs.dir_per_cluster; i++){
+    for ( ent = _rsh_fat16_dirent_next(clust, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(clust, ent) ){
 
-      if ( *(dir_entries[i].name) ){
+      if ( *FAT_DIRENT_NAME(ent) ){
 	printf("Entry %d\n", index++);
-	printf(" name  %s\n", dir_entries[i].name);
-	printf(" index %u\n", dir_entries[i].index);
-	printf(" size  %u\n", dir_entries[i].size);
-	printf(" type  0x%02x\n", dir_entries[i].type);
-	printf(" epoch %u\n", dir_entries[i].epoch);
+	printf(" name  %s\n", FAT_DIRENT_NAME(ent));
+	printf(" index %u\n", ent->index);
+	printf(" size  %llu\n", (unsigned long long)FAT_DIRENT_SIZE(ent));
+	printf(" type  0x%02x\n", ent->type);
+	printf(" epoch %u\n", ent->epoch);
       }
 
     }
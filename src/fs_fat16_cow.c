@@ -0,0 +1,294 @@
+/*
+ * Files that share clusters. Cloning a file makes a new dirent pointing at
+ * the same chain, so the copy is instant and takes no space. Writing to
+ * either one afterwards copies just enough of the chain to give the writer
+ * its own clusters.
+ *
+ * Version 3 images have a byte per cluster after the journal counting the
+ * extra references to it: how many more chains run into it than the one.
+ * Something "runs into" a cluster if it's a dirent pointing at it or a FAT
+ * entry linking to it. Since a chain goes wherever the FAT says, once two
+ * files share a cluster they share everything after it too; sharing is
+ * always the tail end of a chain.
+ *
+ * So to write cluster k of a file whose chain is shared from cluster j on,
+ * clusters j through k get copied and linked in place of the originals, and
+ * the last copy links back into the shared chain at k + 1. Everything else
+ * stays shared. Freeing a chain stops at the first cluster somebody else
+ * still runs into.
+ *
+ * Open files keep where in their cluster maps the sharing starts. A count
+ * going up only matters to them if a cluster that wasn't shared now is: the
+ * head of a file being cloned, whose open files get told, or where a copy
+ * rejoins the chain, and anyone else running through there was already
+ * sharing from further up. A count going down just means they unshare
+ * a bit early.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define FAT_REFS_TABLE							\
+  ( (uint8_t *)FAT_CLUSTER_TO_ADDR(fat16_fs.fs_header.refs_offset) )
+
+/*
+ * Extra references to a cluster, 0 if it isn't shared.
+ */
+uint32_t _rsh_fat16_refs(uint32_t cluster){
+
+  if ( ! fat16_fs.fs_header.refs_offset || cluster >= fat16_fs.fat_entries )
+    return 0;
+
+  return FAT_REFS_TABLE[cluster];
+
+}
+
+void _rsh_fat16_set_refs(uint32_t cluster, uint32_t refs){
+
+  if ( ! fat16_fs.fs_header.refs_offset || cluster >= fat16_fs.fat_entries )
+    return;
+
+  FAT_REFS_TABLE[cluster] = refs;
+  rsh_fat16_meta(&FAT_REFS_TABLE[cluster], 1);
+
+}
+
+/*
+ * Drop a reference to the chain starting at cluster. Clusters are freed up
+ * to the first one that somebody else still runs into.
+ */
+void _rsh_fat16_release(uint32_t cluster){
+
+  uint32_t refs;
+  uint32_t next;
+
+  while ( cluster != FAT_TERM ){
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    refs = _rsh_fat16_refs(cluster);
+    if ( refs ){
+      _rsh_fat16_set_refs(cluster, refs - 1);
+      return;
+    }
+
+    next = rsh_fat16_get_entry(cluster);
+    rsh_fat16_set_entry(cluster, FAT_FREE);
+    cluster = next;
+
+  }
+
+}
+
+/*
+ * Is any of the chain starting at head shared?
+ */
+int _rsh_fat16_chain_shared(uint32_t head){
+
+  if ( ! fat16_fs.fs_header.refs_offset )
+    return 0;
+
+  for ( ; head != FAT_TERM; head = rsh_fat16_get_entry(head) ){
+    if ( head == FAT_FREE || head == FAT_RESERVED )
+      rsh_fat16_badness();
+    if ( _rsh_fat16_refs(head) )
+      return 1;
+  }
+
+  return 0;
+
+}
+
+/*
+ * Give file its own copy of the cluster at index in its map, along with any
+ * shared clusters before it. The map must already reach index.
+ */
+int _rsh_fat16_unshare(struct rsh_fat16_file *file, uint32_t index){
+
+  uint32_t i;
+  uint32_t first;
+  uint32_t next;
+  uint32_t cluster;
+  uint32_t prev = FAT_TERM;
+  uint32_t pos = file->pos;
+
+  /* Where does the sharing start? */
+  for ( first = 0; first <= index; first++ )
+    if ( _rsh_fat16_refs(file->clusters[first]) )
+      break;
+  if ( first > index )
+    return RSH_OK;
+
+  /* The copy will link back into the chain at next, which needs room for
+   * one more reference. Copy further along until there is. */
+  for ( ; ; ){
+    next = rsh_fat16_get_entry(file->clusters[index]);
+    if ( next == FAT_TERM || _rsh_fat16_refs(next) < FAT_MAX_REFS )
+      break;
+    if ( _rsh_fat16_file_cluster(file, file->logical[index] + 1 +
+				 _rsh_fat16_gap(file->clusters[index]))
+	 == FAT_RESERVED )
+      return RSH_ERR;
+    file->pos = pos;
+    index++;
+  }
+
+  if ( _rsh_fat16_make_room(index - first + 1) )
+    return RSH_ERR;
+
+  _rsh_fat16_chain_changed(file->clusters[0], file);
+  for ( i = first; i <= index; i++ ){
+
+    if ( __rsh_fat16_find_open_cluster(&cluster) ){
+      errno = ENOSPC;
+      return RSH_ERR;
+    }
+    memcpy(FAT_CLUSTER_TO_ADDR(cluster), FAT_CLUSTER_TO_ADDR(file->clusters[i]),
+	   FAT_CLUSTER_SIZE);
+    rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster), FAT_CLUSTER_SIZE);
+    rsh_fat16_set_entry(cluster, FAT_TERM);
+    _rsh_fat16_set_gap(cluster, _rsh_fat16_gap(file->clusters[i]));
+
+    if ( i == first ){
+      /* We don't run into the old cluster anymore. */
+      _rsh_fat16_set_refs(file->clusters[i],
+			  _rsh_fat16_refs(file->clusters[i]) - 1);
+      if ( i == 0 ){
+	file->dirent->index = cluster;
+	rsh_fat16_meta(file->dirent, sizeof(struct rsh_fat_dirent));
+      } else {
+	rsh_fat16_set_entry(file->clusters[i - 1], cluster);
+      }
+    } else {
+      rsh_fat16_set_entry(prev, cluster);
+    }
+
+    file->clusters[i] = cluster;
+    prev = cluster;
+
+  }
+
+  /* And back into the shared part. */
+  if ( next != FAT_TERM ){
+    rsh_fat16_set_entry(prev, next);
+    _rsh_fat16_set_refs(next, _rsh_fat16_refs(next) + 1);
+  }
+
+  /* Our own map is right, it just has to know what's shared now. */
+  file->shared = next != FAT_TERM && index + 1 < file->length ?
+    index + 1 : FAT_UNSHARED;
+
+  return RSH_OK;
+
+}
+
+/*
+ * Make newpath a clone of the file at oldpath. Anything already at newpath is
+ * replaced, unless it's a directory or open (EBUSY; its slot gets reused).
+ */
+int rsh_fat16_clone(const char *oldpath, const char *newpath){
+
+  int ret = -1;
+  char *old_copy, *new_copy;
+  char *old_name, *new_name;
+  uint32_t old_dir, new_dir;
+  uint32_t refs;
+  uint32_t unit = 0;
+  int packed;
+  struct rsh_fat_dirent *child;
+  struct rsh_fat_dirent *slot;
+
+  if ( ! fat16_fs.fs_header.refs_offset ){
+    errno = ENOSYS;
+    return -1;
+  }
+
+  old_copy = strdup(oldpath);
+  new_copy = strdup(newpath);
+  if ( ! old_copy || ! new_copy ){
+    errno = ENOMEM;
+    goto out;
+  }
+
+  if ( _rsh_fat16_parent(old_copy, &old_name, &old_dir) ||
+       _rsh_fat16_parent(new_copy, &new_name, &new_dir) )
+    goto out;
+
+  child = _rsh_fat16_locate_child(old_name, old_dir);
+  if ( ! child ){
+    errno = ENOENT;
+    goto out;
+  }
+  if ( child->type == FAT_DIR ){
+    errno = EISDIR;
+    goto out;
+  }
+
+  /* A packed file is small enough to just copy. */
+  packed = FAT_DIRENT_PACKED(child);
+  refs = packed ? 0 : _rsh_fat16_refs(child->index);
+  if ( refs >= FAT_MAX_REFS ){
+    errno = EMLINK;
+    goto out;
+  }
+
+  slot = _rsh_fat16_locate_child(new_name, new_dir);
+  if ( slot == child ){
+    ret = 0;
+    goto out;
+  }
+  if ( slot ){
+    if ( slot->type == FAT_DIR ){
+      errno = EISDIR;
+      goto out;
+    }
+    if ( _rsh_fat16_is_open(slot) ){
+      errno = EBUSY;
+      goto out;
+    }
+    if ( packed && _rsh_fat16_pack_copy(child, &unit) )
+      goto out;
+    _rsh_fat16_remove(new_dir, slot);
+    /* That may have been the last other reference. */
+    if ( ! packed )
+      refs = _rsh_fat16_refs(child->index);
+  } else {
+    slot = _rsh_fat16_new_dirent(new_dir, new_name);
+    if ( ! slot )
+      goto out;
+    if ( packed && _rsh_fat16_pack_copy(child, &unit) )
+      goto out;
+  }
+
+  *slot = *child;
+  _rsh_fat16_dirent_name(slot, new_name);
+  slot->epoch = (uint32_t) time(NULL);
+  if ( packed )
+    slot->size_hi = unit;
+  else
+    _rsh_fat16_set_refs(child->index, refs + 1);
+  rsh_fat16_meta(slot, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_dindex_insert(new_dir, slot);
+  _rsh_fat16_dcache_created();
+
+  /* Anyone with the original open has to know its chain is shared now. */
+  if ( ! packed )
+    _rsh_fat16_chain_changed(child->index, NULL);
+
+  _rsh_fat16_journal_commit();
+  ret = 0;
+
+ out:
+  free(old_copy);
+  free(new_copy);
+  return ret;
+
+}
@@ -0,0 +1,801 @@
+/*
+ * Cluster checksums. The image is a mmap()'ed file, so a bit that flips on
+ * the disk or a write that only half makes it shows up as file data that's
+ * just wrong, and nothing notices unless it happens to be the FAT.
+ *
+ * Version 7 images have a table of CRC32Cs after the hole table, one per
+ * cluster. Keeping it up to date on every write would mean summing a whole
+ * cluster for every byte written, so instead anything that marks part of
+ * the image changed (rsh_fat16_dirty(), rsh_fat16_meta() and the journal)
+ * marks its clusters stale here, and the sums of stale clusters get worked
+ * out again just before the image is written back: rsh_fat16_sync() and
+ * journal checkpoints flush them first. So the table on the disk goes with
+ * the data on the disk. A crash in between leaves sums that don't match,
+ * which is exactly what they're for.
+ *
+ * Reads check the sum of each cluster they touch if rsh_fat16_verify_reads
+ * is set (--verify, or the verify builtin), failing with EIO if it's wrong.
+ * A cluster is only checked once until it changes again, so reading the
+ * same data over and over costs a bit test. Stale clusters aren't checked
+ * at all; what's in memory is newer than their sum.
+ *
+ * The scrub builtin checks everything in the image on a pool of threads
+ * and says which files are bad.
+ *
+ * The CRC uses the SSE4.2 crc32 instruction where there is one, three
+ * streams at a time to keep it busy, and slicing-by-8 tables otherwise.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Most scrubbing threads we'll start. */
+#define CSUM_MAX_THREADS 8
+
+/* CRC32C, bit reversed. */
+#define CSUM_POLY 0x82f63b78
+
+/* Block sizes the hardware CRC interleaves three streams over. These have to
+ * be powers of two. */
+#define CSUM_LONG  2048
+#define CSUM_SHORT 256
+
+#define FAT_CSUM_TABLE							\
+  ( (uint32_t *)FAT_CLUSTER_TO_ADDR(fat16_fs.fs_header.csum_offset) )
+
+/* Something to scrub: a file or a directory, and what was wrong with it. */
+struct rsh_fat16_scrub_ent {
+
+  char *path;
+  struct rsh_fat_dirent *ent;
+  uint32_t dir;              /* First cluster of a directory, else 0. */
+  uint32_t clusters;
+  uint32_t bad;
+
+};
+
+struct rsh_fat16_scrub {
+
+  struct rsh_fat16_scrub_ent *ents;
+  uint32_t nents;
+  uint32_t size;
+  uint32_t next;             /* Next entry to check, taken atomically. */
+
+};
+
+int rsh_fat16_verify_reads = 0;
+
+/* Bad sums reads have run into. */
+uint32_t rsh_fat16_csum_errors = 0;
+
+static uint32_t csum_table[8][256];
+static uint32_t csum_long[4][256];
+static uint32_t csum_short[4][256];
+static uint32_t (*csum_fn)(uint32_t crc, const void *buf, size_t len) = NULL;
+
+/* The sum of a cluster of zeros, which is what every cluster of a new image
+ * (and of the new part of a grown one) is. */
+static uint32_t csum_zero;
+
+/* A bit per cluster, set in stale when the cluster changes and in checked
+ * once a read has checked it. stale_any is set whenever a bit in stale is,
+ * so flushing nothing is cheap. */
+static uint32_t *stale = NULL;
+static uint32_t *checked = NULL;
+static uint32_t csum_words = 0;
+static volatile int stale_any = 0;
+
+/* Flushes happen from the flusher thread too; one at a time. */
+static pthread_mutex_t csum_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * CRC of len bytes at buf carrying on from crc, a byte at a time through the
+ * slicing tables, 8 bytes at a time where it can.
+ */
+static uint32_t _rsh_fat16_csum_sw(uint32_t crc, const void *buf, size_t len){
+
+  uint64_t w;
+  const uint8_t *p = buf;
+
+  crc = ~crc;
+  while ( len && ((uintptr_t)p & 7) ){
+    crc = csum_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    len--;
+  }
+  while ( len >= 8 ){
+    memcpy(&w, p, 8);
+    w ^= crc;
+    crc = csum_table[7][w & 0xff] ^ csum_table[6][(w >> 8) & 0xff] ^
+      csum_table[5][(w >> 16) & 0xff] ^ csum_table[4][(w >> 24) & 0xff] ^
+      csum_table[3][(w >> 32) & 0xff] ^ csum_table[2][(w >> 40) & 0xff] ^
+      csum_table[1][(w >> 48) & 0xff] ^ csum_table[0][w >> 56];
+    p += 8;
+    len -= 8;
+  }
+  while ( len-- )
+    crc = csum_table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+  return ~crc;
+
+}
+
+/*
+ * Multiply vec by the 32x32 bit matrix mat over GF(2).
+ */
+static uint32_t _rsh_fat16_csum_times(const uint32_t *mat, uint32_t vec){
+
+  uint32_t sum = 0;
+
+  for ( ; vec; vec >>= 1, mat++ )
+    if ( vec & 1 )
+      sum ^= *mat;
+
+  return sum;
+
+}
+
+static void _rsh_fat16_csum_square(uint32_t *square, const uint32_t *mat){
+
+  int n;
+
+  for ( n = 0; n < 32; n++ )
+    square[n] = _rsh_fat16_csum_times(mat, mat[n]);
+
+}
+
+/*
+ * Tables for moving a CRC past len zero bytes (len a power of two), which is
+ * what it takes to join up the CRCs of blocks done side by side.
+ */
+static void _rsh_fat16_csum_zeros(uint32_t zeros[][256], size_t len){
+
+  int n;
+  uint32_t row = 1;
+  uint32_t even[32];
+  uint32_t odd[32];
+
+  /* One zero bit, then square our way up to len bytes. */
+  odd[0] = CSUM_POLY;
+  for ( n = 1; n < 32; n++, row <<= 1 )
+    odd[n] = row;
+  _rsh_fat16_csum_square(even, odd);
+  _rsh_fat16_csum_square(odd, even);
+  for ( ; ; ){
+    _rsh_fat16_csum_square(even, odd);
+    len >>= 1;
+    if ( ! len )
+      break;
+    _rsh_fat16_csum_square(odd, even);
+    len >>= 1;
+    if ( ! len ){
+      memcpy(even, odd, sizeof(even));
+      break;
+    }
+  }
+
+  for ( n = 0; n < 256; n++ ){
+    zeros[0][n] = _rsh_fat16_csum_times(even, n);
+    zeros[1][n] = _rsh_fat16_csum_times(even, n << 8);
+    zeros[2][n] = _rsh_fat16_csum_times(even, n << 16);
+    zeros[3][n] = _rsh_fat16_csum_times(even, (uint32_t)n << 24);
+  }
+
+}
+
+static uint32_t _rsh_fat16_csum_shift(uint32_t zeros[][256], uint32_t crc){
+
+  return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^
+    zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+
+}
+
+#if defined(__x86_64__)
+
+/*
+ * The same thing with the crc32 instruction. It takes three cycles to come
+ * back with an answer but can start a new one every cycle, so the buffer is
+ * done as three blocks side by side which get joined up after.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t _rsh_fat16_csum_hw(uint32_t crc, const void *buf, size_t len){
+
+  uint64_t c0, c1, c2;
+  uint64_t w0, w1, w2;
+  const uint8_t *p = buf;
+  const uint8_t *end;
+
+  c0 = ~crc;
+  while ( len && ((uintptr_t)p & 7) ){
+    c0 = __builtin_ia32_crc32qi(c0, *p++);
+    len--;
+  }
+
+  while ( len >= CSUM_LONG * 3 ){
+    c1 = c2 = 0;
+    for ( end = p + CSUM_LONG; p < end; p += 8 ){
+      memcpy(&w0, p, 8);
+      memcpy(&w1, p + CSUM_LONG, 8);
+      memcpy(&w2, p + CSUM_LONG * 2, 8);
+      c0 = __builtin_ia32_crc32di(c0, w0);
+      c1 = __builtin_ia32_crc32di(c1, w1);
+      c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    c0 = _rsh_fat16_csum_shift(csum_long, c0) ^ c1;
+    c0 = _rsh_fat16_csum_shift(csum_long, c0) ^ c2;
+    p += CSUM_LONG * 2;
+    len -= CSUM_LONG * 3;
+  }
+
+  while ( len >= CSUM_SHORT * 3 ){
+    c1 = c2 = 0;
+    for ( end = p + CSUM_SHORT; p < end; p += 8 ){
+      memcpy(&w0, p, 8);
+      memcpy(&w1, p + CSUM_SHORT, 8);
+      memcpy(&w2, p + CSUM_SHORT * 2, 8);
+      c0 = __builtin_ia32_crc32di(c0, w0);
+      c1 = __builtin_ia32_crc32di(c1, w1);
+      c2 = __builtin_ia32_crc32di(c2, w2);
+    }
+    c0 = _rsh_fat16_csum_shift(csum_short, c0) ^ c1;
+    c0 = _rsh_fat16_csum_shift(csum_short, c0) ^ c2;
+    p += CSUM_SHORT * 2;
+    len -= CSUM_SHORT * 3;
+  }
+
+  for ( ; len >= 8; p += 8, len -= 8 ){
+    memcpy(&w0, p, 8);
+    c0 = __builtin_ia32_crc32di(c0, w0);
+  }
+  while ( len-- )
+    c0 = __builtin_ia32_crc32qi(c0, *p++);
+
+  return ~(uint32_t)c0;
+
+}
+
+#endif
+
+/*
+ * Build the tables and pick the fastest CRC this CPU can do.
+ */
+static void _rsh_fat16_csum_setup(){
+
+  int i, k;
+  uint32_t crc;
+
+  if ( csum_fn )
+    return;
+
+  for ( i = 0; i < 256; i++ ){
+    crc = i;
+    for ( k = 0; k < 8; k++ )
+      crc = crc & 1 ? (crc >> 1) ^ CSUM_POLY : crc >> 1;
+    csum_table[0][i] = crc;
+  }
+  for ( i = 0; i < 256; i++ )
+    for ( k = 1; k < 8; k++ )
+      csum_table[k][i] = csum_table[0][csum_table[k - 1][i] & 0xff] ^
+	(csum_table[k - 1][i] >> 8);
+  _rsh_fat16_csum_zeros(csum_long, CSUM_LONG);
+  _rsh_fat16_csum_zeros(csum_short, CSUM_SHORT);
+
+  csum_fn = _rsh_fat16_csum_sw;
+#if defined(__x86_64__)
+  if ( __builtin_cpu_supports("sse4.2") )
+    csum_fn = _rsh_fat16_csum_hw;
+#endif
+
+}
+
+/*
+ * CRC32C of len bytes at buf, carrying on from crc (0 to start).
+ */
+uint32_t _rsh_fat16_crc32c(uint32_t crc, const void *buf, size_t len){
+
+  _rsh_fat16_csum_setup();
+  return csum_fn(crc, buf, len);
+
+}
+
+/*
+ * The same, always with the tables. For checking one against the other.
+ */
+uint32_t _rsh_fat16_crc32c_sw(uint32_t crc, const void *buf, size_t len){
+
+  _rsh_fat16_csum_setup();
+  return _rsh_fat16_csum_sw(crc, buf, len);
+
+}
+
+static uint32_t _rsh_fat16_csum_cluster(uint32_t cluster){
+
+  return csum_fn(0, FAT_CLUSTER_TO_ADDR(cluster), FAT_CLUSTER_SIZE);
+
+}
+
+/*
+ * Forget the image we had.
+ */
+void _rsh_fat16_csum_close(){
+
+  pthread_mutex_lock(&csum_lock);
+  free(stale);
+  free(checked);
+  stale = checked = NULL;
+  csum_words = 0;
+  stale_any = 0;
+  pthread_mutex_unlock(&csum_lock);
+
+}
+
+/*
+ * Get ready for the image in fs, which is mapped with its header read in.
+ * Nothing is stale or checked yet.
+ */
+int _rsh_fat16_csum_open(struct rsh_fat16_fs *fs){
+
+  void *zero;
+
+  _rsh_fat16_csum_close();
+  if ( ! fs->fs_header.csum_offset )
+    return RSH_OK;
+
+  pthread_mutex_lock(&csum_lock);
+  _rsh_fat16_csum_setup();
+  zero = calloc(1, fs->fs_header.csize);
+  if ( zero ){
+    csum_zero = csum_fn(0, zero, fs->fs_header.csize);
+    free(zero);
+  }
+
+  csum_words = (fs->fat_entries + 31) / 32;
+  stale = calloc(csum_words, sizeof(uint32_t));
+  checked = calloc(csum_words, sizeof(uint32_t));
+  if ( ! zero || ! stale || ! checked ){
+    free(stale);
+    free(checked);
+    stale = checked = NULL;
+    csum_words = 0;
+    pthread_mutex_unlock(&csum_lock);
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+  pthread_mutex_unlock(&csum_lock);
+
+  return RSH_OK;
+
+}
+
+/*
+ * Fill in the sums of a new image: the clusters in use have whatever they
+ * have, and the rest are zeros.
+ */
+void _rsh_fat16_csum_format(struct rsh_fat16_fs *fs){
+
+  uint32_t i;
+
+  if ( ! fs->fs_header.csum_offset )
+    return;
+
+  for ( i = 0; i < fs->fat_entries; i++ )
+    FAT_CSUM_TABLE[i] = rsh_fat16_get_entry(i) == FAT_FREE ? csum_zero :
+      _rsh_fat16_csum_cluster(i);
+
+}
+
+/*
+ * Sums of clusters from to fat_entries, the new part of a grown image. They
+ * start out as zeros.
+ */
+void _rsh_fat16_csum_grow(uint32_t *table, uint32_t from, uint32_t to){
+
+  for ( ; from < to; from++ )
+    table[from] = csum_zero;
+
+}
+
+/*
+ * Note that len bytes at addr have changed.
+ */
+void _rsh_fat16_csum_stale(void *addr, size_t len){
+
+  uint32_t cluster;
+  uint32_t last;
+
+  if ( ! stale || ! len )
+    return;
+
+  cluster = (addr - fat16_fs.fs_io) / FAT_CLUSTER_SIZE;
+  last = (addr + len - 1 - fat16_fs.fs_io) / FAT_CLUSTER_SIZE;
+  if ( last >= fat16_fs.fat_entries )
+    last = fat16_fs.fat_entries - 1;
+
+  for ( ; cluster <= last; cluster++ ){
+
+    /* The table itself changes every time it's flushed. */
+    if ( cluster >= fat16_fs.fs_header.csum_offset &&
+	 cluster < fat16_fs.fs_header.csum_offset +
+	 fat16_fs.fs_header.csum_clusters )
+      continue;
+
+    checked[cluster / 32] &= ~(1U << (cluster % 32));
+    if ( ! (stale[cluster / 32] & (1U << (cluster % 32))) )
+      __sync_fetch_and_or(&stale[cluster / 32], 1U << (cluster % 32));
+
+  }
+
+  __sync_synchronize();
+  stale_any = 1;
+
+}
+
+/*
+ * Work out the sums of everything that's changed since the last flush, and
+ * mark them to be written back along with it.
+ */
+void _rsh_fat16_csum_flush(){
+
+  uint32_t w;
+  uint32_t bits;
+  uint32_t cluster;
+  uint32_t *table;
+
+  if ( ! stale_any )
+    return;
+
+  pthread_mutex_lock(&csum_lock);
+  stale_any = 0;
+  __sync_synchronize();
+
+  table = FAT_CSUM_TABLE;
+  for ( w = 0; stale && w < csum_words; w++ ){
+    if ( ! stale[w] )
+      continue;
+    bits = __sync_fetch_and_and(&stale[w], 0);
+    while ( bits ){
+      cluster = w * 32 + __builtin_ctz(bits);
+      bits &= bits - 1;
+      table[cluster] = _rsh_fat16_csum_cluster(cluster);
+      rsh_fat16_dirty(&table[cluster], sizeof(uint32_t));
+    }
+  }
+  pthread_mutex_unlock(&csum_lock);
+
+}
+
+/*
+ * Is the sum of cluster right? Stale clusters are.
+ */
+static int _rsh_fat16_csum_good(uint32_t cluster){
+
+  int good;
+
+  if ( _rsh_fat16_csum_cluster(cluster) == FAT_CSUM_TABLE[cluster] ||
+       (stale && (stale[cluster / 32] & (1U << (cluster % 32)))) )
+    return 1;
+
+  /* Could be the flusher is halfway through it; once it's done it'll
+   * either match or be stale again. */
+  pthread_mutex_lock(&csum_lock);
+  good = _rsh_fat16_csum_cluster(cluster) == FAT_CSUM_TABLE[cluster] ||
+    (stale && (stale[cluster / 32] & (1U << (cluster % 32))));
+  pthread_mutex_unlock(&csum_lock);
+
+  return good;
+
+}
+
+/*
+ * A read is about to use cluster. If reads are being checked, make sure its
+ * sum is right: RSH_ERR with errno set to EIO if it isn't.
+ */
+int _rsh_fat16_csum_check(uint32_t cluster){
+
+  if ( ! rsh_fat16_verify_reads || ! checked ||
+       cluster >= fat16_fs.fat_entries ||
+       (checked[cluster / 32] & (1U << (cluster % 32))) )
+    return RSH_OK;
+
+  if ( ! _rsh_fat16_csum_good(cluster) ){
+    rsh_fat16_csum_errors++;
+    errno = EIO;
+    return RSH_ERR;
+  }
+
+  checked[cluster / 32] |= 1U << (cluster % 32);
+  return RSH_OK;
+
+}
+
+/*
+ * The same for a read from a packed file's data.
+ */
+int _rsh_fat16_csum_check_addr(void *addr){
+
+  return _rsh_fat16_csum_check((addr - fat16_fs.fs_io) / FAT_CLUSTER_SIZE);
+
+}
+
+/*
+ * Add something to scrub. Takes path.
+ */
+static int _rsh_fat16_scrub_add(struct rsh_fat16_scrub *scrub, char *path,
+				struct rsh_fat_dirent *ent, uint32_t dir){
+
+  struct rsh_fat16_scrub_ent *ents;
+
+  if ( ! path )
+    goto fail;
+
+  if ( scrub->nents == scrub->size ){
+    ents = realloc(scrub->ents, (scrub->size ? scrub->size * 2 : 64) *
+		   sizeof(struct rsh_fat16_scrub_ent));
+    if ( ! ents )
+      goto fail;
+    scrub->ents = ents;
+    scrub->size = scrub->size ? scrub->size * 2 : 64;
+  }
+
+  scrub->ents[scrub->nents].path = path;
+  scrub->ents[scrub->nents].ent = ent;
+  scrub->ents[scrub->nents].dir = dir;
+  scrub->ents[scrub->nents].clusters = 0;
+  scrub->ents[scrub->nents].bad = 0;
+  scrub->nents++;
+  return RSH_OK;
+
+ fail:
+  free(path);
+  errno = ENOMEM;
+  return RSH_ERR;
+
+}
+
+/*
+ * Add the directory whose table starts at dir (path is its path) and
+ * everything in it to the scrub.
+ */
+static int _rsh_fat16_scrub_dir(struct rsh_fat16_scrub *scrub, uint32_t dir,
+				const char *path){
+
+  char *name;
+  char *sub;
+  uint32_t cluster = dir;
+  struct rsh_fat_dirent *ent;
+
+  if ( _rsh_fat16_scrub_add(scrub, strdup(*path ? path : "/"), NULL, dir) )
+    return RSH_ERR;
+
+  do {
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+      name = FAT_DIRENT_NAME(ent);
+      if ( ! name[0] || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 )
+	continue;
+
+      sub = malloc(strlen(path) + strlen(name) + 2);
+      if ( sub )
+	sprintf(sub, "%s/%s", path, name);
+
+      if ( ent->type == FAT_DIR ){
+	if ( ! sub ){
+	  errno = ENOMEM;
+	  return RSH_ERR;
+	}
+	if ( _rsh_fat16_scrub_dir(scrub, ent->index, sub) ){
+	  free(sub);
+	  return RSH_ERR;
+	}
+	free(sub);
+	continue;
+      }
+
+      if ( _rsh_fat16_scrub_add(scrub, sub, ent, 0) )
+	return RSH_ERR;
+
+    }
+
+    cluster = rsh_fat16_get_entry(cluster);
+
+  } while ( cluster != FAT_TERM );
+
+  return RSH_OK;
+
+}
+
+/*
+ * Check one file or directory: every cluster of its chain, or the pack
+ * cluster it's in. Empty packed files aren't anywhere.
+ */
+static void _rsh_fat16_scrub_one(struct rsh_fat16_scrub_ent *sent){
+
+  uint32_t cluster;
+  uint32_t limit = fat16_fs.fat_entries;
+  uint64_t index = 0;
+
+  if ( sent->ent && FAT_DIRENT_PACKED(sent->ent) ){
+    if ( ! sent->ent->size )
+      return;
+    cluster = (FAT_PACK_TO_ADDR(sent->ent->size_hi) - fat16_fs.fs_io) /
+      FAT_CLUSTER_SIZE;
+    sent->clusters = 1;
+    if ( cluster < fat16_fs.fat_entries && ! _rsh_fat16_csum_good(cluster) )
+      sent->bad++;
+    return;
+  }
+
+  /* Only the clusters with some of the file in them matter. Walking a
+   * chain that loops is fsck's problem; just don't go forever. */
+  for ( cluster = sent->ent ? sent->ent->index : sent->dir;
+	cluster != FAT_TERM && limit--;
+	cluster = rsh_fat16_get_entry(cluster) ){
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED ||
+	 cluster >= fat16_fs.fat_entries ||
+	 (sent->ent && index * FAT_CLUSTER_SIZE >= FAT_DIRENT_SIZE(sent->ent)) )
+      break;
+    sent->clusters++;
+    if ( ! _rsh_fat16_csum_good(cluster) )
+      sent->bad++;
+    index += 1 + _rsh_fat16_gap(cluster);
+  }
+
+}
+
+static void *_rsh_fat16_scrub_worker(void *arg){
+
+  uint32_t i;
+  struct rsh_fat16_scrub *scrub = arg;
+
+  while ( (i = __sync_fetch_and_add(&scrub->next, 1)) < scrub->nents )
+    _rsh_fat16_scrub_one(&scrub->ents[i]);
+
+  return NULL;
+
+}
+
+/*
+ * Check the sum of everything in the image on threads threads (0 picks a
+ * number). Every file or directory with bad clusters gets a line on out.
+ * Returns how many bad clusters there were, or -1 if the scrub couldn't be
+ * done.
+ */
+int rsh_fat16_scrub(int threads, int out){
+
+  int i;
+  int bad = 0;
+  int started = 0;
+  uint32_t n;
+  uint64_t clusters = 0;
+  pthread_t workers[CSUM_MAX_THREADS];
+  struct rsh_fat16_scrub scrub;
+  struct timespec start, end;
+
+  if ( ! fat16_fs.fs_header.csum_offset ){
+    errno = ENOTSUP;
+    return -1;
+  }
+
+  if ( threads <= 0 )
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ( threads < 1 )
+    threads = 1;
+  if ( threads > CSUM_MAX_THREADS )
+    threads = CSUM_MAX_THREADS;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  /* Whatever's changed gets its sum first. */
+  _rsh_fat16_csum_flush();
+
+  memset(&scrub, 0, sizeof(struct rsh_fat16_scrub));
+  if ( _rsh_fat16_scrub_dir(&scrub, fat16_fs.fs_header.root_offset, "") ){
+    bad = -1;
+    goto out;
+  }
+
+  for ( i = 0; i < threads - 1; i++ ){
+    if ( pthread_create(&workers[i], NULL, _rsh_fat16_scrub_worker, &scrub) )
+      break;
+    started++;
+  }
+  _rsh_fat16_scrub_worker(&scrub);
+  for ( i = 0; i < started; i++ )
+    pthread_join(workers[i], NULL);
+
+  for ( n = 0; n < scrub.nents; n++ ){
+    clusters += scrub.ents[n].clusters;
+    if ( ! scrub.ents[n].bad )
+      continue;
+    bad += scrub.ents[n].bad;
+    rsh_dprintf(out, "%s: %u bad cluster%s\n", scrub.ents[n].path,
+		scrub.ents[n].bad, scrub.ents[n].bad == 1 ? "" : "s");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  rsh_dprintf(out, "%u files and dirs, %llu clusters in %.1f ms: %d bad\n",
+	      scrub.nents, (unsigned long long)clusters,
+	      (end.tv_sec - start.tv_sec) * 1e3 +
+	      (end.tv_nsec - start.tv_nsec) / 1e6, bad);
+
+ out:
+  for ( n = 0; n < scrub.nents; n++ )
+    free(scrub.ents[n].path);
+  free(scrub.ents);
+
+  return bad;
+
+}
+
+/*
+ * Check every cluster's sum:
+ *
+ *   scrub [-j <threads>]
+ */
+int builtin_scrub(int argc, char **argv, int in, int out, int err){
+
+  int i;
+  int bad;
+  int threads = 0;
+
+  for ( i = 1; i < argc; i++ ){
+    if ( strcmp(argv[i], "-j") == 0 && i + 1 < argc ){
+      threads = strtol(argv[++i], NULL, 0);
+    } else {
+      rsh_dprintf(err, "Usage: scrub [-j <threads>]\n");
+      return 1;
+    }
+  }
+
+  bad = rsh_fat16_scrub(threads, out);
+  if ( bad < 0 ){
+    if ( errno == ENOTSUP )
+      rsh_dprintf(err, "scrub: images older than version 7 have no "
+		  "checksums\n");
+    else
+      rsh_dprintf(err, "scrub: %s\n", strerror(errno));
+    return 1;
+  }
+
+  return bad != 0;
+
+}
+
+/*
+ * Show or change whether reads check sums:
+ *
+ *   verify [on|off]
+ */
+int builtin_verify(int argc, char **argv, int in, int out, int err){
+
+  if ( argc < 2 ){
+    rsh_dprintf(out, "%s", rsh_fat16_verify_reads ? "on" : "off");
+    if ( ! fat16_fs.fs_header.csum_offset )
+      rsh_dprintf(out, " (this image has no checksums)");
+    rsh_dprintf(out, "\n");
+    return 0;
+  }
+
+  if ( argc > 2 ||
+       (strcmp(argv[1], "on") != 0 && strcmp(argv[1], "off") != 0) ){
+    rsh_dprintf(err, "Usage: verify [on|off]\n");
+    return 1;
+  }
+
+  rsh_fat16_verify_reads = strcmp(argv[1], "on") == 0;
+  return 0;
+
+}
@@ -0,0 +1,247 @@
+/*
+ * A small dentry cache for the FAT16 driver. Resolving a path means looking
+ * up each of its nodes in turn starting at the root, so /a/b/c/d costs four
+ * directory lookups. That adds up when ls stats every file in a deep
+ * directory. So we remember what absolute paths resolved to: either the
+ * address of the dirent in the image, or the fact that there was nothing
+ * there (a negative entry). Resolving a path then starts from the longest
+ * prefix of it that we already know about.
+ *
+ * The cache has a fixed number of entries and throws out the least recently
+ * used one when it needs room. Paths too long for an entry just don't get
+ * cached.
+ *
+ * Keeping it honest:
+ *   - Creating anything may make a negative entry wrong, so creates bump a
+ *     generation number and negative entries from older generations are
+ *     ignored.
+ *   - Unlinking a file drops the entries that point at its dirent. Unlinking
+ *     a directory drops everything since we don't know which paths went
+ *     through it (think /x/../dir/y). Directories don't get deleted much.
+ */
+
+#include <rsh.h>
+#include <rshfs.h>
+
+#include <string.h>
+
+/* Number of entries and hash buckets. Buckets must be a power of 2. */
+#define DCACHE_ENTRIES 256
+#define DCACHE_BUCKETS 512
+
+static struct rsh_fat16_dentry dcache[DCACHE_ENTRIES];
+static struct rsh_fat16_dentry *dcache_hash[DCACHE_BUCKETS];
+
+/* LRU list. Most recently used at the head. */
+static struct rsh_fat16_dentry *dcache_head;
+static struct rsh_fat16_dentry *dcache_tail;
+
+/* Negative entries are only good for the generation they were made in. */
+static uint32_t dcache_gen;
+
+/* Some stats for fatinfo. */
+uint32_t rsh_fat16_dcache_hits;
+uint32_t rsh_fat16_dcache_misses;
+
+static uint32_t _rsh_fat16_dcache_hash(const char *path, int len){
+
+  uint32_t hash = 2166136261u;
+
+  while ( len-- ){
+    hash ^= (unsigned char) *path++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+
+}
+
+static void _rsh_fat16_dcache_lru_unlink(struct rsh_fat16_dentry *dentry){
+
+  if ( dentry->prev )
+    dentry->prev->next = dentry->next;
+  else
+    dcache_head = dentry->next;
+
+  if ( dentry->next )
+    dentry->next->prev = dentry->prev;
+  else
+    dcache_tail = dentry->prev;
+
+}
+
+static void _rsh_fat16_dcache_lru_push(struct rsh_fat16_dentry *dentry){
+
+  dentry->prev = NULL;
+  dentry->next = dcache_head;
+  if ( dcache_head )
+    dcache_head->prev = dentry;
+  else
+    dcache_tail = dentry;
+  dcache_head = dentry;
+
+}
+
+/*
+ * Take an entry out of its hash chain and mark it unused. It stays on the LRU
+ * list, but moves to the tail so it gets reused first.
+ */
+static void _rsh_fat16_dcache_kill(struct rsh_fat16_dentry *dentry){
+
+  struct rsh_fat16_dentry **prev;
+
+  if ( ! dentry->len )
+    return;
+
+  prev = &dcache_hash[dentry->hash & (DCACHE_BUCKETS - 1)];
+  while ( *prev != dentry )
+    prev = &(*prev)->hnext;
+  *prev = dentry->hnext;
+  dentry->len = 0;
+
+  _rsh_fat16_dcache_lru_unlink(dentry);
+  dentry->prev = dcache_tail;
+  dentry->next = NULL;
+  if ( dcache_tail )
+    dcache_tail->next = dentry;
+  else
+    dcache_head = dentry;
+  dcache_tail = dentry;
+
+}
+
+/*
+ * Set up the LRU list. Every entry starts out unused.
+ */
+static void _rsh_fat16_dcache_setup(){
+
+  int i;
+
+  for ( i = 0; i < DCACHE_ENTRIES; i++ ){
+    dcache[i].len = 0;
+    _rsh_fat16_dcache_lru_push(&dcache[i]);
+  }
+
+}
+
+/*
+ * Look up the first len characters of path. Returns the entry or NULL. The
+ * entry's slot is NULL for a negative entry, in which case err holds the
+ * errno the lookup failed with.
+ */
+struct rsh_fat16_dentry *_rsh_fat16_dcache_lookup(const char *path, int len){
+
+  uint32_t hash;
+  struct rsh_fat16_dentry *dentry;
+
+  if ( len >= RSH_FAT16_DCACHE_PATH )
+    return NULL;
+
+  hash = _rsh_fat16_dcache_hash(path, len);
+  for ( dentry = dcache_hash[hash & (DCACHE_BUCKETS - 1)]; dentry;
+	dentry = dentry->hnext ){
+
+    if ( dentry->hash != hash || dentry->len != len ||
+	 memcmp(dentry->path, path, len) != 0 )
+      continue;
+
+    /* Stale negative entry. */
+    if ( ! dentry->slot && dentry->gen != dcache_gen ){
+      _rsh_fat16_dcache_kill(dentry);
+      break;
+    }
+
+    rsh_fat16_dcache_hits++;
+    _rsh_fat16_dcache_lru_unlink(dentry);
+    _rsh_fat16_dcache_lru_push(dentry);
+    return dentry;
+
+  }
+
+  rsh_fat16_dcache_misses++;
+  return NULL;
+
+}
+
+/*
+ * Remember that the first len characters of path resolve to slot. Pass a
+ * NULL slot and an errno to remember that the path doesn't resolve.
+ */
+void _rsh_fat16_dcache_add(const char *path, int len,
+			   struct rsh_fat_dirent *slot, int err){
+
+  uint32_t hash;
+  struct rsh_fat16_dentry *dentry;
+
+  if ( len >= RSH_FAT16_DCACHE_PATH || len < 1 )
+    return;
+
+  if ( ! dcache_tail )
+    _rsh_fat16_dcache_setup();
+
+  /* Replace an existing entry for the path, if there is one. */
+  hash = _rsh_fat16_dcache_hash(path, len);
+  for ( dentry = dcache_hash[hash & (DCACHE_BUCKETS - 1)]; dentry;
+	dentry = dentry->hnext )
+    if ( dentry->hash == hash && dentry->len == len &&
+	 memcmp(dentry->path, path, len) == 0 )
+      break;
+
+  if ( ! dentry ){
+    dentry = dcache_tail;
+    _rsh_fat16_dcache_kill(dentry);
+    memcpy(dentry->path, path, len);
+    dentry->len = len;
+    dentry->hash = hash;
+    dentry->hnext = dcache_hash[hash & (DCACHE_BUCKETS - 1)];
+    dcache_hash[hash & (DCACHE_BUCKETS - 1)] = dentry;
+  }
+
+  dentry->slot = slot;
+  dentry->err = err;
+  dentry->gen = dcache_gen;
+
+  _rsh_fat16_dcache_lru_unlink(dentry);
+  _rsh_fat16_dcache_lru_push(dentry);
+
+}
+
+/*
+ * The dirent at slot is going away. If it's a directory then everything
+ * goes.
+ */
+void _rsh_fat16_dcache_forget(struct rsh_fat_dirent *slot){
+
+  int i;
+
+  if ( slot->type == FAT_DIR ){
+    _rsh_fat16_dcache_flush();
+    return;
+  }
+
+  for ( i = 0; i < DCACHE_ENTRIES; i++ )
+    if ( dcache[i].len && dcache[i].slot == slot )
+      _rsh_fat16_dcache_kill(&dcache[i]);
+
+}
+
+/*
+ * Something was just created. Any negative entry may be wrong now.
+ */
+void _rsh_fat16_dcache_created(){
+
+  dcache_gen++;
+
+}
+
+/*
+ * Empty the cache.
+ */
+void _rsh_fat16_dcache_flush(){
+
+  int i;
+
+  for ( i = 0; i < DCACHE_ENTRIES; i++ )
+    _rsh_fat16_dcache_kill(&dcache[i]);
+
+}
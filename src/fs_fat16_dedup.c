@@ -0,0 +1,715 @@
+/*
+ * Sharing clusters that hold the same data. The same build artifacts get
+ * copied into the image over and over, and copies that come in from outside
+ * (or with cp --no-clone) get clusters of their own every time.
+ *
+ * Clusters are shared the way clones share them (see fs_fat16_cow.c), so
+ * the only thing that can be shared is the tail end of a chain: a FAT entry
+ * has room for one next cluster, and two chains that run into the same
+ * cluster go the same way from there on. So sharing goes from the back of a
+ * file to the front. A file's last cluster can take the place of another
+ * one that's the last of its chain and has the same data up to the end of
+ * the file; once it has, the cluster before it can take the place of
+ * another that has the same data and now runs into the same cluster, and so
+ * on. Two copies of a file end up with one chain between them, and files
+ * that only end the same way share just that part. Writing to a shared
+ * cluster afterwards copies it, same as for a clone.
+ *
+ * Finding a cluster with the same data goes through an index keyed by a
+ * hash of the cluster, where it goes next and the hole after it. The hash is
+ * only a hint; a cluster is only ever shared after comparing it byte for
+ * byte. The index is kept in memory and isn't kept up to date as files
+ * change, so whatever it turns up is checked against the FAT before it's
+ * used. The one thing that can't be checked that way is whether a cluster
+ * still belongs to a file at all, so freeing a cluster drops it from the
+ * index (well, marks it, the entry is replaced the next time it's wanted).
+ *
+ * The dedup builtin goes over the whole image: every file's clusters are
+ * hashed by a pool of threads and then each file is shared what it can be,
+ * one file at a time. On images made with RSH_FS_DEDUP_FILES (--dedup) a
+ * file is also shared what it can be when it's closed after a write; the
+ * first time that happens the index gets built from the whole image.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/* Most hashing threads we'll start. */
+#define DEDUP_MAX_THREADS 8
+
+#define DEDUP_P1 0x9e3779b185ebca87ULL
+#define DEDUP_P2 0xc2b2ae3d27d4eb4fULL
+#define DEDUP_P3 0x165667b19e3779f9ULL
+
+/* A cluster in the index. Cluster 0 is the boot record, so 0 is empty. */
+struct rsh_fat16_dedup_ent {
+
+  uint64_t hash;
+  uint32_t cluster;
+  uint32_t next;             /* What the cluster linked to when it went in. */
+  uint32_t gap;
+  uint32_t valid;            /* Bytes of it that are file. */
+
+};
+
+/* A file being shared. */
+struct rsh_fat16_dedup_file {
+
+  struct rsh_fat_dirent *ent;
+  uint32_t *clusters;
+  uint64_t *hashes;
+  uint32_t length;
+  uint32_t valid;            /* Bytes of file in the last cluster. */
+
+};
+
+/* A pass over the whole image. */
+struct rsh_fat16_dedup {
+
+  struct rsh_fat_dirent *skip;
+  struct rsh_fat16_dedup_file *files;
+  uint32_t nfiles;
+  uint32_t size;
+  uint32_t next;             /* Next file to hash, taken atomically. */
+  int failed;
+
+  uint64_t clusters;
+  uint64_t shared;
+
+};
+
+static struct rsh_fat16_dedup_ent *dedup_table = NULL;
+static uint32_t dedup_mask;
+static uint32_t dedup_used;
+
+/* A bit per cluster that's gone in the index since it was last freed. */
+static uint8_t *dedup_bits = NULL;
+static uint32_t dedup_bits_len;
+
+/* Clusters sharing has saved since the shell started. */
+uint64_t rsh_fat16_dedup_saved = 0;
+
+static uint64_t _rsh_fat16_dedup_rotl(uint64_t v, int r){
+
+  return (v << r) | (v >> (64 - r));
+
+}
+
+static uint64_t _rsh_fat16_dedup_round(uint64_t acc, uint64_t in){
+
+  acc += in * DEDUP_P2;
+  acc = _rsh_fat16_dedup_rotl(acc, 31);
+  return acc * DEDUP_P1;
+
+}
+
+/*
+ * Hash len bytes of data. Four lanes of multiply and rotate, like xxHash,
+ * which keeps the CPU busy enough to go at memory speed.
+ */
+uint64_t _rsh_fat16_dedup_hash(const void *data, uint32_t len){
+
+  uint64_t h, w;
+  uint64_t v[4] = { DEDUP_P1 + DEDUP_P2, DEDUP_P2, 0, -DEDUP_P1 };
+  const uint8_t *p = data;
+  const uint8_t *end = p + len;
+
+  while ( end - p >= 32 ){
+    memcpy(&w, p, 8);
+    v[0] = _rsh_fat16_dedup_round(v[0], w);
+    memcpy(&w, p + 8, 8);
+    v[1] = _rsh_fat16_dedup_round(v[1], w);
+    memcpy(&w, p + 16, 8);
+    v[2] = _rsh_fat16_dedup_round(v[2], w);
+    memcpy(&w, p + 24, 8);
+    v[3] = _rsh_fat16_dedup_round(v[3], w);
+    p += 32;
+  }
+
+  h = _rsh_fat16_dedup_rotl(v[0], 1) + _rsh_fat16_dedup_rotl(v[1], 7) +
+    _rsh_fat16_dedup_rotl(v[2], 12) + _rsh_fat16_dedup_rotl(v[3], 18) + len;
+
+  while ( end - p >= 8 ){
+    memcpy(&w, p, 8);
+    h ^= _rsh_fat16_dedup_round(0, w);
+    h = _rsh_fat16_dedup_rotl(h, 27) * DEDUP_P1 + DEDUP_P3;
+    p += 8;
+  }
+  while ( p < end )
+    h = _rsh_fat16_dedup_rotl(h ^ (*p++ * DEDUP_P3), 11) * DEDUP_P1;
+
+  h ^= h >> 33;
+  h *= DEDUP_P2;
+  h ^= h >> 29;
+  h *= DEDUP_P3;
+  h ^= h >> 32;
+
+  return h;
+
+}
+
+/*
+ * Where in the index to start looking for a key.
+ */
+static uint32_t _rsh_fat16_dedup_slot(uint64_t hash, uint32_t next,
+				      uint32_t gap, uint32_t valid){
+
+  uint64_t key = hash ^ (next * DEDUP_P1) ^ ((uint64_t)gap << 32) ^
+    (valid * DEDUP_P3);
+
+  return (key ^ (key >> 29)) & dedup_mask;
+
+}
+
+static int _rsh_fat16_dedup_same(struct rsh_fat16_dedup_ent *ent,
+				 uint64_t hash, uint32_t next, uint32_t gap,
+				 uint32_t valid){
+
+  return ent->hash == hash && ent->next == next && ent->gap == gap &&
+    ent->valid == valid;
+
+}
+
+/*
+ * Make the index twice the size (or start it off).
+ */
+static int _rsh_fat16_dedup_grow(){
+
+  uint32_t i, slot;
+  uint32_t old_size = dedup_table ? dedup_mask + 1 : 0;
+  struct rsh_fat16_dedup_ent *old = dedup_table;
+  struct rsh_fat16_dedup_ent *table;
+
+  table = calloc(old_size ? old_size * 2 : 1024,
+		 sizeof(struct rsh_fat16_dedup_ent));
+  if ( ! table ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+
+  dedup_table = table;
+  dedup_mask = (old_size ? old_size * 2 : 1024) - 1;
+  for ( i = 0; i < old_size; i++ ){
+    if ( ! old[i].cluster )
+      continue;
+    slot = _rsh_fat16_dedup_slot(old[i].hash, old[i].next, old[i].gap,
+				 old[i].valid);
+    while ( dedup_table[slot].cluster )
+      slot = (slot + 1) & dedup_mask;
+    dedup_table[slot] = old[i];
+  }
+  free(old);
+
+  return RSH_OK;
+
+}
+
+/*
+ * Whether the cluster in an index entry is still what the entry says, and
+ * has the same data as cluster.
+ */
+static int _rsh_fat16_dedup_good(struct rsh_fat16_dedup_ent *ent,
+				 uint32_t cluster){
+
+  uint32_t other = ent->cluster;
+
+  return other && other < dedup_bits_len &&
+    (dedup_bits[other / 8] & (1 << (other % 8))) &&
+    rsh_fat16_get_entry(other) == ent->next &&
+    _rsh_fat16_gap(other) == ent->gap &&
+    memcmp(FAT_CLUSTER_TO_ADDR(other), FAT_CLUSTER_TO_ADDR(cluster),
+	   ent->valid) == 0;
+
+}
+
+/*
+ * Put a cluster in the index, in place of whatever was there for the same
+ * key unless that's still good.
+ */
+static int _rsh_fat16_dedup_put(uint64_t hash, uint32_t cluster,
+				uint32_t next, uint32_t gap, uint32_t valid){
+
+  uint32_t slot;
+  uint8_t *bits;
+
+  if ( cluster >= dedup_bits_len ){
+    bits = realloc(dedup_bits, (fat16_fs.fat_entries + 7) / 8);
+    if ( ! bits ){
+      errno = ENOMEM;
+      return RSH_ERR;
+    }
+    memset(bits + (dedup_bits_len + 7) / 8, 0,
+	   (fat16_fs.fat_entries + 7) / 8 - (dedup_bits_len + 7) / 8);
+    dedup_bits = bits;
+    dedup_bits_len = fat16_fs.fat_entries;
+  }
+
+  if ( ! dedup_table || dedup_used * 2 >= dedup_mask ){
+    if ( _rsh_fat16_dedup_grow() )
+      return RSH_ERR;
+  }
+
+  slot = _rsh_fat16_dedup_slot(hash, next, gap, valid);
+  while ( dedup_table[slot].cluster &&
+	  ! _rsh_fat16_dedup_same(&dedup_table[slot], hash, next, gap, valid) )
+    slot = (slot + 1) & dedup_mask;
+
+  if ( ! dedup_table[slot].cluster )
+    dedup_used++;
+  else if ( _rsh_fat16_dedup_good(&dedup_table[slot], cluster) )
+    return RSH_OK;
+  dedup_table[slot].hash = hash;
+  dedup_table[slot].cluster = cluster;
+  dedup_table[slot].next = next;
+  dedup_table[slot].gap = gap;
+  dedup_table[slot].valid = valid;
+  dedup_bits[cluster / 8] |= 1 << (cluster % 8);
+
+  return RSH_OK;
+
+}
+
+/*
+ * Find a cluster other than cluster with its first valid bytes, linking to
+ * next with gap clusters of hole in between. FAT_TERM if there isn't one.
+ */
+static uint32_t _rsh_fat16_dedup_find(uint64_t hash, uint32_t cluster,
+				      uint32_t next, uint32_t gap,
+				      uint32_t valid){
+
+  uint32_t slot;
+
+  if ( ! dedup_table )
+    return FAT_TERM;
+
+  slot = _rsh_fat16_dedup_slot(hash, next, gap, valid);
+  while ( dedup_table[slot].cluster &&
+	  ! _rsh_fat16_dedup_same(&dedup_table[slot], hash, next, gap, valid) )
+    slot = (slot + 1) & dedup_mask;
+
+  /* It may have changed since it went in. */
+  if ( dedup_table[slot].cluster == cluster ||
+       ! _rsh_fat16_dedup_good(&dedup_table[slot], cluster) )
+    return FAT_TERM;
+
+  return dedup_table[slot].cluster;
+
+}
+
+/*
+ * A cluster has been freed, so it can't be shared any more.
+ */
+void _rsh_fat16_dedup_forget(uint32_t cluster){
+
+  if ( cluster < dedup_bits_len )
+    dedup_bits[cluster / 8] &= ~(1 << (cluster % 8));
+
+}
+
+/*
+ * Throw the index away; it's for some other image.
+ */
+void _rsh_fat16_dedup_drop(){
+
+  free(dedup_table);
+  free(dedup_bits);
+  dedup_table = NULL;
+  dedup_bits = NULL;
+  dedup_used = 0;
+  dedup_bits_len = 0;
+
+}
+
+/*
+ * Find the clusters of the file at ent. Packed files, and files whose chain
+ * doesn't end where the file does (an open file with clusters set aside past
+ * the end, say), are left with a length of 0.
+ */
+static int _rsh_fat16_dedup_load(struct rsh_fat16_dedup_file *file,
+				 struct rsh_fat_dirent *ent){
+
+  uint32_t size = 0;
+  uint32_t cluster;
+  uint32_t *clusters;
+  uint64_t index = 0;
+  uint64_t bytes = FAT_DIRENT_SIZE(ent);
+
+  memset(file, 0, sizeof(struct rsh_fat16_dedup_file));
+  file->ent = ent;
+  if ( FAT_DIRENT_PACKED(ent) )
+    return RSH_OK;
+
+  for ( cluster = ent->index; cluster != FAT_TERM;
+	cluster = rsh_fat16_get_entry(cluster) ){
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED ||
+	 cluster >= fat16_fs.fat_entries )
+      rsh_fat16_badness();
+    if ( file->length == size ){
+      size = size ? size * 2 : 16;
+      clusters = realloc(file->clusters, size * sizeof(uint32_t));
+      if ( ! clusters ){
+	free(file->clusters);
+	file->clusters = NULL;
+	errno = ENOMEM;
+	return RSH_ERR;
+      }
+      file->clusters = clusters;
+    }
+    file->clusters[file->length++] = cluster;
+    index += 1 + _rsh_fat16_gap(cluster);
+  }
+
+  /* index is now one past the last cluster, counting holes. */
+  if ( bytes > index * FAT_CLUSTER_SIZE ||
+       bytes + FAT_CLUSTER_SIZE < index * FAT_CLUSTER_SIZE ||
+       _rsh_fat16_gap(file->clusters[file->length - 1]) ){
+    file->length = 0;
+    return RSH_OK;
+  }
+  file->valid = bytes - (index - 1) * FAT_CLUSTER_SIZE;
+
+  return RSH_OK;
+
+}
+
+static uint32_t _rsh_fat16_dedup_valid(struct rsh_fat16_dedup_file *file,
+				       uint32_t i){
+
+  return i + 1 < file->length ? FAT_CLUSTER_SIZE : file->valid;
+
+}
+
+/*
+ * Hash every cluster of a loaded file.
+ */
+static int _rsh_fat16_dedup_hash_file(struct rsh_fat16_dedup_file *file){
+
+  uint32_t i;
+
+  if ( ! file->length )
+    return RSH_OK;
+
+  file->hashes = malloc(file->length * sizeof(uint64_t));
+  if ( ! file->hashes ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+
+  for ( i = 0; i < file->length; i++ )
+    file->hashes[i] =
+      _rsh_fat16_dedup_hash(FAT_CLUSTER_TO_ADDR(file->clusters[i]),
+			    _rsh_fat16_dedup_valid(file, i));
+
+  return RSH_OK;
+
+}
+
+/*
+ * Share what can be shared of a loaded and hashed file, back to front, and
+ * put whatever's left of it in the index. Returns the number of clusters
+ * freed.
+ */
+static uint32_t _rsh_fat16_dedup_share(struct rsh_fat16_dedup_file *file){
+
+  uint32_t i;
+  uint32_t cluster;
+  uint32_t other;
+  uint32_t next;
+  uint32_t gap;
+  uint32_t valid;
+  uint32_t freed = 0;
+
+  for ( i = file->length; i-- > 0; ){
+
+    cluster = file->clusters[i];
+    next = i + 1 < file->length ? file->clusters[i + 1] : FAT_TERM;
+    gap = _rsh_fat16_gap(cluster);
+    valid = _rsh_fat16_dedup_valid(file, i);
+
+    /* Only a cluster nothing else runs into can go, and the one taking its
+     * place needs room for another reference. The one it links to loses
+     * one, which it has to have had, being run into by both. */
+    other = _rsh_fat16_dedup_find(file->hashes[i], cluster, next, gap, valid);
+    if ( other == FAT_TERM || _rsh_fat16_refs(cluster) ||
+	 _rsh_fat16_refs(other) >= FAT_MAX_REFS ||
+	 (next != FAT_TERM && ! _rsh_fat16_refs(next)) ){
+      if ( _rsh_fat16_dedup_put(file->hashes[i], cluster, next, gap, valid) )
+	break;
+      continue;
+    }
+
+    if ( i == 0 ){
+      file->ent->index = other;
+      rsh_fat16_meta(file->ent, sizeof(struct rsh_fat_dirent));
+    } else {
+      rsh_fat16_set_entry(file->clusters[i - 1], other);
+    }
+    _rsh_fat16_set_refs(other, _rsh_fat16_refs(other) + 1);
+    if ( next != FAT_TERM )
+      _rsh_fat16_set_refs(next, _rsh_fat16_refs(next) - 1);
+    rsh_fat16_set_entry(cluster, FAT_FREE);
+
+    file->clusters[i] = other;
+    freed++;
+
+  }
+
+  /* What got relinked may have been shared with files other than this one,
+   * so every open file has to look at its chain again. */
+  if ( freed )
+    fat16_fs.chain_gen++;
+
+  rsh_fat16_dedup_saved += freed;
+  return freed;
+
+}
+
+static void _rsh_fat16_dedup_free_file(struct rsh_fat16_dedup_file *file){
+
+  free(file->clusters);
+  free(file->hashes);
+
+}
+
+/*
+ * Add the files in the directory whose table starts at dir, and everything
+ * below it, to the pass.
+ */
+static int _rsh_fat16_dedup_dir(struct rsh_fat16_dedup *dedup, uint32_t dir){
+
+  uint32_t cluster = dir;
+  char *name;
+  struct rsh_fat_dirent *ent;
+  struct rsh_fat16_dedup_file *files;
+
+  do {
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+      name = FAT_DIRENT_NAME(ent);
+      if ( ! name[0] || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 )
+	continue;
+
+      if ( ent->type == FAT_DIR ){
+	if ( _rsh_fat16_dedup_dir(dedup, ent->index) )
+	  return RSH_ERR;
+	continue;
+      }
+      if ( ent == dedup->skip )
+	continue;
+
+      if ( dedup->nfiles == dedup->size ){
+	files = realloc(dedup->files, (dedup->size ? dedup->size * 2 : 64) *
+			sizeof(struct rsh_fat16_dedup_file));
+	if ( ! files ){
+	  errno = ENOMEM;
+	  return RSH_ERR;
+	}
+	dedup->files = files;
+	dedup->size = dedup->size ? dedup->size * 2 : 64;
+      }
+
+      if ( _rsh_fat16_dedup_load(&dedup->files[dedup->nfiles], ent) )
+	return RSH_ERR;
+      dedup->clusters += dedup->files[dedup->nfiles].length;
+      dedup->nfiles++;
+
+    }
+
+    cluster = rsh_fat16_get_entry(cluster);
+
+  } while ( cluster != FAT_TERM );
+
+  return RSH_OK;
+
+}
+
+/*
+ * Hash files until there aren't any left.
+ */
+static void *_rsh_fat16_dedup_worker(void *arg){
+
+  uint32_t i;
+  struct rsh_fat16_dedup *dedup = arg;
+
+  while ( (i = __sync_fetch_and_add(&dedup->next, 1)) < dedup->nfiles ){
+    if ( _rsh_fat16_dedup_hash_file(&dedup->files[i]) )
+      dedup->failed = 1;
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Go over the whole image with threads hashing threads (0 picks a number).
+ * If share is set every file is shared what it can be, otherwise the index
+ * is just filled in, with everything but skip. Fills in how many clusters
+ * were looked at and freed.
+ */
+static int _rsh_fat16_dedup_pass(int threads, int share,
+				 struct rsh_fat_dirent *skip,
+				 uint64_t *clusters, uint64_t *shared){
+
+  int i;
+  int started = 0;
+  uint32_t n;
+  pthread_t workers[DEDUP_MAX_THREADS];
+  struct rsh_fat16_dedup dedup;
+
+  if ( ! fat16_fs.fs_header.refs_offset ){
+    errno = ENOTSUP;
+    return RSH_ERR;
+  }
+
+  if ( threads <= 0 )
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ( threads < 1 )
+    threads = 1;
+  if ( threads > DEDUP_MAX_THREADS )
+    threads = DEDUP_MAX_THREADS;
+
+  memset(&dedup, 0, sizeof(struct rsh_fat16_dedup));
+  dedup.skip = skip;
+  if ( _rsh_fat16_dedup_dir(&dedup, fat16_fs.fs_header.root_offset) )
+    goto out;
+
+  for ( i = 0; i < threads - 1; i++ ){
+    if ( pthread_create(&workers[i], NULL, _rsh_fat16_dedup_worker, &dedup) )
+      break;
+    started++;
+  }
+  _rsh_fat16_dedup_worker(&dedup);
+  for ( i = 0; i < started; i++ )
+    pthread_join(workers[i], NULL);
+  if ( dedup.failed ){
+    errno = ENOMEM;
+    goto out;
+  }
+
+  /* Whatever was in the index is about to be in it again. */
+  _rsh_fat16_dedup_drop();
+
+  for ( n = 0; n < dedup.nfiles; n++ ){
+    if ( share ){
+      dedup.shared += _rsh_fat16_dedup_share(&dedup.files[n]);
+      _rsh_fat16_journal_commit();
+      continue;
+    }
+    for ( i = 0; i < dedup.files[n].length; i++ )
+      _rsh_fat16_dedup_put(dedup.files[n].hashes[i],
+			   dedup.files[n].clusters[i],
+			   i + 1 < dedup.files[n].length ?
+			   dedup.files[n].clusters[i + 1] : FAT_TERM,
+			   _rsh_fat16_gap(dedup.files[n].clusters[i]),
+			   _rsh_fat16_dedup_valid(&dedup.files[n], i));
+  }
+  dedup.failed = -1;
+
+ out:
+  for ( n = 0; n < dedup.nfiles; n++ )
+    _rsh_fat16_dedup_free_file(&dedup.files[n]);
+  free(dedup.files);
+
+  if ( clusters )
+    *clusters = dedup.clusters;
+  if ( shared )
+    *shared = dedup.shared;
+
+  return dedup.failed < 0 ? RSH_OK : RSH_ERR;
+
+}
+
+/*
+ * Share what can be shared across the whole image, hashing with threads
+ * threads (0 picks a number). Fills in how many clusters were looked at and
+ * how many were freed.
+ */
+int rsh_fat16_dedup(int threads, uint64_t *clusters, uint64_t *shared){
+
+  return _rsh_fat16_dedup_pass(threads, 1, NULL, clusters, shared);
+
+}
+
+/*
+ * A file's been written and closed; share what can be shared of it. The
+ * first time this happens the index gets built.
+ */
+int _rsh_fat16_dedup_close(struct rsh_fat_dirent *ent){
+
+  int ret = RSH_ERR;
+  struct rsh_fat16_dedup_file file;
+
+  if ( ! dedup_table && _rsh_fat16_dedup_pass(0, 0, ent, NULL, NULL) )
+    return RSH_ERR;
+
+  if ( _rsh_fat16_dedup_load(&file, ent) ||
+       _rsh_fat16_dedup_hash_file(&file) )
+    goto out;
+
+  if ( _rsh_fat16_dedup_share(&file) )
+    _rsh_fat16_journal_commit();
+  ret = RSH_OK;
+
+ out:
+  _rsh_fat16_dedup_free_file(&file);
+  return ret;
+
+}
+
+/*
+ * Share clusters across the whole image:
+ *
+ *   dedup [-j <threads>]
+ */
+int builtin_dedup(int argc, char **argv, int in, int out, int err){
+
+  int i;
+  int threads = 0;
+  uint64_t clusters;
+  uint64_t shared;
+  struct timespec start, end;
+
+  for ( i = 1; i < argc; i++ ){
+    if ( strcmp(argv[i], "-j") == 0 && i + 1 < argc ){
+      threads = strtol(argv[++i], NULL, 0);
+    } else {
+      rsh_dprintf(err, "Usage: dedup [-j <threads>]\n");
+      return 1;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if ( rsh_fat16_dedup(threads, &clusters, &shared) ){
+    if ( errno == ENOTSUP )
+      rsh_dprintf(err, "dedup: images older than version 3 can't share "
+		  "clusters\n");
+    else
+      rsh_dprintf(err, "dedup: %s\n", strerror(errno));
+    return 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  rsh_dprintf(out, "%llu clusters looked at, %llu freed (%llu bytes) in "
+	      "%.1f ms\n", (unsigned long long)clusters,
+	      (unsigned long long)shared,
+	      (unsigned long long)shared * FAT_CLUSTER_SIZE,
+	      (end.tv_sec - start.tv_sec) * 1e3 +
+	      (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  return 0;
+
+}
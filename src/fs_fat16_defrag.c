@@ -0,0 +1,496 @@
+/*
+ * Defragmenting the FAT16 image. A file that was built up by lots of small
+ * appends ends up with its clusters spread all over the image, so reading it
+ * front to back hops around the mapping and the kernel's readahead on the
+ * image file doesn't do us any good. The defrag builtin finds files made of
+ * more than one extent (run of consecutive clusters) and moves each one into
+ * a single free run.
+ *
+ * Moving a file goes: copy its clusters into the free run, chain the run
+ * together, write that out (as hard as the durability mode says to), then
+ * point the dirent at the new chain and free the old one. Until the dirent
+ * changes the file is untouched, so a crash part way through just leaks the
+ * new run rather than losing the file. The shell itself never sees a half
+ * moved file since nothing else runs while we're at it. Open files get told
+ * their chain changed and rebuild their cluster maps.
+ *
+ * Only regular files get moved. Directory tables are pointed into by the
+ * directory indexes and the dentry cache, and are usually small anyway.
+ *
+ * Defragmenting a big image can take a while, so it can also be done a
+ * slice at a time: each slice stops once its time is up and the next one
+ * picks up where it left off. The shell can run a slice after every command.
+ * Where it left off is the directory and the dirent it did last, and since
+ * dirents never move (see fs_fat16_dirent.c) that's still the same place
+ * after whatever the commands in between did. The next slice goes on from
+ * there and then back up through the .. entries to finish the directories
+ * above it. Anything created behind that spot in the meantime waits for the
+ * next pass.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Longest path we bother to print. */
+#define DEFRAG_PATH 1024
+
+/* Slice length for running between commands, 0 for off. */
+long int rsh_fat16_defrag_idle_ms = 0;
+
+/* A place in the tree: the directory table dir and a dirent in it, as an
+ * offset into the image so it doesn't care if the image gets mapped
+ * somewhere else. */
+struct rsh_fat16_defrag_pos {
+
+  uint32_t dir;
+  uint64_t at;
+
+};
+
+/* Where the last slice stopped, dir is FAT_TERM if it finished. */
+static struct rsh_fat16_defrag_pos defrag_cursor = { FAT_TERM, 0 };
+
+struct rsh_fat16_defrag {
+
+  /* What to do. */
+  int report;                /* Just measure, don't move anything. */
+  int verbose;               /* Print each fragmented file. */
+  int out;
+  int timed;
+  struct timespec deadline;
+
+  /* How it went. */
+  struct rsh_fat16_defrag_pos stop; /* Last file done if out of time. */
+  uint32_t files;
+  uint32_t fragmented;
+  uint32_t moved;
+  uint32_t stuck;            /* Fragmented but shared or no free run big
+				enough. */
+  uint64_t extents_before;
+  uint64_t extents_after;
+  uint64_t clusters_moved;
+
+};
+
+/*
+ * Count the clusters and extents in the chain starting at head.
+ */
+uint32_t _rsh_fat16_chain_extents(uint32_t head, uint32_t *length){
+
+  uint32_t next;
+  uint32_t extents = 1;
+
+  *length = 1;
+  while ( (next = rsh_fat16_get_entry(head)) != FAT_TERM ){
+    if ( next == FAT_FREE || next == FAT_RESERVED )
+      rsh_fat16_badness();
+    if ( next != head + 1 )
+      extents++;
+    (*length)++;
+    head = next;
+  }
+
+  return extents;
+
+}
+
+/*
+ * Move the length clusters of ent's chain into one free run. Fails with
+ * ENOSPC if there's no run that long, or EBUSY if some of the chain is shared
+ * with another file; moving it would unshare it.
+ */
+int _rsh_fat16_relocate(struct rsh_fat_dirent *ent, uint32_t length){
+
+  uint32_t i;
+  uint32_t start, run;
+  uint32_t cluster, next;
+
+  if ( _rsh_fat16_chain_shared(ent->index) ){
+    errno = EBUSY;
+    return RSH_ERR;
+  }
+
+  if ( _rsh_fat16_find_open_run(length, &start, &run) || run < length ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+
+  /* Copy into the run and chain it together, holes and all. */
+  cluster = ent->index;
+  for ( i = 0; i < length; i++ ){
+    memcpy(FAT_CLUSTER_TO_ADDR(start + i), FAT_CLUSTER_TO_ADDR(cluster),
+	   FAT_CLUSTER_SIZE);
+    rsh_fat16_set_entry(start + i, i + 1 < length ? start + i + 1 : FAT_TERM);
+    _rsh_fat16_set_gap(start + i, _rsh_fat16_gap(cluster));
+    cluster = rsh_fat16_get_entry(cluster);
+  }
+  rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(start),
+		  (uint64_t)length * FAT_CLUSTER_SIZE);
+
+  /* The copy has to be out before the dirent points at it. */
+  _rsh_fat16_close_sync();
+
+  _rsh_fat16_chain_changed(ent->index, NULL);
+  cluster = ent->index;
+  ent->index = start;
+  rsh_fat16_meta(ent, sizeof(struct rsh_fat_dirent));
+
+  while ( cluster != FAT_TERM ){
+    next = rsh_fat16_get_entry(cluster);
+    rsh_fat16_set_entry(cluster, FAT_FREE);
+    cluster = next;
+  }
+  _rsh_fat16_journal_commit();
+
+  return RSH_OK;
+
+}
+
+/*
+ * Is the slice over?
+ */
+static int _rsh_fat16_defrag_expired(struct rsh_fat16_defrag *defrag){
+
+  struct timespec now;
+
+  if ( ! defrag->timed )
+    return 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec > defrag->deadline.tv_sec ||
+    (now.tv_sec == defrag->deadline.tv_sec &&
+     now.tv_nsec >= defrag->deadline.tv_nsec);
+
+}
+
+/*
+ * Defrag (or just measure) the files in the directory whose table starts at
+ * dir, and then everything below it, starting after from in the table's
+ * cluster (at the start of cluster if from is NULL). path holds the
+ * directory's path, len characters of it. Returns 1 if the slice ran out of
+ * time.
+ */
+static int _rsh_fat16_defrag_dir(uint32_t dir, uint32_t cluster,
+				 struct rsh_fat_dirent *from, char *path,
+				 int len, struct rsh_fat16_defrag *defrag){
+
+  int sub;
+  int name_len;
+  char *name;
+  uint32_t length;
+  uint32_t extents;
+  struct rsh_fat_dirent *ent;
+
+  do {
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    for ( ent = _rsh_fat16_dirent_next(cluster, from); ent;
+	  ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+      name = FAT_DIRENT_NAME(ent);
+      if ( ! name[0] || strcmp(name, ".") == 0 || strcmp(name, "..") == 0 )
+	continue;
+
+      sub = len;
+      name_len = strnlen(name, FAT_NAME_MAX + 1);
+      if ( len + name_len + 2 < DEFRAG_PATH ){
+	path[len] = '/';
+	memcpy(path + len + 1, name, name_len);
+	sub = len + name_len + 1;
+	path[sub] = 0;
+      }
+
+      if ( ent->type == FAT_DIR ){
+	if ( _rsh_fat16_defrag_dir(ent->index, ent->index, NULL, path, sub,
+				   defrag) )
+	  return 1;
+	path[len] = 0;
+	continue;
+      }
+
+      /* Packed files have no clusters to move. */
+      if ( FAT_DIRENT_PACKED(ent) ){
+	path[len] = 0;
+	continue;
+      }
+
+      defrag->files++;
+      extents = _rsh_fat16_chain_extents(ent->index, &length);
+      defrag->extents_before += extents;
+
+      if ( extents > 1 ){
+	defrag->fragmented++;
+	if ( defrag->verbose )
+	  rsh_dprintf(defrag->out, "%s: %u clusters in %u extents\n", path,
+		      length, extents);
+	if ( ! defrag->report ){
+	  if ( _rsh_fat16_relocate(ent, length) ){
+	    defrag->stuck++;
+	  } else {
+	    extents = 1;
+	    defrag->moved++;
+	    defrag->clusters_moved += length;
+	  }
+	}
+      }
+      defrag->extents_after += extents;
+      path[len] = 0;
+
+      if ( _rsh_fat16_defrag_expired(defrag) ){
+	defrag->stop.dir = dir;
+	defrag->stop.at = (void *)ent - fat16_fs.fs_io;
+	return 1;
+      }
+
+    }
+
+    from = NULL;
+    cluster = rsh_fat16_get_entry(cluster);
+
+  } while ( cluster != FAT_TERM );
+
+  return 0;
+
+}
+
+/*
+ * Is dir the table of a directory that's still there? Its . says so.
+ */
+static int _rsh_fat16_defrag_is_dir(uint32_t dir){
+
+  struct rsh_fat_dirent *dot;
+
+  if ( dir >= fat16_fs.fat_entries || rsh_fat16_get_entry(dir) == FAT_FREE ||
+       rsh_fat16_get_entry(dir) == FAT_RESERVED )
+    return 0;
+
+  dot = _rsh_fat16_dirent_next(dir, NULL);
+  return dot && dot->type == FAT_DIR && dot->index == dir &&
+    strcmp(FAT_DIRENT_NAME(dot), ".") == 0;
+
+}
+
+/*
+ * The dirent for the directory whose table is *dir in the one above it. *dir
+ * becomes the table above and *cluster the cluster of it the dirent is in.
+ * NULL for the root, or if the two don't agree on where they are.
+ */
+static struct rsh_fat_dirent *_rsh_fat16_defrag_up(uint32_t *dir,
+						   uint32_t *cluster){
+
+  uint32_t parent;
+  struct rsh_fat_dirent *ent;
+
+  if ( *dir == fat16_fs.fs_header.root_offset )
+    return NULL;
+  ent = _rsh_fat16_dirent_next(*dir, NULL);
+  ent = ent ? _rsh_fat16_dirent_next(*dir, ent) : NULL;
+  if ( ! ent || strcmp(FAT_DIRENT_NAME(ent), "..") ||
+       ! _rsh_fat16_defrag_is_dir(ent->index) )
+    return NULL;
+  parent = ent->index;
+
+  for ( *cluster = parent; *cluster != FAT_TERM;
+	*cluster = rsh_fat16_get_entry(*cluster) ){
+    if ( *cluster == FAT_FREE || *cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+    for ( ent = _rsh_fat16_dirent_next(*cluster, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(*cluster, ent) ){
+      if ( ent->type == FAT_DIR && ent->index == *dir &&
+	   FAT_DIRENT_NAME(ent)[0] && strcmp(FAT_DIRENT_NAME(ent), ".") &&
+	   strcmp(FAT_DIRENT_NAME(ent), "..") ){
+	*dir = parent;
+	return ent;
+      }
+    }
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Put the path of the directory whose table is dir in path, as much of it
+ * as fits. Returns how long it is.
+ */
+static int _rsh_fat16_defrag_path(uint32_t dir, char *path){
+
+  int len;
+  int name_len;
+  uint32_t cluster;
+  struct rsh_fat_dirent *ent;
+
+  path[0] = 0;
+  ent = _rsh_fat16_defrag_up(&dir, &cluster);
+  if ( ! ent )
+    return 0;
+
+  len = _rsh_fat16_defrag_path(dir, path);
+  name_len = strnlen(FAT_DIRENT_NAME(ent), FAT_NAME_MAX + 1);
+  if ( len + name_len + 2 < DEFRAG_PATH ){
+    path[len] = '/';
+    memcpy(path + len + 1, FAT_DIRENT_NAME(ent), name_len);
+    len += name_len + 1;
+    path[len] = 0;
+  }
+
+  return len;
+
+}
+
+/*
+ * Find where the last slice stopped. RSH_ERR if it finished, or if the
+ * directory it was in is gone, and the next one starts from the top.
+ */
+static int _rsh_fat16_defrag_resume(uint32_t *dir, uint32_t *cluster,
+				    struct rsh_fat_dirent **from){
+
+  uint32_t want = defrag_cursor.at / FAT_CLUSTER_SIZE;
+  uint32_t at;
+
+  if ( defrag_cursor.dir == FAT_TERM ||
+       ! _rsh_fat16_defrag_is_dir(defrag_cursor.dir) )
+    return RSH_ERR;
+
+  for ( at = defrag_cursor.dir; at != want; at = rsh_fat16_get_entry(at) )
+    if ( at == FAT_TERM || at == FAT_FREE || at == FAT_RESERVED )
+      return RSH_ERR;
+
+  /* The dirent itself may have been removed and its record joined up with
+   * the one in front of it since. Then that one is where to go on from. */
+  *dir = defrag_cursor.dir;
+  *cluster = at;
+  *from = _rsh_fat16_dirent_refind(at, fat16_fs.fs_io + defrag_cursor.at);
+
+  return RSH_OK;
+
+}
+
+/*
+ * Do a pass over the whole image, or as much of it as fits in ms
+ * milliseconds if ms isn't 0. Returns 1 if the pass isn't finished.
+ */
+int _rsh_fat16_defrag(struct rsh_fat16_defrag *defrag, long int ms){
+
+  int len = 0;
+  int stopped;
+  uint32_t dir = fat16_fs.fs_header.root_offset;
+  uint32_t cluster = dir;
+  char path[DEFRAG_PATH] = "";
+  struct rsh_fat_dirent *from = NULL;
+
+  if ( ms > 0 ){
+    defrag->timed = 1;
+    clock_gettime(CLOCK_MONOTONIC, &defrag->deadline);
+    defrag->deadline.tv_sec += ms / 1000;
+    defrag->deadline.tv_nsec += (ms % 1000) * 1000000;
+    if ( defrag->deadline.tv_nsec >= 1000000000 ){
+      defrag->deadline.tv_sec++;
+      defrag->deadline.tv_nsec -= 1000000000;
+    }
+    if ( _rsh_fat16_defrag_resume(&dir, &cluster, &from) == RSH_OK )
+      len = _rsh_fat16_defrag_path(dir, path);
+  }
+
+  /* Finish the directory it stopped in, then the rest of each one above. */
+  while ( ! (stopped = _rsh_fat16_defrag_dir(dir, cluster, from, path, len,
+					     defrag)) ){
+    from = _rsh_fat16_defrag_up(&dir, &cluster);
+    if ( ! from )
+      break;
+    len = _rsh_fat16_defrag_path(dir, path);
+  }
+
+  /* A report doesn't get in the way of an incremental pass. */
+  if ( ! defrag->report ){
+    defrag_cursor.dir = stopped ? defrag->stop.dir : FAT_TERM;
+    defrag_cursor.at = defrag->stop.at;
+  }
+
+  return stopped;
+
+}
+
+/*
+ * Run a slice between commands if that's been turned on. Returns 1 if the
+ * pass it's part of isn't finished.
+ */
+int rsh_fat16_defrag_idle(){
+
+  struct rsh_fat16_defrag defrag;
+
+  if ( rsh_fat16_defrag_idle_ms <= 0 || ! fat16_fs.fs_io )
+    return 0;
+
+  memset(&defrag, 0, sizeof(struct rsh_fat16_defrag));
+  return _rsh_fat16_defrag(&defrag, rsh_fat16_defrag_idle_ms);
+
+}
+
+/*
+ * Measure and fix fragmentation.
+ *
+ *   defrag [-r] [-v] [-s <ms>] [-i <ms>]
+ *
+ * -r only reports, -v lists every fragmented file, -s does one slice of at
+ * most ms milliseconds and -i runs a slice that long after every command (0
+ * turns that off).
+ */
+int builtin_defrag(int argc, char **argv, int in, int out, int err){
+
+  int i;
+  int stopped;
+  long int ms = 0;
+  struct rsh_fat16_defrag defrag;
+
+  memset(&defrag, 0, sizeof(struct rsh_fat16_defrag));
+  defrag.out = out;
+
+  for ( i = 1; i < argc; i++ ){
+    if ( strcmp(argv[i], "-r") == 0 ){
+      defrag.report = 1;
+    } else if ( strcmp(argv[i], "-v") == 0 ){
+      defrag.verbose = 1;
+    } else if ( strcmp(argv[i], "-s") == 0 && i + 1 < argc ){
+      ms = strtol(argv[++i], NULL, 0);
+    } else if ( strcmp(argv[i], "-i") == 0 && i + 1 < argc ){
+      rsh_fat16_defrag_idle_ms = strtol(argv[++i], NULL, 0);
+      return 0;
+    } else {
+      rsh_dprintf(err, "Usage: defrag [-r] [-v] [-s <ms>] [-i <ms>]\n");
+      return 1;
+    }
+  }
+
+  /* A report on part of the image isn't much use. */
+  if ( defrag.report )
+    ms = 0;
+
+  stopped = _rsh_fat16_defrag(&defrag, ms);
+
+  rsh_dprintf(out, "Files: %u, fragmented: %u\n", defrag.files,
+	      defrag.fragmented);
+  rsh_dprintf(out, "Extents before: %llu, after: %llu\n",
+	      (unsigned long long)defrag.extents_before,
+	      (unsigned long long)defrag.extents_after);
+  if ( ! defrag.report )
+    rsh_dprintf(out, "Moved %u files (%llu clusters)\n", defrag.moved,
+		(unsigned long long)defrag.clusters_moved);
+  if ( defrag.stuck )
+    rsh_dprintf(out, "%u files were shared or had no free run big enough\n",
+		defrag.stuck);
+  if ( stopped )
+    rsh_dprintf(out, "Out of time, run again to continue.\n");
+
+  return 0;
+
+}
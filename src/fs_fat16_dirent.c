@@ -0,0 +1,333 @@
+/*
+ * Directory formats. A directory is a chain of clusters full of dirents, and
+ * there are two ways of laying them out:
+ *
+ *   fixed    Every dirent gets a 128 byte slot: 108 bytes of name and then
+ *            the dirent itself. What every image had before version 6.
+ *   compact  Every dirent gets a record just as long as its name needs: a
+ *            small header, the dirent and then the name. Most names are
+ *            short, so a cluster holds several times as many of them and
+ *            going through a directory touches that much less of the image.
+ *            The header has the length of the name and 16 bits of its hash,
+ *            which lookups check before looking at the name itself.
+ *
+ * Version 6 images pick one when they're made (RSH_FS_COMPACT_DIRS) and stick
+ * with it. Anything older is fixed.
+ *
+ * Records don't cross from one cluster into the next and a record with a name
+ * in it never moves, so a pointer to a dirent is good for as long as the
+ * dirent is there; the indexes, the dentry cache and open files all count on
+ * that. A new compact record is cut off the front of an empty one. Removing a
+ * record just empties it, and empty records next to each other are joined
+ * back up the next time somebody looks for room in that cluster. That's the
+ * one time a record goes away: an empty one following another empty one. The
+ * indexes only keep clusters with room in them for compact directories, not
+ * the empty records themselves, and the dentry cache forgets a dirent when it
+ * goes, so the only thing left that can be holding on to an empty record is a
+ * directory being read; readdir checks _rsh_fat16_dir_joins() and finds its
+ * place again with _rsh_fat16_dirent_refind() when it has changed.
+ */
+
+#include <rsh.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <string.h>
+
+/* The shortest a record can be: one with an empty name. */
+#define DREC_MIN FAT_DREC_LEN(0)
+
+/* How many times empty records have been joined up. */
+static uint32_t dir_joins;
+
+/*
+ * The first dirent in a directory cluster if ent is NULL, otherwise the one
+ * after ent. Empty ones count. NULL when there are no more, or when a compact
+ * record doesn't make sense; fsck goes looking for that, everybody else just
+ * doesn't see anything past it.
+ */
+struct rsh_fat_dirent *_rsh_fat16_dirent_next(uint32_t cluster,
+					      struct rsh_fat_dirent *ent){
+
+  void *start = FAT_CLUSTER_TO_ADDR(cluster);
+  void *end = start + FAT_CLUSTER_SIZE;
+  struct rsh_fat_slot *slot;
+  struct rsh_fat_drec *rec;
+
+  if ( ! FAT_COMPACT_DIRS ){
+    slot = ent ? FAT_DIRENT_SLOT(ent) + 1 : start;
+    if ( (void *)(slot + 1) > end )
+      return NULL;
+    return &slot->ent;
+  }
+
+  rec = ent ? (void *)FAT_DIRENT_DREC(ent) + FAT_DIRENT_DREC(ent)->len : start;
+  if ( end - (void *)rec < DREC_MIN || rec->len < DREC_MIN || rec->len % 4 ||
+       rec->len > end - (void *)rec || rec->name_len > FAT_NAME_MAX ||
+       FAT_DREC_LEN(rec->name_len) > rec->len || rec->name[rec->name_len] )
+    return NULL;
+
+  return &rec->ent;
+
+}
+
+/*
+ * ent was a dirent in cluster, but empty records may have been joined up since
+ * and ent may be gone. The dirent whose record starts where ent's did, or the
+ * one that has taken over that spot if there's nothing there any more. NULL if
+ * the cluster doesn't make sense up to there.
+ */
+struct rsh_fat_dirent *_rsh_fat16_dirent_refind(uint32_t cluster,
+						struct rsh_fat_dirent *ent){
+
+  void *where = FAT_DIRENT_DREC(ent);
+  struct rsh_fat_dirent *prev = NULL;
+  struct rsh_fat_dirent *next;
+
+  if ( ! FAT_COMPACT_DIRS )
+    return ent;
+
+  for ( next = _rsh_fat16_dirent_next(cluster, NULL);
+	next && (void *)FAT_DIRENT_DREC(next) <= where;
+	next = _rsh_fat16_dirent_next(cluster, next) )
+    prev = next;
+
+  return prev;
+
+}
+
+/*
+ * Goes up every time empty records are joined up; see the top of the file.
+ */
+uint32_t _rsh_fat16_dir_joins(){
+
+  return dir_joins;
+
+}
+
+/*
+ * Could ent be given name without it running into the next dirent? A name too
+ * long for the image doesn't fit anywhere.
+ */
+int _rsh_fat16_dirent_fits(struct rsh_fat_dirent *ent, const char *name){
+
+  if ( strlen(name) > FAT_NAME_MAX )
+    return 0;
+  if ( ! FAT_COMPACT_DIRS )
+    return 1;
+
+  return FAT_DIRENT_DREC(ent)->len >=
+    FAT_DREC_LEN(strnlen(name, FAT_NAME_MAX));
+
+}
+
+/*
+ * Name ent, cutting the name off at FAT_NAME_MAX characters; whoever made the
+ * room for it has already turned away longer ones. It has to fit. On version 0
+ * images this writes over size_hi.
+ */
+void _rsh_fat16_dirent_name(struct rsh_fat_dirent *ent, const char *name){
+
+  size_t len = strnlen(name, FAT_NAME_MAX);
+  char *dest = FAT_DIRENT_NAME(ent);
+  struct rsh_fat_drec *rec;
+
+  /* fsck gives things the name they already have. */
+  memmove(dest, name, len);
+
+  if ( ! FAT_COMPACT_DIRS ){
+    memset(dest + len, 0, FAT_NAME_MAX + 1 - len);
+    rsh_fat16_meta(FAT_DIRENT_SLOT(ent), sizeof(struct rsh_fat_slot));
+    return;
+  }
+
+  dest[len] = 0;
+  rec = FAT_DIRENT_DREC(ent);
+  rec->name_len = len;
+  rec->hash = _rsh_fat16_name_hash(dest);
+  rsh_fat16_meta(rec, FAT_DREC_LEN(len));
+
+}
+
+/*
+ * Do a compact record's name length and hash go with its name?
+ */
+int _rsh_fat16_dirent_name_ok(struct rsh_fat_dirent *ent){
+
+  struct rsh_fat_drec *rec = FAT_DIRENT_DREC(ent);
+
+  if ( ! FAT_COMPACT_DIRS )
+    return 1;
+
+  return rec->name_len == strlen(rec->name) &&
+    rec->hash == (uint16_t)_rsh_fat16_name_hash(rec->name);
+
+}
+
+/*
+ * Empty out ent.
+ */
+void _rsh_fat16_dirent_clear(struct rsh_fat_dirent *ent){
+
+  struct rsh_fat_drec *rec;
+
+  if ( ! FAT_COMPACT_DIRS ){
+    memset(FAT_DIRENT_SLOT(ent), 0, sizeof(struct rsh_fat_slot));
+    rsh_fat16_meta(FAT_DIRENT_SLOT(ent), sizeof(struct rsh_fat_slot));
+    return;
+  }
+
+  rec = FAT_DIRENT_DREC(ent);
+  rsh_fat16_meta(rec, FAT_DREC_LEN(rec->name_len));
+  memset(rec->name, 0, rec->name_len + 1);
+  memset(&rec->ent, 0, sizeof(struct rsh_fat_dirent));
+  rec->hash = 0;
+  rec->name_len = 0;
+
+}
+
+/*
+ * Find an empty dirent in a directory cluster that name would fit in, without
+ * taking it. *any is set if the cluster has any empty dirents at all. Empty
+ * compact records get joined up with the empty ones after them on the way,
+ * and if the one we pick is bigger than name needs the rest is cut off into
+ * an empty record of its own.
+ */
+struct rsh_fat_dirent *_rsh_fat16_dirent_room(uint32_t cluster,
+					      const char *name, int *any){
+
+  uint32_t need = FAT_DREC_LEN(strnlen(name, FAT_NAME_MAX));
+  struct rsh_fat_dirent *ent;
+  struct rsh_fat_dirent *next;
+  struct rsh_fat_drec *rec;
+  struct rsh_fat_drec *rest;
+
+  *any = 0;
+  for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+    if ( FAT_DIRENT_NAME(ent)[0] )
+      continue;
+
+    *any = 1;
+    if ( ! FAT_COMPACT_DIRS )
+      return ent;
+
+    rec = FAT_DIRENT_DREC(ent);
+    while ( (next = _rsh_fat16_dirent_next(cluster, ent)) &&
+	    ! FAT_DIRENT_NAME(next)[0] ){
+      rec->len += FAT_DIRENT_DREC(next)->len;
+      rsh_fat16_meta(&rec->len, sizeof(rec->len));
+      dir_joins++;
+    }
+    if ( rec->len < need )
+      continue;
+
+    if ( rec->len - need >= DREC_MIN ){
+      rest = (void *)rec + need;
+      memset(rest, 0, DREC_MIN);
+      rest->len = rec->len - need;
+      rsh_fat16_meta(rest, DREC_MIN);
+      rec->len = need;
+      rsh_fat16_meta(&rec->len, sizeof(rec->len));
+    }
+    return ent;
+
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Set up a new, cleared, cluster of a directory table: all empty.
+ */
+void _rsh_fat16_dir_cluster(uint32_t cluster){
+
+  struct rsh_fat_drec *rec = FAT_CLUSTER_TO_ADDR(cluster);
+
+  if ( ! FAT_COMPACT_DIRS )
+    return;
+
+  rec->len = FAT_CLUSTER_SIZE;
+  rsh_fat16_meta(&rec->len, sizeof(rec->len));
+
+}
+
+/*
+ * Set up the first, cleared, cluster of a new directory: . pointing at itself
+ * and .. at parent.
+ */
+void _rsh_fat16_dir_format(uint32_t cluster, uint32_t parent){
+
+  int any;
+  struct rsh_fat_dirent *dot;
+  struct rsh_fat_dirent *dotdot;
+
+  _rsh_fat16_dir_cluster(cluster);
+
+  dot = _rsh_fat16_dirent_room(cluster, ".", &any);
+  _rsh_fat16_dirent_name(dot, ".");
+  dot->index = cluster;
+  dot->size = 0;
+  dot->type = FAT_DIR;
+  dot->epoch = (uint32_t) time(NULL);
+  rsh_fat16_meta(dot, sizeof(struct rsh_fat_dirent));
+
+  dotdot = _rsh_fat16_dirent_room(cluster, "..", &any);
+  _rsh_fat16_dirent_name(dotdot, "..");
+  dotdot->index = parent;
+  dotdot->size = 0;
+  dotdot->type = FAT_DIR;
+  dotdot->epoch = (uint32_t) time(NULL);
+  rsh_fat16_meta(dotdot, sizeof(struct rsh_fat_dirent));
+
+}
+
+/*
+ * Do the records of a directory cluster go right up to the end of it? last is
+ * the last dirent _rsh_fat16_dirent_next() gave back, NULL if there wasn't
+ * one.
+ */
+int _rsh_fat16_dir_ends(uint32_t cluster, struct rsh_fat_dirent *last){
+
+  void *end;
+
+  if ( ! FAT_COMPACT_DIRS )
+    return 1;
+
+  end = last ? (void *)FAT_DIRENT_DREC(last) + FAT_DIRENT_DREC(last)->len :
+    FAT_CLUSTER_TO_ADDR(cluster);
+
+  return end == FAT_CLUSTER_TO_ADDR(cluster) + FAT_CLUSTER_SIZE;
+
+}
+
+/*
+ * Make the records of a directory cluster stop after last (NULL for none at
+ * all) with the rest of the cluster one empty record. Whatever was past last
+ * is gone. For fsck.
+ */
+void _rsh_fat16_dir_cut(uint32_t cluster, struct rsh_fat_dirent *last){
+
+  void *end = FAT_CLUSTER_TO_ADDR(cluster) + FAT_CLUSTER_SIZE;
+  struct rsh_fat_drec *rec;
+
+  if ( ! FAT_COMPACT_DIRS )
+    return;
+
+  rec = last ? (void *)FAT_DIRENT_DREC(last) + FAT_DIRENT_DREC(last)->len :
+    FAT_CLUSTER_TO_ADDR(cluster);
+
+  /* Too little left over for a record of its own. */
+  if ( last && end - (void *)rec < DREC_MIN ){
+    FAT_DIRENT_DREC(last)->len += end - (void *)rec;
+    rsh_fat16_meta(FAT_DIRENT_DREC(last), sizeof(uint32_t));
+    return;
+  }
+
+  memset(rec, 0, DREC_MIN);
+  rec->len = end - (void *)rec;
+  rsh_fat16_meta(rec, DREC_MIN);
+
+}
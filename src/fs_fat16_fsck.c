@@ -0,0 +1,1216 @@
+/*
+ * Checking (and fixing) a FAT16 image. The rest of the driver calls
+ * rsh_fat16_badness() as soon as it trips over something that doesn't add
+ * up, which is no fun at all if the image is yours. This walks the whole
+ * thing up front and finds:
+ *
+ *   - chains that link to a free, reserved or out of range cluster
+ *   - cross-linked clusters: two chains that end up sharing a cluster
+ *   - cycles in a chain
+ *   - files whose size doesn't match the length of their chain
+ *   - directories whose . or .. point at the wrong place
+ *   - orphaned clusters: in use according to the FAT but not in any chain
+ *   - reference counts that don't match how many chains run into a cluster
+ *   - packed files whose data isn't in a pack cluster, or is in units some
+ *     other file has, and pack clusters whose maps are wrong
+ *   - compact directory records that don't add up to the cluster they're in,
+ *     or whose name length or hash doesn't go with the name
+ *   - directory trees whose nodes are out of order, lead somewhere other
+ *     than the directory's own dirents or are missing some of them
+ *   - compressed files whose header doesn't make sense or whose chunks don't
+ *     uncompress
+ *
+ * The directory tree is walked by a pool of threads. Each cluster gets an
+ * owner (the chain that got to it first) which is claimed with a compare and
+ * swap, so a worker finding the cluster already taken knows right away it's
+ * either cross-linked or going around in circles, unless the cluster's shared
+ * (see fs_fat16_cow.c), in which case the file just joins the chain that
+ * already has it. Directories go on a queue
+ * as they're found; files are checked by whoever finds them. Nothing is
+ * changed while the workers are running.
+ *
+ * Repairs are done afterwards by one thread and go for whatever loses the
+ * least: bad chains are cut off at the last good cluster, sizes are clamped
+ * to the chain, extra clusters past the end of a file and orphans are freed.
+ * A dirent whose very first cluster is bad can't be saved so it's cleared,
+ * and neither can a packed file with bad units, which is emptied. Directory
+ * records stop at the last good one, anything after it is lost (and its
+ * clusters end up orphans). A broken directory tree is just thrown away.
+ * A compressed file that's broken, or loses any of its chain, is emptied
+ * since what's left of it can't be read anyway.
+ * Reference counts and pack maps are rewritten last to match whatever is
+ * left, and if anything at all was fixed every directory tree is built over
+ * again from its table.
+ * Fixing things while files are open isn't a good idea.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Most worker threads we'll start. */
+#define FSCK_MAX_THREADS 8
+
+/* Kinds of problems. */
+#define FSCK_BAD_LINK    0  /* Links to a free/reserved/bogus cluster. */
+#define FSCK_CROSS_LINK  1
+#define FSCK_CYCLE       2
+#define FSCK_BAD_HEAD    3  /* The first cluster itself is no good. */
+#define FSCK_SIZE_LONG   4  /* Size is past the end of the chain. */
+#define FSCK_CHAIN_LONG  5  /* Chain has clusters past the end of the file. */
+#define FSCK_BAD_DOT     6
+#define FSCK_BAD_DOTDOT  7
+#define FSCK_BAD_FAT     8  /* The FAT's own chain is wrong. */
+#define FSCK_BAD_PACK    9  /* Packed data is somewhere it can't be. */
+#define FSCK_BAD_RECORDS 10 /* Compact records run off the cluster. */
+#define FSCK_BAD_NAME    11 /* Compact record's hash or length is wrong. */
+#define FSCK_BAD_TREE    12
+#define FSCK_BAD_ZIP     13
+
+static char *problem_names[] = {
+  "links to a bad cluster",
+  "cross-linked",
+  "chain loops back on itself",
+  "starts at a bad cluster",
+  "size is past the end of its chain",
+  "chain is longer than the file",
+  "bad . entry",
+  "bad .. entry",
+  "FAT chain is wrong",
+  "packed data is in a bad place",
+  "directory records are broken",
+  "name hash is wrong",
+  "directory tree is broken",
+  "compressed data is broken",
+};
+
+struct rsh_fat16_problem {
+
+  int type;
+  char *path;
+  struct rsh_fat_dirent *ent; /* NULL for the root and the FAT itself, the
+				 last good record for broken records. */
+  uint32_t cluster;           /* Where things went wrong. */
+  uint32_t prev;              /* Last good cluster, FAT_TERM if none. */
+  uint32_t length;            /* Good clusters in the chain. */
+
+};
+
+/* A directory waiting to be walked. */
+struct rsh_fat16_fsck_dir {
+
+  struct rsh_fat_dirent *ent; /* NULL for the root. */
+  uint32_t table;
+  uint32_t parent;
+  char *path;
+
+  struct rsh_fat16_fsck_dir *next;
+
+};
+
+struct rsh_fat16_fsck {
+
+  uint32_t *owner;            /* Chain id + 1 for each cluster, 0 if none. */
+  uint32_t *in;               /* Dirents and file system chain links
+				 running into each cluster. */
+  uint32_t next_id;
+
+  /* Pack clusters, sorted, and the units of them packed files turn out to
+   * use: a bit per unit, pack after pack. */
+  uint32_t *packs;
+  uint32_t npacks;
+  uint8_t *pack_map;
+
+  /* Work queue. pending counts queued plus in progress directories. */
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct rsh_fat16_fsck_dir *queue;
+  int pending;
+
+  struct rsh_fat16_problem *problems;
+  uint32_t nproblems;
+  uint32_t problems_size;
+  int failed;                 /* Ran out of memory. */
+
+  /* Counts. */
+  uint32_t dirs;
+  uint32_t files;
+  uint32_t clusters;
+  uint32_t orphans;
+  uint32_t bad_refs;
+  uint32_t bad_packs;
+
+};
+
+/*
+ * Note a problem. Takes the lock.
+ */
+static void _rsh_fat16_fsck_problem(struct rsh_fat16_fsck *fsck, int type,
+				    const char *path,
+				    struct rsh_fat_dirent *ent,
+				    uint32_t cluster, uint32_t prev,
+				    uint32_t length){
+
+  struct rsh_fat16_problem *tmp;
+  struct rsh_fat16_problem *problem;
+
+  pthread_mutex_lock(&fsck->lock);
+
+  if ( fsck->nproblems == fsck->problems_size ){
+    tmp = realloc(fsck->problems, (fsck->problems_size ?
+				   fsck->problems_size * 2 : 16) *
+		  sizeof(struct rsh_fat16_problem));
+    if ( ! tmp ){
+      fsck->failed = 1;
+      pthread_mutex_unlock(&fsck->lock);
+      return;
+    }
+    fsck->problems = tmp;
+    fsck->problems_size = fsck->problems_size ? fsck->problems_size * 2 : 16;
+  }
+
+  problem = &fsck->problems[fsck->nproblems++];
+  problem->type = type;
+  problem->path = strdup(path[0] ? path : "/");
+  problem->ent = ent;
+  problem->cluster = cluster;
+  problem->prev = prev;
+  problem->length = length;
+
+  pthread_mutex_unlock(&fsck->lock);
+
+}
+
+/*
+ * How long the rest of a chain somebody else owns is, holes and all. Problems
+ * in it are theirs to report.
+ */
+static uint32_t _rsh_fat16_fsck_joined(uint32_t cluster){
+
+  uint32_t length = 0;
+  uint32_t steps = 0;
+  uint32_t next;
+
+  while ( cluster < fat16_fs.fat_entries && steps++ < fat16_fs.fat_entries ){
+    length++;
+    next = rsh_fat16_get_entry(cluster);
+    if ( next < fat16_fs.fat_entries )
+      length += _rsh_fat16_gap(cluster);
+    cluster = next;
+  }
+
+  return length;
+
+}
+
+/*
+ * Walk a chain and claim its clusters. Returns how far into the file the good
+ * part of it reaches, in clusters and counting holes; anything wrong gets
+ * noted as a problem against path.
+ */
+static uint32_t _rsh_fat16_fsck_chain(struct rsh_fat16_fsck *fsck,
+				      uint32_t head, const char *path,
+				      struct rsh_fat_dirent *ent){
+
+  uint32_t id = __sync_add_and_fetch(&fsck->next_id, 1);
+  uint32_t prev = FAT_TERM;
+  uint32_t cluster = head;
+  uint32_t length = 0;
+  uint32_t index = 0;
+  uint32_t claimed = 0;
+  uint32_t owner;
+
+  while ( 1 ){
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED ||
+	 cluster >= fat16_fs.fat_entries ){
+      _rsh_fat16_fsck_problem(fsck, prev == FAT_TERM ? FSCK_BAD_HEAD :
+			      FSCK_BAD_LINK, path, ent, cluster, prev, length);
+      break;
+    }
+
+    owner = __sync_val_compare_and_swap(&fsck->owner[cluster], 0, id);
+    if ( owner && owner != id && ent && ent->type != FAT_DIR &&
+	 _rsh_fat16_refs(cluster) ){
+      __sync_add_and_fetch(&fsck->clusters, claimed);
+      return index + _rsh_fat16_fsck_joined(cluster);
+    }
+    if ( owner ){
+      if ( prev == FAT_TERM )
+	_rsh_fat16_fsck_problem(fsck, FSCK_BAD_HEAD, path, ent, cluster,
+				prev, length);
+      else
+	_rsh_fat16_fsck_problem(fsck, owner == id ? FSCK_CYCLE :
+				FSCK_CROSS_LINK, path, ent, cluster, prev,
+				length);
+      break;
+    }
+
+    claimed++;
+    length = index + 1;
+    index = length + _rsh_fat16_gap(cluster);
+    prev = cluster;
+    cluster = rsh_fat16_get_entry(cluster);
+    if ( cluster == FAT_TERM )
+      break;
+
+  }
+
+  __sync_add_and_fetch(&fsck->clusters, claimed);
+  return length;
+
+}
+
+/*
+ * Where in fsck->packs a cluster is, or npacks if it's not a pack cluster.
+ */
+static uint32_t _rsh_fat16_fsck_find_pack(struct rsh_fat16_fsck *fsck,
+					  uint32_t cluster){
+
+  uint32_t lo = 0, hi = fsck->npacks;
+  uint32_t mid;
+
+  while ( lo < hi ){
+    mid = lo + (hi - lo) / 2;
+    if ( fsck->packs[mid] == cluster )
+      return mid;
+    if ( fsck->packs[mid] < cluster )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return fsck->npacks;
+
+}
+
+/*
+ * Check where a packed file's data is and claim its units.
+ */
+static void _rsh_fat16_fsck_packed(struct rsh_fat16_fsck *fsck,
+				   struct rsh_fat_dirent *ent,
+				   const char *path){
+
+  uint32_t per = FAT_CLUSTER_SIZE / FAT_PACK_UNIT;
+  uint32_t count = FAT_PACK_UNITS(ent->size);
+  uint32_t first = ent->size_hi % per;
+  uint32_t n = _rsh_fat16_fsck_find_pack(fsck, ent->size_hi / per);
+  uint32_t i, bit;
+  uint8_t mask;
+
+  if ( ! count )
+    return;
+
+  if ( ent->size > fat16_fs.pack_max || n == fsck->npacks ||
+       first < _rsh_fat16_pack_header_units() || first + count > per ){
+    _rsh_fat16_fsck_problem(fsck, FSCK_BAD_PACK, path, ent, 0, 0, 0);
+    return;
+  }
+
+  for ( i = 0; i < count; i++ ){
+    bit = n * per + first + i;
+    mask = 1 << (bit % 8);
+    if ( __sync_fetch_and_or(&fsck->pack_map[bit / 8], mask) & mask )
+      break;
+  }
+  if ( i == count )
+    return;
+
+  /* Somebody else's. Let go of what we took, they can keep it. */
+  while ( i-- ){
+    bit = n * per + first + i;
+    __sync_fetch_and_and(&fsck->pack_map[bit / 8], ~(1 << (bit % 8)));
+  }
+  _rsh_fat16_fsck_problem(fsck, FSCK_BAD_PACK, path, ent, 0, 0, 0);
+
+}
+
+/*
+ * Check a file's chain against its size.
+ */
+static void _rsh_fat16_fsck_file(struct rsh_fat16_fsck *fsck,
+				 struct rsh_fat_dirent *ent, const char *path){
+
+  uint32_t length;
+  uint64_t need;
+
+  if ( FAT_DIRENT_PACKED(ent) ){
+    _rsh_fat16_fsck_packed(fsck, ent, path);
+    return;
+  }
+
+  length = _rsh_fat16_fsck_chain(fsck, ent->index, path, ent);
+  if ( ! length )
+    return;
+
+  need = (FAT_DIRENT_SIZE(ent) + FAT_CLUSTER_SIZE - 1) / FAT_CLUSTER_SIZE;
+  if ( ! need )
+    need = 1;
+
+  if ( need > length )
+    _rsh_fat16_fsck_problem(fsck, FSCK_SIZE_LONG, path, ent, 0, 0, length);
+  else if ( need < length )
+    _rsh_fat16_fsck_problem(fsck, FSCK_CHAIN_LONG, path, ent, 0, 0, need);
+
+  /* Only worth looking inside if the chain's all there. */
+  if ( ent->type == FAT_ZFILE && need <= length &&
+       _rsh_fat16_zip_check(ent) ){
+    if ( errno == ENOMEM )
+      fsck->failed = 1;
+    else
+      _rsh_fat16_fsck_problem(fsck, FSCK_BAD_ZIP, path, ent, 0, 0, 0);
+  }
+
+}
+
+/*
+ * Queue up a directory to be walked. Takes the lock.
+ */
+static void _rsh_fat16_fsck_queue(struct rsh_fat16_fsck *fsck,
+				  struct rsh_fat_dirent *ent, uint32_t table,
+				  uint32_t parent, char *path){
+
+  struct rsh_fat16_fsck_dir *dir = malloc(sizeof(struct rsh_fat16_fsck_dir));
+
+  pthread_mutex_lock(&fsck->lock);
+  if ( ! dir ){
+    fsck->failed = 1;
+    free(path);
+    pthread_mutex_unlock(&fsck->lock);
+    return;
+  }
+
+  dir->ent = ent;
+  dir->table = table;
+  dir->parent = parent;
+  dir->path = path;
+  dir->next = fsck->queue;
+  fsck->queue = dir;
+  fsck->pending++;
+  pthread_cond_signal(&fsck->cond);
+  pthread_mutex_unlock(&fsck->lock);
+
+}
+
+/* What checking a directory's tree needs to know about the directory. */
+struct rsh_fat16_fsck_tree {
+
+  uint32_t id;                /* Owner for the tree's clusters. */
+  uint32_t *clusters;         /* The directory's own, sorted. */
+  uint32_t nclusters;
+  uint64_t *ents;             /* Where its named dirents are, sorted. */
+  uint32_t nents;
+  uint32_t keys;              /* Keys found in the leaves. */
+  uint32_t claimed;
+  uint32_t last_leaf;         /* Last leaf seen, FAT_TERM before the first. */
+
+};
+
+static int _rsh_fat16_fsck_cmp(const void *a, const void *b){
+
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+
+}
+
+static int _rsh_fat16_fsck_cmp64(const void *a, const void *b){
+
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return x < y ? -1 : x > y;
+
+}
+
+static int _rsh_fat16_fsck_key_cmp(struct rsh_fat_tkey *a,
+				   struct rsh_fat_tkey *b){
+
+  int ret = memcmp(a->name, b->name, a->len < b->len ? a->len : b->len);
+
+  return ret ? ret : (int)a->len - (int)b->len;
+
+}
+
+/*
+ * Note one more named dirent of the directory.
+ */
+static int _rsh_fat16_fsck_tree_ent(struct rsh_fat16_fsck_tree *tree,
+				    struct rsh_fat_dirent *ent){
+
+  uint64_t *tmp;
+
+  if ( (tree->nents & (tree->nents - 1)) == 0 ){
+    tmp = realloc(tree->ents, (tree->nents ? tree->nents * 2 : 1) *
+		  sizeof(uint64_t));
+    if ( ! tmp )
+      return RSH_ERR;
+    tree->ents = tmp;
+  }
+
+  tree->ents[tree->nents++] = (void *)ent - fat16_fs.fs_io;
+  return RSH_OK;
+
+}
+
+/*
+ * Check the tree node at cluster, which should be at level and have keys no
+ * earlier than lo and before hi (either NULL for no limit), and everything
+ * under it. Leaves have to turn up in the order they're chained in and each
+ * key has to name a dirent of the directory. Returns non-zero if it's no
+ * good.
+ */
+static int _rsh_fat16_fsck_tnode(struct rsh_fat16_fsck *fsck,
+				 struct rsh_fat16_fsck_tree *tree,
+				 uint32_t cluster, uint32_t level,
+				 struct rsh_fat_tkey *lo,
+				 struct rsh_fat_tkey *hi){
+
+  uint32_t i;
+  uint64_t at;
+  struct rsh_fat_tnode *node;
+  struct rsh_fat_tkey *key;
+  struct rsh_fat_tkey *prev = NULL;
+  struct rsh_fat_dirent *ent;
+
+  if ( cluster == FAT_FREE || cluster >= fat16_fs.fat_entries ||
+       rsh_fat16_get_entry(cluster) != FAT_TERM ||
+       __sync_val_compare_and_swap(&fsck->owner[cluster], 0, tree->id) )
+    return 1;
+  tree->claimed++;
+
+  node = FAT_TNODE(cluster);
+  if ( node->magic != FAT_TNODE_MAGIC || node->level != level ||
+       sizeof(struct rsh_fat_tnode) + node->count * sizeof(uint16_t) >
+       node->heap || node->heap > FAT_CLUSTER_SIZE )
+    return 1;
+
+  for ( i = 0; i < node->count; i++, prev = key ){
+    if ( node->offs[i] < node->heap ||
+	 node->offs[i] + sizeof(struct rsh_fat_tkey) > FAT_CLUSTER_SIZE )
+      return 1;
+    key = FAT_TKEY(node, i);
+    if ( ! key->len || key->len > FAT_NAME_MAX ||
+	 node->offs[i] + FAT_TKEY_LEN(key->len) > FAT_CLUSTER_SIZE ||
+	 memchr(key->name, 0, key->len) )
+      return 1;
+    if ( (prev && _rsh_fat16_fsck_key_cmp(prev, key) >= 0) ||
+	 (lo && _rsh_fat16_fsck_key_cmp(key, lo) < 0) ||
+	 (hi && _rsh_fat16_fsck_key_cmp(key, hi) >= 0) )
+      return 1;
+  }
+
+  if ( level ){
+    if ( _rsh_fat16_fsck_tnode(fsck, tree, node->link, level - 1, lo,
+			       node->count ? FAT_TKEY(node, 0) : hi) )
+      return 1;
+    for ( i = 0; i < node->count; i++ )
+      if ( _rsh_fat16_fsck_tnode(fsck, tree, FAT_TKEY(node, i)->ptr,
+				 level - 1, FAT_TKEY(node, i),
+				 i + 1 < node->count ?
+				 FAT_TKEY(node, i + 1) : hi) )
+	return 1;
+    return 0;
+  }
+
+  /* A leaf. The one before it has to link here. */
+  if ( tree->last_leaf != FAT_TERM &&
+       FAT_TNODE(tree->last_leaf)->link != cluster )
+    return 1;
+  tree->last_leaf = cluster;
+
+  for ( i = 0; i < node->count; i++ ){
+    key = FAT_TKEY(node, i);
+    at = (uint64_t)key->ptr * FAT_CLUSTER_SIZE + key->at;
+    if ( ! bsearch(&at, tree->ents, tree->nents, sizeof(uint64_t),
+		   _rsh_fat16_fsck_cmp64) )
+      return 1;
+    ent = FAT_CLUSTER_TO_ADDR(key->ptr) + key->at;
+    if ( strncmp(FAT_DIRENT_NAME(ent), key->name, key->len) != 0 ||
+	 FAT_DIRENT_NAME(ent)[key->len] )
+      return 1;
+  }
+  tree->keys += node->count;
+
+  return 0;
+
+}
+
+/*
+ * Check the tree of the directory whose . is dot. tree has the directory's
+ * clusters and dirents. Its nodes are claimed if it's good.
+ */
+static void _rsh_fat16_fsck_tree(struct rsh_fat16_fsck *fsck,
+				 struct rsh_fat16_fsck_dir *dir,
+				 struct rsh_fat_dirent *dot,
+				 struct rsh_fat16_fsck_tree *tree){
+
+  uint32_t i;
+  uint32_t root = dot->size_hi;
+  int bad;
+
+  tree->id = __sync_add_and_fetch(&fsck->next_id, 1);
+  tree->last_leaf = FAT_TERM;
+
+  qsort(tree->clusters, tree->nclusters, sizeof(uint32_t),
+	_rsh_fat16_fsck_cmp);
+  qsort(tree->ents, tree->nents, sizeof(uint64_t), _rsh_fat16_fsck_cmp64);
+
+  bad = root >= fat16_fs.fat_entries ||
+    FAT_TNODE(root)->level >= FAT_TREE_DEPTH ||
+    _rsh_fat16_fsck_tnode(fsck, tree, root, FAT_TNODE(root)->level,
+			  NULL, NULL) ||
+    tree->keys != tree->nents ||
+    FAT_TNODE(tree->last_leaf)->link != FAT_TERM ||
+    (dot->size && ! bsearch(&dot->size, tree->clusters, tree->nclusters,
+			    sizeof(uint32_t), _rsh_fat16_fsck_cmp));
+
+  if ( ! bad ){
+    __sync_add_and_fetch(&fsck->clusters, tree->claimed);
+    return;
+  }
+
+  /* Let go of the nodes so they end up orphans. */
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    __sync_val_compare_and_swap(&fsck->owner[i], tree->id, 0);
+  _rsh_fat16_fsck_problem(fsck, FSCK_BAD_TREE, dir->path, dot, dir->table,
+			  0, 0);
+
+}
+
+/*
+ * Walk one directory: its own chain, its . and .., its files and queue up
+ * its subdirectories.
+ */
+static void _rsh_fat16_fsck_dir(struct rsh_fat16_fsck *fsck,
+				struct rsh_fat16_fsck_dir *dir){
+
+  int i;
+  int len;
+  char *name;
+  char *path;
+  uint32_t j;
+  uint32_t length;
+  uint32_t cluster;
+  uint32_t files = 0;
+  struct rsh_fat_dirent *ent;
+  struct rsh_fat_dirent *last;
+  struct rsh_fat_dirent *dot = NULL;
+  struct rsh_fat16_fsck_tree tree;
+
+  length = _rsh_fat16_fsck_chain(fsck, dir->table, dir->path, dir->ent);
+
+  /* A tree gets checked against the clusters and dirents found here. */
+  memset(&tree, 0, sizeof(struct rsh_fat16_fsck_tree));
+  if ( FAT_TREE_DIRS ){
+    tree.clusters = malloc(length * sizeof(uint32_t) + 1);
+    if ( ! tree.clusters )
+      fsck->failed = 1;
+  }
+
+  /* Only look at the clusters that turned out to be ours. */
+  cluster = dir->table;
+  for ( j = 0; j < length; j++ ){
+
+    if ( tree.clusters )
+      tree.clusters[tree.nclusters++] = cluster;
+
+    last = NULL;
+    for ( i = 0, ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	  i++, last = ent, ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+      name = FAT_DIRENT_NAME(ent);
+      if ( ! name[0] )
+	continue;
+
+      if ( tree.clusters && _rsh_fat16_fsck_tree_ent(&tree, ent) ){
+	fsck->failed = 1;
+	free(tree.clusters);
+	tree.clusters = NULL;
+      }
+
+      if ( j == 0 && i == 0 ){
+	if ( strcmp(name, ".") != 0 || ent->index != dir->table )
+	  _rsh_fat16_fsck_problem(fsck, FSCK_BAD_DOT, dir->path, ent,
+				  dir->table, 0, 0);
+	else
+	  dot = ent;
+	continue;
+      }
+      if ( j == 0 && i == 1 ){
+	if ( strcmp(name, "..") != 0 || ent->index != dir->parent )
+	  _rsh_fat16_fsck_problem(fsck, FSCK_BAD_DOTDOT, dir->path, ent,
+				  dir->parent, 0, 0);
+	continue;
+      }
+
+      if ( ! FAT_DIRENT_PACKED(ent) && ent->index < fat16_fs.fat_entries )
+	__sync_add_and_fetch(&fsck->in[ent->index], 1);
+
+      len = strlen(dir->path) + strnlen(name, FAT_NAME_MAX + 1);
+      path = malloc(len + 2);
+      if ( ! path ){
+	fsck->failed = 1;
+	continue;
+      }
+      sprintf(path, "%s/%.*s", dir->path, FAT_NAME_MAX + 1, name);
+
+      if ( ! _rsh_fat16_dirent_name_ok(ent) )
+	_rsh_fat16_fsck_problem(fsck, FSCK_BAD_NAME, path, ent, 0, 0, 0);
+
+      if ( ent->type == FAT_DIR ){
+	_rsh_fat16_fsck_queue(fsck, ent, ent->index, dir->table, path);
+	continue;
+      }
+
+      _rsh_fat16_fsck_file(fsck, ent, path);
+      files++;
+      free(path);
+
+    }
+
+    if ( ! _rsh_fat16_dir_ends(cluster, last) )
+      _rsh_fat16_fsck_problem(fsck, FSCK_BAD_RECORDS, dir->path, last,
+			      cluster, 0, 0);
+
+    cluster = rsh_fat16_get_entry(cluster);
+
+  }
+
+  if ( tree.clusters && dot && dot->size_hi )
+    _rsh_fat16_fsck_tree(fsck, dir, dot, &tree);
+  free(tree.clusters);
+  free(tree.ents);
+
+  __sync_add_and_fetch(&fsck->files, files);
+  __sync_add_and_fetch(&fsck->dirs, 1);
+
+}
+
+static void *_rsh_fat16_fsck_worker(void *arg){
+
+  struct rsh_fat16_fsck *fsck = arg;
+  struct rsh_fat16_fsck_dir *dir;
+
+  pthread_mutex_lock(&fsck->lock);
+  while ( 1 ){
+
+    while ( ! fsck->queue && fsck->pending )
+      pthread_cond_wait(&fsck->cond, &fsck->lock);
+    if ( ! fsck->queue )
+      break;
+
+    dir = fsck->queue;
+    fsck->queue = dir->next;
+    pthread_mutex_unlock(&fsck->lock);
+
+    _rsh_fat16_fsck_dir(fsck, dir);
+    free(dir->path);
+    free(dir);
+
+    pthread_mutex_lock(&fsck->lock);
+    if ( --fsck->pending == 0 )
+      pthread_cond_broadcast(&fsck->cond);
+
+  }
+  pthread_mutex_unlock(&fsck->lock);
+
+  return NULL;
+
+}
+
+/*
+ * Free the clusters of a file past the first keep (counting holes), up to the
+ * first one another chain runs into. If that leaves the file ending in a hole
+ * the size comes in to the last real cluster.
+ */
+static void _rsh_fat16_fsck_trim(struct rsh_fat16_fsck *fsck,
+				 struct rsh_fat_dirent *ent, uint32_t keep){
+
+  uint32_t cluster = ent->index;
+  uint32_t index = 0;
+  uint32_t next;
+  uint64_t max;
+
+  next = rsh_fat16_get_entry(cluster);
+  while ( next != FAT_TERM && index + 1 + _rsh_fat16_gap(cluster) < keep ){
+    index += 1 + _rsh_fat16_gap(cluster);
+    cluster = next;
+    next = rsh_fat16_get_entry(cluster);
+  }
+
+  max = ((uint64_t)index + 1) * FAT_CLUSTER_SIZE;
+  if ( FAT_DIRENT_SIZE(ent) > max )
+    _rsh_fat16_set_size(ent, max);
+
+  rsh_fat16_set_entry(cluster, FAT_TERM);
+  _rsh_fat16_set_gap(cluster, 0);
+  while ( next != FAT_TERM ){
+    cluster = next;
+    if ( fsck->in[cluster] > 1 ){
+      fsck->in[cluster]--;
+      break;
+    }
+    fsck->in[cluster] = 0;
+    next = rsh_fat16_get_entry(cluster);
+    rsh_fat16_set_entry(cluster, FAT_FREE);
+  }
+
+}
+
+/*
+ * Make a file an empty, ordinary one, keeping its first cluster.
+ */
+static void _rsh_fat16_fsck_empty(struct rsh_fat16_fsck *fsck,
+				  struct rsh_fat_dirent *ent){
+
+  ent->type = FAT_FILE;
+  _rsh_fat16_set_size(ent, 0);
+  _rsh_fat16_fsck_trim(fsck, ent, 1);
+
+}
+
+/*
+ * Cut a chain off after prev, or clear the dirent if there's nothing before
+ * the bad spot.
+ */
+static void _rsh_fat16_fsck_cut(struct rsh_fat16_fsck *fsck,
+				struct rsh_fat16_problem *problem){
+
+  uint64_t max;
+
+  if ( problem->cluster < fat16_fs.fat_entries && fsck->in[problem->cluster] )
+    fsck->in[problem->cluster]--;
+
+  if ( problem->prev == FAT_TERM ){
+    if ( problem->ent )
+      _rsh_fat16_dirent_clear(problem->ent);
+    return;
+  }
+
+  rsh_fat16_set_entry(problem->prev, FAT_TERM);
+  _rsh_fat16_set_gap(problem->prev, 0);
+
+  /* Whatever's left of a file may not cover its size any more, and part of
+   * a compressed file is no use at all. */
+  if ( problem->ent && problem->ent->type == FAT_ZFILE ){
+    _rsh_fat16_fsck_empty(fsck, problem->ent);
+  } else if ( problem->ent && problem->ent->type == FAT_FILE ){
+    max = (uint64_t)problem->length * FAT_CLUSTER_SIZE;
+    if ( FAT_DIRENT_SIZE(problem->ent) > max )
+      _rsh_fat16_set_size(problem->ent, max);
+  }
+
+}
+
+/*
+ * Does pack n's header agree with what the files in it use? If fix is set,
+ * make it.
+ */
+static int _rsh_fat16_fsck_pack_map(struct rsh_fat16_fsck *fsck, uint32_t n,
+				    int fix){
+
+  uint32_t per = FAT_CLUSTER_SIZE / FAT_PACK_UNIT;
+  uint32_t i, bit;
+  uint32_t used = 0;
+  int bad = 0;
+  struct rsh_fat16_pack *pack = FAT_CLUSTER_TO_ADDR(fsck->packs[n]);
+
+  if ( fix ){
+    memset(pack, 0, sizeof(struct rsh_fat16_pack) + (per + 7) / 8);
+    pack->magic = FAT_PACK_MAGIC;
+  }
+
+  for ( i = 0; i < per; i++ ){
+    bit = n * per + i;
+    if ( ! (fsck->pack_map[bit / 8] & (1 << (bit % 8))) )
+      continue;
+    used++;
+    if ( fix )
+      pack->map[i / 8] |= 1 << (i % 8);
+    else if ( ! (pack->map[i / 8] & (1 << (i % 8))) )
+      bad = 1;
+  }
+
+  if ( fix ){
+    pack->used = used;
+    rsh_fat16_meta(pack, sizeof(struct rsh_fat16_pack) + (per + 7) / 8);
+  }
+
+  return bad || pack->magic != FAT_PACK_MAGIC || pack->used != used;
+
+}
+
+/*
+ * Claim the chain of pack clusters for the file system and set up to track
+ * which of their units are used. A bad link cuts the chain short.
+ */
+static int _rsh_fat16_fsck_packs(struct rsh_fat16_fsck *fsck){
+
+  uint32_t per = FAT_CLUSTER_SIZE / FAT_PACK_UNIT;
+  uint32_t header = _rsh_fat16_pack_header_units();
+  uint32_t prev = FAT_TERM;
+  uint32_t cluster = fat16_fs.fs_header.pack_offset;
+  uint32_t i, n, bit;
+
+  if ( ! cluster )
+    return RSH_OK;
+
+  fsck->packs = malloc(fat16_fs.pack_count * sizeof(uint32_t) +
+		       sizeof(uint32_t));
+  if ( ! fsck->packs )
+    return RSH_ERR;
+
+  while ( cluster != FAT_TERM ){
+    if ( cluster >= fat16_fs.fat_entries || fsck->owner[cluster] ||
+	 fsck->npacks > fat16_fs.pack_count ){
+      if ( prev != FAT_TERM )
+	_rsh_fat16_fsck_problem(fsck, FSCK_BAD_FAT, "pack clusters", NULL,
+				prev, FAT_TERM, 0);
+      break;
+    }
+    fsck->owner[cluster] = fsck->next_id;
+    fsck->clusters++;
+    fsck->packs[fsck->npacks++] = cluster;
+    prev = cluster;
+    cluster = rsh_fat16_get_entry(cluster);
+  }
+
+  qsort(fsck->packs, fsck->npacks, sizeof(uint32_t), _rsh_fat16_fsck_cmp);
+
+  fsck->pack_map = calloc(((uint64_t)fsck->npacks * per + 7) / 8, 1);
+  if ( ! fsck->pack_map )
+    return RSH_ERR;
+  for ( n = 0; n < fsck->npacks; n++ ){
+    for ( i = 0; i < header; i++ ){
+      bit = n * per + i;
+      fsck->pack_map[bit / 8] |= 1 << (bit % 8);
+    }
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * What a cluster's reference count ought to be.
+ */
+static uint32_t _rsh_fat16_fsck_want_refs(struct rsh_fat16_fsck *fsck,
+					  uint32_t cluster){
+
+  if ( fsck->in[cluster] <= 1 )
+    return 0;
+  if ( fsck->in[cluster] - 1 > FAT_MAX_REFS )
+    return FAT_MAX_REFS;
+  return fsck->in[cluster] - 1;
+
+}
+
+static void _rsh_fat16_fsck_repair(struct rsh_fat16_fsck *fsck){
+
+  uint32_t i;
+  struct rsh_fat16_problem *problem;
+
+  for ( i = 0; i < fsck->nproblems; i++ ){
+
+    problem = &fsck->problems[i];
+    switch ( problem->type ){
+    case FSCK_BAD_LINK:
+    case FSCK_CROSS_LINK:
+    case FSCK_CYCLE:
+    case FSCK_BAD_HEAD:
+      _rsh_fat16_fsck_cut(fsck, problem);
+      break;
+    case FSCK_SIZE_LONG:
+      if ( problem->ent->type == FAT_ZFILE )
+	_rsh_fat16_fsck_empty(fsck, problem->ent);
+      else
+	_rsh_fat16_set_size(problem->ent,
+			    (uint64_t)problem->length * FAT_CLUSTER_SIZE);
+      break;
+    case FSCK_CHAIN_LONG:
+      _rsh_fat16_fsck_trim(fsck, problem->ent, problem->length);
+      break;
+    case FSCK_BAD_DOT:
+      _rsh_fat16_dirent_name(problem->ent, ".");
+      problem->ent->index = problem->cluster;
+      problem->ent->type = FAT_DIR;
+      problem->ent->size_hi = 0;
+      problem->ent->size = 0;
+      rsh_fat16_meta(problem->ent, sizeof(struct rsh_fat_dirent));
+      break;
+    case FSCK_BAD_DOTDOT:
+      _rsh_fat16_dirent_name(problem->ent, "..");
+      problem->ent->index = problem->cluster;
+      problem->ent->type = FAT_DIR;
+      rsh_fat16_meta(problem->ent, sizeof(struct rsh_fat_dirent));
+      break;
+    case FSCK_BAD_FAT:
+      rsh_fat16_set_entry(problem->cluster, problem->prev);
+      break;
+    case FSCK_BAD_PACK:
+      problem->ent->size_hi = 0;
+      _rsh_fat16_set_size(problem->ent, 0);
+      break;
+    case FSCK_BAD_RECORDS:
+      _rsh_fat16_dir_cut(problem->cluster, problem->ent);
+      break;
+    case FSCK_BAD_NAME:
+      _rsh_fat16_dirent_name(problem->ent, FAT_DIRENT_NAME(problem->ent));
+      break;
+    case FSCK_BAD_TREE:
+      problem->ent->size_hi = 0;
+      problem->ent->size = 0;
+      rsh_fat16_meta(problem->ent, sizeof(struct rsh_fat_dirent));
+      break;
+    case FSCK_BAD_ZIP:
+      _rsh_fat16_fsck_empty(fsck, problem->ent);
+      break;
+    }
+
+  }
+
+  for ( i = 0; i < fsck->npacks; i++ )
+    if ( _rsh_fat16_fsck_pack_map(fsck, i, 0) )
+      _rsh_fat16_fsck_pack_map(fsck, i, 1);
+
+  /* Orphans last: cutting chains doesn't make any more of them since we
+   * only ever cut at the first cluster that wasn't ours. */
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    if ( ! fsck->owner[i] && rsh_fat16_get_entry(i) != FAT_FREE )
+      rsh_fat16_set_entry(i, FAT_FREE);
+
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    if ( _rsh_fat16_refs(i) != _rsh_fat16_fsck_want_refs(fsck, i) )
+      _rsh_fat16_set_refs(i, _rsh_fat16_fsck_want_refs(fsck, i));
+
+  /* Directories may have changed under their trees, the indexes and the
+   * cache, and the pack chain may have been cut. Clusters may also have
+   * left files without being freed, so the dedup index goes too. */
+  if ( fsck->nproblems )
+    _rsh_fat16_tree_rebuild_all();
+  _rsh_fat16_dindex_drop_all();
+  _rsh_fat16_dcache_flush();
+  _rsh_fat16_dedup_drop();
+  _rsh_fat16_pack_open(&fat16_fs);
+  fat16_fs.chain_gen++;
+  rsh_fat16_sync(MS_SYNC);
+
+  /* Some of what was cut off may have been directory clusters, so nothing
+   * in the journal can be allowed to land on them later. */
+  _rsh_fat16_journal_checkpoint();
+
+}
+
+/*
+ * Claim count clusters from first for the file system itself. They have to be
+ * one contiguous chain.
+ */
+static void _rsh_fat16_fsck_region(struct rsh_fat16_fsck *fsck,
+				   const char *name, uint32_t first,
+				   uint32_t count){
+
+  uint32_t i;
+  uint32_t end = first + count;
+
+  for ( i = first; i < end && i < fat16_fs.fat_entries; i++ ){
+    fsck->owner[i] = fsck->next_id;
+    if ( rsh_fat16_get_entry(i) != (i + 1 < end ? i + 1 : FAT_TERM) )
+      _rsh_fat16_fsck_problem(fsck, FSCK_BAD_FAT, name, NULL, i,
+			      i + 1 < end ? i + 1 : FAT_TERM, 0);
+  }
+  fsck->clusters += count;
+
+}
+
+/*
+ * Check the mounted image with threads workers (0 picks a number). Problems
+ * are printed to out; if repair is set they're fixed too. Returns the number
+ * of problems found, or -1 if the check couldn't be done.
+ */
+int rsh_fat16_fsck(int threads, int repair, int out){
+
+  int i;
+  int started = 0;
+  uint32_t next;
+  uint32_t count;
+  uint32_t *freeing;
+  pthread_t workers[FSCK_MAX_THREADS];
+  struct rsh_fat16_fsck fsck;
+  struct rsh_fat16_problem *problem;
+  char *root;
+
+  if ( ! fat16_fs.fs_io )
+    return -1;
+
+  if ( threads <= 0 )
+    threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if ( threads < 1 )
+    threads = 1;
+  if ( threads > FSCK_MAX_THREADS )
+    threads = FSCK_MAX_THREADS;
+
+  memset(&fsck, 0, sizeof(struct rsh_fat16_fsck));
+  fsck.owner = calloc(fat16_fs.fat_entries, sizeof(uint32_t));
+  fsck.in = calloc(fat16_fs.fat_entries, sizeof(uint32_t));
+  root = strdup("");
+  if ( ! fsck.owner || ! fsck.in || ! root ){
+    free(fsck.owner);
+    free(fsck.in);
+    free(root);
+    return -1;
+  }
+  pthread_mutex_init(&fsck.lock, NULL);
+  pthread_cond_init(&fsck.cond, NULL);
+
+  /* The header, the FAT, the journal, the reference counts, the hole table,
+   * the checksums and the pack clusters belong to nobody in particular. */
+  fsck.owner[0] = ++fsck.next_id;
+  fsck.clusters = 1;
+  _rsh_fat16_fsck_region(&fsck, "FAT", fat16_fs.fs_header.fat_offset,
+			 fat16_fs.fat_clusters);
+  if ( fat16_fs.fs_header.journal_offset )
+    _rsh_fat16_fsck_region(&fsck, "journal",
+			   fat16_fs.fs_header.journal_offset,
+			   fat16_fs.fs_header.journal_clusters);
+  if ( fat16_fs.fs_header.refs_offset )
+    _rsh_fat16_fsck_region(&fsck, "reference counts",
+			   fat16_fs.fs_header.refs_offset,
+			   fat16_fs.fs_header.refs_clusters);
+  if ( fat16_fs.fs_header.holes_offset )
+    _rsh_fat16_fsck_region(&fsck, "hole table",
+			   fat16_fs.fs_header.holes_offset,
+			   fat16_fs.fs_header.holes_clusters);
+  if ( fat16_fs.fs_header.csum_offset )
+    _rsh_fat16_fsck_region(&fsck, "checksums",
+			   fat16_fs.fs_header.csum_offset,
+			   fat16_fs.fs_header.csum_clusters);
+  count = _rsh_fat16_journal_freeing(&freeing);
+  for ( i = 0; i < count; i++ )
+    _rsh_fat16_fsck_region(&fsck, "freed cluster", freeing[i], 1);
+
+  if ( _rsh_fat16_fsck_packs(&fsck) ){
+    free(fsck.packs);
+    free(fsck.owner);
+    free(fsck.in);
+    free(root);
+    return -1;
+  }
+
+  _rsh_fat16_fsck_queue(&fsck, NULL, fat16_fs.fs_header.root_offset,
+			fat16_fs.fs_header.root_offset, root);
+
+  for ( i = 0; i < threads - 1; i++ ){
+    if ( pthread_create(&workers[i], NULL, _rsh_fat16_fsck_worker, &fsck) )
+      break;
+    started++;
+  }
+  _rsh_fat16_fsck_worker(&fsck);
+  for ( i = 0; i < started; i++ )
+    pthread_join(workers[i], NULL);
+
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    if ( ! fsck.owner[i] && rsh_fat16_get_entry(i) != FAT_FREE )
+      fsck.orphans++;
+
+  /* Add in the links from one cluster to the next, leaving out the file
+   * system's own chains (id 1), and see if the counts agree. */
+  for ( i = 0; i < fat16_fs.fat_entries; i++ ){
+    next = rsh_fat16_get_entry(i);
+    if ( fsck.owner[i] > 1 && next < fat16_fs.fat_entries )
+      fsck.in[next]++;
+  }
+  for ( i = 0; i < fat16_fs.fat_entries; i++ )
+    if ( _rsh_fat16_refs(i) != _rsh_fat16_fsck_want_refs(&fsck, i) )
+      fsck.bad_refs++;
+  for ( i = 0; i < fsck.npacks; i++ )
+    if ( _rsh_fat16_fsck_pack_map(&fsck, i, 0) )
+      fsck.bad_packs++;
+
+  for ( i = 0; i < fsck.nproblems; i++ ){
+    problem = &fsck.problems[i];
+    rsh_dprintf(out, "%s: %s", problem->path, problem_names[problem->type]);
+    if ( problem->type <= FSCK_BAD_HEAD || problem->type == FSCK_BAD_FAT ||
+	 problem->type == FSCK_BAD_RECORDS || problem->type == FSCK_BAD_TREE )
+      rsh_dprintf(out, " (cluster %u)", problem->cluster);
+    rsh_dprintf(out, "\n");
+  }
+  if ( fsck.orphans )
+    rsh_dprintf(out, "%u orphaned clusters\n", fsck.orphans);
+  if ( fsck.bad_refs )
+    rsh_dprintf(out, "%u clusters with the wrong reference count\n",
+		fsck.bad_refs);
+  if ( fsck.bad_packs )
+    rsh_dprintf(out, "%u pack clusters with the wrong map\n",
+		fsck.bad_packs);
+  if ( fsck.failed )
+    rsh_dprintf(out, "Ran out of memory, the check is incomplete.\n");
+
+  rsh_dprintf(out, "%u dirs, %u files, %u clusters in use: %u problems%s\n",
+	      fsck.dirs, fsck.files, fsck.clusters,
+	      fsck.nproblems + (fsck.orphans ? 1 : 0) + (fsck.bad_refs ? 1 : 0) +
+	      (fsck.bad_packs ? 1 : 0),
+	      repair && (fsck.nproblems || fsck.orphans || fsck.bad_refs ||
+			 fsck.bad_packs) ? " (fixed)" : "");
+
+  if ( repair && ! fsck.failed )
+    _rsh_fat16_fsck_repair(&fsck);
+
+  for ( i = 0; i < fsck.nproblems; i++ )
+    free(fsck.problems[i].path);
+  free(fsck.problems);
+  free(fsck.owner);
+  free(fsck.in);
+  free(fsck.packs);
+  free(fsck.pack_map);
+  pthread_mutex_destroy(&fsck.lock);
+  pthread_cond_destroy(&fsck.cond);
+
+  if ( fsck.failed )
+    return -1;
+  return fsck.nproblems + (fsck.orphans ? 1 : 0) + (fsck.bad_refs ? 1 : 0) +
+    (fsck.bad_packs ? 1 : 0);
+
+}
+
+/*
+ * Check the image:
+ *
+ *   fsck [-r] [-j <threads>]
+ *
+ * -r fixes whatever is found.
+ */
+int builtin_fsck(int argc, char **argv, int in, int out, int err){
+
+  int i;
+  int repair = 0;
+  int threads = 0;
+  int problems;
+
+  for ( i = 1; i < argc; i++ ){
+    if ( strcmp(argv[i], "-r") == 0 ){
+      repair = 1;
+    } else if ( strcmp(argv[i], "-j") == 0 && i + 1 < argc ){
+      threads = strtol(argv[++i], NULL, 0);
+    } else {
+      rsh_dprintf(err, "Usage: fsck [-r] [-j <threads>]\n");
+      return 1;
+    }
+  }
+
+  problems = rsh_fat16_fsck(threads, repair, out);
+  if ( problems < 0 ){
+    rsh_dprintf(err, "fsck: unable to check the image\n");
+    return 1;
+  }
+
+  return problems && ! repair;
+
+}
@@ -0,0 +1,422 @@
+/*
+ * Growing the FAT16 image while it's in use. An image used to be as big as
+ * it was made and running out of clusters meant ENOSPC, so images got made
+ * far bigger than they needed to be. Now, given a maximum size, the image
+ * gets bigger on its own once less than a certain percentage of it is free.
+ *
+ * Growing goes:
+ *
+ *   - write out everything and checkpoint the journal, so nothing logged
+ *     refers to the tables we're about to move
+ *   - make the image file bigger and mremap() the mapping to match, in
+ *     place (see fs_fat16_map.c), so every pointer into the image is still
+ *     good
+ *   - build a new FAT, and reference count, hole and checksum tables if the
+ *     image has them, big enough for the new size in the new space at the
+ *     end. The clusters of the old tables are marked free in the new FAT
+ *   - write the new tables out, then point the header at them
+ *
+ * The header is the commit point. A crash before it leaves the old image,
+ * with a bigger file than it needs, and a crash after it the new one. Nothing
+ * else in the image moves: clusters keep their numbers, so chains, dirents and
+ * open files don't notice.
+ *
+ * The sync and checkpoint can't happen in the middle of an operation, with
+ * half of it in the journal, so while there's a transaction being built the
+ * image only notes how big it wants to be and grows right after the commit
+ * (_rsh_fat16_grow_deferred()). That works as long as the free clusters under
+ * the threshold last until then. Writes, which can need any number of them,
+ * grow ahead of time before they change anything (_rsh_fat16_grow_ahead()).
+ *
+ * Version 0 images have nowhere to put a bigger size, so they don't grow.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Grow once less than this much of the image is free. */
+#define GROW_DEFAULT_PCT 5
+
+uint64_t rsh_fat16_grow_max = 0;
+int      rsh_fat16_grow_pct = GROW_DEFAULT_PCT;
+
+/* What to grow to once the transaction being built is committed. */
+static uint64_t grow_deferred = 0;
+
+/*
+ * Clusters it takes to hold bytes.
+ */
+static uint32_t _rsh_fat16_grow_clusters(uint64_t bytes){
+
+  return (bytes + FAT_CLUSTER_SIZE - 1) / FAT_CLUSTER_SIZE;
+
+}
+
+/*
+ * Clusters the tables of an image with entries clusters take up.
+ */
+static uint32_t _rsh_fat16_grow_tables(uint32_t entries){
+
+  uint32_t clusters = _rsh_fat16_grow_clusters((uint64_t)entries *
+					       sizeof(fat_t));
+
+  if ( fat16_fs.fs_header.refs_offset )
+    clusters += _rsh_fat16_grow_clusters(entries);
+  if ( fat16_fs.fs_header.holes_offset )
+    clusters += _rsh_fat16_grow_clusters((uint64_t)entries *
+					 sizeof(uint32_t));
+  if ( fat16_fs.fs_header.csum_offset )
+    clusters += _rsh_fat16_grow_clusters((uint64_t)entries *
+					 sizeof(uint32_t));
+
+  return clusters;
+
+}
+
+/*
+ * Move one of the per cluster tables (len bytes, from cluster old to cluster
+ * new) and chain its new clusters together in the new FAT. Whatever the new
+ * part of the table covers starts out as 0.
+ */
+static void _rsh_fat16_grow_table(fat_t *fat, uint32_t old, uint32_t new,
+				  uint64_t len, uint32_t clusters){
+
+  uint32_t i;
+
+  memmove(FAT_CLUSTER_TO_ADDR(new), FAT_CLUSTER_TO_ADDR(old), len);
+  memset(FAT_CLUSTER_TO_ADDR(new) + len, 0,
+	 (uint64_t)clusters * FAT_CLUSTER_SIZE - len);
+
+  for ( i = 0; i + 1 < clusters; i++ )
+    fat[new + i] = new + i + 1;
+  fat[new + i] = FAT_TERM;
+
+}
+
+/*
+ * Mark an old table's clusters free in the new FAT.
+ */
+static void _rsh_fat16_grow_release(fat_t *fat, uint32_t start,
+				    uint32_t clusters){
+
+  uint32_t i;
+
+  for ( i = 0; i < clusters; i++ )
+    fat[start + i] = FAT_FREE;
+
+}
+
+/*
+ * Grow the image to size bytes. Shrinking isn't a thing; asking for less
+ * than the image already has does nothing.
+ */
+int rsh_fat16_grow(uint64_t size){
+
+  struct rsh_fat16_fs *fs = &fat16_fs;
+  struct rsh_fs_block *header = &fs->fs_header;
+  uint32_t old_entries = fs->fat_entries;
+  uint32_t entries;
+  uint32_t fat_at, refs_at, holes_at, csum_at;
+  uint32_t refs_clusters = 0, holes_clusters = 0, csum_clusters = 0;
+  uint32_t fat_clusters;
+  uint64_t off;
+  fat_t *fat;
+
+  if ( ! fs->fs_io || ! header->version ){
+    errno = ENOSYS;
+    return RSH_ERR;
+  }
+
+  /* Whole clusters, and no more of them than a cluster number can count. */
+  size -= size % FAT_CLUSTER_SIZE;
+  if ( size / FAT_CLUSTER_SIZE >= FAT_RESERVED )
+    size = (uint64_t)(FAT_RESERVED - 1) * FAT_CLUSTER_SIZE;
+  if ( size <= header->size )
+    return RSH_OK;
+
+  /* The new tables go in the new space, so it has to have room for them. */
+  entries = size / FAT_CLUSTER_SIZE;
+  if ( entries - old_entries <= _rsh_fat16_grow_tables(entries) ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+
+  if ( _rsh_fat16_map_reserve(fs, size) )
+    return RSH_ERR;
+
+  rsh_fat16_sync(MS_SYNC);
+  if ( _rsh_fat16_journal_checkpoint() )
+    return RSH_ERR;
+
+  if ( ftruncate(fs->fs_fd, size) || _rsh_fat16_map_extend(fs, size) )
+    return RSH_ERR;
+
+  /* FAT first, then the reference counts, then the holes, then the
+   * checksums. */
+  fat_clusters = _rsh_fat16_grow_clusters((uint64_t)entries * sizeof(fat_t));
+  fat_at = old_entries;
+  fat = FAT_CLUSTER_TO_ADDR(fat_at);
+  _rsh_fat16_grow_table(fat, header->fat_offset, fat_at,
+			(uint64_t)old_entries * sizeof(fat_t), fat_clusters);
+
+  refs_at = fat_at + fat_clusters;
+  if ( header->refs_offset ){
+    refs_clusters = _rsh_fat16_grow_clusters(entries);
+    _rsh_fat16_grow_table(fat, header->refs_offset, refs_at, old_entries,
+			  refs_clusters);
+  }
+
+  holes_at = refs_at + refs_clusters;
+  if ( header->holes_offset ){
+    holes_clusters = _rsh_fat16_grow_clusters((uint64_t)entries *
+					      sizeof(uint32_t));
+    _rsh_fat16_grow_table(fat, header->holes_offset, holes_at,
+			  (uint64_t)old_entries * sizeof(uint32_t),
+			  holes_clusters);
+  }
+
+  /* The new clusters are all zeros, and so are their sums. The tables just
+   * built are in there too but nothing checks those. */
+  csum_at = holes_at + holes_clusters;
+  if ( header->csum_offset ){
+    csum_clusters = _rsh_fat16_grow_clusters((uint64_t)entries *
+					     sizeof(uint32_t));
+    _rsh_fat16_grow_table(fat, header->csum_offset, csum_at,
+			  (uint64_t)old_entries * sizeof(uint32_t),
+			  csum_clusters);
+    _rsh_fat16_csum_grow(FAT_CLUSTER_TO_ADDR(csum_at), old_entries, entries);
+  }
+
+  _rsh_fat16_grow_release(fat, header->fat_offset, fs->fat_clusters);
+  if ( header->refs_offset )
+    _rsh_fat16_grow_release(fat, header->refs_offset, header->refs_clusters);
+  if ( header->holes_offset )
+    _rsh_fat16_grow_release(fat, header->holes_offset,
+			    header->holes_clusters);
+  if ( header->csum_offset )
+    _rsh_fat16_grow_release(fat, header->csum_offset,
+			    header->csum_clusters);
+
+  off = (uint64_t)fat_at * FAT_CLUSTER_SIZE % fs->page_size;
+  if ( msync((void *)fat - off, (uint64_t)(fat_clusters + refs_clusters +
+					   holes_clusters + csum_clusters) *
+	     FAT_CLUSTER_SIZE + off, MS_SYNC) )
+    return RSH_ERR;
+
+  /* And switch over. */
+  header->size = size;
+  header->fat_offset = fat_at;
+  if ( header->refs_offset ){
+    header->refs_offset = refs_at;
+    header->refs_clusters = refs_clusters;
+  }
+  if ( header->holes_offset ){
+    header->holes_offset = holes_at;
+    header->holes_clusters = holes_clusters;
+  }
+  if ( header->csum_offset ){
+    header->csum_offset = csum_at;
+    header->csum_clusters = csum_clusters;
+  }
+  memcpy(fs->fs_io, header, sizeof(struct rsh_fs_block));
+  msync(fs->fs_io, sizeof(struct rsh_fs_block), MS_SYNC);
+
+  fs->fat_entries = entries;
+  fs->fat_clusters = fat_clusters;
+  fs->fat_size = entries * sizeof(fat_t);
+
+  /* The free and dirty maps are sized by the image. Nothing is dirty after
+   * the checkpoint. */
+  free(fs->free_map);
+  free(fs->free_summary);
+  if ( _rsh_fat16_build_free_map(fs) )
+    printf("Warning: no memory for the free cluster map, using FAT scans.\n");
+  if ( _rsh_fat16_build_dirty_map(fs) )
+    printf("Warning: no memory for the dirty page map, syncing everything.\n");
+  if ( _rsh_fat16_csum_open(fs) )
+    printf("Warning: no memory for checksums, they won't be kept.\n");
+
+  return RSH_OK;
+
+}
+
+/*
+ * How big the image should be for want more clusters to leave at least the
+ * growth threshold free. 0 if it's fine as it is or can't grow.
+ */
+static uint64_t _rsh_fat16_grow_size(uint32_t want){
+
+  uint64_t low;
+  uint64_t size;
+  uint64_t max = rsh_fat16_grow_max;
+  uint32_t entries;
+
+  if ( max <= fat16_fs.fs_header.size || ! fat16_fs.fs_header.version )
+    return 0;
+
+  low = (uint64_t)fat16_fs.fat_entries * rsh_fat16_grow_pct / 100;
+  if ( fat16_fs.free_clusters >= want + low )
+    return 0;
+
+  /* Double it until that's enough, but no bigger than the max. */
+  size = fat16_fs.fs_header.size;
+  do {
+    size = size * 2 < max ? size * 2 : max;
+    entries = size / FAT_CLUSTER_SIZE;
+  } while ( size < max &&
+	    fat16_fs.free_clusters + entries - fat16_fs.fat_entries -
+	    _rsh_fat16_grow_tables(entries) < want + low );
+
+  return size;
+
+}
+
+/*
+ * Make sure want clusters can be had, growing the image if that would leave
+ * less free than the growth threshold. In the middle of a transaction the
+ * growing waits for the commit, see the top of the file. Fails with ENOSPC if
+ * the clusters can't be had now.
+ */
+int _rsh_fat16_make_room(uint32_t want){
+
+  uint64_t size = _rsh_fat16_grow_size(want);
+
+  if ( size ){
+    if ( ! _rsh_fat16_journal_pending() )
+      rsh_fat16_grow(size);
+    else if ( size > grow_deferred )
+      grow_deferred = size;
+  }
+
+  if ( fat16_fs.free_clusters < want ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+  return RSH_OK;
+
+}
+
+/*
+ * Between operations: about to need up to want clusters. If that would take
+ * the image under the growth threshold, commit whatever is pending and grow
+ * now, while nothing is half done.
+ */
+void _rsh_fat16_grow_ahead(uint32_t want){
+
+  uint64_t size = _rsh_fat16_grow_size(want);
+
+  if ( ! size )
+    return;
+
+  _rsh_fat16_journal_commit();
+  if ( ! _rsh_fat16_journal_pending() )
+    rsh_fat16_grow(size);
+
+}
+
+/*
+ * A transaction was just committed: do any growing that was put off until
+ * then.
+ */
+void _rsh_fat16_grow_deferred(){
+
+  uint64_t size = grow_deferred;
+
+  if ( ! size || _rsh_fat16_journal_pending() )
+    return;
+
+  grow_deferred = 0;
+  rsh_fat16_grow(size);
+
+}
+
+/*
+ * Set how big the image may grow and when. A max of 0 turns growing off. If
+ * the image is mapped, the max has to fit in the address space after it.
+ */
+int rsh_fat16_set_grow(uint64_t max, int pct){
+
+  if ( pct < 0 || pct > 90 ){
+    errno = EINVAL;
+    return RSH_ERR;
+  }
+
+  if ( max && _rsh_fat16_map_reserve(&fat16_fs, max) )
+    return RSH_ERR;
+
+  rsh_fat16_grow_max = max;
+  rsh_fat16_grow_pct = pct;
+  return RSH_OK;
+
+}
+
+/*
+ * Parse a growth spec as passed to --grow: <max bytes>[:<percent free>].
+ */
+int rsh_fat16_parse_grow(char *spec){
+
+  long long max;
+  int pct = GROW_DEFAULT_PCT;
+
+  if ( sscanf(spec, "%lli:%i", &max, &pct) < 1 || max < 0 )
+    return RSH_ERR;
+
+  return rsh_fat16_set_grow(max, pct);
+
+}
+
+/*
+ * Show or change how the image grows:
+ *
+ *   grow [off|<max bytes> [<percent free>]]
+ */
+int builtin_grow(int argc, char **argv, int in, int out, int err){
+
+  long long max;
+  int pct = GROW_DEFAULT_PCT;
+
+  if ( argc < 2 ){
+    if ( rsh_fat16_grow_max )
+      rsh_dprintf(out, "up to %llu bytes once less than %d%% is free",
+		  (unsigned long long)rsh_fat16_grow_max, rsh_fat16_grow_pct);
+    else
+      rsh_dprintf(out, "off");
+    rsh_dprintf(out, " (now %llu bytes)\n",
+		(unsigned long long)fat16_fs.fs_header.size);
+    return 0;
+  }
+
+  if ( argc > 3 ){
+    rsh_dprintf(err, "Usage: grow [off|<max bytes> [<percent free>]]\n");
+    return 1;
+  }
+
+  if ( strcmp(argv[1], "off") == 0 ){
+    max = 0;
+  } else {
+    max = strtoll(argv[1], NULL, 0);
+    if ( max <= 0 ){
+      rsh_dprintf(err, "grow: bad size %s\n", argv[1]);
+      return 1;
+    }
+  }
+  if ( argc > 2 )
+    pct = strtol(argv[2], NULL, 0);
+
+  if ( rsh_fat16_set_grow(max, pct) ){
+    rsh_dprintf(err, "grow: unable to grow up to %s: %s\n", argv[1],
+		strerror(errno));
+    return 1;
+  }
+
+  return 0;
+
+}
@@ -0,0 +1,496 @@
+/*
+ * In memory directory indexes for the FAT16 driver. Looking a name up in a
+ * directory used to mean a strcmp() against every dirent in every cluster of
+ * the directory. That's fine for 10 files, not so much for 10000. So the
+ * first time a directory is looked at we read the whole thing once and build
+ * a hash table of name -> dirent slot. We also keep a stack of the empty
+ * slots so that finding a place to put a new file doesn't need a scan either.
+ * Compact directories (see fs_fat16_dirent.c) can't do that since not every
+ * empty record is big enough for every name; they keep a stack of clusters
+ * with empty records in them instead, and only those get looked through.
+ *
+ * The indexes point straight into the mmap()'ed image, so they stay valid as
+ * long as the FS is mounted. Whoever changes a directory (mkfile, mkdir,
+ * unlink) is responsible for telling us about it.
+ *
+ * Directories with a B+tree (see fs_fat16_tree.c) don't need any of this;
+ * changes to them get passed on to the tree instead.
+ */
+
+#include <rsh.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Number of buckets for finding a directory's index from its cluster. */
+#define DINDEX_BUCKETS 64
+
+/* Starting size of a directory's hash table. Must be a power of 2. */
+#define DINDEX_MIN_SIZE 16
+
+static struct rsh_fat16_dindex *dindex_cache[DINDEX_BUCKETS];
+
+/*
+ * FNV-1a on a NULL terminated name. Nothing fancy, but it spreads file names
+ * like foo1, foo2, ... out nicely.
+ */
+uint32_t _rsh_fat16_name_hash(const char *name){
+
+  uint32_t hash = 2166136261u;
+
+  while ( *name ){
+    hash ^= (unsigned char) *name++;
+    hash *= 16777619u;
+  }
+
+  return hash;
+
+}
+
+/*
+ * Put slot into the hash table. There must be room for it.
+ */
+static void _rsh_fat16_dindex_hash_put(struct rsh_fat16_dindex *index,
+				       struct rsh_fat_dirent *slot){
+
+  uint32_t i = _rsh_fat16_name_hash(FAT_DIRENT_NAME(slot)) & index->mask;
+
+  while ( index->table[i] )
+    i = (i + 1) & index->mask;
+
+  index->table[i] = slot;
+  index->entries++;
+
+}
+
+/*
+ * Make the hash table big enough to take one more entry. We keep the load
+ * under 1/2 so that the probe sequences stay short.
+ */
+static int _rsh_fat16_dindex_reserve(struct rsh_fat16_dindex *index){
+
+  uint32_t i;
+  uint32_t old_size = index->mask + 1;
+  struct rsh_fat_dirent **old = index->table;
+
+  if ( old && (index->entries + 1) * 2 <= old_size )
+    return RSH_OK;
+
+  index->table = calloc(old ? old_size * 2 : DINDEX_MIN_SIZE,
+			sizeof(struct rsh_fat_dirent *));
+  if ( ! index->table ){
+    index->table = old;
+    return RSH_ERR;
+  }
+  index->mask = (old ? old_size * 2 : DINDEX_MIN_SIZE) - 1;
+  index->entries = 0;
+
+  if ( ! old )
+    return RSH_OK;
+
+  for ( i = 0; i < old_size; i++ )
+    if ( old[i] )
+      _rsh_fat16_dindex_hash_put(index, old[i]);
+
+  free(old);
+  return RSH_OK;
+
+}
+
+/*
+ * Push an empty slot onto the free slot stack.
+ */
+static int _rsh_fat16_dindex_push_free(struct rsh_fat16_dindex *index,
+				       struct rsh_fat_dirent *slot){
+
+  struct rsh_fat_dirent **tmp;
+
+  if ( index->free_len == index->free_size ){
+    tmp = realloc(index->free, (index->free_size ? index->free_size * 2 :
+				DINDEX_MIN_SIZE) * sizeof(*tmp));
+    if ( ! tmp )
+      return RSH_ERR;
+    index->free = tmp;
+    index->free_size = index->free_size ? index->free_size * 2 :
+      DINDEX_MIN_SIZE;
+  }
+
+  index->free[index->free_len++] = slot;
+  return RSH_OK;
+
+}
+
+/*
+ * Push a compact directory cluster with empty records in it onto the room
+ * stack, unless it's on top already.
+ */
+static int _rsh_fat16_dindex_push_room(struct rsh_fat16_dindex *index,
+				       uint32_t cluster){
+
+  uint32_t *tmp;
+
+  if ( index->rooms_len && index->rooms[index->rooms_len - 1] == cluster )
+    return RSH_OK;
+
+  if ( index->rooms_len == index->rooms_size ){
+    tmp = realloc(index->rooms, (index->rooms_size ? index->rooms_size * 2 :
+				 DINDEX_MIN_SIZE) * sizeof(*tmp));
+    if ( ! tmp )
+      return RSH_ERR;
+    index->rooms = tmp;
+    index->rooms_size = index->rooms_size ? index->rooms_size * 2 :
+      DINDEX_MIN_SIZE;
+  }
+
+  index->rooms[index->rooms_len++] = cluster;
+  return RSH_OK;
+
+}
+
+/*
+ * Add all of the dirents in a directory cluster to the index. Empty slots go
+ * onto the free stack backwards so that the first empty slot in the cluster
+ * is the first to be handed out.
+ */
+static int _rsh_fat16_dindex_load(struct rsh_fat16_dindex *index,
+				  uint32_t cluster){
+
+  int i;
+  int room = 0;
+  struct rsh_fat_slot *slots = FAT_CLUSTER_TO_ADDR(cluster);
+  struct rsh_fat_dirent *ent;
+
+  if ( ! FAT_COMPACT_DIRS ){
+    for ( i = FAT_CLUSTER_SIZE / sizeof(struct rsh_fat_slot) - 1; i >= 0; i-- )
+      if ( ! slots[i].name[0] &&
+	   _rsh_fat16_dindex_push_free(index, &slots[i].ent) )
+	return RSH_ERR;
+  }
+
+  for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+    if ( ! FAT_DIRENT_NAME(ent)[0] ){
+      room = 1;
+      continue;
+    }
+
+    if ( _rsh_fat16_dindex_reserve(index) )
+      return RSH_ERR;
+    _rsh_fat16_dindex_hash_put(index, ent);
+    if ( ent->type != FAT_DIR )
+      index->bytes += FAT_DIRENT_SIZE(ent);
+
+  }
+
+  if ( FAT_COMPACT_DIRS && room )
+    return _rsh_fat16_dindex_push_room(index, cluster);
+  return RSH_OK;
+
+}
+
+static void _rsh_fat16_dindex_free(struct rsh_fat16_dindex *index){
+
+  free(index->table);
+  free(index->free);
+  free(index->rooms);
+  free(index);
+
+}
+
+/*
+ * Find the index for the directory whose table starts at cluster dir. If we
+ * haven't seen the directory yet, build its index. Returns NULL if there
+ * isn't enough memory to build one; callers should fall back on scanning the
+ * directory in that case.
+ */
+struct rsh_fat16_dindex *_rsh_fat16_dindex_get(uint32_t dir){
+
+  uint32_t cluster;
+  uint32_t *clusters = NULL;
+  uint32_t *tmp;
+  uint32_t count = 0, size = 0;
+  struct rsh_fat16_dindex *index;
+  struct rsh_fat16_dindex **bucket = &dindex_cache[dir % DINDEX_BUCKETS];
+
+  for ( index = *bucket; index; index = index->next )
+    if ( index->dir == dir )
+      return index;
+
+  index = calloc(1, sizeof(struct rsh_fat16_dindex));
+  if ( ! index )
+    return NULL;
+  index->dir = dir;
+  if ( _rsh_fat16_dindex_reserve(index) )
+    goto fail;
+
+  /* The free stack wants the earliest slots on top, so we load the clusters
+   * last to first. That means remembering the chain first. */
+  cluster = dir;
+  do {
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    if ( count == size ){
+      size = size ? size * 2 : DINDEX_MIN_SIZE;
+      tmp = realloc(clusters, size * sizeof(uint32_t));
+      if ( ! tmp )
+	goto fail;
+      clusters = tmp;
+    }
+    clusters[count++] = cluster;
+    cluster = rsh_fat16_get_entry(cluster);
+
+  } while ( cluster != FAT_TERM );
+
+  while ( count-- )
+    if ( _rsh_fat16_dindex_load(index, clusters[count]) )
+      goto fail;
+
+  free(clusters);
+  index->next = *bucket;
+  *bucket = index;
+  return index;
+
+ fail:
+  free(clusters);
+  _rsh_fat16_dindex_free(index);
+  return NULL;
+
+}
+
+/*
+ * Look up a name in an index. Returns the dirent slot or NULL. Compact
+ * records have some of the hash right there, which saves looking at the
+ * names of whatever else landed in the same buckets.
+ */
+struct rsh_fat_dirent *_rsh_fat16_dindex_lookup(struct rsh_fat16_dindex *index,
+						const char *name){
+
+  uint32_t hash = _rsh_fat16_name_hash(name);
+  uint32_t i = hash & index->mask;
+
+  while ( index->table[i] ){
+    if ( (! FAT_COMPACT_DIRS ||
+	  FAT_DIRENT_DREC(index->table[i])->hash == (uint16_t)hash) &&
+	 strcmp(FAT_DIRENT_NAME(index->table[i]), name) == 0 )
+      return index->table[i];
+    i = (i + 1) & index->mask;
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Return an empty slot in the directory that name fits in, without taking it.
+ * NULL if the directory is full and needs another cluster. Clusters that turn
+ * out to have nothing empty left come off the room stack as we go.
+ */
+struct rsh_fat_dirent *_rsh_fat16_dindex_open_slot(
+					    struct rsh_fat16_dindex *index,
+					    const char *name){
+
+  int any;
+  uint32_t i;
+  struct rsh_fat_dirent *slot;
+
+  if ( ! FAT_COMPACT_DIRS ){
+    if ( ! index->free_len )
+      return NULL;
+    return index->free[index->free_len - 1];
+  }
+
+  for ( i = index->rooms_len; i > 0; i-- ){
+    slot = _rsh_fat16_dirent_room(index->rooms[i - 1], name, &any);
+    if ( slot )
+      return slot;
+    if ( ! any ){
+      memmove(&index->rooms[i - 1], &index->rooms[i],
+	      (index->rooms_len - i) * sizeof(*index->rooms));
+      index->rooms_len--;
+    }
+  }
+
+  return NULL;
+
+}
+
+/*
+ * Let the index for dir know that slot has just been filled in. If the index
+ * can't take it we just throw the index away; it'll be rebuilt next time.
+ */
+void _rsh_fat16_dindex_insert(uint32_t dir, struct rsh_fat_dirent *slot){
+
+  uint32_t i;
+  struct rsh_fat16_dindex *index;
+
+  if ( _rsh_fat16_tree_root(dir) ){
+    _rsh_fat16_tree_insert(dir, slot);
+    return;
+  }
+
+  index = _rsh_fat16_dindex_get(dir);
+  if ( ! index )
+    return;
+
+  /* Almost always the slot came off the top of the stack. */
+  for ( i = index->free_len; i > 0; i-- ){
+    if ( index->free[i - 1] == slot ){
+      memmove(&index->free[i - 1], &index->free[i],
+	      (index->free_len - i) * sizeof(*index->free));
+      index->free_len--;
+      break;
+    }
+  }
+
+  if ( _rsh_fat16_dindex_reserve(index) ){
+    _rsh_fat16_dindex_drop(dir);
+    return;
+  }
+  _rsh_fat16_dindex_hash_put(index, slot);
+  if ( slot->type != FAT_DIR )
+    index->bytes += FAT_DIRENT_SIZE(slot);
+
+}
+
+/*
+ * Take slot out of dir's index. This must be called before the slot is
+ * cleared since we need the name to find it.
+ */
+void _rsh_fat16_dindex_remove(uint32_t dir, struct rsh_fat_dirent *slot){
+
+  uint32_t i, j, home;
+  struct rsh_fat16_dindex *index;
+
+  if ( _rsh_fat16_tree_root(dir) ){
+    _rsh_fat16_tree_remove(dir, slot);
+    return;
+  }
+
+  index = _rsh_fat16_dindex_get(dir);
+  if ( ! index )
+    return;
+
+  i = _rsh_fat16_name_hash(FAT_DIRENT_NAME(slot)) & index->mask;
+  while ( index->table[i] && index->table[i] != slot )
+    i = (i + 1) & index->mask;
+  if ( ! index->table[i] )
+    return;
+
+  /* Shift anything after the hole back into it if the hole is between it and
+   * its home bucket. No tombstones this way. */
+  j = i;
+  while ( 1 ){
+    index->table[i] = NULL;
+    do {
+      j = (j + 1) & index->mask;
+      if ( ! index->table[j] )
+	goto done;
+      home = _rsh_fat16_name_hash(FAT_DIRENT_NAME(index->table[j])) &
+	index->mask;
+    } while ( i <= j ? (i < home && home <= j) : (i < home || home <= j) );
+    index->table[i] = index->table[j];
+    i = j;
+  }
+
+ done:
+  index->entries--;
+  if ( slot->type != FAT_DIR )
+    index->bytes -= FAT_DIRENT_SIZE(slot);
+  if ( FAT_COMPACT_DIRS ){
+    if ( _rsh_fat16_dindex_push_room(index, ((void *)slot - fat16_fs.fs_io) /
+				     FAT_CLUSTER_SIZE) )
+      _rsh_fat16_dindex_drop(dir);
+  } else if ( _rsh_fat16_dindex_push_free(index, slot) ){
+    _rsh_fat16_dindex_drop(dir);
+  }
+
+}
+
+/*
+ * The directory at dir just got another cluster tacked onto its table. The
+ * new cluster must be empty, see _rsh_fat16_dir_cluster(). On tree directory
+ * images that's when a directory gets its tree.
+ */
+void _rsh_fat16_dindex_add_cluster(uint32_t dir, uint32_t cluster){
+
+  struct rsh_fat16_dindex *index;
+
+  if ( FAT_TREE_DIRS ){
+    _rsh_fat16_tree_build(dir);
+    if ( _rsh_fat16_tree_root(dir) )
+      return;
+  }
+
+  for ( index = dindex_cache[dir % DINDEX_BUCKETS]; index;
+	index = index->next )
+    if ( index->dir == dir )
+      break;
+
+  /* Nothing to do if there's no index yet, it'll see the cluster when it
+   * gets built. */
+  if ( ! index )
+    return;
+
+  if ( _rsh_fat16_dindex_load(index, cluster) )
+    _rsh_fat16_dindex_drop(dir);
+
+}
+
+/*
+ * A file in dir changed size by delta bytes. Only matters if dir has an
+ * index already; if not the total gets worked out when it's built.
+ */
+void _rsh_fat16_dindex_resize(uint32_t dir, int64_t delta){
+
+  struct rsh_fat16_dindex *index;
+
+  for ( index = dindex_cache[dir % DINDEX_BUCKETS]; index;
+	index = index->next )
+    if ( index->dir == dir ){
+      index->bytes += delta;
+      return;
+    }
+
+}
+
+/*
+ * Forget about dir's index, if there is one. Used when a directory is deleted
+ * (its clusters may end up in some other file) or when the index can no
+ * longer be trusted.
+ */
+void _rsh_fat16_dindex_drop(uint32_t dir){
+
+  struct rsh_fat16_dindex **prev = &dindex_cache[dir % DINDEX_BUCKETS];
+  struct rsh_fat16_dindex *index;
+
+  for ( index = *prev; index; prev = &index->next, index = index->next ){
+    if ( index->dir == dir ){
+      *prev = index->next;
+      _rsh_fat16_dindex_free(index);
+      return;
+    }
+  }
+
+}
+
+/*
+ * Throw away every index. For when the FS underneath changes completely.
+ */
+void _rsh_fat16_dindex_drop_all(){
+
+  int i;
+  struct rsh_fat16_dindex *index;
+
+  for ( i = 0; i < DINDEX_BUCKETS; i++ ){
+    while ( (index = dindex_cache[i]) ){
+      dindex_cache[i] = index->next;
+      _rsh_fat16_dindex_free(index);
+    }
+  }
+
+}
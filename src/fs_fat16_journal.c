@@ -0,0 +1,746 @@
+/*
+ * The metadata journal. Creating, deleting and growing files changes the FAT
+ * and dirents in place, spread over several clusters, and the only way to
+ * keep that consistent across a crash used to be msync()'ing all of it. On
+ * version 2 images there's a small circular log right after the FAT instead.
+ *
+ * Changes to metadata are noted with rsh_fat16_meta() as they're made. At the
+ * end of an operation (closing a changed file, mkdir, unlink, ...) the ranges
+ * that changed are copied out of the mapping into one transaction at the tail
+ * of the log, and that gets flushed as hard as the durability mode says to.
+ * One write to one spot in the image per operation. The metadata itself is
+ * left for the kernel to write back whenever it likes.
+ *
+ * When the log fills up we checkpoint: sync the whole image, then move the
+ * head of the log up to the tail. When the image is opened, anything between
+ * the head and the first bad transaction is written back over the metadata,
+ * which brings it up to the last commit.
+ *
+ * The log starts with a superblock saying where the head is and what sequence
+ * number the transaction there has. A transaction is a header, then for each
+ * range an entry followed by that many bytes (padded to 8). A range can also
+ * be a run of zeros with no bytes, which is how new directory clusters go in.
+ * Each transaction has a checksum and a sequence number one more than the
+ * last, so replay stops at a torn write or at stale data from a lap ago.
+ *
+ * Replay copies whatever was logged to where it came from, so anything that
+ * was ever logged has to stay metadata for as long as it could be replayed.
+ * File data is never logged, and removing a directory checkpoints so that its
+ * old clusters can't be written over once they're someone's file data. Pack
+ * clusters come and go more often than that; an empty one is taken off its
+ * chain in the normal txn and only freed at the next checkpoint (see
+ * _rsh_fat16_journal_free()).
+ *
+ * With the image mapped shared, the kernel may write back metadata of an
+ * operation before its transaction is committed, and nothing logged can undo
+ * that. So the superblock also says whether the image is mounted: the flag
+ * goes on when the journal is opened and only comes off again after a clean
+ * unmount has synced everything. An image that's opened with the flag still
+ * set wasn't unmounted, and gets replayed and then fsck'ed and repaired,
+ * which cleans up whatever half-done operation made it to the disk.
+ *
+ * In periodic mode commits don't write anything. The log gets written by the
+ * next sync, after the data it points at.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define JOURNAL_MAGIC     0x4c4e524a /* "JRNL" */
+#define JOURNAL_TXN_MAGIC 0x4e584154 /* "TAXN" */
+
+/* The log proper starts this far into the journal. */
+#define JOURNAL_LOG_START 512
+
+/* How many of the latest ranges to try merging a new one into. */
+#define JOURNAL_MERGE     8
+
+/* Entry flags. */
+#define JOURNAL_ZERO      0x1
+
+/* Superblock flags. */
+#define JOURNAL_DIRTY     0x1        /* Mounted, or not unmounted cleanly. */
+
+#define JOURNAL_PAD(len)  ( ((len) + 7) & ~(uint64_t)7 )
+
+struct rsh_fat16_jsb {
+
+  uint32_t magic;
+  uint32_t flags;
+  uint64_t seq;              /* Sequence number of the txn at head. */
+  uint64_t head;             /* Offset of the oldest live txn in the log. */
+
+} __attribute__((packed));
+
+struct rsh_fat16_txn {
+
+  uint32_t magic;
+  uint32_t sum;              /* FNV-1a of the txn with this set to 0. */
+  uint64_t seq;
+  uint32_t len;              /* Whole txn, header included. */
+  uint32_t count;            /* Number of entries. */
+
+} __attribute__((packed));
+
+struct rsh_fat16_txn_ent {
+
+  uint64_t offset;           /* Where in the image the bytes go. */
+  uint32_t len;
+  uint32_t flags;
+
+} __attribute__((packed));
+
+/* A range of the image that has changed since the last commit. */
+struct rsh_fat16_jrange {
+
+  uint64_t offset;
+  uint32_t len;
+  uint32_t zero;
+
+};
+
+static struct {
+
+  void *log;                 /* NULL if there's no journal. */
+  uint64_t log_size;
+  struct rsh_fat16_jsb *jsb;
+
+  uint64_t tail;             /* Where the next txn goes. */
+  uint64_t used;             /* Bytes between head and tail. */
+  uint64_t seq;              /* Sequence number of the next txn. */
+
+  struct rsh_fat16_jrange *ranges;
+  uint32_t ranges_len;
+  uint32_t ranges_size;
+  uint64_t pending;          /* Size of the txn the ranges would make. */
+  int overflow;              /* Too much for the log; checkpoint instead. */
+
+  int unclean;               /* The image wasn't unmounted cleanly. */
+
+  /* Clusters to free at the next checkpoint. */
+  uint32_t *frees;
+  uint32_t frees_len;
+  uint32_t frees_size;
+
+  /* Periodic mode: the part of the log that's been committed but not
+   * synced yet, which may wrap around. */
+  int unsynced;
+  uint64_t unsynced_from;
+  uint64_t unsynced_to;
+
+} journal;
+
+/* Protects the unsynced range, which the flusher takes. */
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+uint32_t rsh_fat16_journal_commits = 0;
+uint32_t rsh_fat16_journal_checkpoints = 0;
+
+static uint32_t _rsh_fat16_journal_sum(uint32_t sum, void *buf, uint64_t len){
+
+  uint64_t i;
+  uint8_t *bytes = buf;
+
+  for ( i = 0; i < len; i++ ){
+    sum ^= bytes[i];
+    sum *= 16777619U;
+  }
+
+  return sum;
+
+}
+
+/*
+ * Checksum a txn as if its sum field were 0. The txn isn't touched since it
+ * may be one we're replaying.
+ */
+static uint32_t _rsh_fat16_txn_sum(struct rsh_fat16_txn *txn){
+
+  struct rsh_fat16_txn header = *txn;
+
+  header.sum = 0;
+  return _rsh_fat16_journal_sum(
+    _rsh_fat16_journal_sum(2166136261U, &header, sizeof(header)),
+    txn + 1, txn->len - sizeof(struct rsh_fat16_txn));
+
+}
+
+/*
+ * msync() len bytes at addr. msync() wants a page aligned address.
+ */
+static int _rsh_fat16_journal_msync(void *addr, uint64_t len, int flags){
+
+  uint64_t off = (addr - fat16_fs.fs_io) % sysconf(_SC_PAGESIZE);
+
+  return msync(addr - off, len + off, flags);
+
+}
+
+/*
+ * Forget everything that's pending.
+ */
+static void _rsh_fat16_journal_drop(){
+
+  journal.ranges_len = 0;
+  journal.pending = sizeof(struct rsh_fat16_txn);
+  journal.overflow = 0;
+
+}
+
+/*
+ * Set the superblock to an empty log starting with sequence number seq.
+ */
+static int _rsh_fat16_journal_reset(uint64_t seq, uint32_t flags){
+
+  pthread_mutex_lock(&journal_lock);
+  journal.unsynced = 0;
+  pthread_mutex_unlock(&journal_lock);
+
+  journal.tail = 0;
+  journal.used = 0;
+  journal.seq = seq;
+
+  journal.jsb->magic = JOURNAL_MAGIC;
+  journal.jsb->flags = flags;
+  journal.jsb->seq = seq;
+  journal.jsb->head = 0;
+
+  return _rsh_fat16_journal_msync(journal.jsb, sizeof(struct rsh_fat16_jsb),
+				  MS_SYNC);
+
+}
+
+/*
+ * Stop journaling. Whatever is pending is lost; call this when switching
+ * images.
+ */
+void _rsh_fat16_journal_close(){
+
+  pthread_mutex_lock(&journal_lock);
+  free(journal.ranges);
+  free(journal.frees);
+  memset(&journal, 0, sizeof(journal));
+  pthread_mutex_unlock(&journal_lock);
+
+}
+
+/*
+ * Point at the journal of a freshly mapped image. Returns 0 if there isn't
+ * one.
+ */
+static int _rsh_fat16_journal_setup(struct rsh_fat16_fs *fs){
+
+  void *base;
+
+  _rsh_fat16_journal_close();
+  if ( fs->fs_header.version < RSH_FS_V2 || ! fs->fs_header.journal_offset )
+    return 0;
+
+  base = fs->fs_io + (uint64_t)fs->fs_header.journal_offset *
+    fs->fs_header.csize;
+  journal.jsb = base;
+  journal.log = base + JOURNAL_LOG_START;
+  journal.log_size = (uint64_t)fs->fs_header.journal_clusters *
+    fs->fs_header.csize - JOURNAL_LOG_START;
+  _rsh_fat16_journal_drop();
+
+  return 1;
+
+}
+
+/*
+ * Write an empty journal into a new image. The clusters have already been
+ * marked in the FAT.
+ */
+int _rsh_fat16_journal_format(struct rsh_fat16_fs *fs){
+
+  if ( ! _rsh_fat16_journal_setup(fs) )
+    return RSH_OK;
+
+  return _rsh_fat16_journal_reset(1, JOURNAL_DIRTY);
+
+}
+
+/*
+ * Is the txn at pos in the log whole, with sequence number seq, and does
+ * everything in it land somewhere sane? Returns its length if so, 0 if not.
+ */
+static uint64_t _rsh_fat16_journal_check(struct rsh_fat16_fs *fs, uint64_t pos,
+					 uint64_t seq){
+
+  uint32_t i;
+  uint64_t at;
+  uint64_t jstart, jend;
+  struct rsh_fat16_txn *txn = journal.log + pos;
+  struct rsh_fat16_txn_ent *ent;
+
+  if ( pos + sizeof(struct rsh_fat16_txn) > journal.log_size ||
+       txn->magic != JOURNAL_TXN_MAGIC || txn->seq != seq ||
+       txn->len < sizeof(struct rsh_fat16_txn) || txn->len % 8 ||
+       pos + txn->len > journal.log_size )
+    return 0;
+
+  if ( _rsh_fat16_txn_sum(txn) != txn->sum )
+    return 0;
+
+  jstart = (uint64_t)fs->fs_header.journal_offset * fs->fs_header.csize;
+  jend = jstart + (uint64_t)fs->fs_header.journal_clusters *
+    fs->fs_header.csize;
+
+  at = sizeof(struct rsh_fat16_txn);
+  for ( i = 0; i < txn->count; i++ ){
+    if ( at + sizeof(struct rsh_fat16_txn_ent) > txn->len )
+      return 0;
+    ent = (void *)txn + at;
+    at += sizeof(struct rsh_fat16_txn_ent);
+    if ( ent->offset < fs->fs_header.csize ||
+	 ent->offset + ent->len > fs->fs_header.size ||
+	 (ent->offset < jend && ent->offset + ent->len > jstart) )
+      return 0;
+    if ( ! (ent->flags & JOURNAL_ZERO) )
+      at += JOURNAL_PAD(ent->len);
+    if ( at > txn->len )
+      return 0;
+  }
+
+  return txn->len;
+
+}
+
+/*
+ * Write the txn at pos back over the metadata.
+ */
+static void _rsh_fat16_journal_apply(struct rsh_fat16_fs *fs, uint64_t pos){
+
+  uint32_t i;
+  uint64_t at = sizeof(struct rsh_fat16_txn);
+  struct rsh_fat16_txn *txn = journal.log + pos;
+  struct rsh_fat16_txn_ent *ent;
+
+  for ( i = 0; i < txn->count; i++ ){
+    ent = (void *)txn + at;
+    at += sizeof(struct rsh_fat16_txn_ent);
+    if ( ent->flags & JOURNAL_ZERO ){
+      memset(fs->fs_io + ent->offset, 0, ent->len);
+    } else {
+      memcpy(fs->fs_io + ent->offset, (void *)txn + at, ent->len);
+      at += JOURNAL_PAD(ent->len);
+    }
+    _rsh_fat16_csum_stale(fs->fs_io + ent->offset, ent->len);
+  }
+
+}
+
+/*
+ * Find the journal of an image we just opened and replay whatever was
+ * committed since the last checkpoint.
+ */
+int _rsh_fat16_journal_open(struct rsh_fat16_fs *fs){
+
+  uint64_t len;
+  uint64_t pos;
+  uint64_t seq;
+  uint32_t replayed = 0;
+
+  if ( ! _rsh_fat16_journal_setup(fs) )
+    return RSH_OK;
+
+  if ( journal.jsb->magic != JOURNAL_MAGIC ||
+       journal.jsb->head >= journal.log_size ){
+    printf("Warning: bad journal, not replaying it.\n");
+    journal.unclean = 1;
+    return _rsh_fat16_journal_reset(1, JOURNAL_DIRTY);
+  }
+  journal.unclean = journal.jsb->flags & JOURNAL_DIRTY;
+
+  /* A txn that doesn't fit before the end of the log goes at the start, so
+   * if the next one isn't where the last one ended, try there. */
+  pos = journal.jsb->head;
+  seq = journal.jsb->seq;
+  for ( ; ; ){
+    len = _rsh_fat16_journal_check(fs, pos, seq);
+    if ( ! len && pos ){
+      pos = 0;
+      len = _rsh_fat16_journal_check(fs, pos, seq);
+    }
+    if ( ! len )
+      break;
+    _rsh_fat16_journal_apply(fs, pos);
+    pos += len;
+    seq++;
+    replayed++;
+  }
+
+  if ( replayed ){
+    printf("Replayed %u journal transactions.\n", replayed);
+    msync(fs->fs_io, fs->fs_header.size, MS_SYNC);
+  }
+
+  return _rsh_fat16_journal_reset(seq, JOURNAL_DIRTY);
+
+}
+
+/*
+ * Was the image we just opened left mounted? If so it wants an fsck.
+ */
+int _rsh_fat16_journal_unclean(){
+
+  return journal.unclean;
+
+}
+
+/*
+ * Note that len bytes at addr have changed and should go in the next txn. If
+ * zero is set the bytes are all zero and only the range gets logged.
+ */
+void _rsh_fat16_journal_log(void *addr, size_t len, int zero){
+
+  uint32_t i;
+  uint64_t offset = addr - fat16_fs.fs_io;
+  uint64_t end = offset + len;
+  struct rsh_fat16_jrange *range;
+  struct rsh_fat16_jrange *bigger;
+
+  _rsh_fat16_csum_stale(addr, len);
+
+  if ( ! journal.log || journal.overflow || ! len )
+    return;
+
+  /* Most changes land right next to, or on top of, a recent one: the
+   * FAT entries of a growing chain, the size in a dirent. */
+  for ( i = 0; i < JOURNAL_MERGE && i < journal.ranges_len; i++ ){
+    range = &journal.ranges[journal.ranges_len - 1 - i];
+    if ( range->zero != zero || offset > range->offset + range->len ||
+	 end < range->offset )
+      continue;
+    if ( offset < range->offset ){
+      if ( ! zero )
+	journal.pending += JOURNAL_PAD(range->offset + range->len - offset) -
+	  JOURNAL_PAD(range->len);
+      range->len += range->offset - offset;
+      range->offset = offset;
+    }
+    if ( end > range->offset + range->len ){
+      if ( ! zero )
+	journal.pending += JOURNAL_PAD(end - range->offset) -
+	  JOURNAL_PAD(range->len);
+      range->len = end - range->offset;
+    }
+    goto out;
+  }
+
+  if ( journal.ranges_len == journal.ranges_size ){
+    bigger = realloc(journal.ranges, (journal.ranges_size ?
+				      journal.ranges_size * 2 : 64) *
+		     sizeof(struct rsh_fat16_jrange));
+    if ( ! bigger ){
+      journal.overflow = 1;
+      return;
+    }
+    journal.ranges = bigger;
+    journal.ranges_size = journal.ranges_size ? journal.ranges_size * 2 : 64;
+  }
+
+  range = &journal.ranges[journal.ranges_len++];
+  range->offset = offset;
+  range->len = len;
+  range->zero = zero;
+  journal.pending += sizeof(struct rsh_fat16_txn_ent) +
+    (zero ? 0 : JOURNAL_PAD(len));
+
+ out:
+  /* No point remembering a txn that can't be logged. */
+  if ( journal.pending > journal.log_size ){
+    journal.overflow = 1;
+    journal.ranges_len = 0;
+  }
+
+}
+
+/*
+ * Note that len bytes of metadata at addr have changed. Without a journal it
+ * just has to get written back like anything else.
+ */
+void rsh_fat16_meta(void *addr, size_t len){
+
+  if ( journal.log )
+    _rsh_fat16_journal_log(addr, len, 0);
+  else
+    rsh_fat16_dirty(addr, len);
+
+}
+
+/*
+ * Is there a txn being built, which a checkpoint would cut in half?
+ */
+int _rsh_fat16_journal_pending(){
+
+  return journal.log && (journal.ranges_len || journal.overflow);
+
+}
+
+/*
+ * Is the pending txn getting big enough that it should go out now?
+ */
+int _rsh_fat16_journal_full(){
+
+  return journal.log && journal.pending > journal.log_size / 4;
+
+}
+
+/*
+ * Sync the whole image and empty the log, leaving the superblock flags set
+ * to flags. Clusters waiting for that are freed on the way.
+ */
+static int _rsh_fat16_journal_settle(uint32_t flags){
+
+  int ret;
+  uint32_t i;
+
+  for ( i = 0; i < journal.frees_len; i++ )
+    rsh_fat16_set_entry(journal.frees[i], FAT_FREE);
+  journal.frees_len = 0;
+
+  _rsh_fat16_csum_flush();
+  ret = msync(fat16_fs.fs_io, fat16_fs.fs_header.size, MS_SYNC);
+  _rsh_fat16_journal_drop();
+  if ( _rsh_fat16_journal_reset(journal.seq, flags) )
+    ret = -1;
+
+  return ret;
+
+}
+
+/*
+ * Free a cluster that had logged metadata in it. Until the next checkpoint
+ * the log could still be replayed over it, so it stays out of the free map
+ * until then as a chain of its own that nothing points at; fsck knows about
+ * it. Without a journal it's just freed.
+ */
+void _rsh_fat16_journal_free(uint32_t cluster){
+
+  uint32_t *bigger;
+
+  if ( ! journal.log ){
+    rsh_fat16_set_entry(cluster, FAT_FREE);
+    return;
+  }
+
+  if ( journal.frees_len == journal.frees_size ){
+    bigger = realloc(journal.frees, (journal.frees_size ?
+				     journal.frees_size * 2 : 16) *
+		     sizeof(uint32_t));
+    if ( ! bigger ){
+      _rsh_fat16_journal_checkpoint();
+      rsh_fat16_set_entry(cluster, FAT_FREE);
+      return;
+    }
+    journal.frees = bigger;
+    journal.frees_size = journal.frees_size ? journal.frees_size * 2 : 16;
+  }
+
+  rsh_fat16_set_entry(cluster, FAT_TERM);
+  journal.frees[journal.frees_len++] = cluster;
+
+}
+
+/*
+ * The clusters _rsh_fat16_journal_free() is holding on to. Returns how many.
+ */
+uint32_t _rsh_fat16_journal_freeing(uint32_t **clusters){
+
+  *clusters = journal.frees;
+  return journal.frees_len;
+
+}
+
+/*
+ * Sync the whole image and empty the log.
+ */
+int _rsh_fat16_journal_checkpoint(){
+
+  if ( ! journal.log )
+    return 0;
+
+  rsh_fat16_journal_checkpoints++;
+  return _rsh_fat16_journal_settle(JOURNAL_DIRTY);
+
+}
+
+/*
+ * Done with the image: sync it, mark it clean and stop journaling. Anything
+ * that's pending goes out with the sync.
+ */
+int _rsh_fat16_journal_unmount(){
+
+  int ret = 0;
+
+  if ( journal.log )
+    ret = _rsh_fat16_journal_settle(0);
+  _rsh_fat16_journal_close();
+
+  return ret;
+
+}
+
+/*
+ * Periodic mode: take the part of the log that's been committed since the
+ * last sync. The sync writes it after the data, so take it before the data
+ * is looked at; anything committed after that waits for the next one.
+ * Returns 0 if there's nothing to write.
+ */
+int _rsh_fat16_journal_unsynced(uint64_t *from, uint64_t *to){
+
+  int ret;
+
+  pthread_mutex_lock(&journal_lock);
+  ret = journal.unsynced;
+  *from = journal.unsynced_from;
+  *to = journal.unsynced_to;
+  journal.unsynced = 0;
+  pthread_mutex_unlock(&journal_lock);
+
+  return ret;
+
+}
+
+/*
+ * Write out the part of the log that _rsh_fat16_journal_unsynced() took.
+ */
+int _rsh_fat16_journal_sync(uint64_t from, uint64_t to, int flags){
+
+  int ret = 0;
+
+  if ( ! journal.log )
+    return 0;
+
+  if ( to <= from ){
+    if ( _rsh_fat16_journal_msync(journal.log + from, journal.log_size - from,
+				  flags) )
+      ret = -1;
+    from = 0;
+  }
+  if ( to > from &&
+       _rsh_fat16_journal_msync(journal.log + from, to - from, flags) )
+    ret = -1;
+
+  return ret;
+
+}
+
+/*
+ * Write out the data, then put everything that's pending into a txn at the
+ * tail of the log and write that out. How hard we push each of those depends
+ * on the durability mode.
+ */
+static int _rsh_fat16_journal_txn(){
+
+  int ret = 0;
+  int flags = rsh_fat16_durability == RSH_FAT16_ASYNC ? MS_ASYNC : MS_SYNC;
+  uint32_t i, pass;
+  uint64_t at;
+  uint64_t start;
+  uint64_t gap = 0;
+  struct rsh_fat16_jrange *range;
+  struct rsh_fat16_txn *txn;
+  struct rsh_fat16_txn_ent *ent;
+
+  if ( ! journal.log )
+    return 0;
+  if ( journal.overflow )
+    return _rsh_fat16_journal_checkpoint();
+  if ( ! journal.ranges_len )
+    return 0;
+
+  /* The data has to be on the disk before the metadata that points at it. */
+  if ( rsh_fat16_durability != RSH_FAT16_PERIODIC )
+    ret = rsh_fat16_sync(flags);
+
+  /* Find room. A txn that won't fit before the end of the log goes at the
+   * start. */
+  start = journal.tail;
+  if ( start + journal.pending > journal.log_size ){
+    gap = journal.log_size - start;
+    start = 0;
+  }
+  if ( journal.used + gap + journal.pending > journal.log_size ){
+    if ( _rsh_fat16_journal_checkpoint() )
+      ret = -1;
+    return ret;
+  }
+
+  txn = journal.log + start;
+  txn->magic = JOURNAL_TXN_MAGIC;
+  txn->sum = 0;
+  txn->seq = journal.seq;
+  txn->len = journal.pending;
+  txn->count = journal.ranges_len;
+
+  /* Zeros first: the rest of a new directory cluster lands on top. */
+  at = sizeof(struct rsh_fat16_txn);
+  for ( pass = 0; pass < 2; pass++ ){
+    for ( i = 0; i < journal.ranges_len; i++ ){
+      range = &journal.ranges[i];
+      if ( range->zero != ! pass )
+	continue;
+      ent = journal.log + start + at;
+      ent->offset = range->offset;
+      ent->len = range->len;
+      ent->flags = range->zero ? JOURNAL_ZERO : 0;
+      at += sizeof(struct rsh_fat16_txn_ent);
+      if ( range->zero )
+	continue;
+      memcpy(journal.log + start + at, fat16_fs.fs_io + range->offset,
+	     range->len);
+      memset(journal.log + start + at + range->len, 0,
+	     JOURNAL_PAD(range->len) - range->len);
+      at += JOURNAL_PAD(range->len);
+    }
+  }
+  txn->sum = _rsh_fat16_txn_sum(txn);
+
+  switch ( rsh_fat16_durability ){
+  case RSH_FAT16_PERIODIC:
+    pthread_mutex_lock(&journal_lock);
+    if ( ! journal.unsynced )
+      journal.unsynced_from = start;
+    journal.unsynced_to = start + journal.pending;
+    journal.unsynced = 1;
+    pthread_mutex_unlock(&journal_lock);
+    break;
+  default:
+    if ( _rsh_fat16_journal_msync(txn, txn->len, flags) )
+      ret = -1;
+  }
+
+  journal.used += gap + journal.pending;
+  journal.tail = start + journal.pending;
+  journal.seq++;
+  rsh_fat16_journal_commits++;
+  _rsh_fat16_journal_drop();
+
+  return ret;
+
+}
+
+/*
+ * Commit everything that's pending. With nothing half done any more, this is
+ * when an image that filled up in the middle of an operation grows.
+ */
+int _rsh_fat16_journal_commit(){
+
+  int ret = _rsh_fat16_journal_txn();
+
+  _rsh_fat16_grow_deferred();
+  return ret;
+
+}
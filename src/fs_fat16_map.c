@@ -0,0 +1,357 @@
+/*
+ * How the FAT16 image gets mapped. By default it's a plain MAP_SHARED mapping
+ * and the kernel faults pages in as they're touched, which on a cold image
+ * means a fault for every page of the first pass over it. The mapping policy
+ * can ask for more:
+ *
+ *   populate  Map with MAP_POPULATE so the whole image is read in up front.
+ *             Costs time (and memory) when the image is mapped, saves the
+ *             faults later.
+ *   hugepage  madvise(MADV_HUGEPAGE) the mapping. Fewer, bigger faults and
+ *             TLB entries, if the kernel does huge pages for the file the
+ *             image lives on (tmpfs with huge=advise, say). Elsewhere the
+ *             madvise() is refused and we just say so.
+ *   stream    Watch reads for files being read front to back and, once one
+ *             is, madvise(MADV_SEQUENTIAL) and MADV_WILLNEED the clusters
+ *             coming up next. The file's clusters can be anywhere in the
+ *             image so the kernel's own readahead on the image doesn't help
+ *             much; this gets the right pages read ahead instead.
+ *
+ * Changing the policy with the image already mapped maps it again in the
+ * same place (MAP_FIXED), so all the pointers into the image stay good.
+ *
+ * The image can also grow while it's mapped (see fs_fat16_grow.c), and that
+ * mustn't move it either. So the mapping sits at the start of a reservation
+ * of address space as big as the image is allowed to get, and growing it
+ * gives the next bit of the reservation back and mremap()s the mapping over
+ * it without MREMAP_MAYMOVE.
+ */
+
+#define _GNU_SOURCE /* For mremap(). */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+/* Sequential reads in a row before a file counts as streaming. */
+#define STREAM_READS  4
+
+/* How far ahead of a streaming read to have asked for. Hints go out a half
+ * window at a time. */
+#define STREAM_WINDOW (4*1024*1024)
+
+static char *policy_names[] = { "populate", "hugepage", "stream" };
+
+int rsh_fat16_map_policy = 0;
+
+#define PAGE_UP(len, page) ( ((len) + (page) - 1) & ~(uint64_t)((page) - 1) )
+
+/*
+ * Map (or map again) size bytes of the image per the mapping policy. The
+ * first time, address space is set aside for the image to grow into.
+ */
+int _rsh_fat16_map_image(struct rsh_fat16_fs *fs, uint64_t size){
+
+  int flags = MAP_SHARED|MAP_FIXED;
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t reserve;
+  void *io;
+
+  if ( ! fs->fs_io ){
+    reserve = size;
+    if ( rsh_fat16_grow_max > reserve )
+      reserve = rsh_fat16_grow_max;
+    reserve = PAGE_UP(reserve, page);
+    io = mmap(NULL, reserve, PROT_NONE,
+	      MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE, -1, 0);
+    if ( io == MAP_FAILED ){
+      perror("mmap");
+      return RSH_ERR;
+    }
+    fs->fs_io = io;
+    fs->map_size = reserve;
+  }
+#ifdef MAP_POPULATE
+  if ( rsh_fat16_map_policy & RSH_FAT16_MAP_POPULATE )
+    flags |= MAP_POPULATE;
+#endif
+
+  io = mmap(fs->fs_io, size, PROT_READ|PROT_WRITE, flags, fs->fs_fd, 0);
+  if ( io == MAP_FAILED ){
+    perror("mmap");
+    return RSH_ERR;
+  }
+
+  if ( rsh_fat16_map_policy & RSH_FAT16_MAP_HUGEPAGE ){
+#ifdef MADV_HUGEPAGE
+    if ( madvise(io, size, MADV_HUGEPAGE) )
+      printf("Warning: no huge pages for the image: %s\n", strerror(errno));
+#else
+    printf("Warning: no huge pages for the image on this system.\n");
+#endif
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Let go of the image's mapping and its reservation.
+ */
+void _rsh_fat16_unmap_image(struct rsh_fat16_fs *fs){
+
+  if ( ! fs->fs_io )
+    return;
+
+  munmap(fs->fs_io, fs->map_size);
+  fs->fs_io = NULL;
+  fs->map_size = 0;
+
+}
+
+/*
+ * Make room in the reservation for the image to grow to size bytes, by
+ * taking more address space right after it. Fails with ENOMEM if somebody
+ * else already has that.
+ */
+int _rsh_fat16_map_reserve(struct rsh_fat16_fs *fs, uint64_t size){
+
+  long page = sysconf(_SC_PAGESIZE);
+  void *want, *got;
+  uint64_t more;
+
+  size = PAGE_UP(size, page);
+  if ( ! fs->fs_io || size <= fs->map_size )
+    return RSH_OK;
+
+  want = fs->fs_io + fs->map_size;
+  more = size - fs->map_size;
+  got = mmap(want, more, PROT_NONE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE,
+	     -1, 0);
+  if ( got == MAP_FAILED )
+    return RSH_ERR;
+  if ( got != want ){
+    munmap(got, more);
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+
+  fs->map_size = size;
+  return RSH_OK;
+
+}
+
+/*
+ * Grow the mapping of the image to size bytes, in place. The image file must
+ * already be that big.
+ */
+int _rsh_fat16_map_extend(struct rsh_fat16_fs *fs, uint64_t size){
+
+  long page = sysconf(_SC_PAGESIZE);
+  uint64_t old = PAGE_UP(fs->fs_header.size, page);
+  uint64_t new = PAGE_UP(size, page);
+  void *io;
+
+  if ( new > fs->map_size ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+
+  if ( new > old && munmap(fs->fs_io + old, new - old) )
+    return RSH_ERR;
+
+  io = mremap(fs->fs_io, fs->fs_header.size, size, 0);
+  if ( io == MAP_FAILED ){
+    /* Put the reservation back so nothing else lands there. */
+    mmap(fs->fs_io + old, new - old, PROT_NONE,
+	 MAP_PRIVATE|MAP_ANONYMOUS|MAP_NORESERVE|MAP_FIXED, -1, 0);
+    return RSH_ERR;
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Switch mapping policies. If there's an image mapped it gets mapped again so
+ * the new policy takes effect now.
+ */
+int rsh_fat16_set_map_policy(int policy){
+
+  if ( policy & ~RSH_FAT16_MAP_ALL ){
+    errno = EINVAL;
+    return RSH_ERR;
+  }
+
+  rsh_fat16_map_policy = policy;
+  if ( ! fat16_fs.fs_io )
+    return RSH_OK;
+
+  return _rsh_fat16_map_image(&fat16_fs, fat16_fs.fs_header.size);
+
+}
+
+/*
+ * Parse a policy as passed to --mapping: a comma separated list of policy
+ * names, or "none". Then switch to it.
+ */
+int rsh_fat16_parse_map_policy(char *spec){
+
+  int i;
+  int policy = 0;
+  char *copy, *name, *save;
+
+  copy = strdup(spec);
+  if ( ! copy )
+    return RSH_ERR;
+
+  for ( name = strtok_r(copy, ",", &save); name;
+	name = strtok_r(NULL, ",", &save) ){
+    if ( strcmp(name, "none") == 0 )
+      continue;
+    for ( i = 0; i < sizeof(policy_names) / sizeof(char *); i++ )
+      if ( strcmp(name, policy_names[i]) == 0 )
+	break;
+    if ( i == sizeof(policy_names) / sizeof(char *) ){
+      free(copy);
+      errno = EINVAL;
+      return RSH_ERR;
+    }
+    policy |= 1 << i;
+  }
+
+  free(copy);
+  return rsh_fat16_set_map_policy(policy);
+
+}
+
+/*
+ * Hint the clusters holding bytes from..to of a file. Clusters next to each
+ * other in the image go out as one range.
+ */
+static void _rsh_fat16_hint_range(struct rsh_fat16_file *fat_file,
+				  uint64_t from, uint64_t to){
+
+  uint32_t index;
+  uint32_t cluster;
+  uint32_t pos = fat_file->pos;
+  uint32_t start = FAT_TERM;
+  uint32_t run = 0;
+  uintptr_t addr, end;
+  long page = fat16_fs.page_size;
+
+  for ( index = from / FAT_CLUSTER_SIZE;
+	(uint64_t)index * FAT_CLUSTER_SIZE < to; index++ ){
+
+    cluster = _rsh_fat16_file_cluster(fat_file, index);
+    if ( cluster == FAT_TERM || cluster == FAT_RESERVED )
+      break;
+    if ( cluster == FAT_HOLE )
+      continue;
+
+    if ( start != FAT_TERM && cluster == start + run ){
+      run++;
+      continue;
+    }
+
+    if ( start != FAT_TERM ){
+      addr = (uintptr_t)FAT_CLUSTER_TO_ADDR(start) & ~(page - 1);
+      end = (uintptr_t)FAT_CLUSTER_TO_ADDR(start + run);
+      madvise((void *)addr, end - addr, MADV_SEQUENTIAL);
+      madvise((void *)addr, end - addr, MADV_WILLNEED);
+    }
+    start = cluster;
+    run = 1;
+
+  }
+
+  if ( start != FAT_TERM ){
+    addr = (uintptr_t)FAT_CLUSTER_TO_ADDR(start) & ~(page - 1);
+    end = (uintptr_t)FAT_CLUSTER_TO_ADDR(start + run);
+    madvise((void *)addr, end - addr, MADV_SEQUENTIAL);
+    madvise((void *)addr, end - addr, MADV_WILLNEED);
+  }
+
+  /* Don't throw off the next lookup. */
+  fat_file->pos = pos;
+
+}
+
+/*
+ * Called by the read paths before reading count bytes at the file's offset.
+ * A file read front to back for a few reads in a row gets the next window of
+ * its clusters read ahead; anything else starts the count over.
+ */
+void _rsh_fat16_stream_hint(struct rsh_file *file, size_t count){
+
+  uint64_t ahead;
+  struct rsh_fat16_file *fat_file = file->local;
+  uint64_t size = FAT_DIRENT_SIZE(fat_file->dirent);
+
+  if ( ! (rsh_fat16_map_policy & RSH_FAT16_MAP_STREAM) )
+    return;
+
+  if ( file->offset != fat_file->next_read ){
+    fat_file->streak = 0;
+    fat_file->hinted = 0;
+  }
+  fat_file->next_read = file->offset + count;
+
+  if ( ++fat_file->streak < STREAM_READS )
+    return;
+
+  if ( fat_file->hinted < file->offset )
+    fat_file->hinted = file->offset;
+  if ( fat_file->hinted >= size ||
+       fat_file->hinted > file->offset + STREAM_WINDOW / 2 )
+    return;
+
+  ahead = file->offset + STREAM_WINDOW;
+  if ( ahead > size )
+    ahead = size;
+  _rsh_fat16_hint_range(fat_file, fat_file->hinted, ahead);
+  fat_file->hinted = ahead;
+
+}
+
+/*
+ * Show or change the mapping policy:
+ *
+ *   mapping [none|<policy>[,<policy>...]]
+ */
+int builtin_mapping(int argc, char **argv, int in, int out, int err){
+
+  int i;
+  int any = 0;
+
+  if ( argc < 2 ){
+    for ( i = 0; i < sizeof(policy_names) / sizeof(char *); i++ ){
+      if ( rsh_fat16_map_policy & (1 << i) ){
+	rsh_dprintf(out, "%s%s", any ? "," : "", policy_names[i]);
+	any = 1;
+      }
+    }
+    rsh_dprintf(out, "%s\n", any ? "" : "none");
+    return 0;
+  }
+
+  if ( argc > 2 ){
+    rsh_dprintf(err, "Usage: mapping [none|populate,hugepage,stream]\n");
+    return 1;
+  }
+
+  if ( rsh_fat16_parse_map_policy(argv[1]) ){
+    rsh_dprintf(err, "mapping: unable to switch to %s\n", argv[1]);
+    return 1;
+  }
+
+  return 0;
+
+}
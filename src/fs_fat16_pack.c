@@ -0,0 +1,455 @@
+/*
+ * Packed small files. A file used to get a whole cluster as soon as it was
+ * made, so a tree of a few thousand little config files took a hundred times
+ * the space of what was in them, and reading them meant a page of image for
+ * every few bytes of file.
+ *
+ * On version 5 images a file no bigger than a quarter of a cluster doesn't
+ * get clusters of its own. Its data goes in a pack cluster instead, in a run
+ * of FAT_PACK_UNIT byte units next to other small files. The dirent's index
+ * is FAT_PACKED and size_hi (which a file that small doesn't need) is the
+ * unit of the image the data starts at. An empty file has no units at all.
+ *
+ * Pack clusters are chained together starting from the header's pack_offset,
+ * so the FAT sees one more chain belonging to the file system. Each starts
+ * with a header: a magic number, a count of the units taken and a bit per
+ * unit. The first pack cluster is made with the image and stays; the others
+ * come and go as they're needed.
+ *
+ * A packed file that grows past the limit gets unpacked: it's given a
+ * cluster, its data is copied over and from then on it's an ordinary chain.
+ * Every entry point that deals with a file's data checks for a packed file
+ * first, so nothing that walks chains ever sees FAT_PACKED.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FAT_PACK_HEADER(cluster)					\
+  ( (struct rsh_fat16_pack *)FAT_CLUSTER_TO_ADDR(cluster) )
+
+#define FAT_PACK_PER_CLUSTER ( FAT_CLUSTER_SIZE / FAT_PACK_UNIT )
+
+#define FAT_PACK_TAKEN(pack, unit)				\
+  ( (pack)->map[(unit) / 8] & (1 << ((unit) % 8)) )
+
+/*
+ * Units at the start of a pack cluster taken by its header.
+ */
+uint32_t _rsh_fat16_pack_header_units(){
+
+  return FAT_PACK_UNITS(sizeof(struct rsh_fat16_pack) +
+			(FAT_PACK_PER_CLUSTER + 7) / 8);
+
+}
+
+/*
+ * Set units first..first+count of a pack cluster's map to taken.
+ */
+static void _rsh_fat16_pack_mark(struct rsh_fat16_pack *pack, uint32_t first,
+				 uint32_t count, int taken){
+
+  uint32_t i;
+
+  for ( i = first; i < first + count; i++ ){
+    if ( taken )
+      pack->map[i / 8] |= 1 << (i % 8);
+    else
+      pack->map[i / 8] &= ~(1 << (i % 8));
+  }
+  pack->used += taken ? count : -count;
+  rsh_fat16_meta(pack, sizeof(struct rsh_fat16_pack) +
+		 (FAT_PACK_PER_CLUSTER + 7) / 8);
+
+}
+
+/*
+ * Write an empty pack header at the start of cluster.
+ */
+void _rsh_fat16_pack_format(uint32_t cluster){
+
+  uint32_t header = _rsh_fat16_pack_header_units();
+  struct rsh_fat16_pack *pack = FAT_PACK_HEADER(cluster);
+
+  memset(pack, 0, (uint64_t)header * FAT_PACK_UNIT);
+  pack->magic = FAT_PACK_MAGIC;
+  _rsh_fat16_pack_mark(pack, 0, header, 1);
+
+}
+
+/*
+ * Add a cluster to the end of the list of pack clusters.
+ */
+static int _rsh_fat16_pack_add(struct rsh_fat16_fs *fs, uint32_t cluster){
+
+  uint32_t *tmp;
+  uint32_t size;
+
+  if ( fs->pack_count == fs->pack_size ){
+    size = fs->pack_size ? fs->pack_size * 2 : 16;
+    tmp = realloc(fs->packs, size * sizeof(uint32_t));
+    if ( ! tmp ){
+      errno = ENOMEM;
+      return RSH_ERR;
+    }
+    fs->packs = tmp;
+    fs->pack_size = size;
+  }
+
+  fs->packs[fs->pack_count++] = cluster;
+  return RSH_OK;
+
+}
+
+/*
+ * Find the mounted image's pack clusters. Images from before version 5 don't
+ * pack anything.
+ */
+int _rsh_fat16_pack_open(struct rsh_fat16_fs *fs){
+
+  uint32_t cluster = fs->fs_header.pack_offset;
+  uint32_t steps = 0;
+
+  fs->pack_count = 0;
+  fs->pack_hint = 0;
+  fs->pack_max = 0;
+  if ( ! cluster )
+    return RSH_OK;
+
+  while ( cluster != FAT_TERM ){
+    if ( cluster >= fs->fat_entries || steps++ >= fs->fat_entries ||
+	 FAT_PACK_HEADER(cluster)->magic != FAT_PACK_MAGIC ){
+      printf("Warning: bad pack cluster chain, run fsck.\n");
+      break;
+    }
+    if ( _rsh_fat16_pack_add(fs, cluster) )
+      return RSH_ERR;
+    cluster = rsh_fat16_get_entry(cluster);
+  }
+
+  fs->pack_max = FAT_CLUSTER_SIZE / 4;
+  return RSH_OK;
+
+}
+
+/*
+ * Look for count free units in a row in a pack cluster. Returns the first of
+ * them, or 0 if there aren't any (the header is always at 0).
+ */
+static uint32_t _rsh_fat16_pack_find(struct rsh_fat16_pack *pack,
+				     uint32_t count){
+
+  uint32_t unit;
+  uint32_t run = 0;
+
+  if ( FAT_PACK_PER_CLUSTER - pack->used < count )
+    return 0;
+
+  for ( unit = _rsh_fat16_pack_header_units(); unit < FAT_PACK_PER_CLUSTER;
+	unit++ ){
+    if ( FAT_PACK_TAKEN(pack, unit) ){
+      run = 0;
+      continue;
+    }
+    if ( ++run == count )
+      return unit + 1 - count;
+  }
+
+  return 0;
+
+}
+
+/*
+ * Start another pack cluster and chain it on after the last one.
+ */
+static int _rsh_fat16_pack_grow(uint32_t *cluster){
+
+  /* Units are counted from the start of the image in 32 bits, so a pack
+   * cluster can't be too far in. Only huge images run into this. */
+  if ( __rsh_fat16_find_open_cluster(cluster) ||
+       (uint64_t)(*cluster + 1) * FAT_PACK_PER_CLUSTER > UINT32_MAX ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+
+  if ( _rsh_fat16_pack_add(&fat16_fs, *cluster) )
+    return RSH_ERR;
+
+  _rsh_fat16_pack_format(*cluster);
+  rsh_fat16_set_entry(*cluster, FAT_TERM);
+  rsh_fat16_set_entry(fat16_fs.packs[fat16_fs.pack_count - 2], *cluster);
+  return RSH_OK;
+
+}
+
+/*
+ * Take count units from a pack cluster, starting a new one if none of them
+ * have room. *unit gets the first unit.
+ */
+static int _rsh_fat16_pack_alloc(uint32_t count, uint32_t *unit){
+
+  uint32_t i, n;
+  uint32_t first;
+  uint32_t cluster;
+
+  if ( ! fat16_fs.pack_count ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+
+  /* Start where the last one was found; that's where the room usually is. */
+  for ( n = 0; n < fat16_fs.pack_count; n++ ){
+    i = (fat16_fs.pack_hint + n) % fat16_fs.pack_count;
+    cluster = fat16_fs.packs[i];
+    first = _rsh_fat16_pack_find(FAT_PACK_HEADER(cluster), count);
+    if ( first ){
+      fat16_fs.pack_hint = i;
+      goto found;
+    }
+  }
+
+  if ( _rsh_fat16_pack_grow(&cluster) )
+    return RSH_ERR;
+  fat16_fs.pack_hint = fat16_fs.pack_count - 1;
+  first = _rsh_fat16_pack_header_units();
+
+ found:
+  _rsh_fat16_pack_mark(FAT_PACK_HEADER(cluster), first, count, 1);
+  *unit = cluster * FAT_PACK_PER_CLUSTER + first;
+  return RSH_OK;
+
+}
+
+/*
+ * Give back count units starting at unit. A pack cluster left empty is taken
+ * off the chain and freed, unless it's the first one. Its header may be in
+ * the log, so it isn't anybody else's until the next checkpoint.
+ */
+static void _rsh_fat16_pack_release(uint32_t unit, uint32_t count){
+
+  uint32_t i;
+  uint32_t cluster = unit / FAT_PACK_PER_CLUSTER;
+  struct rsh_fat16_pack *pack = FAT_PACK_HEADER(cluster);
+
+  if ( ! count )
+    return;
+
+  _rsh_fat16_pack_mark(pack, unit % FAT_PACK_PER_CLUSTER, count, 0);
+  if ( pack->used > _rsh_fat16_pack_header_units() ||
+       cluster == fat16_fs.fs_header.pack_offset )
+    return;
+
+  for ( i = 1; i < fat16_fs.pack_count; i++ )
+    if ( fat16_fs.packs[i] == cluster )
+      break;
+  if ( i == fat16_fs.pack_count )
+    rsh_fat16_badness();
+
+  rsh_fat16_set_entry(fat16_fs.packs[i - 1], rsh_fat16_get_entry(cluster));
+  _rsh_fat16_journal_free(cluster);
+  memmove(&fat16_fs.packs[i], &fat16_fs.packs[i + 1],
+	  (fat16_fs.pack_count - i - 1) * sizeof(uint32_t));
+  fat16_fs.pack_count--;
+  fat16_fs.pack_hint = 0;
+
+}
+
+/*
+ * Make room for a packed file to be size bytes. It grows in place if the
+ * units after it are free, otherwise it moves.
+ */
+static int _rsh_fat16_pack_resize(struct rsh_fat_dirent *dirent,
+				  uint64_t size){
+
+  uint32_t i;
+  uint32_t unit;
+  uint32_t first;
+  uint32_t old = FAT_PACK_UNITS(dirent->size);
+  uint32_t new = FAT_PACK_UNITS(size);
+  struct rsh_fat16_pack *pack;
+
+  if ( new <= old )
+    return RSH_OK;
+
+  if ( old ){
+    pack = FAT_PACK_HEADER(dirent->size_hi / FAT_PACK_PER_CLUSTER);
+    first = dirent->size_hi % FAT_PACK_PER_CLUSTER;
+    for ( i = first + old; i < first + new && i < FAT_PACK_PER_CLUSTER; i++ )
+      if ( FAT_PACK_TAKEN(pack, i) )
+	break;
+    if ( i == first + new ){
+      _rsh_fat16_pack_mark(pack, first + old, new - old, 1);
+      return RSH_OK;
+    }
+  }
+
+  if ( _rsh_fat16_pack_alloc(new, &unit) )
+    return RSH_ERR;
+
+  first = dirent->size_hi;
+  memcpy(FAT_PACK_TO_ADDR(unit), FAT_PACK_TO_ADDR(first), dirent->size);
+  rsh_fat16_dirty(FAT_PACK_TO_ADDR(unit), dirent->size);
+  dirent->size_hi = unit;
+  rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+
+  _rsh_fat16_pack_release(first, old);
+  return RSH_OK;
+
+}
+
+/*
+ * Read from a packed file.
+ */
+ssize_t _rsh_fat16_pack_read(struct rsh_file *file, void *buf, size_t count){
+
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat_dirent *dirent = fat_file->dirent;
+
+  if ( file->offset >= dirent->size )
+    return 0;
+  if ( count > dirent->size - file->offset )
+    count = dirent->size - file->offset;
+  if ( _rsh_fat16_csum_check_addr(FAT_PACK_TO_ADDR(dirent->size_hi)) )
+    return -1;
+
+  memcpy(buf, FAT_PACK_TO_ADDR(dirent->size_hi) + file->offset, count);
+  file->offset += count;
+  return count;
+
+}
+
+/*
+ * readv_map for a packed file: it's all in one place, so one segment.
+ */
+int _rsh_fat16_pack_readv_map(struct rsh_file *file, struct iovec *iov,
+			      int iovcnt, size_t count){
+
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat_dirent *dirent = fat_file->dirent;
+
+  if ( file->offset >= dirent->size || ! iovcnt || ! count )
+    return 0;
+  if ( count > dirent->size - file->offset )
+    count = dirent->size - file->offset;
+  if ( _rsh_fat16_csum_check_addr(FAT_PACK_TO_ADDR(dirent->size_hi)) )
+    return -1;
+
+  iov[0].iov_base = FAT_PACK_TO_ADDR(dirent->size_hi) + file->offset;
+  iov[0].iov_len = count;
+  file->offset += count;
+  return 1;
+
+}
+
+/*
+ * Write to a packed file. The caller has made sure it stays small enough to
+ * be packed. Fails without having written anything if there's no room, in
+ * which case the file can still be unpacked.
+ */
+ssize_t _rsh_fat16_pack_write(struct rsh_file *file, const void *buf,
+			      size_t count){
+
+  struct rsh_fat16_file *fat_file = file->local;
+  struct rsh_fat_dirent *dirent = fat_file->dirent;
+  uint64_t size = dirent->size;
+  void *data;
+
+  if ( ! count )
+    return 0;
+
+  if ( _rsh_fat16_pack_resize(dirent, file->offset + count) )
+    return -1;
+  data = FAT_PACK_TO_ADDR(dirent->size_hi);
+
+  /* Writing past the end leaves zeros in between, same as a chain. */
+  if ( file->offset > size ){
+    memset(data + size, 0, file->offset - size);
+    rsh_fat16_dirty(data + size, file->offset - size);
+  }
+
+  memcpy(data + file->offset, buf, count);
+  rsh_fat16_dirty(data + file->offset, count);
+  fat_file->dirty = 1;
+
+  file->offset += count;
+  if ( file->offset > size ){
+    _rsh_fat16_dindex_resize(fat_file->parent, file->offset - size);
+    _rsh_fat16_set_size(dirent, file->offset);
+  }
+
+  return count;
+
+}
+
+/*
+ * Give a copy of a packed file's data its own units, for a clone. *unit gets
+ * where the copy starts.
+ */
+int _rsh_fat16_pack_copy(struct rsh_fat_dirent *from, uint32_t *unit){
+
+  *unit = 0;
+  if ( ! from->size )
+    return RSH_OK;
+
+  if ( _rsh_fat16_pack_alloc(FAT_PACK_UNITS(from->size), unit) )
+    return RSH_ERR;
+
+  memcpy(FAT_PACK_TO_ADDR(*unit), FAT_PACK_TO_ADDR(from->size_hi),
+	 from->size);
+  rsh_fat16_dirty(FAT_PACK_TO_ADDR(*unit), from->size);
+  return RSH_OK;
+
+}
+
+/*
+ * Give back a packed file's units. The size is left for the caller to deal
+ * with.
+ */
+void _rsh_fat16_pack_free(struct rsh_fat_dirent *dirent){
+
+  uint32_t unit = dirent->size_hi;
+
+  dirent->size_hi = 0;
+  rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_pack_release(unit, FAT_PACK_UNITS(dirent->size));
+
+}
+
+/*
+ * Turn a packed file into an ordinary one with a chain of its own.
+ */
+int _rsh_fat16_unpack(struct rsh_fat16_file *file){
+
+  uint32_t cluster;
+  uint32_t unit;
+  struct rsh_fat_dirent *dirent = file->dirent;
+
+  if ( __rsh_fat16_find_open_cluster(&cluster) ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+
+  memcpy(FAT_CLUSTER_TO_ADDR(cluster), FAT_PACK_TO_ADDR(dirent->size_hi),
+	 dirent->size);
+  rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(cluster), dirent->size);
+  rsh_fat16_set_entry(cluster, FAT_TERM);
+
+  unit = dirent->size_hi;
+  dirent->index = cluster;
+  dirent->size_hi = 0;
+  rsh_fat16_meta(dirent, sizeof(struct rsh_fat_dirent));
+  _rsh_fat16_pack_release(unit, FAT_PACK_UNITS(dirent->size));
+
+  /* The map gets built from the new head on the next lookup. */
+  file->length = 0;
+  file->dirty = 1;
+  return RSH_OK;
+
+}
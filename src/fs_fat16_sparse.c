@@ -0,0 +1,203 @@
+/*
+ * Sparse files. A file that's written past its end doesn't get clusters for
+ * the part it skipped over, that part just reads back as zeros.
+ *
+ * The FAT can only say which cluster comes next, not how far into the file
+ * it is, so version 4 images keep a second table next to it: for every
+ * cluster, how many clusters of the file come between it and the next one
+ * in the chain. Nearly all of them are 0. The first cluster of a chain is
+ * always real (a file gets one when it's made or unpacked) and the last one
+ * never has a gap after it, so a file's size always ends in a real cluster.
+ *
+ * Free clusters always have a gap of 0; rsh_fat16_set_entry() sees to that,
+ * so nothing allocating a cluster needs to think about holes.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#define FAT_HOLES_TABLE							\
+  ( (uint32_t *)FAT_CLUSTER_TO_ADDR(fat16_fs.fs_header.holes_offset) )
+
+/*
+ * Number of clusters of hole between cluster and the next one in its chain.
+ */
+uint32_t _rsh_fat16_gap(uint32_t cluster){
+
+  if ( ! fat16_fs.fs_header.holes_offset || cluster >= fat16_fs.fat_entries )
+    return 0;
+
+  return FAT_HOLES_TABLE[cluster];
+
+}
+
+void _rsh_fat16_set_gap(uint32_t cluster, uint32_t gap){
+
+  if ( ! fat16_fs.fs_header.holes_offset || cluster >= fat16_fs.fat_entries )
+    return;
+
+  FAT_HOLES_TABLE[cluster] = gap;
+  rsh_fat16_meta(&FAT_HOLES_TABLE[cluster], sizeof(uint32_t));
+
+}
+
+/*
+ * Give cluster index of a file, which _rsh_fat16_file_cluster() just said was
+ * a hole, a real (zeroed) cluster. It gets linked in between the clusters on
+ * either side of the hole, splitting the hole in two.
+ */
+int _rsh_fat16_fill_hole(struct rsh_fat16_file *file, uint32_t index,
+			 uint32_t *cluster){
+
+  uint32_t pos = file->pos;
+  uint32_t prev;
+  uint32_t next;
+  uint32_t new;
+
+  /* We're about to change where prev links to, so it has to be ours. */
+  if ( pos >= file->shared && _rsh_fat16_unshare(file, pos) )
+    return RSH_ERR;
+
+  if ( _rsh_fat16_file_grow(file) )
+    return RSH_ERR;
+
+  if ( __rsh_fat16_find_open_cluster(&new) ){
+    errno = ENOSPC;
+    return RSH_ERR;
+  }
+  FAT_WIPE_CLUSTER(FAT_CLUSTER_TO_ADDR(new));
+  rsh_fat16_dirty(FAT_CLUSTER_TO_ADDR(new), FAT_CLUSTER_SIZE);
+
+  prev = file->clusters[pos];
+  next = rsh_fat16_get_entry(prev);
+  _rsh_fat16_set_gap(new, file->logical[pos + 1] - index - 1);
+  rsh_fat16_set_entry(new, next);
+  _rsh_fat16_set_gap(prev, index - file->logical[pos] - 1);
+  rsh_fat16_set_entry(prev, new);
+
+  memmove(&file->clusters[pos + 2], &file->clusters[pos + 1],
+	  (file->length - pos - 1) * sizeof(uint32_t));
+  memmove(&file->logical[pos + 2], &file->logical[pos + 1],
+	  (file->length - pos - 1) * sizeof(uint32_t));
+  file->clusters[pos + 1] = new;
+  file->logical[pos + 1] = index;
+  file->length++;
+  file->pos = pos + 1;
+  if ( file->shared != FAT_UNSHARED )
+    file->shared++;
+
+  /* Anybody else with this file open has the wrong map now. */
+  _rsh_fat16_chain_changed(file->clusters[0], file);
+
+  *cluster = new;
+  return RSH_OK;
+
+}
+
+/*
+ * Where the next data or hole at or after offset starts, for SEEK_DATA and
+ * SEEK_HOLE. There's always a hole at the end of the file.
+ */
+static off_t _rsh_fat16_seek_sparse(struct rsh_fat16_file *fat_file,
+				    off_t offset, uint64_t size, int data){
+
+  uint32_t index = offset / FAT_CLUSTER_SIZE;
+  uint32_t last = (size - 1) / FAT_CLUSTER_SIZE;
+  uint32_t cluster;
+  uint32_t pos;
+  uint64_t next;
+
+  /* Get the whole map built, then look from where index lands. */
+  if ( _rsh_fat16_file_cluster(fat_file, last) == FAT_RESERVED )
+    return -1;
+  cluster = _rsh_fat16_file_cluster(fat_file, index);
+  if ( cluster == FAT_RESERVED )
+    return -1;
+
+  if ( (cluster != FAT_HOLE) == data )
+    return offset;
+  pos = fat_file->pos;
+
+  /* In a hole, so the data starts at the next cluster in the map. */
+  if ( data ){
+    if ( pos + 1 >= fat_file->length ){
+      errno = ENXIO;
+      return -1;
+    }
+    return (uint64_t)fat_file->logical[pos + 1] * FAT_CLUSTER_SIZE;
+  }
+
+  /* In data, so find the end of this run of clusters. */
+  while ( pos + 1 < fat_file->length &&
+	  fat_file->logical[pos + 1] == fat_file->logical[pos] + 1 )
+    pos++;
+
+  next = ((uint64_t)fat_file->logical[pos] + 1) * FAT_CLUSTER_SIZE;
+  return next < size ? next : size;
+
+}
+
+/*
+ * Move a file's offset. Seeking past the end is fine; writing there leaves a
+ * hole.
+ */
+off_t rsh_fat16_lseek(struct rsh_file *file, off_t offset, int whence){
+
+  off_t ret;
+  struct rsh_fat16_file *fat_file = file->local;
+  uint64_t size = FAT_DIRENT_SIZE(fat_file->dirent);
+
+  /* A compressed file's dirent has the size of what's stored. */
+  if ( fat_file->dirent->type == FAT_ZFILE ){
+    if ( _rsh_fat16_zip_load(fat_file) )
+      return -1;
+    size = fat_file->zhead->size;
+  }
+
+  switch ( whence ){
+  case SEEK_SET:
+    ret = offset;
+    break;
+  case SEEK_CUR:
+    ret = file->offset + offset;
+    break;
+  case SEEK_END:
+    ret = size + offset;
+    break;
+  case SEEK_DATA:
+  case SEEK_HOLE:
+    if ( offset < 0 || offset >= size ){
+      errno = ENXIO;
+      return -1;
+    }
+    /* Packed and compressed files are all data. */
+    if ( FAT_DIRENT_PACKED(fat_file->dirent) ||
+	 fat_file->dirent->type == FAT_ZFILE ){
+      ret = whence == SEEK_DATA ? offset : size;
+      break;
+    }
+    ret = _rsh_fat16_seek_sparse(fat_file, offset, size, whence == SEEK_DATA);
+    if ( ret < 0 )
+      return -1;
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  if ( ret < 0 ){
+    errno = EINVAL;
+    return -1;
+  }
+
+  file->offset = ret;
+  return ret;
+
+}
@@ -0,0 +1,387 @@
+/*
+ * Getting the FAT16 image onto the disk. The driver marks every page of the
+ * mapping it changes in a dirty page bitmap; this is the code that keeps that
+ * bitmap and writes the dirty pages back.
+ *
+ * How hard we try depends on the durability mode:
+ *
+ *   sync      Closing a changed file msync()'s everything dirty and waits
+ *             for it. Slow, but nothing is lost once close() returns.
+ *   async     Same thing but with MS_ASYNC: the kernel gets told to start
+ *             writing but we don't wait.
+ *   periodic  close() doesn't write anything. A flusher thread writes back
+ *             every so many milliseconds or once enough is dirty, whichever
+ *             comes first. A crash loses at most about that much. With a
+ *             journal, the commits since the last flush go out after the
+ *             data.
+ *
+ * Whatever the mode, rsh_fat16_shutdown() writes out everything on the way
+ * out of the shell.
+ *
+ * Images with a journal only mark data pages here; metadata goes through
+ * the journal (fs_fat16_journal.c) instead, and closing a file commits it.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <time.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+/* Most runs of dirty pages to pull out of the bitmap at a time. */
+#define SYNC_RUNS 64
+
+/* Periodic mode defaults. */
+#define FLUSH_DEFAULT_MS    1000
+#define FLUSH_DEFAULT_BYTES (4*1024*1024)
+
+static char *mode_names[] = { "sync", "async", "periodic" };
+
+int      rsh_fat16_durability = RSH_FAT16_SYNC;
+long int rsh_fat16_flush_ms = FLUSH_DEFAULT_MS;
+long int rsh_fat16_flush_bytes = FLUSH_DEFAULT_BYTES;
+
+/* Protects the dirty map and the flusher's state. The flusher waits on
+ * flush_cond for its timer to run out or to be kicked. */
+static pthread_mutex_t dirty_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t       flusher;
+static int             flusher_running = 0;
+static int             flusher_stop = 0;
+static int             flusher_kick = 0;
+
+/*
+ * Set up the dirty page map. Everything starts out clean since we just
+ * mapped the image. If there's no memory for it, rsh_fat16_sync() just syncs
+ * the whole image.
+ */
+int _rsh_fat16_build_dirty_map(struct rsh_fat16_fs *fs){
+
+  uint32_t pages;
+
+  pthread_mutex_lock(&dirty_lock);
+  free(fs->dirty_map);
+  fs->page_size = sysconf(_SC_PAGESIZE);
+  pages = (fs->fs_header.size + fs->page_size - 1) / fs->page_size;
+  fs->dirty_words = (pages + 31) / 32;
+  fs->dirty_count = 0;
+  fs->dirty_map = (uint32_t *)calloc(fs->dirty_words, sizeof(uint32_t));
+  pthread_mutex_unlock(&dirty_lock);
+
+  return fs->dirty_map ? RSH_OK : RSH_ERR;
+
+}
+
+/*
+ * Note that len bytes at addr (which must be in the image) have changed.
+ */
+void rsh_fat16_dirty(void *addr, size_t len){
+
+  uint32_t page;
+  uint32_t last;
+
+  _rsh_fat16_csum_stale(addr, len);
+
+  if ( ! fat16_fs.dirty_map || ! len )
+    return;
+
+  page = (addr - fat16_fs.fs_io) / fat16_fs.page_size;
+  last = (addr + len - 1 - fat16_fs.fs_io) / fat16_fs.page_size;
+
+  pthread_mutex_lock(&dirty_lock);
+  for ( ; page <= last; page++ ){
+    if ( fat16_fs.dirty_map[page / 32] & (1U << (page % 32)) )
+      continue;
+    fat16_fs.dirty_map[page / 32] |= 1U << (page % 32);
+    fat16_fs.dirty_count++;
+  }
+
+  /* Too much is dirty, don't wait for the timer. */
+  if ( flusher_running && ! flusher_kick &&
+       (long int)fat16_fs.dirty_count * fat16_fs.page_size >=
+       rsh_fat16_flush_bytes ){
+    flusher_kick = 1;
+    pthread_cond_signal(&flush_cond);
+  }
+  pthread_mutex_unlock(&dirty_lock);
+
+}
+
+/*
+ * Write everything that's dirty out to the disk. Runs of dirty pages go out
+ * in one msync() each. Flags are passed on to msync(), so MS_SYNC or
+ * MS_ASYNC. The dirty map is only locked while we pull runs out of it, not
+ * while we wait on the disk.
+ */
+int rsh_fat16_sync(int flags){
+
+  int i, runs;
+  int ret = 0;
+  int logged;
+  uint32_t word = 0;
+  uint32_t bits;
+  uint32_t start[SYNC_RUNS];
+  uint32_t end[SYNC_RUNS];
+  uint64_t log_from, log_to;
+
+  if ( ! fat16_fs.fs_io )
+    return 0;
+
+  /* The sums of what changed go out with it. */
+  _rsh_fat16_csum_flush();
+
+  /* Periodic commits go out after the data they point at. */
+  logged = _rsh_fat16_journal_unsynced(&log_from, &log_to);
+
+  if ( ! fat16_fs.dirty_map ){
+    ret = msync(fat16_fs.fs_io, fat16_fs.fs_header.size, flags);
+    goto out;
+  }
+
+  do {
+
+    pthread_mutex_lock(&dirty_lock);
+    runs = 0;
+    while ( runs < SYNC_RUNS && fat16_fs.dirty_count &&
+	    word < fat16_fs.dirty_words ){
+
+      bits = fat16_fs.dirty_map[word];
+      if ( ! bits ){
+	word++;
+	continue;
+      }
+
+      /* Start of a run, now find the end of it. It may go on for a few
+       * words. */
+      start[runs] = word * 32 + __builtin_ctz(bits);
+      end[runs] = start[runs];
+      while ( end[runs] / 32 < fat16_fs.dirty_words &&
+	      (fat16_fs.dirty_map[end[runs] / 32] & (1U << (end[runs] % 32))) ){
+	fat16_fs.dirty_map[end[runs] / 32] &= ~(1U << (end[runs] % 32));
+	fat16_fs.dirty_count--;
+	end[runs]++;
+      }
+
+      word = end[runs] / 32;
+      runs++;
+
+    }
+    pthread_mutex_unlock(&dirty_lock);
+
+    for ( i = 0; i < runs; i++ )
+      if ( msync(fat16_fs.fs_io + start[i] * fat16_fs.page_size,
+		 (end[i] - start[i]) * fat16_fs.page_size, flags) )
+	ret = -1;
+
+  } while ( runs == SYNC_RUNS );
+
+ out:
+  if ( logged && _rsh_fat16_journal_sync(log_from, log_to, flags) )
+    ret = -1;
+
+  return ret;
+
+}
+
+/*
+ * A file that was changed is being closed. Write it back however the
+ * durability mode says to. With a journal that's a commit.
+ */
+int _rsh_fat16_close_sync(){
+
+  if ( fat16_fs.fs_header.journal_offset )
+    return _rsh_fat16_journal_commit();
+
+  switch ( rsh_fat16_durability ){
+  case RSH_FAT16_SYNC:
+    return rsh_fat16_sync(MS_SYNC);
+  case RSH_FAT16_ASYNC:
+    return rsh_fat16_sync(MS_ASYNC);
+  }
+
+  return 0;
+
+}
+
+/*
+ * The flusher thread. Sleeps for flush_ms, or until kicked, then writes back
+ * whatever is dirty.
+ */
+void *_rsh_fat16_flusher(void *arg){
+
+  struct timespec deadline;
+
+  pthread_mutex_lock(&dirty_lock);
+  while ( ! flusher_stop ){
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += rsh_fat16_flush_ms / 1000;
+    deadline.tv_nsec += (rsh_fat16_flush_ms % 1000) * 1000000;
+    if ( deadline.tv_nsec >= 1000000000 ){
+      deadline.tv_sec++;
+      deadline.tv_nsec -= 1000000000;
+    }
+
+    while ( ! flusher_stop && ! flusher_kick )
+      if ( pthread_cond_timedwait(&flush_cond, &dirty_lock, &deadline) ==
+	   ETIMEDOUT )
+	break;
+    flusher_kick = 0;
+
+    pthread_mutex_unlock(&dirty_lock);
+    rsh_fat16_sync(MS_SYNC);
+    pthread_mutex_lock(&dirty_lock);
+
+  }
+  pthread_mutex_unlock(&dirty_lock);
+
+  return NULL;
+
+}
+
+/*
+ * Stop the flusher, if it's running, and wait for it to finish up.
+ */
+void _rsh_fat16_stop_flusher(){
+
+  if ( ! flusher_running )
+    return;
+
+  pthread_mutex_lock(&dirty_lock);
+  flusher_stop = 1;
+  pthread_cond_signal(&flush_cond);
+  pthread_mutex_unlock(&dirty_lock);
+
+  pthread_join(flusher, NULL);
+  flusher_running = 0;
+  flusher_stop = 0;
+
+}
+
+/*
+ * Switch durability modes. For periodic mode ms and bytes are how often and
+ * after how much dirty data to flush; pass 0 for the defaults. Anything that
+ * was dirtied under the old mode gets written out first.
+ */
+int rsh_fat16_set_durability(int mode, long int ms, long int bytes){
+
+  if ( mode < RSH_FAT16_SYNC || mode > RSH_FAT16_PERIODIC || ms < 0 ||
+       bytes < 0 ){
+    errno = EINVAL;
+    return RSH_ERR;
+  }
+
+  _rsh_fat16_stop_flusher();
+  rsh_fat16_sync(MS_SYNC);
+
+  rsh_fat16_durability = mode;
+  rsh_fat16_flush_ms = ms ? ms : FLUSH_DEFAULT_MS;
+  rsh_fat16_flush_bytes = bytes ? bytes : FLUSH_DEFAULT_BYTES;
+
+  if ( mode != RSH_FAT16_PERIODIC )
+    return RSH_OK;
+
+  if ( pthread_create(&flusher, NULL, _rsh_fat16_flusher, NULL) ){
+    rsh_fat16_durability = RSH_FAT16_SYNC;
+    return RSH_ERR;
+  }
+  flusher_running = 1;
+
+  return RSH_OK;
+
+}
+
+/*
+ * Turn a mode name into a mode. Returns -1 if it isn't one.
+ */
+int _rsh_fat16_durability_mode(const char *name){
+
+  int i;
+
+  for ( i = 0; i < sizeof(mode_names) / sizeof(char *); i++ )
+    if ( strcmp(name, mode_names[i]) == 0 )
+      return i;
+
+  return -1;
+
+}
+
+/*
+ * Parse a durability spec as passed to --durability:
+ * <mode>[:<ms>[:<bytes>]]. Then switch to it.
+ */
+int rsh_fat16_parse_durability(char *spec){
+
+  int mode;
+  char name[16];
+  long int ms = 0, bytes = 0;
+
+  if ( sscanf(spec, "%15[^:]:%li:%li", name, &ms, &bytes) < 1 )
+    return RSH_ERR;
+
+  mode = _rsh_fat16_durability_mode(name);
+  if ( mode < 0 )
+    return RSH_ERR;
+
+  return rsh_fat16_set_durability(mode, ms, bytes);
+
+}
+
+/*
+ * Write out everything and stop the flusher. Called on the way out of the
+ * shell.
+ */
+void rsh_fat16_shutdown(){
+
+  _rsh_fat16_stop_flusher();
+  rsh_fat16_sync(MS_SYNC);
+  _rsh_fat16_journal_unmount();
+
+}
+
+/*
+ * Show or change the durability mode:
+ *
+ *   durability [sync|async|periodic [<ms> [<bytes>]]]
+ */
+int builtin_durability(int argc, char **argv, int in, int out, int err){
+
+  int mode;
+  long int ms = 0, bytes = 0;
+
+  if ( argc < 2 ){
+    rsh_dprintf(out, "%s", mode_names[rsh_fat16_durability]);
+    if ( rsh_fat16_durability == RSH_FAT16_PERIODIC )
+      rsh_dprintf(out, " (every %ld ms or %ld dirty bytes)",
+		  rsh_fat16_flush_ms, rsh_fat16_flush_bytes);
+    rsh_dprintf(out, "\n");
+    return 0;
+  }
+
+  mode = _rsh_fat16_durability_mode(argv[1]);
+  if ( mode < 0 || argc > 4 ){
+    rsh_dprintf(err, "Usage: durability [sync|async|periodic [<ms> "
+		"[<bytes>]]]\n");
+    return 1;
+  }
+
+  if ( argc > 2 )
+    ms = strtol(argv[2], NULL, 0);
+  if ( argc > 3 )
+    bytes = strtol(argv[3], NULL, 0);
+
+  if ( rsh_fat16_set_durability(mode, ms, bytes) ){
+    rsh_dprintf(err, "durability: unable to switch to %s\n", argv[1]);
+    return 1;
+  }
+
+  return 0;
+
+}
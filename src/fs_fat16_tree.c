@@ -0,0 +1,739 @@
+/*
+ * B+tree directories. The directory indexes in fs_fat16_index.c make lookups
+ * cheap once they're built, but building one means reading every cluster of
+ * the directory, and a directory of 100k files has hundreds of them. On
+ * images made with RSH_FS_TREE_DIRS (--tree-dirs) a directory gets a B+tree
+ * as soon as its table grows past one cluster. From then on lookups, new
+ * files and removals go through the tree, which is a handful of clusters
+ * each no matter how big the directory gets.
+ *
+ * The tree is an index over the directory table, not a replacement for it.
+ * Dirents stay where they are in the table (a dirent pointer has to stay
+ * good, see fs_fat16_dirent.c) and the leaves map each name to the cluster
+ * and offset of its dirent. Anything that just walks the table, like defrag,
+ * doesn't have to know the tree is there.
+ *
+ * Keys are the names themselves, so the leaves, which are chained together,
+ * have the whole directory in name order and readdir() hands it out that way
+ * without looking at the table at all. A node is one cluster: keys of any
+ * length packed in from the end and a sorted array of their offsets at the
+ * front (see struct rsh_fat_tnode). A full node splits in two by bytes and
+ * its parent gets a key for the new half; a root that splits gets a new root
+ * on top. Removing a name just takes its key out. Nodes never merge, so a
+ * directory that shrinks a lot keeps a bigger tree than it needs until it's
+ * deleted.
+ *
+ * The directory's . dirent, which is the first thing in its table, keeps the
+ * root of the tree in size_hi. Its size is a cluster of the table that had
+ * something removed from it, and so likely has room; new dirents go there or
+ * in the last cluster of the table so finding room doesn't mean a scan
+ * either. Room the hint has forgotten about gets used again once something
+ * else is removed from that cluster.
+ */
+
+#include <rsh.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+#define TNODE_HEADER sizeof(struct rsh_fat_tnode)
+
+/*
+ * Compare two names of the given lengths, strcmp() style.
+ */
+static int _rsh_fat16_tree_cmp(const char *a, uint32_t a_len,
+			       const char *b, uint32_t b_len){
+
+  int ret = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+  if ( ret )
+    return ret;
+  return (int)a_len - (int)b_len;
+
+}
+
+/*
+ * A node we're about to trust.
+ */
+static struct rsh_fat_tnode *_rsh_fat16_tree_node(uint32_t cluster){
+
+  struct rsh_fat_tnode *node;
+
+  if ( cluster == FAT_FREE || cluster >= fat16_fs.fat_entries )
+    rsh_fat16_badness();
+
+  node = FAT_TNODE(cluster);
+  if ( node->magic != FAT_TNODE_MAGIC ||
+       TNODE_HEADER + node->count * sizeof(uint16_t) > node->heap ||
+       node->heap > FAT_CLUSTER_SIZE )
+    rsh_fat16_badness();
+
+  return node;
+
+}
+
+/*
+ * Where name goes in node: the first key that isn't before it. *found is set
+ * if that key is name.
+ */
+static uint32_t _rsh_fat16_tree_search(struct rsh_fat_tnode *node,
+				       const char *name, uint32_t len,
+				       int *found){
+
+  int cmp;
+  uint32_t mid;
+  uint32_t lo = 0, hi = node->count;
+  struct rsh_fat_tkey *key;
+
+  *found = 0;
+  while ( lo < hi ){
+    mid = lo + (hi - lo) / 2;
+    key = FAT_TKEY(node, mid);
+    cmp = _rsh_fat16_tree_cmp(name, len, key->name, key->len);
+    if ( cmp == 0 ){
+      *found = 1;
+      return mid;
+    }
+    if ( cmp > 0 )
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+
+}
+
+/*
+ * Walk down from root to the leaf that name belongs in, noting the way in
+ * path. Returns how deep the leaf is.
+ */
+static int _rsh_fat16_tree_path(uint32_t root, const char *name, uint32_t len,
+				uint32_t *path){
+
+  int d = 0;
+  int found;
+  uint32_t i;
+  struct rsh_fat_tnode *node = _rsh_fat16_tree_node(root);
+
+  path[0] = root;
+  while ( node->level ){
+
+    if ( d + 1 == FAT_TREE_DEPTH )
+      rsh_fat16_badness();
+
+    i = _rsh_fat16_tree_search(node, name, len, &found);
+    if ( found )
+      path[++d] = FAT_TKEY(node, i)->ptr;
+    else
+      path[++d] = i ? FAT_TKEY(node, i - 1)->ptr : node->link;
+    node = _rsh_fat16_tree_node(path[d]);
+
+  }
+
+  return d;
+
+}
+
+/*
+ * The root of dir's tree, 0 if it doesn't have one.
+ */
+uint32_t _rsh_fat16_tree_root(uint32_t dir){
+
+  struct rsh_fat_dirent *dot;
+
+  if ( ! FAT_TREE_DIRS )
+    return 0;
+
+  dot = _rsh_fat16_dirent_next(dir, NULL);
+  if ( ! dot || ! dot->size_hi )
+    return 0;
+
+  _rsh_fat16_tree_node(dot->size_hi);
+  return dot->size_hi;
+
+}
+
+/*
+ * Look name up in the tree at root. Returns its dirent or NULL.
+ */
+struct rsh_fat_dirent *_rsh_fat16_tree_lookup(uint32_t root,
+					      const char *name){
+
+  int found;
+  uint32_t i;
+  uint32_t len = strnlen(name, FAT_NAME_MAX + 1);
+  uint32_t path[FAT_TREE_DEPTH];
+  struct rsh_fat_tnode *leaf;
+  struct rsh_fat_tkey *key;
+  struct rsh_fat_dirent *ent;
+
+  /* Names get cut down to size when they're made, so nothing is this
+   * long. */
+  if ( len > FAT_NAME_MAX )
+    return NULL;
+
+  leaf = FAT_TNODE(path[_rsh_fat16_tree_path(root, name, len, path)]);
+  i = _rsh_fat16_tree_search(leaf, name, len, &found);
+  if ( ! found )
+    return NULL;
+
+  key = FAT_TKEY(leaf, i);
+  if ( key->ptr >= fat16_fs.fat_entries ||
+       key->at + sizeof(struct rsh_fat_dirent) > FAT_CLUSTER_SIZE )
+    rsh_fat16_badness();
+
+  ent = FAT_CLUSTER_TO_ADDR(key->ptr) + key->at;
+  if ( strcmp(FAT_DIRENT_NAME(ent), name) != 0 )
+    rsh_fat16_badness();
+
+  return ent;
+
+}
+
+/*
+ * Bytes the keys in node take up, offsets and all.
+ */
+static uint32_t _rsh_fat16_tree_used(struct rsh_fat_tnode *node){
+
+  uint32_t i;
+  uint32_t used = 0;
+
+  for ( i = 0; i < node->count; i++ )
+    used += FAT_TKEY_LEN(FAT_TKEY(node, i)->len) + sizeof(uint16_t);
+
+  return used;
+
+}
+
+/*
+ * Put a key in at position i of node. There has to be room for it between
+ * the offsets and the heap.
+ */
+static void _rsh_fat16_tree_put(struct rsh_fat_tnode *node, uint32_t i,
+				const char *name, uint32_t len, uint32_t ptr,
+				uint16_t at){
+
+  struct rsh_fat_tkey *key;
+
+  node->heap -= FAT_TKEY_LEN(len);
+  key = (void *)node + node->heap;
+  key->ptr = ptr;
+  key->at = at;
+  key->len = len;
+  memcpy(key->name, name, len);
+  rsh_fat16_meta(key, FAT_TKEY_LEN(len));
+
+  memmove(&node->offs[i + 1], &node->offs[i],
+	  (node->count - i) * sizeof(uint16_t));
+  node->offs[i] = node->heap;
+  node->count++;
+  rsh_fat16_meta(node, TNODE_HEADER);
+  rsh_fat16_meta(&node->offs[i], (node->count - i) * sizeof(uint16_t));
+
+}
+
+/*
+ * Empty node out and fill it back up with keys [from, to) of copy, a copy of
+ * some node.
+ */
+static void _rsh_fat16_tree_fill(struct rsh_fat_tnode *node,
+				 struct rsh_fat_tnode *copy,
+				 uint32_t from, uint32_t to){
+
+  struct rsh_fat_tkey *key;
+
+  node->count = 0;
+  node->heap = FAT_CLUSTER_SIZE;
+  rsh_fat16_meta(node, TNODE_HEADER);
+
+  for ( ; from < to; from++ ){
+    key = FAT_TKEY(copy, from);
+    _rsh_fat16_tree_put(node, node->count, key->name, key->len, key->ptr,
+			key->at);
+  }
+
+}
+
+/*
+ * Squeeze the space removed keys left behind out of node.
+ */
+static int _rsh_fat16_tree_pack(struct rsh_fat_tnode *node){
+
+  struct rsh_fat_tnode *copy = malloc(FAT_CLUSTER_SIZE);
+
+  if ( ! copy ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+
+  memcpy(copy, node, FAT_CLUSTER_SIZE);
+  _rsh_fat16_tree_fill(node, copy, 0, copy->count);
+
+  free(copy);
+  return RSH_OK;
+
+}
+
+/*
+ * A new, empty node at level. FAT_TERM if the image is full.
+ */
+static uint32_t _rsh_fat16_tree_new(uint32_t level){
+
+  uint32_t cluster;
+  struct rsh_fat_tnode *node;
+
+  if ( _rsh_fat16_make_room(1) )
+    return FAT_TERM;
+
+  cluster = rsh_fat16_alloc_cluster(FAT_TERM);
+  if ( cluster == FAT_TERM ){
+    errno = ENOSPC;
+    return FAT_TERM;
+  }
+  _rsh_fat16_journal_log(FAT_CLUSTER_TO_ADDR(cluster), FAT_CLUSTER_SIZE, 1);
+
+  node = FAT_TNODE(cluster);
+  node->magic = FAT_TNODE_MAGIC;
+  node->level = level;
+  node->count = 0;
+  node->link = FAT_TERM;
+  node->heap = FAT_CLUSTER_SIZE;
+  rsh_fat16_meta(node, TNODE_HEADER);
+
+  return cluster;
+
+}
+
+/*
+ * Split the node at cluster in two, the keys from about half way (by bytes)
+ * on going to a new node. Returns the new node, with the key its parent
+ * needs for it copied to sep, or FAT_TERM if that can't be done.
+ */
+static uint32_t _rsh_fat16_tree_split(uint32_t cluster, char *sep,
+				      uint32_t *sep_len){
+
+  uint32_t mid;
+  uint32_t new;
+  uint32_t used = 0;
+  uint32_t total;
+  struct rsh_fat_tnode *node = FAT_TNODE(cluster);
+  struct rsh_fat_tnode *right;
+  struct rsh_fat_tnode *copy;
+  struct rsh_fat_tkey *key;
+
+  copy = malloc(FAT_CLUSTER_SIZE);
+  if ( ! copy ){
+    errno = ENOMEM;
+    return FAT_TERM;
+  }
+
+  new = _rsh_fat16_tree_new(node->level);
+  if ( new == FAT_TERM ){
+    free(copy);
+    return FAT_TERM;
+  }
+  right = FAT_TNODE(new);
+  memcpy(copy, node, FAT_CLUSTER_SIZE);
+
+  total = _rsh_fat16_tree_used(copy);
+  for ( mid = 0; mid + 1 < copy->count && used < total / 2; mid++ )
+    used += FAT_TKEY_LEN(FAT_TKEY(copy, mid)->len) + sizeof(uint16_t);
+
+  key = FAT_TKEY(copy, mid);
+  memcpy(sep, key->name, key->len);
+  *sep_len = key->len;
+
+  /* A leaf's first key is copied up. Anywhere else the middle key moves up
+   * and the child it had starts off the new node. */
+  if ( copy->level ){
+    right->link = key->ptr;
+    _rsh_fat16_tree_fill(right, copy, mid + 1, copy->count);
+  } else {
+    right->link = node->link;
+    node->link = new;
+    _rsh_fat16_tree_fill(right, copy, mid, copy->count);
+  }
+  _rsh_fat16_tree_fill(node, copy, 0, mid);
+
+  free(copy);
+  return new;
+
+}
+
+/*
+ * Point the . of dir at a new root.
+ */
+static void _rsh_fat16_tree_set_root(uint32_t dir, uint32_t root){
+
+  struct rsh_fat_dirent *dot = _rsh_fat16_dirent_next(dir, NULL);
+
+  dot->size_hi = root;
+  if ( ! root )
+    dot->size = 0;
+  rsh_fat16_meta(dot, sizeof(struct rsh_fat_dirent));
+
+}
+
+/*
+ * Add a key to the node at depth d of path, splitting it, and on up the path
+ * as far as that takes, if it's full.
+ */
+static int _rsh_fat16_tree_add(uint32_t dir, uint32_t *path, int d,
+			       const char *name, uint32_t len, uint32_t ptr,
+			       uint16_t at){
+
+  int found;
+  uint32_t i;
+  uint32_t new = FAT_TERM;
+  uint32_t root;
+  uint32_t sep_len = 0;
+  uint32_t need = FAT_TKEY_LEN(len) + sizeof(uint16_t);
+  char sep[FAT_NAME_ROOM];
+  struct rsh_fat_tnode *node = FAT_TNODE(path[d]);
+
+  if ( TNODE_HEADER + node->count * sizeof(uint16_t) + need > node->heap ){
+    if ( TNODE_HEADER + _rsh_fat16_tree_used(node) + need <=
+	 FAT_CLUSTER_SIZE ){
+      if ( _rsh_fat16_tree_pack(node) )
+	return RSH_ERR;
+    } else {
+      new = _rsh_fat16_tree_split(path[d], sep, &sep_len);
+      if ( new == FAT_TERM )
+	return RSH_ERR;
+      if ( _rsh_fat16_tree_cmp(name, len, sep, sep_len) >= 0 )
+	node = FAT_TNODE(new);
+    }
+  }
+
+  i = _rsh_fat16_tree_search(node, name, len, &found);
+  if ( found ){
+    FAT_TKEY(node, i)->ptr = ptr;
+    FAT_TKEY(node, i)->at = at;
+    rsh_fat16_meta(FAT_TKEY(node, i), sizeof(struct rsh_fat_tkey));
+  } else {
+    _rsh_fat16_tree_put(node, i, name, len, ptr, at);
+  }
+
+  if ( new == FAT_TERM )
+    return RSH_OK;
+
+  /* The new node needs a key in the parent, or a new root if there isn't a
+   * parent. */
+  if ( d )
+    return _rsh_fat16_tree_add(dir, path, d - 1, sep, sep_len, new, 0);
+
+  root = _rsh_fat16_tree_new(FAT_TNODE(path[0])->level + 1);
+  if ( root == FAT_TERM )
+    return RSH_ERR;
+  FAT_TNODE(root)->link = path[0];
+  _rsh_fat16_tree_put(FAT_TNODE(root), 0, sep, sep_len, new, 0);
+  _rsh_fat16_tree_set_root(dir, root);
+
+  return RSH_OK;
+
+}
+
+/*
+ * Add ent, which has just been named, to dir's tree. If the tree can't take
+ * it (the image is full) the tree gets thrown away and dir goes back to being
+ * an ordinary directory.
+ */
+int _rsh_fat16_tree_insert(uint32_t dir, struct rsh_fat_dirent *ent){
+
+  int d;
+  char *name = FAT_DIRENT_NAME(ent);
+  uint32_t len = strnlen(name, FAT_NAME_MAX);
+  uint32_t root = _rsh_fat16_tree_root(dir);
+  uint32_t path[FAT_TREE_DEPTH];
+  uint64_t offset = (void *)ent - fat16_fs.fs_io;
+
+  if ( ! root || ! len )
+    return RSH_OK;
+
+  d = _rsh_fat16_tree_path(root, name, len, path);
+  if ( _rsh_fat16_tree_add(dir, path, d, name, len,
+			   offset / FAT_CLUSTER_SIZE,
+			   offset % FAT_CLUSTER_SIZE) ){
+    _rsh_fat16_tree_drop(dir);
+    return RSH_ERR;
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Take ent out of dir's tree. This must be done before ent is cleared since
+ * the name is what finds it. Its cluster becomes the place to look for room.
+ */
+void _rsh_fat16_tree_remove(uint32_t dir, struct rsh_fat_dirent *ent){
+
+  int found;
+  uint32_t i;
+  uint32_t root = _rsh_fat16_tree_root(dir);
+  uint32_t path[FAT_TREE_DEPTH];
+  char *name = FAT_DIRENT_NAME(ent);
+  uint32_t len = strnlen(name, FAT_NAME_MAX);
+  struct rsh_fat_tnode *leaf;
+  struct rsh_fat_dirent *dot;
+
+  if ( ! root )
+    return;
+
+  leaf = FAT_TNODE(path[_rsh_fat16_tree_path(root, name, len, path)]);
+  i = _rsh_fat16_tree_search(leaf, name, len, &found);
+  if ( found ){
+    memmove(&leaf->offs[i], &leaf->offs[i + 1],
+	    (leaf->count - i - 1) * sizeof(uint16_t));
+    leaf->count--;
+    rsh_fat16_meta(leaf, TNODE_HEADER);
+    rsh_fat16_meta(&leaf->offs[i], (leaf->count - i) * sizeof(uint16_t));
+  }
+
+  dot = _rsh_fat16_dirent_next(dir, NULL);
+  dot->size = ((void *)ent - fat16_fs.fs_io) / FAT_CLUSTER_SIZE;
+  rsh_fat16_meta(dot, sizeof(struct rsh_fat_dirent));
+
+}
+
+/*
+ * An empty dirent in dir that name fits in, without taking it: in the
+ * cluster something was last removed from or else the last cluster. NULL if
+ * the table needs another cluster.
+ */
+struct rsh_fat_dirent *_rsh_fat16_tree_room(uint32_t dir, const char *name){
+
+  int any;
+  struct rsh_fat_dirent *slot;
+  struct rsh_fat_dirent *dot = _rsh_fat16_dirent_next(dir, NULL);
+
+  if ( dot->size ){
+    if ( dot->size >= fat16_fs.fat_entries )
+      rsh_fat16_badness();
+    slot = _rsh_fat16_dirent_room(dot->size, name, &any);
+    if ( slot )
+      return slot;
+    if ( ! any ){
+      dot->size = 0;
+      rsh_fat16_meta(dot, sizeof(struct rsh_fat_dirent));
+    }
+  }
+
+  return _rsh_fat16_dirent_room(_rsh_fat16_follow_head(dir, -1), name, &any);
+
+}
+
+/*
+ * The leftmost leaf of the tree at root.
+ */
+static struct rsh_fat_tnode *_rsh_fat16_tree_first(uint32_t root){
+
+  int d = 0;
+  struct rsh_fat_tnode *node = _rsh_fat16_tree_node(root);
+
+  while ( node->level ){
+    if ( ++d == FAT_TREE_DEPTH )
+      rsh_fat16_badness();
+    node = _rsh_fat16_tree_node(node->link);
+  }
+
+  return node;
+
+}
+
+/*
+ * Is there nothing but . and .. in the tree at root?
+ */
+int _rsh_fat16_tree_empty(uint32_t root){
+
+  uint32_t names = 0;
+  struct rsh_fat_tnode *leaf = _rsh_fat16_tree_first(root);
+
+  while ( 1 ){
+    names += leaf->count;
+    if ( names > 2 )
+      return 0;
+    if ( leaf->link == FAT_TERM )
+      return 1;
+    leaf = _rsh_fat16_tree_node(leaf->link);
+  }
+
+}
+
+/*
+ * Fill in up to max dirents with the names in the tree at root that come
+ * after last (an empty last means from the start), in order, and leave the
+ * last one handed out in last. Returns how many there were.
+ */
+int _rsh_fat16_tree_readdir(uint32_t root, char *last, struct dirent *ents,
+			    int max){
+
+  int n = 0;
+  int found;
+  uint32_t i;
+  uint32_t len = strlen(last);
+  uint32_t path[FAT_TREE_DEPTH];
+  struct rsh_fat_tnode *leaf;
+  struct rsh_fat_tkey *key;
+
+  leaf = FAT_TNODE(path[_rsh_fat16_tree_path(root, last, len, path)]);
+  i = _rsh_fat16_tree_search(leaf, last, len, &found);
+  if ( found )
+    i++;
+
+  while ( n < max ){
+
+    if ( i >= leaf->count ){
+      if ( leaf->link == FAT_TERM )
+	break;
+      leaf = _rsh_fat16_tree_node(leaf->link);
+      i = 0;
+      continue;
+    }
+
+    key = FAT_TKEY(leaf, i++);
+    memset(&ents[n], 0, sizeof(struct dirent));
+    memcpy(ents[n].d_name, key->name, key->len);
+    n++;
+
+  }
+
+  if ( n )
+    strcpy(last, ents[n - 1].d_name);
+  return n;
+
+}
+
+/*
+ * Give dir a tree if it ought to have one and doesn't yet: on a tree
+ * directory image, once its table is more than one cluster long.
+ */
+int _rsh_fat16_tree_build(uint32_t dir){
+
+  uint32_t root;
+  uint32_t cluster;
+  struct rsh_fat_dirent *ent;
+
+  if ( ! FAT_TREE_DIRS || _rsh_fat16_tree_root(dir) ||
+       rsh_fat16_get_entry(dir) == FAT_TERM )
+    return RSH_OK;
+
+  if ( ! _rsh_fat16_dirent_next(dir, NULL) )
+    rsh_fat16_badness();
+
+  root = _rsh_fat16_tree_new(0);
+  if ( root == FAT_TERM )
+    return RSH_ERR;
+  _rsh_fat16_tree_set_root(dir, root);
+
+  for ( cluster = dir; cluster != FAT_TERM;
+	cluster = rsh_fat16_get_entry(cluster) ){
+
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED )
+      rsh_fat16_badness();
+
+    for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	  ent = _rsh_fat16_dirent_next(cluster, ent) )
+      if ( FAT_DIRENT_NAME(ent)[0] && _rsh_fat16_tree_insert(dir, ent) )
+	return RSH_ERR;
+
+  }
+
+  /* Any index dir had doesn't get told about changes any more. */
+  _rsh_fat16_dindex_drop(dir);
+  return RSH_OK;
+
+}
+
+/*
+ * Free the node at cluster and everything under it.
+ */
+static void _rsh_fat16_tree_free(uint32_t cluster){
+
+  uint32_t i;
+  struct rsh_fat_tnode *node = _rsh_fat16_tree_node(cluster);
+
+  if ( node->level ){
+    _rsh_fat16_tree_free(node->link);
+    for ( i = 0; i < node->count; i++ )
+      _rsh_fat16_tree_free(FAT_TKEY(node, i)->ptr);
+  }
+
+  rsh_fat16_set_entry(cluster, FAT_FREE);
+
+}
+
+/*
+ * Throw dir's tree away, if it has one, leaving an ordinary directory.
+ */
+void _rsh_fat16_tree_drop(uint32_t dir){
+
+  uint32_t root = _rsh_fat16_tree_root(dir);
+
+  if ( ! root )
+    return;
+
+  _rsh_fat16_tree_free(root);
+  _rsh_fat16_tree_set_root(dir, 0);
+
+}
+
+/*
+ * Build every directory's tree over again from its table. For fsck, once
+ * it's done fixing up whatever the trees point at.
+ */
+void _rsh_fat16_tree_rebuild_all(){
+
+  char *name;
+  uint32_t dir;
+  uint32_t cluster;
+  uint32_t *stack;
+  uint32_t *tmp;
+  uint32_t len = 0, size = 16;
+  struct rsh_fat_dirent *ent;
+
+  if ( ! FAT_TREE_DIRS )
+    return;
+
+  stack = malloc(size * sizeof(uint32_t));
+  if ( ! stack )
+    return;
+  stack[len++] = fat16_fs.fs_header.root_offset;
+
+  while ( len ){
+
+    dir = stack[--len];
+    _rsh_fat16_tree_drop(dir);
+    _rsh_fat16_tree_build(dir);
+
+    for ( cluster = dir; cluster != FAT_TERM;
+	  cluster = rsh_fat16_get_entry(cluster) ){
+      for ( ent = _rsh_fat16_dirent_next(cluster, NULL); ent;
+	    ent = _rsh_fat16_dirent_next(cluster, ent) ){
+
+	name = FAT_DIRENT_NAME(ent);
+	if ( ent->type != FAT_DIR || ! name[0] || strcmp(name, ".") == 0 ||
+	     strcmp(name, "..") == 0 )
+	  continue;
+
+	if ( len == size ){
+	  tmp = realloc(stack, size * 2 * sizeof(uint32_t));
+	  if ( ! tmp )
+	    goto out;
+	  stack = tmp;
+	  size *= 2;
+	}
+	stack[len++] = ent->index;
+
+      }
+    }
+
+  }
+
+ out:
+  free(stack);
+
+}
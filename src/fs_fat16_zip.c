@@ -0,0 +1,979 @@
+/*
+ * Compressed files. Logs and other text kept in the image are mostly the
+ * same few words over and over, and stored as they are they fill a small
+ * image up fast. On images made with RSH_FS_ZIP_FILES (--compress) a file is
+ * compressed when it's closed after being written, as long as that saves at
+ * least a cluster. The dirent's type becomes FAT_ZFILE.
+ *
+ * A compressed file is an ordinary chain that happens to hold a compressed
+ * copy of the file: a header (struct rsh_fat_zhead), then the file cut into
+ * FAT_ZIP_CHUNK byte chunks, each compressed on its own. The dirent's size is
+ * the size of all that, not of the file, so everything that only cares about
+ * chains (fsck, defrag, clones, df) works on it unchanged. The header has the
+ * real size and where each chunk ends, so a read only uncompresses the chunks
+ * it touches, and only as far into them as it needs to. An open file keeps
+ * the last chunk it uncompressed around, so reading front to back does each
+ * one once.
+ *
+ * Writing is another story: the first write to a compressed file
+ * uncompresses it back into an ordinary file, and it gets compressed again
+ * when it's closed. The write keeps the old chunks, still compressed, with
+ * the handle, and every write after it notes how far from the front the
+ * file is still the same (_rsh_fat16_zip_changed()). Close copies the
+ * chunks in front of that as they were and only compresses the rest, so
+ * appending to a big log compresses the last chunk or two rather than the
+ * whole file. Uncompressing it for the first write still goes through all
+ * of it, which is the price of keeping ordinary files ordinary.
+ *
+ * The compression is a small LZ77 in the style of LZ4: a sequence is a token
+ * (4 bits each of literal count and match length), the literals, and a 2
+ * byte offset back to the match. Matches are found through a hash of the
+ * next 4 bytes. It's nowhere near the best ratio going but it's quick both
+ * ways, which is what matters for reads out of a mapped image.
+ */
+
+#include <rsh.h>
+#include <rshio.h>
+#include <rshfs.h>
+
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+
+/* Chunks compressed since startup, for the tests and the curious. */
+uint32_t rsh_fat16_zip_chunks = 0;
+
+#define ZIP_HASH_BITS    12
+#define ZIP_MIN_MATCH    4
+#define ZIP_LAST_LITERAL 5  /* The last few bytes are always literals. */
+#define ZIP_MATCH_LIMIT  12 /* No match starts closer than this to the end. */
+#define ZIP_MAX_OFFSET   65535
+
+/* Biggest file that gets compressed; the header's ends are 32 bits. */
+#define ZIP_MAX_SIZE     0xf0000000ULL
+
+static uint32_t _rsh_fat16_zip_read32(const uint8_t *p){
+
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(uint32_t));
+  return v;
+
+}
+
+static uint32_t _rsh_fat16_zip_hash(uint32_t v){
+
+  return (v * 2654435761U) >> (32 - ZIP_HASH_BITS);
+
+}
+
+/*
+ * Write out what's left of a length that didn't fit in its token.
+ */
+static uint8_t *_rsh_fat16_zip_len(uint8_t *op, uint32_t len){
+
+  while ( len >= 255 ){
+    *op++ = 255;
+    len -= 255;
+  }
+  *op++ = len;
+
+  return op;
+
+}
+
+/*
+ * Add a sequence: lit literals from anchor followed, unless it's the last
+ * one, by a match of mlen bytes off bytes back. Returns where it ended or
+ * NULL if it doesn't fit before oend.
+ */
+static uint8_t *_rsh_fat16_zip_seq(uint8_t *op, uint8_t *oend,
+				   const uint8_t *anchor, uint32_t lit,
+				   uint32_t off, uint32_t mlen){
+
+  uint8_t *token = op;
+
+  if ( oend - op < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 )
+    return NULL;
+
+  *op++ = (lit >= 15 ? 15 : lit) << 4;
+  if ( lit >= 15 )
+    op = _rsh_fat16_zip_len(op, lit - 15);
+  memcpy(op, anchor, lit);
+  op += lit;
+
+  if ( ! mlen )
+    return op;
+
+  *op++ = off & 0xff;
+  *op++ = off >> 8;
+  mlen -= ZIP_MIN_MATCH;
+  *token |= mlen >= 15 ? 15 : mlen;
+  if ( mlen >= 15 )
+    op = _rsh_fat16_zip_len(op, mlen - 15);
+
+  return op;
+
+}
+
+/*
+ * Compress len bytes of src (no more than FAT_ZIP_CHUNK) into dst. Returns
+ * how long the result is, or 0 if it would be longer than max.
+ */
+uint32_t _rsh_fat16_zip_pack(const uint8_t *src, uint32_t len, uint8_t *dst,
+			     uint32_t max){
+
+  uint32_t h;
+  uint32_t mlen;
+  uint32_t table[1 << ZIP_HASH_BITS];
+  const uint8_t *ip = src;
+  const uint8_t *anchor = src;
+  const uint8_t *ref;
+  const uint8_t *end = src + len;
+  const uint8_t *limit = len > ZIP_MATCH_LIMIT ? end - ZIP_MATCH_LIMIT : src;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + max;
+
+  memset(table, 0, sizeof(table));
+
+  while ( ip < limit ){
+
+    h = _rsh_fat16_zip_hash(_rsh_fat16_zip_read32(ip));
+    ref = src + table[h];
+    table[h] = ip - src;
+
+    /* No match: move on, faster the longer it's been since the last. */
+    if ( ref >= ip || ip - ref > ZIP_MAX_OFFSET ||
+	 _rsh_fat16_zip_read32(ref) != _rsh_fat16_zip_read32(ip) ){
+      ip += 1 + ((ip - anchor) >> 6);
+      continue;
+    }
+
+    for ( mlen = ZIP_MIN_MATCH;
+	  ip + mlen < end - ZIP_LAST_LITERAL && ref[mlen] == ip[mlen]; mlen++ )
+      ;
+
+    op = _rsh_fat16_zip_seq(op, oend, anchor, ip - anchor, ip - ref, mlen);
+    if ( ! op )
+      return 0;
+
+    ip += mlen;
+    anchor = ip;
+
+  }
+
+  op = _rsh_fat16_zip_seq(op, oend, anchor, end - anchor, 0, 0);
+  return op ? op - dst : 0;
+
+}
+
+/*
+ * Copy len bytes 8 at a time, which can go up to 7 bytes past the end both
+ * ways. Most sequences are short, and this beats memcpy() on them.
+ */
+static void _rsh_fat16_zip_copy8(uint8_t *dst, const uint8_t *src,
+				 uint32_t len){
+
+  uint64_t v;
+  uint8_t *end = dst + len;
+
+  do {
+    memcpy(&v, src, sizeof(v));
+    memcpy(dst, &v, sizeof(v));
+    dst += 8;
+    src += 8;
+  } while ( dst < end );
+
+}
+
+/*
+ * Read the rest of a length that didn't fit in its token.
+ */
+static int _rsh_fat16_zip_more(const uint8_t **ip, const uint8_t *end,
+			       uint32_t *len){
+
+  uint8_t b;
+
+  do {
+    if ( *ip >= end )
+      return RSH_ERR;
+    b = *(*ip)++;
+    *len += b;
+  } while ( b == 255 );
+
+  return RSH_OK;
+
+}
+
+/*
+ * Uncompress len bytes of src into dst, which it has to fill exactly: want
+ * bytes. If need is less than want it stops as soon as it has that many,
+ * which may be a few more. Returns RSH_ERR if src is no good.
+ */
+int _rsh_fat16_zip_unpack(const uint8_t *src, uint32_t len, uint8_t *dst,
+			  uint32_t want, uint32_t need){
+
+  uint8_t token;
+  uint32_t i;
+  uint32_t lit, off, mlen;
+  const uint8_t *ip = src;
+  const uint8_t *end = src + len;
+  uint8_t *op = dst;
+  uint8_t *oend = dst + want;
+
+  while ( ip < end && (need >= want || op - dst < need) ){
+
+    token = *ip++;
+    lit = token >> 4;
+    if ( lit == 15 && _rsh_fat16_zip_more(&ip, end, &lit) )
+      return RSH_ERR;
+    if ( lit > end - ip || lit > oend - op )
+      return RSH_ERR;
+    if ( lit + 8 <= end - ip && lit + 8 <= oend - op )
+      _rsh_fat16_zip_copy8(op, ip, lit);
+    else
+      memcpy(op, ip, lit);
+    op += lit;
+    ip += lit;
+
+    /* The last sequence is just literals. */
+    if ( ip == end )
+      break;
+
+    if ( end - ip < 2 )
+      return RSH_ERR;
+    off = ip[0] | ip[1] << 8;
+    ip += 2;
+    if ( ! off || off > op - dst )
+      return RSH_ERR;
+
+    mlen = token & 15;
+    if ( mlen == 15 && _rsh_fat16_zip_more(&ip, end, &mlen) )
+      return RSH_ERR;
+    mlen += ZIP_MIN_MATCH;
+    if ( mlen > oend - op )
+      return RSH_ERR;
+
+    /* A match can overlap what it's making, runs of a byte do. */
+    if ( off >= 8 && mlen + 8 <= oend - op ){
+      _rsh_fat16_zip_copy8(op, op - off, mlen);
+    } else if ( off >= mlen ){
+      memcpy(op, op - off, mlen);
+    } else {
+      for ( i = 0; i < mlen; i++ )
+	op[i] = (op - off)[i];
+    }
+    op += mlen;
+
+  }
+
+  if ( need < want )
+    return op - dst >= need ? RSH_OK : RSH_ERR;
+  return op == oend ? RSH_OK : RSH_ERR;
+
+}
+
+/*
+ * Bytes of the file in chunk i.
+ */
+static uint32_t _rsh_fat16_zip_chunk_len(struct rsh_fat_zhead *head,
+					 uint32_t i){
+
+  uint64_t left = head->size - (uint64_t)i * FAT_ZIP_CHUNK;
+
+  return left < FAT_ZIP_CHUNK ? left : FAT_ZIP_CHUNK;
+
+}
+
+/*
+ * Copy len bytes from off into the chain starting at head to buf. Returns
+ * RSH_ERR (EIO) if the chain doesn't go that far or has holes in it, which a
+ * compressed file's chain never does.
+ */
+static int _rsh_fat16_zip_copy(uint32_t head, uint64_t off, void *buf,
+			       uint32_t len){
+
+  uint32_t xfer;
+  uint32_t cluster = head;
+  uint64_t index;
+
+  for ( index = off / FAT_CLUSTER_SIZE; ; index-- ){
+    if ( cluster == FAT_FREE || cluster == FAT_RESERVED ||
+	 cluster >= fat16_fs.fat_entries || _rsh_fat16_gap(cluster) ){
+      errno = EIO;
+      return RSH_ERR;
+    }
+    if ( ! index )
+      break;
+    cluster = rsh_fat16_get_entry(cluster);
+  }
+
+  off %= FAT_CLUSTER_SIZE;
+  while ( len ){
+
+    xfer = FAT_CLUSTER_SIZE - off;
+    if ( xfer > len )
+      xfer = len;
+    if ( _rsh_fat16_csum_check(cluster) )
+      return RSH_ERR;
+    memcpy(buf, FAT_CLUSTER_TO_ADDR(cluster) + off, xfer);
+    buf += xfer;
+    len -= xfer;
+    off = 0;
+
+    if ( len ){
+      cluster = rsh_fat16_get_entry(cluster);
+      if ( cluster == FAT_FREE || cluster == FAT_RESERVED ||
+	   cluster >= fat16_fs.fat_entries || _rsh_fat16_gap(cluster) ){
+	errno = EIO;
+	return RSH_ERR;
+      }
+    }
+
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Read and check the header of the compressed file at dirent. Returns a
+ * malloc()ed copy in *head, or RSH_ERR with errno EIO if it's no good (or
+ * ENOMEM).
+ */
+static int _rsh_fat16_zip_head(struct rsh_fat_dirent *dirent,
+			       struct rsh_fat_zhead **head){
+
+  uint32_t i;
+  uint32_t start;
+  uint32_t len;
+  uint64_t stored = FAT_DIRENT_SIZE(dirent);
+  struct rsh_fat_zhead first;
+
+  *head = NULL;
+  if ( stored < sizeof(struct rsh_fat_zhead) ||
+       _rsh_fat16_zip_copy(dirent->index, 0, &first, sizeof(first)) ){
+    errno = EIO;
+    return RSH_ERR;
+  }
+  if ( first.magic != FAT_ZHEAD_MAGIC || first.size > ZIP_MAX_SIZE ||
+       first.chunks != (first.size + FAT_ZIP_CHUNK - 1) / FAT_ZIP_CHUNK ||
+       FAT_ZHEAD_LEN(first.chunks) > stored ){
+    errno = EIO;
+    return RSH_ERR;
+  }
+
+  *head = malloc(FAT_ZHEAD_LEN(first.chunks));
+  if ( ! *head ){
+    errno = ENOMEM;
+    return RSH_ERR;
+  }
+  if ( _rsh_fat16_zip_copy(dirent->index, 0, *head,
+			   FAT_ZHEAD_LEN(first.chunks)) )
+    goto bad;
+
+  /* Every chunk takes at least a byte and no more than it started with. */
+  start = FAT_ZHEAD_LEN(first.chunks);
+  for ( i = 0; i < first.chunks; i++ ){
+    len = _rsh_fat16_zip_chunk_len(*head, i);
+    if ( (*head)->ends[i] <= start || (*head)->ends[i] - start > len )
+      goto bad;
+    start = (*head)->ends[i];
+  }
+  if ( start > stored )
+    goto bad;
+
+  return RSH_OK;
+
+ bad:
+  free(*head);
+  *head = NULL;
+  errno = EIO;
+  return RSH_ERR;
+
+}
+
+/*
+ * Make sure file has the header of its compressed data, and that it's still
+ * the right one. A bad header is a bad image, unless its checksum already
+ * said so: then it's just an EIO for this read.
+ */
+int _rsh_fat16_zip_load(struct rsh_fat16_file *file){
+
+  uint32_t errors = rsh_fat16_csum_errors;
+
+  if ( file->zhead && file->zgen == fat16_fs.chain_gen )
+    return RSH_OK;
+
+  _rsh_fat16_zip_forget(file);
+  if ( _rsh_fat16_zip_head(file->dirent, &file->zhead) ){
+    if ( errno == EIO && errors == rsh_fat16_csum_errors )
+      rsh_fat16_badness();
+    return RSH_ERR;
+  }
+  file->zgen = fat16_fs.chain_gen;
+
+  return RSH_OK;
+
+}
+
+/*
+ * Drop what file knows about its compressed data.
+ */
+void _rsh_fat16_zip_forget(struct rsh_fat16_file *file){
+
+  free(file->zhead);
+  free(file->zbuf);
+  free(file->zin);
+  file->zhead = NULL;
+  file->zbuf = NULL;
+  file->zin = NULL;
+  file->zchunk = FAT_TERM;
+
+}
+
+/*
+ * Drop the old chunks a write left file with; close has no use for them.
+ */
+void _rsh_fat16_zip_drop(struct rsh_fat16_file *file){
+
+  free(file->zold);
+  free(file->zdata);
+  file->zold = NULL;
+  file->zdata = NULL;
+
+}
+
+/*
+ * Point at len bytes of file's chain from off: right into the image if
+ * they're all in one cluster, otherwise a copy in buf. Holes read as zeros.
+ * NULL if the map couldn't be grown, or if a cluster's checksum is wrong.
+ */
+static void *_rsh_fat16_zip_raw(struct rsh_fat16_file *file, uint64_t off,
+				uint32_t len, uint8_t *buf){
+
+  uint32_t at;
+  uint32_t xfer;
+  uint32_t done = 0;
+  uint32_t cluster;
+
+  while ( done < len ){
+
+    at = (off + done) % FAT_CLUSTER_SIZE;
+    cluster = _rsh_fat16_file_cluster(file, (off + done) / FAT_CLUSTER_SIZE);
+    if ( cluster == FAT_RESERVED )
+      return NULL;
+    if ( cluster == FAT_TERM )
+      rsh_fat16_badness();
+    if ( cluster != FAT_HOLE && _rsh_fat16_csum_check(cluster) )
+      return NULL;
+
+    xfer = FAT_CLUSTER_SIZE - at;
+    if ( xfer > len - done )
+      xfer = len - done;
+    if ( cluster != FAT_HOLE && ! done && xfer == len )
+      return FAT_CLUSTER_TO_ADDR(cluster) + at;
+
+    if ( cluster == FAT_HOLE )
+      memset(buf + done, 0, xfer);
+    else
+      memcpy(buf + done, FAT_CLUSTER_TO_ADDR(cluster) + at, xfer);
+    done += xfer;
+
+  }
+
+  return buf;
+
+}
+
+/*
+ * The data of chunk i of a compressed file, at least its first need bytes.
+ * Only good until the next call. zbuf holds the first zfill bytes of chunk
+ * zchunk, or nothing if that's FAT_TERM. Going back for more of the same
+ * chunk gets all of it, so reading one in small pieces doesn't start over
+ * for every piece.
+ */
+static uint8_t *_rsh_fat16_zip_chunk(struct rsh_fat16_file *file, uint32_t i,
+				     uint32_t need){
+
+  uint8_t *in;
+  uint32_t start;
+  uint32_t len;
+  struct rsh_fat_zhead *head = file->zhead;
+
+  if ( file->zbuf && file->zchunk == i ){
+    if ( file->zfill >= need )
+      return file->zbuf;
+    need = _rsh_fat16_zip_chunk_len(head, i);
+  }
+
+  if ( ! file->zin )
+    file->zin = malloc(FAT_ZIP_CHUNK);
+  if ( ! file->zbuf )
+    file->zbuf = malloc(FAT_ZIP_CHUNK);
+  if ( ! file->zin || ! file->zbuf ){
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  start = i ? head->ends[i - 1] : FAT_ZHEAD_LEN(head->chunks);
+  len = _rsh_fat16_zip_chunk_len(head, i);
+
+  /* Stored as it was, so it doesn't go through zbuf. */
+  file->zchunk = FAT_TERM;
+  if ( head->ends[i] - start == len )
+    return _rsh_fat16_zip_raw(file, start, need, file->zin);
+
+  in = _rsh_fat16_zip_raw(file, start, head->ends[i] - start, file->zin);
+  if ( ! in )
+    return NULL;
+  if ( _rsh_fat16_zip_unpack(in, head->ends[i] - start, file->zbuf, len,
+			     need) )
+    rsh_fat16_badness();
+  file->zchunk = i;
+  file->zfill = need < len ? need : len;
+
+  return file->zbuf;
+
+}
+
+/*
+ * Read from a compressed file.
+ */
+ssize_t _rsh_fat16_zip_read(struct rsh_file *file, void *buf, size_t count){
+
+  uint8_t *data;
+  uint32_t at;
+  uint32_t len;
+  size_t xfer;
+  size_t done = 0;
+  struct rsh_fat16_file *fat_file = file->local;
+
+  if ( _rsh_fat16_zip_load(fat_file) )
+    return -1;
+
+  while ( done < count && file->offset < fat_file->zhead->size ){
+
+    at = file->offset % FAT_ZIP_CHUNK;
+    len = _rsh_fat16_zip_chunk_len(fat_file->zhead,
+				   file->offset / FAT_ZIP_CHUNK);
+    xfer = len - at;
+    if ( xfer > count - done )
+      xfer = count - done;
+
+    data = _rsh_fat16_zip_chunk(fat_file, file->offset / FAT_ZIP_CHUNK,
+				at + xfer);
+    if ( ! data )
+      return done ? done : -1;
+
+    memcpy(buf + done, data + at, xfer);
+    done += xfer;
+    file->offset += xfer;
+
+  }
+
+  return done;
+
+}
+
+/*
+ * readv_map for a compressed file. What comes back points at the chunk just
+ * uncompressed, so it's one segment at a time.
+ */
+int _rsh_fat16_zip_readv_map(struct rsh_file *file, struct iovec *iov,
+			     int iovcnt, size_t count){
+
+  uint8_t *data;
+  uint32_t at;
+  uint32_t len;
+  struct rsh_fat16_file *fat_file = file->local;
+
+  if ( _rsh_fat16_zip_load(fat_file) )
+    return -1;
+  if ( file->offset >= fat_file->zhead->size || ! iovcnt || ! count )
+    return 0;
+
+  at = file->offset % FAT_ZIP_CHUNK;
+  len = _rsh_fat16_zip_chunk_len(fat_file->zhead,
+				 file->offset / FAT_ZIP_CHUNK);
+  iov[0].iov_len = len - at < count ? len - at : count;
+  data = _rsh_fat16_zip_chunk(fat_file, file->offset / FAT_ZIP_CHUNK,
+			      at + iov[0].iov_len);
+  if ( ! data )
+    return -1;
+
+  iov[0].iov_base = data + at;
+  file->offset += iov[0].iov_len;
+
+  return 1;
+
+}
+
+/* A chain being written from the front, see _rsh_fat16_zip_put(). */
+struct rsh_fat16_zip_out {
+
+  uint32_t head;
+  uint32_t tail;
+  uint64_t len;
+
+};
+
+/*
+ * Add len bytes of data (zeros if it's NULL) to the end of out, taking more
+ * clusters as needed.
+ */
+static int _rsh_fat16_zip_put(struct rsh_fat16_zip_out *out, const void *data,
+			      uint32_t len){
+
+  uint32_t at;
+  uint32_t xfer;
+  uint32_t cluster;
+  void *dest;
+
+  while ( len ){
+
+    at = out->len % FAT_CLUSTER_SIZE;
+    if ( ! at ){
+      if ( _rsh_fat16_make_room(1) ||
+	   __rsh_fat16_find_open_cluster(&cluster) ){
+	errno = ENOSPC;
+	return RSH_ERR;
+      }
+      rsh_fat16_set_entry(cluster, FAT_TERM);
+      if ( out->tail == FAT_TERM )
+	out->head = cluster;
+      else
+	rsh_fat16_set_entry(out->tail, cluster);
+      out->tail = cluster;
+    }
+
+    xfer = FAT_CLUSTER_SIZE - at;
+    if ( xfer > len )
+      xfer = len;
+    dest = FAT_CLUSTER_TO_ADDR(out->tail) + at;
+    if ( data ){
+      memcpy(dest, data, xfer);
+      data += xfer;
+    } else {
+      memset(dest, 0, xfer);
+    }
+    rsh_fat16_dirty(dest, xfer);
+
+    out->len += xfer;
+    len -= xfer;
+
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Point dirent at the chain in out, which is the file's data in a new form
+ * (type says which) of size bytes, and give back the old chain. The new chain
+ * has to be out before the dirent points at it.
+ */
+static void _rsh_fat16_zip_swap(struct rsh_fat_dirent *dirent, uint32_t parent,
+				struct rsh_fat16_zip_out *out, uint32_t type,
+				uint64_t size){
+
+  uint32_t old = dirent->index;
+
+  _rsh_fat16_close_sync();
+
+  _rsh_fat16_dindex_resize(parent, (int64_t)size -
+			   (int64_t)FAT_DIRENT_SIZE(dirent));
+  _rsh_fat16_chain_changed(old, NULL);
+  dirent->index = out->head;
+  dirent->type = type;
+  _rsh_fat16_set_size(dirent, size);
+  _rsh_fat16_release(old);
+
+  _rsh_fat16_journal_commit();
+
+}
+
+/*
+ * A file struct for a dirent that isn't open, to read it through.
+ */
+static void _rsh_fat16_zip_file(struct rsh_fat16_file *file,
+				struct rsh_fat_dirent *dirent, uint32_t parent){
+
+  memset(file, 0, sizeof(struct rsh_fat16_file));
+  file->dirent = dirent;
+  file->parent = parent;
+  file->gen = fat16_fs.chain_gen;
+  file->shared = FAT_UNSHARED;
+  file->zchunk = FAT_TERM;
+
+}
+
+static void _rsh_fat16_zip_file_done(struct rsh_fat16_file *file){
+
+  free(file->clusters);
+  free(file->logical);
+  _rsh_fat16_zip_forget(file);
+
+}
+
+/*
+ * Is chunk i of the file just the same as chunk i of what it was before a
+ * write uncompressed it? Only whole chunks that end before the first change
+ * are.
+ */
+static int _rsh_fat16_zip_same(struct rsh_fat16_file *fat_file,
+			       struct rsh_fat_zhead *head, uint32_t i){
+
+  struct rsh_fat_zhead *old = fat_file->zold;
+
+  return old && i < old->chunks &&
+    (uint64_t)(i + 1) * FAT_ZIP_CHUNK <= fat_file->zsame &&
+    _rsh_fat16_zip_chunk_len(old, i) == FAT_ZIP_CHUNK &&
+    _rsh_fat16_zip_chunk_len(head, i) == FAT_ZIP_CHUNK;
+
+}
+
+/*
+ * Compress the file fat_file has open if that saves at least a cluster. If
+ * it doesn't, or there isn't room for the compressed copy, the file is left
+ * as it was. Chunks a write didn't get to are copied from what it was
+ * before rather than compressed again.
+ */
+int _rsh_fat16_zip(struct rsh_fat16_file *fat_file){
+
+  int ret = RSH_ERR;
+  uint8_t *in;
+  uint8_t *src;
+  uint8_t *data;
+  uint32_t i;
+  uint32_t len;
+  uint32_t start;
+  uint32_t packed;
+  uint32_t parent = fat_file->parent;
+  uint64_t size;
+  uint64_t most;
+  struct rsh_fat_dirent *dirent = fat_file->dirent;
+  struct rsh_fat_zhead *head;
+  struct rsh_fat_zhead *old = fat_file->zold;
+  struct rsh_fat16_file file;
+  struct rsh_fat16_zip_out out = { FAT_TERM, FAT_TERM, 0 };
+
+  size = FAT_DIRENT_SIZE(dirent);
+
+  if ( dirent->type != FAT_FILE || FAT_DIRENT_PACKED(dirent) ||
+       size <= FAT_CLUSTER_SIZE || size > ZIP_MAX_SIZE )
+    return RSH_OK;
+
+  /* Anything longer than this doesn't save a cluster. Holes don't take up
+   * any room so it's the clusters really in the chain that count. */
+  most = 0;
+  for ( i = dirent->index; i != FAT_TERM; i = rsh_fat16_get_entry(i) ){
+    if ( i == FAT_FREE || i == FAT_RESERVED )
+      rsh_fat16_badness();
+    most++;
+  }
+  most = (most - 1) * FAT_CLUSTER_SIZE;
+
+  _rsh_fat16_zip_file(&file, dirent, parent);
+  head = malloc(FAT_ZHEAD_LEN((size + FAT_ZIP_CHUNK - 1) / FAT_ZIP_CHUNK));
+  in = malloc(FAT_ZIP_CHUNK);
+  data = malloc(FAT_ZIP_CHUNK);
+  if ( ! head || ! in || ! data ){
+    errno = ENOMEM;
+    goto out;
+  }
+
+  head->magic = FAT_ZHEAD_MAGIC;
+  head->size = size;
+  head->chunks = (size + FAT_ZIP_CHUNK - 1) / FAT_ZIP_CHUNK;
+  if ( FAT_ZHEAD_LEN(head->chunks) > most )
+    goto skip;
+  if ( _rsh_fat16_zip_put(&out, NULL, FAT_ZHEAD_LEN(head->chunks)) )
+    goto out;
+
+  for ( i = 0; i < head->chunks; i++ ){
+
+    if ( _rsh_fat16_zip_same(fat_file, head, i) ){
+      start = i ? old->ends[i - 1] : FAT_ZHEAD_LEN(old->chunks);
+      if ( _rsh_fat16_zip_put(&out, fat_file->zdata + start -
+			      FAT_ZHEAD_LEN(old->chunks),
+			      old->ends[i] - start) )
+	goto out;
+      head->ends[i] = out.len;
+      if ( out.len > most )
+	goto skip;
+      continue;
+    }
+
+    /* The image only ever grows in place, so src stays good across puts. */
+    len = _rsh_fat16_zip_chunk_len(head, i);
+    src = _rsh_fat16_zip_raw(&file, (uint64_t)i * FAT_ZIP_CHUNK, len, in);
+    if ( ! src )
+      goto out;
+
+    /* A chunk that doesn't get any smaller is stored as it is. */
+    packed = _rsh_fat16_zip_pack(src, len, data, len - 1);
+    rsh_fat16_zip_chunks++;
+    if ( _rsh_fat16_zip_put(&out, packed ? data : src, packed ? packed : len) )
+      goto out;
+    head->ends[i] = out.len;
+
+    if ( out.len > most )
+      goto skip;
+
+  }
+
+  /* Now that the ends are known the header can go in. */
+  src = (uint8_t *)head;
+  for ( i = 0, len = FAT_ZHEAD_LEN(head->chunks); len; i++ ){
+    packed = len < FAT_CLUSTER_SIZE ? len : FAT_CLUSTER_SIZE;
+    memcpy(FAT_CLUSTER_TO_ADDR(_rsh_fat16_follow_head(out.head, i)), src,
+	   packed);
+    src += packed;
+    len -= packed;
+  }
+
+  _rsh_fat16_zip_swap(dirent, parent, &out, FAT_ZFILE, out.len);
+  out.head = FAT_TERM;
+  ret = RSH_OK;
+  goto out;
+
+ skip:
+  ret = RSH_OK;
+
+ out:
+  if ( out.head != FAT_TERM )
+    _rsh_fat16_release(out.head);
+  _rsh_fat16_zip_file_done(&file);
+  free(head);
+  free(in);
+  free(data);
+  return ret;
+
+}
+
+/*
+ * Turn the compressed file fat_file has open back into an ordinary one. The
+ * handle keeps a copy of the compressed chunks for _rsh_fat16_zip() to use
+ * again, if there's memory for one.
+ */
+int _rsh_fat16_unzip(struct rsh_fat16_file *fat_file){
+
+  int ret = RSH_ERR;
+  uint8_t *data;
+  uint8_t *kept = NULL;
+  uint32_t i;
+  uint32_t len;
+  struct rsh_fat_dirent *dirent = fat_file->dirent;
+  struct rsh_fat16_file file;
+  struct rsh_fat16_zip_out out = { FAT_TERM, FAT_TERM, 0 };
+
+  if ( dirent->type != FAT_ZFILE )
+    return RSH_OK;
+
+  _rsh_fat16_zip_file(&file, dirent, fat_file->parent);
+  if ( _rsh_fat16_zip_load(&file) )
+    goto out;
+
+  /* Every chunk has at least a byte, so this is never a malloc(0). */
+  len = file.zhead->chunks ? file.zhead->ends[file.zhead->chunks - 1] -
+    FAT_ZHEAD_LEN(file.zhead->chunks) : 0;
+  if ( len )
+    kept = malloc(len);
+  if ( kept ){
+    data = _rsh_fat16_zip_raw(&file, FAT_ZHEAD_LEN(file.zhead->chunks), len,
+			      kept);
+    if ( ! data )
+      goto out;
+    if ( data != kept )
+      memcpy(kept, data, len);
+  }
+
+  for ( i = 0; i < file.zhead->chunks; i++ ){
+    data = _rsh_fat16_zip_chunk(&file, i,
+				_rsh_fat16_zip_chunk_len(file.zhead, i));
+    if ( ! data ||
+	 _rsh_fat16_zip_put(&out, data,
+			    _rsh_fat16_zip_chunk_len(file.zhead, i)) )
+      goto out;
+  }
+
+  /* Even an empty file has a cluster. */
+  if ( out.head == FAT_TERM ){
+    if ( _rsh_fat16_zip_put(&out, NULL, 1) )
+      goto out;
+    out.len = 0;
+  }
+
+  _rsh_fat16_zip_swap(dirent, fat_file->parent, &out, FAT_FILE,
+		      file.zhead->size);
+  out.head = FAT_TERM;
+  ret = RSH_OK;
+
+  _rsh_fat16_zip_drop(fat_file);
+  if ( kept ){
+    fat_file->zold = file.zhead;
+    fat_file->zdata = kept;
+    fat_file->zsame = file.zhead->size;
+    file.zhead = NULL;
+    kept = NULL;
+  }
+
+ out:
+  if ( out.head != FAT_TERM )
+    _rsh_fat16_release(out.head);
+  _rsh_fat16_zip_file_done(&file);
+  free(kept);
+  return ret;
+
+}
+
+/*
+ * Is the compressed file at dirent any good: a header that makes sense and
+ * chunks that all uncompress to the right size? For fsck, which has already
+ * made sure the chain covers the dirent's size. Returns RSH_ERR with errno
+ * EIO if it's broken, ENOMEM if we couldn't tell.
+ */
+int _rsh_fat16_zip_check(struct rsh_fat_dirent *dirent){
+
+  int ret = RSH_ERR;
+  uint8_t *in;
+  uint32_t i;
+  uint32_t len;
+  uint32_t start;
+  struct rsh_fat16_file file;
+
+  _rsh_fat16_zip_file(&file, dirent, FAT_TERM);
+  if ( _rsh_fat16_zip_head(dirent, &file.zhead) )
+    goto out;
+
+  file.zin = malloc(FAT_ZIP_CHUNK);
+  file.zbuf = malloc(FAT_ZIP_CHUNK);
+  if ( ! file.zin || ! file.zbuf ){
+    errno = ENOMEM;
+    goto out;
+  }
+
+  start = FAT_ZHEAD_LEN(file.zhead->chunks);
+  for ( i = 0; i < file.zhead->chunks; start = file.zhead->ends[i++] ){
+    in = _rsh_fat16_zip_raw(&file, start, file.zhead->ends[i] - start,
+			    file.zin);
+    if ( ! in )
+      goto out;
+    if ( file.zhead->ends[i] - start ==
+	 _rsh_fat16_zip_chunk_len(file.zhead, i) )
+      continue;
+    len = _rsh_fat16_zip_chunk_len(file.zhead, i);
+    if ( _rsh_fat16_zip_unpack(in, file.zhead->ends[i] - start, file.zbuf,
+			       len, len) ){
+      errno = EIO;
+      goto out;
+    }
+  }
+  ret = RSH_OK;
+
+ out:
+  _rsh_fat16_zip_file_done(&file);
+  return ret;
+
+}
@@ -7,6 +7,7 @@
 #include <rshfs.h>
 
 #include <fcntl.h>
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -18,6 +19,12 @@
 
 #define BUFFER_SIZE 512
 
+/* For rsh_copy_fd(). How many segments and bytes to map at a time and how big
+ * a buffer to use when we can't map. */
+#define COPY_IOVECS  64
+#define COPY_MAP_MAX (4*1024*1024)
+#define COPY_CHUNK   (16*1024)
+
 /*
  * If set, the shell will read from the native file system. If this is not set,
  * RSH IO wrappers will read from the built in file system.
@@ -136,6 +143,239 @@ ssize_t rsh_write(int fd, const void *buf, size_t count){
   
 }
 
+/*
+ * Wrapper for writev().
+ */
+ssize_t rsh_writev(int fd, const struct iovec *iov, int iovcnt){
+
+  if ( ! _RSH_FD(fd) )
+    return writev(fd, iov, iovcnt);
+  else
+    return _rsh_writev(fd, iov, iovcnt);
+
+}
+
+/*
+ * Map some of a built in file's data rather than reading it. There's no such
+ * thing for native files; you get ENOSYS and should use rsh_read().
+ */
+int rsh_readv_map(int fd, struct iovec *iov, int iovcnt, size_t count){
+
+  if ( ! _RSH_FD(fd) ){
+    errno = ENOSYS;
+    return -1;
+  }
+
+  return _rsh_readv_map(fd, iov, iovcnt, count);
+
+}
+
+/*
+ * Wrapper for lseek().
+ */
+off_t rsh_lseek(int fd, off_t offset, int whence){
+
+  if ( ! _RSH_FD(fd) )
+    return lseek(fd, offset, whence);
+  else
+    return _rsh_lseek(fd, offset, whence);
+
+}
+
+/*
+ * Reserve room for len more bytes at fd's current offset. For native files
+ * this is posix_fallocate(), which unlike the built in FS does grow the file.
+ */
+int rsh_fallocate(int fd, off_t len){
+
+  int err;
+  off_t offset;
+
+  if ( _RSH_FD(fd) )
+    return _rsh_fallocate(fd, len);
+
+  offset = lseek(fd, 0, SEEK_CUR);
+  if ( offset < 0 )
+    return -1;
+
+  err = posix_fallocate(fd, offset, len);
+  if ( err ){
+    errno = err;
+    return -1;
+  }
+
+  return 0;
+
+}
+
+/*
+ * Write out all of the passed segments, picking up after short writes. The
+ * iovec array gets scribbled on.
+ */
+int _rsh_writev_all(int fd, struct iovec *iov, int iovcnt){
+
+  ssize_t bytes;
+
+  while ( iovcnt > 0 ){
+
+    bytes = rsh_writev(fd, iov, iovcnt);
+    if ( bytes < 0 )
+      return RSH_ERR;
+
+    while ( iovcnt > 0 && bytes >= iov->iov_len ){
+      bytes -= iov->iov_len;
+      iov++;
+      iovcnt--;
+    }
+    if ( iovcnt > 0 ){
+      iov->iov_base += bytes;
+      iov->iov_len -= bytes;
+    }
+
+  }
+
+  return RSH_OK;
+
+}
+
+/*
+ * Copy len bytes from in to out, or everything left if len is negative. If in
+ * is a built in file we write straight out of the file system image, otherwise
+ * it's the usual read() and write() through a buffer.
+ */
+static ssize_t _rsh_copy_bytes(int in, int out, off_t len){
+
+  int i, segs;
+  size_t want;
+  ssize_t bytes;
+  ssize_t total = 0;
+  char chunk[COPY_CHUNK];
+  struct iovec iov[COPY_IOVECS];
+
+  for ( ; ; ){
+    want = len < 0 || len - total > COPY_MAP_MAX ? COPY_MAP_MAX : len - total;
+    if ( want == 0 )
+      return total;
+    if ( (segs = rsh_readv_map(in, iov, COPY_IOVECS, want)) <= 0 )
+      break;
+    for ( i = 0; i < segs; i++ )
+      total += iov[i].iov_len;
+    if ( _rsh_writev_all(out, iov, segs) )
+      return -1;
+  }
+  if ( segs == 0 )
+    return total;
+  if ( errno != ENOSYS )
+    return -1;
+
+  for ( ; ; ){
+    want = len < 0 || len - total > COPY_CHUNK ? COPY_CHUNK : len - total;
+    if ( want == 0 )
+      return total;
+    if ( (bytes = rsh_read(in, chunk, want)) <= 0 )
+      break;
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = bytes;
+    if ( _rsh_writev_all(out, iov, 1) )
+      return -1;
+    total += bytes;
+  }
+
+  return bytes < 0 ? -1 : total;
+
+}
+
+/*
+ * Does in have any holes between start and size?
+ */
+static int _rsh_has_holes(int in, off_t start, off_t size){
+
+  off_t data, hole;
+
+  if ( start >= size )
+    return 0;
+
+  data = rsh_lseek(in, start, SEEK_DATA);
+  hole = rsh_lseek(in, start, SEEK_HOLE);
+  rsh_lseek(in, start, SEEK_SET);
+
+  return data >= 0 && hole >= 0 && (data > start || hole < size);
+
+}
+
+/*
+ * Copy just the data in in to the same places in out, seeking over the holes
+ * so they stay holes.
+ */
+static ssize_t _rsh_copy_sparse(int in, int out, off_t start, off_t size){
+
+  off_t data, hole;
+  off_t end = start;
+  off_t out_start;
+
+  out_start = rsh_lseek(out, 0, SEEK_CUR);
+  if ( out_start < 0 )
+    return -1;
+
+  for ( data = start; data < size; data = hole ){
+
+    data = rsh_lseek(in, data, SEEK_DATA);
+    if ( data < 0 ){
+      if ( errno == ENXIO )
+	break;
+      return -1;
+    }
+    hole = rsh_lseek(in, data, SEEK_HOLE);
+    if ( hole < 0 )
+      return -1;
+
+    if ( rsh_lseek(in, data, SEEK_SET) < 0 ||
+	 rsh_lseek(out, out_start + (data - start), SEEK_SET) < 0 ||
+	 _rsh_copy_bytes(in, out, hole - data) < 0 )
+      return -1;
+    end = hole;
+
+  }
+
+  /* Ending in a hole still has to make out the right size. */
+  if ( end < size ){
+    if ( rsh_lseek(out, out_start + (size - start) - 1, SEEK_SET) < 0 ||
+	 rsh_write(out, "", 1) != 1 )
+      return -1;
+  }
+
+  rsh_lseek(in, size, SEEK_SET);
+  return size - start;
+
+}
+
+/*
+ * Copy everything left in in to out. Returns the number of bytes copied or
+ * -1. Holes in a regular file going to another regular file are kept as
+ * holes.
+ */
+ssize_t rsh_copy_fd(int in, int out){
+
+  off_t start;
+  struct stat buf;
+  struct stat out_buf;
+
+  if ( rsh_fstat(in, &buf) == 0 && S_ISREG(buf.st_mode) &&
+       rsh_fstat(out, &out_buf) == 0 && S_ISREG(out_buf.st_mode) &&
+       (start = rsh_lseek(in, 0, SEEK_CUR)) >= 0 &&
+       _rsh_has_holes(in, start, buf.st_size) )
+    return _rsh_copy_sparse(in, out, start, buf.st_size);
+
+  /* If we know how much is coming, get the built in FS to make room for it
+   * all in one go. It's only a hint so don't worry if it fails. */
+  if ( _RSH_FD(out) && rsh_fstat(in, &buf) == 0 && S_ISREG(buf.st_mode) &&
+       buf.st_size > 0 )
+    rsh_fallocate(out, buf.st_size);
+
+  return _rsh_copy_bytes(in, out, -1);
+
+}
+
 /*
  * Not yet implemented.
  */
@@ -220,6 +460,59 @@ int rsh_unlink(const char *path){
 
 }
 
+/*
+ * Wrapper for rename(). Both paths have to be on the same file system; a
+ * move from one to the other fails with EXDEV.
+ */
+int rsh_rename(const char *oldpath, const char *newpath){
+
+  int old_native = rsh_native_path(oldpath);
+
+  if ( old_native != rsh_native_path(newpath) ){
+    errno = EXDEV;
+    return -1;
+  }
+
+  if ( old_native )
+    return rename(oldpath, newpath);
+
+  /* Built in paths may still have the image's name on the front. */
+  if ( *oldpath == '/' )
+    oldpath = rsh_builtin_path((char *)oldpath);
+  if ( *newpath == '/' )
+    newpath = rsh_builtin_path((char *)newpath);
+
+  return _rsh_rename(oldpath, newpath);
+
+}
+
+/*
+ * Copy a file by sharing its data. Only the built in file system can do that;
+ * native paths get ENOSYS so the caller falls back to copying.
+ */
+int rsh_clone(const char *oldpath, const char *newpath){
+
+  int old_native = rsh_native_path(oldpath);
+
+  if ( old_native != rsh_native_path(newpath) ){
+    errno = EXDEV;
+    return -1;
+  }
+
+  if ( old_native ){
+    errno = ENOSYS;
+    return -1;
+  }
+
+  if ( *oldpath == '/' )
+    oldpath = rsh_builtin_path((char *)oldpath);
+  if ( *newpath == '/' )
+    newpath = rsh_builtin_path((char *)newpath);
+
+  return _rsh_clone(oldpath, newpath);
+
+}
+
 /*
  * Wrapper for chdir().
  */
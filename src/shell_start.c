@@ -36,9 +36,17 @@ char *shell_name;
 /* Name of the built in file system image. */
 char *bifs = "builtin_fs.img";
 
-/* Stuff specific to the FAT16 used. */
+/* Stuff specific to the FAT16 used. Version 0 images top out at 65534
+ * clusters, which is where the old 50MB limit comes from. */
+#define DISK_MIN        (5L * 1024*1024)
+#define DISK_MAX        (64L * 1024*1024*1024)
+#define DISK_MAX_LEGACY (50L * 1024*1024)
 long int geometry[2] = { 5*1024*1024, 8*1024 };
 int override = 0; /* If set, override the limits imposed. */
+char *durability = NULL; /* How hard to try to get the image onto disk. */
+char *fsck = NULL;       /* Check the image at start up; "repair" to fix it. */
+char *mapping = NULL;    /* How to map the image, see fs_fat16_map.c. */
+char *grow = NULL;       /* How big the image may grow, see fs_fat16_grow.c. */
 extern int _rsh_fat16_geometry(char *geometry, long int *geo);
 
 /* Function to source the init scripts. */
@@ -54,6 +62,16 @@ static struct option options[] = {
   { "login", 0, NULL, 'l' },
   { "filesystem", 1, NULL, 'f' }, 
   { "geometry", 1, NULL, 'g' },
+  { "durability", 1, NULL, 'y' },
+  { "mapping", 1, NULL, 'm' },
+  { "grow", 1, NULL, 'G' },
+  { "legacy-fs", 0, NULL, 'L' },
+  { "compact-dirs", 0, NULL, 'C' },
+  { "tree-dirs", 0, NULL, 'T' },
+  { "compress", 0, NULL, 'Z' },
+  { "dedup", 0, NULL, 'D' },
+  { "verify", 0, NULL, 'V' },
+  { "fsck", 2, NULL, 'k' },
   { "native", 1, NULL, 'n' },
   { "override", 0, NULL, 'o' },
   { NULL, 0, NULL, 0 }
@@ -88,6 +106,7 @@ int rsh_main(int argc, char **argv){
 
   if ( interactive )
     printf("Good bye.\n");
+  rsh_exit(0);
   return 0;
 
 }
@@ -119,6 +138,36 @@ int rsh_parse_args(int argc, char **argv){
 	geometry[1] = 8*1024;
       }
       break;
+    case 'y':
+      durability = optarg;
+      break;
+    case 'm':
+      mapping = optarg;
+      break;
+    case 'G':
+      grow = optarg;
+      break;
+    case 'L':
+      rsh_fat16_new_version = RSH_FS_V0;
+      break;
+    case 'C':
+      rsh_fat16_new_flags |= RSH_FS_COMPACT_DIRS;
+      break;
+    case 'T':
+      rsh_fat16_new_flags |= RSH_FS_TREE_DIRS;
+      break;
+    case 'Z':
+      rsh_fat16_new_flags |= RSH_FS_ZIP_FILES;
+      break;
+    case 'D':
+      rsh_fat16_new_flags |= RSH_FS_DEDUP_FILES;
+      break;
+    case 'V':
+      rsh_fat16_verify_reads = 1;
+      break;
+    case 'k':
+      fsck = optarg ? optarg : "check";
+      break;
     case 'o':
       override = 1;
       break;
@@ -179,7 +228,8 @@ int script_shell(){
 
 void rsh_init(){
 
-  int err;
+  int i, err;
+  long int disk_max;
 
   /* Ignore these signals for interactive shells. */
   if ( interactive ){
@@ -204,10 +254,12 @@ void rsh_init(){
   /* Init the internal file system. */
   rsh_init_fs();
 
-  if ( geometry[0] < (5 * 1024*1024) || geometry[0] > (50 * 1024*1024) ){
+  disk_max = rsh_fat16_new_version ? DISK_MAX : DISK_MAX_LEGACY;
+  if ( geometry[0] < DISK_MIN || geometry[0] > disk_max ){
     if ( ! override ){
-      printf("Disk size must be between 5 and 50 Megabytes."
-	     " %d not acceptable\n", geometry[0]);
+      printf("Disk size must be between %ld and %ld Megabytes."
+	     " %ld not acceptable\n", DISK_MIN / (1024*1024),
+	     disk_max / (1024*1024), geometry[0]);
       printf(
 	"Specify --override to force a disk size outside of these limits.\n");
       exit(1);
@@ -231,10 +283,24 @@ void rsh_init(){
     exit(1);
   }
 
+  /* These have to be set before the image is mapped. */
+  if ( mapping && rsh_fat16_parse_map_policy(mapping) )
+    printf("Warning: unable to use mapping '%s', using none.\n", mapping);
+  if ( grow && rsh_fat16_parse_grow(grow) )
+    printf("Warning: unable to use grow '%s', not growing.\n", grow);
+
   printf("Loading disk image: %s (%ld:%ld)\n", bifs, geometry[0], geometry[1]);
   err = rsh_fat16_init(bifs, geometry[0], geometry[1]);
   if ( err ){
     printf("WARNING: Could not load internal FS.\n");
+  } else {
+    if ( fsck && rsh_fat16_fsck(0, strcmp(fsck, "repair") == 0, 1) < 0 )
+      printf("Warning: unable to check the image.\n");
+    if ( durability && rsh_fat16_parse_durability(durability) )
+      printf("Warning: unable to use durability '%s', using sync.\n",
+	     durability);
+    for ( i = 0; rsh_fat16_stat_syms[i]; i++ )
+      symtable_add_dynamic(rsh_fat16_stat_syms[i], rsh_fat16_stat_sym);
   }
 
   /* Initialize the terminal. */
@@ -290,6 +356,9 @@ void rsh_exit(int status){
   fflush(stdout);
   fflush(stderr);
 
+  /* Make sure the built in FS is all on disk. */
+  rsh_fat16_shutdown();
+
   /* If I cared, maybe clean up child processes or something. But whatever
    * I don't have time anymore :(. */
   exit(status);
@@ -6,6 +6,7 @@
 #include <exec.h>
 #include <lexxer.h>
 #include <parser.h>
+#include <rshfs.h>
 #include <symbol_table.h>
 
 #include <stdio.h>
@@ -64,6 +65,9 @@ int run_interactive(){
     /* Run the command. */
     exec_token_seq(tokens);
 
+    /* Use the time the user spends reading the output. */
+    rsh_fat16_defrag_idle();
+
   } while (1);
 
   return 0;
@@ -69,15 +69,44 @@ int symtable_add(char *sym, char *data){
 
 }
 
+/*
+ * Add a symbol whose value comes from calling get() each time the symbol is
+ * used. These take priority over everything else.
+ */
+int symtable_add_dynamic(char *sym, char *(*get)(char *sym)){
+
+  struct sym_dynamic *dyn;
+
+  if ( ! sym || ! get )
+    return RSH_ERR;
+
+  dyn = (struct sym_dynamic *)malloc(sizeof(struct sym_dynamic));
+  if ( ! dyn )
+    return RSH_ERR;
+
+  dyn->name = sym;
+  dyn->get = get;
+  dyn->next = table.dynamic;
+  table.dynamic = dyn;
+
+  return RSH_OK;
+
+}
+
 char *symtable_get(char *sym){
 
   char *env_sym;
   struct sym_entry *syment;
+  struct sym_dynamic *dyn;
 
   /* It is rude to pass a NULL sym. */
   if ( ! sym )
     return NULL;
 
+  for ( dyn = table.dynamic; dyn; dyn = dyn->next )
+    if ( strcmp(sym, dyn->name) == 0 )
+      return dyn->get(sym);
+
   env_sym = getenv(sym);
   if ( env_sym )
     return env_sym;